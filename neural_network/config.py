@@ -35,6 +35,7 @@ class ModelParams:
     dt_init_floor: float = 1e-4
     expand_factor: int = 2 # Expansion factor in the Mamba architecture, 2 in the Mamba paper
     bias: bool = False # Whether to use bias in the Mamba projection layers
+    fused_cpu_scan: bool = True # Use the fused C++ scan (model/csrc) instead of the parallel scan when running on CPU
 
     d_inner: int = int(expand_factor * d_model)
     if conj_sym:
@@ -0,0 +1,140 @@
+import argparse
+import copy
+import json
+import numpy as np
+
+
+def engine_blocks(n_out, half, block):
+    """
+    Output rows of each weight batch of the C++ engine for one input: the outputs are split
+    into halves of `half` rows (in_proj: [u | res]), each padded to whole batches of `block`.
+    """
+    blocks = []
+    for start in range(0, n_out, half):
+        for b in range(start, start + half, block):
+            blocks.append(np.arange(b, min(b + block, start + half)))
+    return blocks
+
+
+def relative_error(W, W_approx):
+    return float(np.linalg.norm(W - W_approx) / max(np.linalg.norm(W), 1e-30))
+
+
+def low_rank(W, rank):
+    """Truncated SVD W ~ U V with the singular values split evenly between U (out, r) and V (r, in)."""
+    U, s, Vt = np.linalg.svd(W, full_matrices=False)
+    root = np.sqrt(s[:rank])
+    return U[:, :rank] * root, root[:, None] * Vt[:rank]
+
+
+def prune_blocks(W, sparsity, half, block):
+    """Zero the fraction `sparsity` of weight batches (one input, `block` outputs) with the smallest norm."""
+    blocks = engine_blocks(W.shape[0], half, block)
+    norms = np.array([[np.linalg.norm(W[rows, j]) for rows in blocks] for j in range(W.shape[1])])
+    n_pruned = int(round(sparsity * norms.size))
+    pruned = W.copy()
+    for flat in np.argsort(norms, axis=None)[:n_pruned]:
+        j, b = np.unravel_index(flat, norms.shape)
+        pruned[blocks[b], j] = 0.0
+    return pruned, n_pruned / norms.size
+
+
+def factor_projection(proj, half, rank=None, sparsity=None, block=16):
+    """
+    Factor (rank) or prune (sparsity) one Mamba projection {"weights": (out, in), "bias"}.
+    The dense weights are replaced by the approximation, so every engine still loads the file;
+    the C++ engine (StructuredProjection.h) runs the factors or skips the zero batches. A pruned
+    projection records its block size, the engine only looks for zero batches if its SIMD width
+    divides it.
+    Returns the report entry.
+    """
+    W = np.array(proj['weights'], dtype=np.float64)
+    n_out, n_in = W.shape
+    dense = n_in * len(engine_blocks(n_out, half, block))
+    if rank is not None:
+        U, V = low_rank(W, rank)
+        W_approx = U @ V
+        proj['low_rank'] = {'U': U.tolist(), 'V': V.tolist()}
+        cost = n_in * -(-rank // block) + rank * len(engine_blocks(n_out, half, block))
+        kind = f'rank {rank}'
+    else:
+        W_approx, fraction = prune_blocks(W, sparsity, half, block)
+        proj['block'] = block
+        # the engine only switches to the sparse kernel if at least a quarter of the batches are zero
+        cost = dense * (1.0 - fraction) if fraction >= 0.25 else dense
+        kind = f'{fraction:.0%} blocks zero'
+    proj['weights'] = W_approx.tolist()
+    return {
+        'kind': kind,
+        'shape': (n_out, n_in),
+        'error': relative_error(W, W_approx),
+        'singular_values': np.linalg.svd(W, compute_uv=False).tolist(),
+        'speedup': dense / cost if cost > 0 else float('inf'),
+        'dense': cost >= dense,
+    }
+
+
+def factor_model(model_data, in_rank=None, out_rank=None, in_sparsity=None, out_sparsity=None, block=16):
+    """
+    Low-rank or block-sparse approximation of the Mamba projections of an exported
+    model_weights.json (model2json.py). Each projection takes either a rank or a sparsity.
+
+    Args:
+        model_data   (dict):  parsed model_weights.json
+        in_rank      (int):   rank of in_proj
+        out_rank     (int):   rank of out_proj
+        in_sparsity  (float): fraction of the in_proj weight batches to zero
+        out_sparsity (float): fraction of the out_proj weight batches to zero
+        block        (int):   SIMD batch size the pruning is aligned to (16 for AVX-512; a pattern
+                              pruned for 16 stays aligned for 8 and 4, not the other way around)
+    Returns:
+        (dict, list): approximated model data and one report entry per layer and projection
+    """
+    if in_rank is not None and in_sparsity is not None or out_rank is not None and out_sparsity is not None:
+        raise ValueError('a projection is either factored or pruned')
+
+    out = copy.deepcopy(model_data)
+    layers = out['layers']
+    n_layers = len(layers) - 4
+    report = []
+    for i in range(n_layers):
+        mamba = layers[i + 3]['parameters']['mamba']
+        d_inner = len(mamba['D'])
+        d_model = len(mamba['out_proj']['weights'])
+        for name, half, rank, sparsity in (('in_proj', d_inner, in_rank, in_sparsity), ('out_proj', d_model, out_rank, out_sparsity)):
+            if rank is None and sparsity is None:
+                continue
+            info = factor_projection(mamba[name], half, rank, sparsity, block)
+            info['layer'] = i
+            info['projection'] = name
+            report.append(info)
+    return out, report
+
+
+def print_report(report):
+    for info in report:
+        n_out, n_in = info['shape']
+        print(f"layer {info['layer']} {info['projection']} ({n_out}x{n_in}): {info['kind']}, "
+              f"relative error {info['error']:.3e}, predicted speedup {info['speedup']:.2f}x")
+        if info['dense']:
+            print('  no work saved, the engine keeps the dense kernel')
+    print('check the result against the original with accuracy_harness --candidate')
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Low-rank or block-sparse Mamba projections in model_weights.json.')
+    parser.add_argument('weights', help='model_weights.json written by model2json.py')
+    parser.add_argument('-o', '--output', default='model_weights_factored.json')
+    parser.add_argument('--in-rank', type=int, default=None, help='factor in_proj to this rank')
+    parser.add_argument('--out-rank', type=int, default=None, help='factor out_proj to this rank')
+    parser.add_argument('--in-sparsity', type=float, default=None, help='zero this fraction of the in_proj weight batches')
+    parser.add_argument('--out-sparsity', type=float, default=None, help='zero this fraction of the out_proj weight batches')
+    parser.add_argument('--block', type=int, default=16, help='SIMD batch size of the pruned blocks')
+    args = parser.parse_args()
+
+    with open(args.weights) as f:
+        model_data = json.load(f)
+    factored, report = factor_model(model_data, args.in_rank, args.out_rank, args.in_sparsity, args.out_sparsity, args.block)
+    print_report(report)
+    with open(args.output, 'w') as f:
+        json.dump(factored, f, indent=1)
@@ -0,0 +1,68 @@
+// PyTorch CPU extension wrapping s5_scan_kernel.h, loaded by model/fused_scan.py
+#include <torch/extension.h>
+
+#include "s5_scan_kernel.h"
+
+#include <vector>
+
+namespace
+{
+s5_scan::Weights makeWeights(const torch::Tensor& dA_re, const torch::Tensor& dA_im, const torch::Tensor& dB_re, const torch::Tensor& dB_im, const torch::Tensor& C_re, const torch::Tensor& C_im, const torch::Tensor& D, bool conj_sym)
+{
+  const std::vector<torch::Tensor> tensors = {dA_re, dA_im, dB_re, dB_im, C_re, C_im, D};
+  for (const auto& t : tensors)
+  {
+    TORCH_CHECK(t.device().is_cpu(), "fused S5 scan runs on CPU tensors only");
+    TORCH_CHECK(t.scalar_type() == torch::kFloat32 && t.is_contiguous(), "fused S5 scan expects contiguous float32 tensors");
+  }
+  return {dA_re.data_ptr<float>(), dA_im.data_ptr<float>(), dB_re.data_ptr<float>(), dB_im.data_ptr<float>(), C_re.data_ptr<float>(), C_im.data_ptr<float>(), D.data_ptr<float>(), static_cast<int>(dA_re.size(0)), static_cast<int>(D.size(0)), conj_sym ? 2.0f : 1.0f};
+}
+
+std::vector<torch::Tensor> forward(torch::Tensor dA_re, torch::Tensor dA_im, torch::Tensor dB_re, torch::Tensor dB_im, torch::Tensor C_re, torch::Tensor C_im, torch::Tensor D, torch::Tensor u, torch::Tensor h_re, torch::Tensor h_im, bool conj_sym, int64_t checkpoint)
+{
+  const auto w = makeWeights(dA_re, dA_im, dB_re, dB_im, C_re, C_im, D, conj_sym);
+  TORCH_CHECK(u.dim() == 3 && u.size(2) == w.H, "u must be (B, L, H)");
+  TORCH_CHECK(u.is_contiguous() && h_re.is_contiguous() && h_im.is_contiguous(), "u and h must be contiguous");
+
+  const int B = static_cast<int>(u.size(0));
+  const int L = static_cast<int>(u.size(1));
+  auto y = torch::empty_like(u);
+  auto hT_re = torch::empty_like(h_re);
+  auto hT_im = torch::empty_like(h_im);
+  auto checkpoints = torch::empty({B, s5_scan::numCheckpoints(L, static_cast<int>(checkpoint)), 2, w.P}, u.options());
+
+  s5_scan::forward(w, u.data_ptr<float>(), h_re.data_ptr<float>(), h_im.data_ptr<float>(), B, L, static_cast<int>(checkpoint), y.data_ptr<float>(), hT_re.data_ptr<float>(), hT_im.data_ptr<float>(), checkpoints.data_ptr<float>(), at::get_num_threads());
+  return {y, hT_re, hT_im, checkpoints};
+}
+
+std::vector<torch::Tensor> backward(torch::Tensor dA_re, torch::Tensor dA_im, torch::Tensor dB_re, torch::Tensor dB_im, torch::Tensor C_re, torch::Tensor C_im, torch::Tensor D, torch::Tensor u, torch::Tensor checkpoints, torch::Tensor grad_y, torch::Tensor grad_hT_re, torch::Tensor grad_hT_im, bool conj_sym, int64_t checkpoint)
+{
+  const auto w = makeWeights(dA_re, dA_im, dB_re, dB_im, C_re, C_im, D, conj_sym);
+  grad_y = grad_y.contiguous();
+  grad_hT_re = grad_hT_re.contiguous();
+  grad_hT_im = grad_hT_im.contiguous();
+
+  const int B = static_cast<int>(u.size(0));
+  const int L = static_cast<int>(u.size(1));
+  auto grad_u = torch::empty_like(u);
+  auto grad_h_re = torch::empty_like(grad_hT_re);
+  auto grad_h_im = torch::empty_like(grad_hT_im);
+  auto g_dA_re = torch::empty_like(dA_re);
+  auto g_dA_im = torch::empty_like(dA_im);
+  auto g_dB_re = torch::empty_like(dB_re);
+  auto g_dB_im = torch::empty_like(dB_im);
+  auto g_C_re = torch::empty_like(C_re);
+  auto g_C_im = torch::empty_like(C_im);
+  auto g_D = torch::empty_like(D);
+
+  const s5_scan::Gradients g = {g_dA_re.data_ptr<float>(), g_dA_im.data_ptr<float>(), g_dB_re.data_ptr<float>(), g_dB_im.data_ptr<float>(), g_C_re.data_ptr<float>(), g_C_im.data_ptr<float>(), g_D.data_ptr<float>()};
+  s5_scan::backward(w, u.data_ptr<float>(), checkpoints.data_ptr<float>(), grad_y.data_ptr<float>(), grad_hT_re.data_ptr<float>(), grad_hT_im.data_ptr<float>(), B, L, static_cast<int>(checkpoint), grad_u.data_ptr<float>(), grad_h_re.data_ptr<float>(), grad_h_im.data_ptr<float>(), g, at::get_num_threads());
+  return {g_dA_re, g_dA_im, g_dB_re, g_dB_im, g_C_re, g_C_im, g_D, grad_u, grad_h_re, grad_h_im};
+}
+} // namespace
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+  m.def("forward", &forward, "Fused S5 scan forward (CPU)");
+  m.def("backward", &backward, "Fused S5 scan backward (CPU)");
+}
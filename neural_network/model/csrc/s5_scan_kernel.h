@@ -0,0 +1,377 @@
+#pragma once
+// Fused S5 scan for CPU training: Bu projection, diagonal complex recurrence and C readout in one
+// pass over (B, L), without materializing any (B, L, P) tensor.
+//
+//   h[t] = dA * h[t - 1] + dB u[t]
+//   y[t] = s * real(C h[t]) + D u[t],  s = 2 with conjugate symmetry, 1 otherwise
+//
+// The forward pass stores the state at the start of every `checkpoint` steps. The backward pass runs
+// the adjoint recurrence in reverse, recomputing one segment of states at a time from its checkpoint.
+// Both run in parallel over (batch element, mode block) tiles.
+// All matrices are row-major float32; complex values are split into real and imaginary arrays.
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace s5_scan
+{
+struct Weights
+{
+  const float* dA_re; // (P)
+  const float* dA_im; // (P)
+  const float* dB_re; // (P, H)
+  const float* dB_im; // (P, H)
+  const float* C_re;  // (H, P)
+  const float* C_im;  // (H, P)
+  const float* D;     // (H)
+  int P;
+  int H;
+  float scale;        // 2 with conjugate symmetry
+};
+
+struct Gradients
+{
+  float* dA_re; // (P)
+  float* dA_im; // (P)
+  float* dB_re; // (P, H)
+  float* dB_im; // (P, H)
+  float* C_re;  // (H, P)
+  float* C_im;  // (H, P)
+  float* D;     // (H)
+};
+
+inline int numCheckpoints(int L, int checkpoint) { return (L + checkpoint - 1) / checkpoint; }
+
+namespace detail
+{
+// Mode blocks are whole multiples of one 512-bit vector of floats
+constexpr int blockAlign = 16;
+
+// The modes of one batch element are split into `count` blocks of `width` (the last one may be
+// narrower). The recurrence of a mode does not depend on the others, so the (batch element, mode
+// block) tiles run in parallel and a small batch still fills the threads; only the readout and the
+// input gradient sum over the blocks.
+struct Blocks
+{
+  int count;
+  int width;
+};
+
+// At most `wanted` blocks, all but the last a whole multiple of blockAlign modes
+inline Blocks modeBlocks(int P, int wanted)
+{
+  const int count = std::max(1, std::min(wanted, P / blockAlign));
+  const int width = ((P + count - 1) / count + blockAlign - 1) / blockAlign * blockAlign;
+  return {(P + width - 1) / width, width};
+}
+
+// dB transposed to (H, P) so the Bu projection is a sequence of axpys over contiguous state
+inline void transpose(const float* src, float* dst, int rows, int cols)
+{
+  for (int r = 0; r < rows; ++r)
+    for (int c = 0; c < cols; ++c)
+      dst[c * rows + r] = src[r * cols + c];
+}
+
+// h <- dA * h + dB u for one time step, on the n modes from p0. h and bu hold those modes.
+inline void step(const Weights& w, int p0, int n, const float* dBt_re, const float* dBt_im, const float* u, float* h_re, float* h_im, float* bu_re, float* bu_im)
+{
+  const int P = w.P;
+  std::fill(bu_re, bu_re + n, 0.0f);
+  std::fill(bu_im, bu_im + n, 0.0f);
+  for (int k = 0; k < w.H; ++k)
+  {
+    const float uk = u[k];
+    const float* br = dBt_re + k * P + p0;
+    const float* bi = dBt_im + k * P + p0;
+#pragma omp simd
+    for (int p = 0; p < n; ++p)
+    {
+      bu_re[p] += uk * br[p];
+      bu_im[p] += uk * bi[p];
+    }
+  }
+
+  const float* ar = w.dA_re + p0;
+  const float* ai = w.dA_im + p0;
+#pragma omp simd
+  for (int p = 0; p < n; ++p)
+  {
+    const float hr = h_re[p];
+    const float hi = h_im[p];
+    h_re[p] = ar[p] * hr - ai[p] * hi + bu_re[p];
+    h_im[p] = ai[p] * hr + ar[p] * hi + bu_im[p];
+  }
+}
+
+// y = s * real(C h) + D u over the n modes from p0, the D u term only if `direct`
+inline void readout(const Weights& w, int p0, int n, const float* u, const float* h_re, const float* h_im, float* y, bool direct)
+{
+  const int P = w.P;
+  for (int k = 0; k < w.H; ++k)
+  {
+    const float* cr = w.C_re + k * P + p0;
+    const float* ci = w.C_im + k * P + p0;
+    float acc = 0.0f;
+#pragma omp simd reduction(+ : acc)
+    for (int p = 0; p < n; ++p)
+      acc += cr[p] * h_re[p] - ci[p] * h_im[p];
+    y[k] = w.scale * acc + (direct ? w.D[k] * u[k] : 0.0f);
+  }
+}
+
+// dst = the sum of the `count` partial arrays of `size` floats in src, in block order
+inline void sumBlocks(const float* src, int count, std::int64_t size, float* dst, int threads)
+{
+#ifndef _OPENMP
+  (void)threads;
+#endif
+#pragma omp parallel for schedule(static) num_threads(threads)
+  for (std::int64_t i = 0; i < size; ++i)
+  {
+    float sum = src[i];
+    for (int blk = 1; blk < count; ++blk)
+      sum += src[blk * size + i];
+    dst[i] = sum;
+  }
+}
+
+inline int maxThreads(int requested)
+{
+#ifdef _OPENMP
+  return requested > 0 ? requested : omp_get_max_threads();
+#else
+  (void)requested;
+  return 1;
+#endif
+}
+
+inline int threadIndex()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+} // namespace detail
+
+// u: (B, L, H), h0: (B, P), y: (B, L, H), hT: (B, P), checkpoints: (B, numCheckpoints, 2, P)
+inline void forward(const Weights& w, const float* u, const float* h0_re, const float* h0_im, int B, int L, int checkpoint, float* y, float* hT_re, float* hT_im, float* checkpoints, int threads = 0)
+{
+  const int P = w.P;
+  const int H = w.H;
+  const int nck = numCheckpoints(L, checkpoint);
+  const int maxThreads = detail::maxThreads(threads);
+  const detail::Blocks blocks = detail::modeBlocks(P, (maxThreads + B - 1) / B);
+  const int tiles = B * blocks.count;
+
+  std::vector<float> dBt_re(H * P), dBt_im(H * P);
+  detail::transpose(w.dB_re, dBt_re.data(), P, H);
+  detail::transpose(w.dB_im, dBt_im.data(), P, H);
+
+  // each block's share of the readout when there are several, summed afterwards
+  const std::int64_t size = static_cast<std::int64_t>(B) * L * H;
+  std::vector<float> partial(blocks.count > 1 ? blocks.count * size : 0);
+
+#pragma omp parallel for schedule(static) num_threads(std::min(tiles, maxThreads))
+  for (int tile = 0; tile < tiles; ++tile)
+  {
+    const int b = tile / blocks.count;
+    const int blk = tile % blocks.count;
+    const int p0 = blk * blocks.width;
+    const int n = std::min(blocks.width, P - p0);
+    float* out = blocks.count > 1 ? partial.data() + blk * size : y;
+
+    std::vector<float> bu_re(n), bu_im(n);
+    float* h_re = hT_re + b * P + p0;
+    float* h_im = hT_im + b * P + p0;
+    std::copy(h0_re + b * P + p0, h0_re + b * P + p0 + n, h_re);
+    std::copy(h0_im + b * P + p0, h0_im + b * P + p0 + n, h_im);
+
+    for (int t = 0; t < L; ++t)
+    {
+      if (t % checkpoint == 0)
+      {
+        float* ck = checkpoints + (static_cast<std::int64_t>(b) * nck + t / checkpoint) * 2 * P + p0;
+        std::copy(h_re, h_re + n, ck);
+        std::copy(h_im, h_im + n, ck + P);
+      }
+
+      const std::int64_t offset = (static_cast<std::int64_t>(b) * L + t) * H;
+      detail::step(w, p0, n, dBt_re.data(), dBt_im.data(), u + offset, h_re, h_im, bu_re.data(), bu_im.data());
+      detail::readout(w, p0, n, u + offset, h_re, h_im, out + offset, blk == 0);
+    }
+  }
+
+  if (blocks.count > 1)
+    detail::sumBlocks(partial.data(), blocks.count, size, y, maxThreads);
+}
+
+// Adjoint of forward. grad_y: (B, L, H), grad_hT: (B, P). Writes grad_u (B, L, H), grad_h0 (B, P)
+// and overwrites the weight gradients in g.
+inline void backward(const Weights& w, const float* u, const float* checkpoints, const float* grad_y, const float* grad_hT_re, const float* grad_hT_im, int B, int L, int checkpoint, float* grad_u, float* grad_h0_re, float* grad_h0_im, const Gradients& g, int threads = 0)
+{
+  const int P = w.P;
+  const int H = w.H;
+  const int nck = numCheckpoints(L, checkpoint);
+  const int maxThreads = detail::maxThreads(threads);
+  const detail::Blocks blocks = detail::modeBlocks(P, (maxThreads + B - 1) / B);
+  const int tiles = B * blocks.count;
+  const int numThreads = std::min(tiles, maxThreads);
+
+  std::vector<float> dBt_re(H * P), dBt_im(H * P);
+  detail::transpose(w.dB_re, dBt_re.data(), P, H);
+  detail::transpose(w.dB_im, dBt_im.data(), P, H);
+
+  // per thread accumulators: dA_re, dA_im (P), dBt_re, dBt_im (H, P), C_re, C_im (H, P), D (H)
+  const std::size_t accSize = 2 * P + 4 * static_cast<std::size_t>(H) * P + H;
+  std::vector<float> acc(accSize * numThreads, 0.0f);
+
+  // each block's share of grad_u when there are several, summed afterwards
+  const std::int64_t size = static_cast<std::int64_t>(B) * L * H;
+  std::vector<float> partial(blocks.count > 1 ? blocks.count * size : 0);
+
+#pragma omp parallel num_threads(numThreads)
+  {
+    float* a = acc.data() + accSize * detail::threadIndex();
+    float* g_ar = a;
+    float* g_ai = g_ar + P;
+    float* g_bt_re = g_ai + P;
+    float* g_bt_im = g_bt_re + H * P;
+    float* g_cr = g_bt_im + H * P;
+    float* g_ci = g_cr + H * P;
+    float* g_d = g_ci + H * P;
+
+    const int width = blocks.width;
+    std::vector<float> states(2 * static_cast<std::size_t>(checkpoint + 1) * width);
+    std::vector<float> bu_re(width), bu_im(width), lam_re(width), lam_im(width), gu(H);
+
+#pragma omp for schedule(static)
+    for (int tile = 0; tile < tiles; ++tile)
+    {
+      const int b = tile / blocks.count;
+      const int blk = tile % blocks.count;
+      const int p0 = blk * width;
+      const int n = std::min(width, P - p0);
+      float* gradU = blocks.count > 1 ? partial.data() + blk * size : grad_u;
+      const float* ar = w.dA_re + p0;
+      const float* ai = w.dA_im + p0;
+
+      std::copy(grad_hT_re + b * P + p0, grad_hT_re + b * P + p0 + n, lam_re.begin());
+      std::copy(grad_hT_im + b * P + p0, grad_hT_im + b * P + p0 + n, lam_im.begin());
+
+      for (int s = nck - 1; s >= 0; --s)
+      {
+        const int t0 = s * checkpoint;
+        const int len = std::min(checkpoint, L - t0);
+
+        // recompute the states of this segment, states[i] is the state before step t0 + i
+        const float* ck = checkpoints + (static_cast<std::int64_t>(b) * nck + s) * 2 * P + p0;
+        std::copy(ck, ck + n, states.begin());
+        std::copy(ck + P, ck + P + n, states.begin() + n);
+        for (int i = 0; i < len; ++i)
+        {
+          float* next = states.data() + 2 * (i + 1) * n;
+          std::copy(states.begin() + 2 * i * n, states.begin() + 2 * (i + 1) * n, next);
+          const std::int64_t offset = (static_cast<std::int64_t>(b) * L + t0 + i) * H;
+          detail::step(w, p0, n, dBt_re.data(), dBt_im.data(), u + offset, next, next + n, bu_re.data(), bu_im.data());
+        }
+
+        for (int i = len - 1; i >= 0; --i)
+        {
+          const std::int64_t offset = (static_cast<std::int64_t>(b) * L + t0 + i) * H;
+          const float* ut = u + offset;
+          const float* gy = grad_y + offset;
+          const float* h_re = states.data() + 2 * (i + 1) * n;
+          const float* h_im = h_re + n;
+          const float* hp_re = states.data() + 2 * i * n;
+          const float* hp_im = hp_re + n;
+
+          // readout: y = s * (C_re h_re - C_im h_im) + D u, the D u term in the first block
+          for (int k = 0; k < H; ++k)
+          {
+            const float sg = w.scale * gy[k];
+            const float* cr = w.C_re + k * P + p0;
+            const float* ci = w.C_im + k * P + p0;
+            float* gcr = g_cr + k * P + p0;
+            float* gci = g_ci + k * P + p0;
+            if (blk == 0)
+            {
+              g_d[k] += gy[k] * ut[k];
+              gu[k] = gy[k] * w.D[k];
+            }
+            else
+              gu[k] = 0.0f;
+#pragma omp simd
+            for (int p = 0; p < n; ++p)
+            {
+              gcr[p] += sg * h_re[p];
+              gci[p] -= sg * h_im[p];
+              lam_re[p] += sg * cr[p];
+              lam_im[p] -= sg * ci[p];
+            }
+          }
+
+          // lam is now the full gradient of h[t]; Bu projection
+          for (int k = 0; k < H; ++k)
+          {
+            const float uk = ut[k];
+            const float* br = dBt_re.data() + k * P + p0;
+            const float* bi = dBt_im.data() + k * P + p0;
+            float* gbr = g_bt_re + k * P + p0;
+            float* gbi = g_bt_im + k * P + p0;
+            float sum = 0.0f;
+#pragma omp simd reduction(+ : sum)
+            for (int p = 0; p < n; ++p)
+            {
+              gbr[p] += lam_re[p] * uk;
+              gbi[p] += lam_im[p] * uk;
+              sum += lam_re[p] * br[p] + lam_im[p] * bi[p];
+            }
+            gu[k] += sum;
+          }
+          std::copy(gu.begin(), gu.end(), gradU + offset);
+
+          // recurrence: gradient of dA and propagation to h[t - 1]
+#pragma omp simd
+          for (int p = 0; p < n; ++p)
+          {
+            const float lr = lam_re[p];
+            const float li = lam_im[p];
+            g_ar[p0 + p] += lr * hp_re[p] + li * hp_im[p];
+            g_ai[p0 + p] += li * hp_re[p] - lr * hp_im[p];
+            lam_re[p] = ar[p] * lr + ai[p] * li;
+            lam_im[p] = ar[p] * li - ai[p] * lr;
+          }
+        }
+      }
+
+      std::copy(lam_re.begin(), lam_re.begin() + n, grad_h0_re + b * P + p0);
+      std::copy(lam_im.begin(), lam_im.begin() + n, grad_h0_im + b * P + p0);
+    }
+  }
+
+  if (blocks.count > 1)
+    detail::sumBlocks(partial.data(), blocks.count, size, grad_u, maxThreads);
+
+  // reduce the per thread accumulators
+  for (std::size_t i = 1; i < static_cast<std::size_t>(numThreads); ++i)
+    for (std::size_t j = 0; j < accSize; ++j)
+      acc[j] += acc[i * accSize + j];
+
+  const float* a = acc.data();
+  std::copy(a, a + P, g.dA_re);
+  std::copy(a + P, a + 2 * P, g.dA_im);
+  detail::transpose(a + 2 * P, g.dB_re, H, P);
+  detail::transpose(a + 2 * P + H * P, g.dB_im, H, P);
+  std::copy(a + 2 * P + 2 * H * P, a + 2 * P + 3 * H * P, g.C_re);
+  std::copy(a + 2 * P + 3 * H * P, a + 2 * P + 4 * H * P, g.C_im);
+  std::copy(a + 2 * P + 4 * H * P, a + accSize, g.D);
+}
+} // namespace s5_scan
@@ -0,0 +1,69 @@
+import os
+import sys
+import warnings
+import torch
+
+_CHECKPOINT = 64 # states are stored every _CHECKPOINT steps and recomputed in the backward pass
+_extension = None
+_extension_failed = False
+
+
+def _load_extension():
+    """JIT-build model/csrc/s5_scan.cpp on first use (cached by torch in its extensions folder)."""
+    global _extension, _extension_failed
+    if _extension is None and not _extension_failed:
+        from torch.utils.cpp_extension import load
+        csrc = os.path.join(os.path.dirname(os.path.abspath(__file__)), "csrc")
+        if sys.platform.startswith("win"):
+            cflags, ldflags = ["/O2", "/openmp"], []
+        elif sys.platform == "darwin":
+            cflags, ldflags = ["-O3", "-Xpreprocessor", "-fopenmp"], ["-lomp"]
+        else:
+            cflags, ldflags = ["-O3", "-march=native", "-fopenmp"], ["-fopenmp"]
+        try:
+            _extension = load(name="s5_scan_cpu", sources=[os.path.join(csrc, "s5_scan.cpp")], extra_cflags=cflags, extra_ldflags=ldflags)
+        except Exception as e:
+            _extension_failed = True
+            warnings.warn(f"Fused S5 scan unavailable, falling back to the parallel scan: {e}")
+    return _extension
+
+
+def fused_scan_available():
+    return _load_extension() is not None
+
+
+class _FusedS5Scan(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, dA_re, dA_im, dB_re, dB_im, C_re, C_im, D, u, h_re, h_im, conj_sym):
+        weights = [t.contiguous() for t in (dA_re, dA_im, dB_re, dB_im, C_re, C_im, D)]
+        u = u.contiguous()
+        y, hT_re, hT_im, checkpoints = _load_extension().forward(*weights, u, h_re.contiguous(), h_im.contiguous(), conj_sym, _CHECKPOINT)
+        ctx.save_for_backward(*weights, u, checkpoints)
+        ctx.conj_sym = conj_sym
+        return y, hT_re, hT_im
+
+    @staticmethod
+    def backward(ctx, grad_y, grad_hT_re, grad_hT_im):
+        *weights, u, checkpoints = ctx.saved_tensors
+        grads = _load_extension().backward(*weights, u, checkpoints, grad_y, grad_hT_re, grad_hT_im, ctx.conj_sym, _CHECKPOINT)
+        return (*grads, None)
+
+
+def apply_ssm_fused(dA: torch.Tensor, dB: torch.Tensor, C: torch.Tensor, D: torch.Tensor, u: torch.Tensor, h: torch.Tensor, conj_sym: bool):
+    """ Same as torch_parallel_scan.apply_ssm, computed by the fused C++ CPU kernel (model/csrc).
+        The Bu projection, the diagonal recurrence and the C readout run in one pass, and only a state
+        checkpoint every _CHECKPOINT steps is kept for the backward pass instead of (B, L, P) tensors.
+        Args:
+            dA       (complex64):       discretized diagonal state matrix (P)
+            dB       (complex64):       discretized input matrix          (P, H)
+            C        (complex64):       weight matrix                     (H, P)
+            D        (float32):         weight vector                     (H)
+            h        (complex64):       hidden state                      (B, P)
+            u        (float32):         input sequence of features        (B, L, H)
+            conj_sym (bool):            enforce conjugate symmetry
+        Returns:
+            y      (float32): the SSM outputs              (B, L, H)
+            h_real (float32): real part of the last state  (B, P)
+            h_imag (float32): imag part of the last state  (B, P)
+    """
+    return _FusedS5Scan.apply(dA.real, dA.imag, dB.real, dB.imag, C.real, C.imag, D, u, h.real, h.imag, conj_sym)
@@ -6,13 +6,15 @@ import torch.nn.functional as F
 from config import ModelParams
 from model.init_ssm import make_DPLR_HiPPO
 from model.torch_parallel_scan import apply_ssm
+from model.fused_scan import apply_ssm_fused, fused_scan_available
 from model.film import FiLM
 
 
 class S5_SSM(nn.Module):
-    def __init__(self, d_inner, ssm_size, Lambda_re_init, Lambda_im_init, V, Vinv, dt_min, dt_max, dt_init_floor, conj_sym):
+    def __init__(self, d_inner, ssm_size, Lambda_re_init, Lambda_im_init, V, Vinv, dt_min, dt_max, dt_init_floor, conj_sym, fused_cpu_scan=False):
         super(S5_SSM, self).__init__()
         self.conj_sym = conj_sym
+        self.fused_cpu_scan = fused_cpu_scan
         if conj_sym:
             local_P = 2*ssm_size
         else:
@@ -67,7 +69,10 @@ class S5_SSM(nn.Module):
 
         # Apply: h[n] = Ah[n-1]     + Bu[n]
         #        y[n] = real(Ch[n]) + Du[n]
-        y, h_real, h_imag = apply_ssm(dA, dB, C, self.D, u, h, self.conj_sym)
+        if self.fused_cpu_scan and u.device.type == "cpu" and fused_scan_available():
+            y, h_real, h_imag = apply_ssm_fused(dA, dB, C, self.D, u, h, self.conj_sym)
+        else:
+            y, h_real, h_imag = apply_ssm(dA, dB, C, self.D, u, h, self.conj_sym)
         return y, h_real, h_imag
 
     def change_scale(self, step_rescale):
@@ -99,7 +104,7 @@ class MambaBlock(nn.Module):
         V = torch.block_diag(*([V] * args.blocks))
         Vinv = torch.block_diag(*([Vc] * args.blocks))
 
-        self.ssm = S5_SSM(args.d_inner, ssm_size, Lambda.real, Lambda.imag, V, Vinv, args.dt_min, args.dt_max, args.dt_init_floor, args.conj_sym)
+        self.ssm = S5_SSM(args.d_inner, ssm_size, Lambda.real, Lambda.imag, V, Vinv, args.dt_min, args.dt_max, args.dt_init_floor, args.conj_sym, args.fused_cpu_scan)
 
         self.out_proj = nn.Linear(args.d_inner, args.d_model, bias=args.bias)
 
@@ -0,0 +1,216 @@
+import argparse
+import json
+import math
+import os
+import struct
+
+# Rows of every generated array are zero padded to a multiple of this many floats
+# (compiled_pad in plugin/NeuralAudioPlugin/CompiledModel.h)
+PAD = 16
+
+
+def stride(n):
+    return -(-n // PAD) * PAD
+
+
+def f32(x):
+    """Round to float32 and format as a C++ float literal that reads back exactly."""
+    return repr(struct.unpack('f', struct.pack('f', x))[0]) + 'f'
+
+
+def read_config(model_data):
+    """
+    Model hyperparameters, from the "config" section written by model2json.py or inferred from the
+    weight shapes (same rules as ModelConfig.h).
+    """
+    layers = model_data['layers']
+    mamba = layers[3]['parameters']['mamba']
+    if 'config' in model_data:
+        c = dict(model_data['config'])
+    else:
+        d_model = len(layers[2]['weights'][0])
+        c = {
+            'd_model': d_model,
+            'd_state': 2 * len(mamba['A_real']),
+            'expand_factor': len(mamba['in_proj']['weights']) // (2 * d_model),
+            'n_layers': len(layers) - 4,
+            'c_dim': len(layers[0]['weights'][0][0]),
+            'film_hidden': len(layers[0]['weights'][0]),
+            'bias': mamba['in_proj']['bias'] is not None,
+            'conj_sym': True,
+        }
+    c['d_inner'] = c['expand_factor'] * c['d_model']
+    c['ssm_size'] = c['d_state'] // 2 if c['conj_sym'] else c['d_state']
+    if len(layers) != c['n_layers'] + 4 or len(mamba['A_real']) != c['ssm_size']:
+        raise ValueError('weight file does not match its configuration')
+    return c
+
+
+def padded(rows, n):
+    """Flatten a list of rows, each zero padded to stride(n)."""
+    out = []
+    for row in rows:
+        out.extend(row)
+        out.extend([0.0] * (stride(n) - len(row)))
+    return out
+
+
+def discretize(m, sr, trained_sr):
+    """Bilinear discretization of one layer, as Model::discretize_bilinear (in double precision)."""
+    P = len(m['A_real'])
+    H = len(m['B_real'][0])
+    dA_re, dA_im = [], []
+    dB_re = [[0.0] * P for _ in range(H)]
+    dB_im = [[0.0] * P for _ in range(H)]
+    for p in range(P):
+        dt = trained_sr / sr * math.log1p(math.exp(m['inv_dt'][p]))
+        A = complex(m['A_real'][p], m['A_imag'][p])
+        BL = 1.0 / (1.0 - dt / 2.0 * A)
+        dA = BL * (1.0 + dt / 2.0 * A)
+        dA_re.append(dA.real)
+        dA_im.append(dA.imag)
+        for k in range(H):
+            dB = BL * dt * complex(m['B_real'][p][k], m['B_imag'][p][k])
+            dB_re[k][p] = dB.real
+            dB_im[k][p] = dB.imag
+    return dA_re, dA_im, dB_re, dB_im
+
+
+def compile_model(model_data, struct_name='CompiledWeights', sample_rates=(44100, 48000), trained_sr=48000):
+    """
+    Run every load-time transform of the C++ engine on a parsed model_weights.json and return a
+    header with the result as constexpr arrays, for CompiledModel<struct_name> / CompiledFiLM<struct_name>.
+
+    Args:
+        model_data   (dict):  parsed model_weights.json
+        struct_name  (str):   name of the generated weight struct
+        sample_rates (tuple): sample rates to discretize for, others are discretized at runtime
+        trained_sr   (int):   sample rate the model was trained at
+    Returns:
+        str
+    """
+    c = read_config(model_data)
+    d_model, d_inner, ssm_size, L = c['d_model'], c['d_inner'], c['ssm_size'], c['n_layers']
+    layers = model_data['layers']
+    blocks = [layers[i + 3]['parameters'] for i in range(L)]
+    c_scale = 2.0 if c['conj_sym'] else 1.0
+    zeros = lambda n: [0.0] * n
+
+    def T(mat):
+        return [list(r) for r in zip(*mat)]
+
+    arrays = []
+
+    # FiLM: Linear -> ReLU -> Linear, gamma and beta halves padded separately
+    W1, B1 = layers[0]['weights'][0], layers[0]['weights'][1]
+    W2, B2 = layers[1]['weights'][0], layers[1]['weights'][1]
+    arrays.append(('film_in_proj', padded(T(W1), c['film_hidden'])))
+    arrays.append(('film_in_bias', padded([B1], c['film_hidden'])))
+    arrays.append(('film_out_proj', padded([h for row in T(W2) for h in (row[:d_model], row[d_model:])], d_model)))
+    arrays.append(('film_out_bias', padded([B2[:d_model], B2[d_model:]], d_model)))
+
+    # in and out projections
+    in_layer, out_layer = layers[2]['weights'], layers[L + 3]['weights']
+    arrays.append(('in_proj', padded([[w[0] for w in in_layer[0]]], d_model)))
+    arrays.append(('in_bias', padded([in_layer[1] if c['bias'] else zeros(d_model)], d_model)))
+    arrays.append(('out_proj', padded([out_layer[0][0]], d_model)))
+    out_bias = out_layer[1][0] if c['bias'] else 0.0
+
+    # residual blocks
+    def per_layer(fn, n):
+        return padded([row for b in blocks for row in fn(b)], n)
+
+    mamba = lambda b: b['mamba']
+    arrays.append(('norm', per_layer(lambda b: [b['norm']['weight']], d_model)))
+    arrays.append(('in_proj_mamba', per_layer(lambda b: [h for row in T(mamba(b)['in_proj']['weights']) for h in (row[:d_inner], row[d_inner:])], d_inner)))
+    arrays.append(('in_proj_mamba_bias', per_layer(lambda b: [mamba(b)['in_proj']['bias'][:d_inner], mamba(b)['in_proj']['bias'][d_inner:]] if c['bias'] else [zeros(d_inner)] * 2, d_inner)))
+    arrays.append(('out_proj_mamba', per_layer(lambda b: T(mamba(b)['out_proj']['weights']), d_model)))
+    arrays.append(('out_proj_mamba_bias', per_layer(lambda b: [mamba(b)['out_proj']['bias'] if c['bias'] else zeros(d_model)], d_model)))
+    arrays.append(('C_real', per_layer(lambda b: [[c_scale * x for x in r] for r in T(mamba(b)['C_real'])], d_inner)))
+    arrays.append(('C_imag', per_layer(lambda b: [[c_scale * x for x in r] for r in T(mamba(b)['C_imag'])], d_inner)))
+    arrays.append(('D', per_layer(lambda b: [mamba(b)['D']], d_inner)))
+
+    # continuous parameters, only read when discretizing for a rate that was not compiled in
+    arrays.append(('A_real', per_layer(lambda b: [mamba(b)['A_real']], ssm_size)))
+    arrays.append(('A_imag', per_layer(lambda b: [mamba(b)['A_imag']], ssm_size)))
+    arrays.append(('inv_dt', per_layer(lambda b: [mamba(b)['inv_dt']], ssm_size)))
+    arrays.append(('B_real', per_layer(lambda b: T(mamba(b)['B_real']), ssm_size)))
+    arrays.append(('B_imag', per_layer(lambda b: T(mamba(b)['B_imag']), ssm_size)))
+
+    # discretized A and B: [rate][layer][...]
+    disc = [[discretize(mamba(b), sr, trained_sr) for b in blocks] for sr in sample_rates]
+    arrays.append(('dA_real', padded([d[0] for r in disc for d in r], ssm_size)))
+    arrays.append(('dA_imag', padded([d[1] for r in disc for d in r], ssm_size)))
+    arrays.append(('dB_real', padded([row for r in disc for d in r for row in d[2]], ssm_size)))
+    arrays.append(('dB_imag', padded([row for r in disc for d in r for row in d[3]], ssm_size)))
+
+    lines = [
+        '// Generated by neural_network/model2cpp.py, do not edit.',
+        f'// d_model={d_model} d_state={c["d_state"]} expand_factor={c["expand_factor"]} n_layers={L} '
+        f'c_dim={c["c_dim"]} bias={c["bias"]} conj_sym={c["conj_sym"]}',
+        '#pragma once',
+        '',
+        '#include "CompiledModel.h"',
+        '',
+        f'struct {struct_name}',
+        '{',
+        f'  static constexpr int d_model = {d_model};',
+        f'  static constexpr int d_inner = {d_inner};',
+        f'  static constexpr int ssm_size = {ssm_size};',
+        f'  static constexpr int num_layers = {L};',
+        f'  static constexpr int c_in = {c["c_dim"]};',
+        f'  static constexpr int d_hidden = {c["film_hidden"]};',
+        f'  static constexpr bool bias = {"true" if c["bias"] else "false"};',
+        f'  static constexpr int num_rates = {len(sample_rates)};',
+        f'  static constexpr float sample_rates[num_rates] = {{{", ".join(f32(sr) for sr in sample_rates)}}};',
+        f'  static constexpr float out_bias = {f32(out_bias)};',
+        f'  static constexpr float eps[num_layers] = {{{", ".join(f32(b["norm"]["eps"]) for b in blocks)}}};',
+        '',
+    ]
+    for name, values in arrays:
+        lines.append(f'  alignas(64) static constexpr float {name}[{len(values)}] = {{')
+        for i in range(0, len(values), PAD):
+            lines.append('    ' + ', '.join(f32(v) for v in values[i:i + PAD]) + ',')
+        lines.append('  };')
+    lines += [
+        '};',
+        '',
+    ]
+    return '\n'.join(lines)
+
+
+def embed_json(data, out_path, symbol='model_weights_json'):
+    """Write the weight file as a byte array header (model_weights.h) for runtime loading, replaces xxd -i."""
+    guard = os.path.splitext(os.path.basename(out_path))[0].upper() + '_H'
+    lines = [f'#ifndef {guard}', f'#define {guard}', '', f'unsigned char {symbol}[] = {{']
+    for i in range(0, len(data), 16):
+        lines.append('  ' + ', '.join(f'0x{b:02x}' for b in data[i:i + 16]) + ',')
+    lines += ['};', f'unsigned int {symbol}_len = {len(data)};', '', '#endif', '']
+    with open(out_path, 'w') as f:
+        f.write('\n'.join(lines))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Compile model_weights.json into C++ headers for the plugin.')
+    parser.add_argument('weights', help='model_weights.json written by model2json.py')
+    parser.add_argument('--out-dir', default='.', help='where to write the headers')
+    parser.add_argument('--name', default='CompiledWeights', help='name of the generated weight struct')
+    parser.add_argument('--sample-rates', type=int, nargs='+', default=[44100, 48000], help='sample rates to discretize for')
+    parser.add_argument('--trained-sr', type=int, default=48000, help='sample rate the model was trained at')
+    parser.add_argument('--eco', default=None,
+                        help='cheaper weight file for the eco quality tier (reduce_ssm.py, factor_projections.py or a smaller capture), '
+                             'written as model_weights_eco.h')
+    args = parser.parse_args()
+
+    with open(args.weights, 'rb') as f:
+        raw = f.read()
+
+    # runtime loading (Model/FiLM)
+    embed_json(raw, os.path.join(args.out_dir, 'model_weights.h'))
+    if args.eco is not None:
+        with open(args.eco, 'rb') as f:
+            embed_json(f.read(), os.path.join(args.out_dir, 'model_weights_eco.h'), 'model_weights_eco_json')
+
+    # compiled engine (CompiledModel/CompiledFiLM)
+    with open(os.path.join(args.out_dir, 'model_compiled.h'), 'w') as f:
+        f.write(compile_model(json.loads(raw), args.name, tuple(args.sample_rates), args.trained_sr))
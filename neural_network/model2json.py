@@ -1,8 +1,11 @@
+import os
 import torch
 import torch.nn as nn
 import json
 import numpy as np
 from model.mamba import Mamba
+from utils import init_hidden
+from reduce_ssm import reduce_model, print_report
 
 def parse_linear_layers(model: Mamba, file_dict):
     """
@@ -126,9 +129,129 @@ def parse_linear_layers(model: Mamba, file_dict):
     traverse_model(model)
     return file_dict
 
-def model_2_json(model: Mamba, out_path="model_weights"):
-    file_dict = {'in_shape': [None, 1]}
+def get_model_config(model: Mamba):
+    """
+    Hyperparameters the C++ engine needs to size itself (plugin/NeuralAudioPlugin/ModelConfig.h),
+    read back from the module shapes.
+
+    Args:
+        model (Mamba: nn.Module)
+    Returns:
+        dict
+    """
+    block = model.mamba_blocks[0].mamba
+    d_model = model.in_proj.out_features
+    ssm_size = block.ssm.A_real.shape[0]
+    return {
+        'd_model': d_model,
+        'd_state': 2 * ssm_size if block.ssm.conj_sym else ssm_size,
+        'expand_factor': block.in_proj.out_features // (2 * d_model),
+        'n_layers': model.n_layers,
+        'c_dim': model.film_gen.fc[0].in_features,
+        'film_hidden': model.film_gen.fc[0].out_features,
+        'bias': block.in_proj.bias is not None,
+        'conj_sym': bool(block.ssm.conj_sym),
+    }
+
+def model_2_json(model: Mamba, out_path="model_weights", max_error=None):
+    """
+    Args:
+        model     (Mamba: nn.Module)
+        out_path  (str):   output file without the .json extension
+        max_error (float): if set, reduce the S5 state size by balanced truncation with this
+                           relative error budget per layer (see reduce_ssm.py)
+    """
+    file_dict = {'in_shape': [None, 1], 'config': get_model_config(model)}
     file_dict = parse_linear_layers(model, file_dict)
+    if max_error is not None:
+        file_dict, report = reduce_model(file_dict, max_error)
+        print_report(report)
 
     with open(f"{out_path}.json", "w") as json_file: 
-        json.dump(file_dict, json_file, indent=1)
\ No newline at end of file
+        json.dump(file_dict, json_file, indent=1)
+
+def make_test_signals(sr, seconds=1.0):
+    """
+    Fixed test material for the C++ accuracy harness (plugin/NeuralAudioPlugin/tools/accuracy_harness.cpp).
+
+    Args:
+        sr      (int):   sample rate
+        seconds (float): length of each signal
+    Returns:
+        dict of name -> float32 numpy array
+    """
+    n = int(sr * seconds)
+    t = np.arange(n) / sr
+
+    f0, f1 = 20.0, min(20000.0, 0.45 * sr)
+    k = np.log(f1 / f0)
+    sweep = 0.5 * np.sin(2 * np.pi * f0 * seconds / k * (np.exp(t / seconds * k) - 1.0))
+
+    notes = [82.41, 110.0, 146.83, 196.0, 246.94, 329.63]
+    note_len = max(1, n // len(notes))
+    note_idx = np.minimum(np.arange(n) // note_len, len(notes) - 1)
+    t_note = (np.arange(n) - note_idx * note_len) / sr
+    f_note = np.array(notes)[note_idx]
+    plucks = sum(np.sin(2 * np.pi * f_note * h * t_note) * np.exp(-t_note * (3.0 + 2.0 * h)) / h for h in range(1, 9))
+    plucks = 0.8 * 0.5 * plucks
+
+    rng = np.random.default_rng(12345)
+    segment = max(1, n // 6)
+    levels = np.array([0.5, 0.0, 0.125, 0.0, 0.0316, 0.0])
+    noise_bursts = rng.uniform(-1.0, 1.0, n) * levels[np.minimum(np.arange(n) // segment, 5)]
+
+    quiet_tone = 0.01 * np.sin(np.pi * np.arange(n) / max(1, n - 1)) * np.sin(2 * np.pi * 440.0 * t)
+
+    impulse_tail = np.zeros(n)
+    impulse_tail[n // 10] = 1.0
+
+    signals = {
+        'sweep': sweep,
+        'plucks': plucks,
+        'noise_bursts': noise_bursts,
+        'quiet_tone': quiet_tone,
+        'impulse_tail': impulse_tail,
+    }
+    return {name: x.astype(np.float32) for name, x in signals.items()}
+
+
+def export_reference(model: Mamba, out_dir="reference", sample_rates=(48000, 44100), conditions=((-1.0, -1.0), (0.0, 0.0), (1.0, 1.0), (1.0, -1.0), (-1.0, 1.0)), seconds=1.0, trained_sr=48000):
+    """
+    Render the test material through the PyTorch model and store inputs and outputs as raw
+    little-endian float32 files with a reference.json manifest. Pass the manifest to
+    accuracy_harness --reference to check the C++ engine against the trained model.
+
+    Args:
+        model        (Mamba: nn.Module)
+        out_dir      (str):   output directory
+        sample_rates (tuple): sample rates to render at (the model is rescaled from trained_sr)
+        conditions   (tuple): (drive, tone) pairs in [-1, 1]
+        seconds      (float): length of each test signal
+        trained_sr   (int):   sample rate the model was trained at
+    """
+    os.makedirs(out_dir, exist_ok=True)
+    model.eval()
+    n_layers = model.n_layers
+    ssm_size = model.mamba_blocks[0].mamba.ssm.A_real.shape[0]
+    c_dim = model.film_gen.fc[0].in_features
+
+    cases = []
+    with torch.no_grad():
+        for sr in sample_rates:
+            model.change_scale(trained_sr / sr)
+            for name, x in make_test_signals(sr, seconds).items():
+                input_file = f"{name}_{sr}_input.f32"
+                x.astype('<f4').tofile(os.path.join(out_dir, input_file))
+                for c1, c2 in conditions:
+                    h = init_hidden(n_layers, 1, ssm_size, 'cpu')
+                    c = torch.tensor([c1, c2][:c_dim], dtype=torch.float32).expand(1, x.shape[0], c_dim)
+                    y, _ = model(torch.from_numpy(x).view(1, -1, 1), h, c)
+
+                    case_name = f"{name}_d{c1:g}_t{c2:g}_{sr}"
+                    output_file = f"{case_name}_output.f32"
+                    y.view(-1).numpy().astype('<f4').tofile(os.path.join(out_dir, output_file))
+                    cases.append({'name': case_name, 'sample_rate': sr, 'c': [c1, c2], 'input': input_file, 'output': output_file})
+        model.change_scale(1.0)
+
+    with open(os.path.join(out_dir, "reference.json"), "w") as json_file:
+        json.dump({'trained_sample_rate': trained_sr, 'cases': cases}, json_file, indent=1)
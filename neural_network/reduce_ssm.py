@@ -0,0 +1,241 @@
+import argparse
+import copy
+import json
+import math
+import numpy as np
+
+# Sample rate the C++ engine assumes for the exported dt (Model::discretize_bilinear)
+TRAINED_SR = 48000
+
+# softplus^-1(1): the reduced modes are stored with dt = 1 sample at the trained rate
+INV_DT_ONE = math.log(math.expm1(1.0))
+
+
+def layer_system(mamba, conj_sym):
+    """
+    Discrete system of one S5 layer at the trained rate, as the engine runs it:
+        h[n] = dA h[n-1] + dB u[n],  y[n] = c_scale * Re(C h[n])
+    Returns (dA (P), dB (P, H), C (H, P), c_scale), complex.
+    """
+    A = np.array(mamba['A_real'], dtype=np.float64) + 1j * np.array(mamba['A_imag'], dtype=np.float64)
+    B = np.array(mamba['B_real'], dtype=np.float64) + 1j * np.array(mamba['B_imag'], dtype=np.float64)
+    C = np.array(mamba['C_real'], dtype=np.float64) + 1j * np.array(mamba['C_imag'], dtype=np.float64)
+    dt = np.logaddexp(0.0, np.array(mamba['inv_dt'], dtype=np.float64))
+    den = 1.0 - dt / 2.0 * A
+    return (1.0 + dt / 2.0 * A) / den, (dt / den)[:, None] * B, C, 2.0 if conj_sym else 1.0
+
+
+def real_realization(dA, dB, C, c_scale):
+    """
+    The same system with real state [Re h | Im h] (2P states), and its controllability and
+    observability Gramians. The Gramians are computed in the diagonal complex basis [h | conj(h)],
+    where the Stein equations have a closed form, then transformed.
+    """
+    P = dA.shape[0]
+    ar, ai = np.diag(dA.real), np.diag(dA.imag)
+    A = np.block([[ar, -ai], [ai, ar]])
+    B = np.vstack([dB.real, dB.imag])
+    Cr = c_scale * np.hstack([C.real, -C.imag])
+
+    # y = c_scale / 2 (C h + conj(C) conj(h))
+    a = np.concatenate([dA, dA.conj()])
+    b = np.vstack([dB, dB.conj()])
+    c = c_scale / 2.0 * np.hstack([C, C.conj()])
+    Wc = (b @ b.conj().T) / (1.0 - a[:, None] * a.conj()[None, :])
+    Wo = (c.conj().T @ c) / (1.0 - a.conj()[:, None] * a[None, :])
+
+    # [h | conj(h)] = M [Re h | Im h]
+    I = np.eye(P)
+    M = np.block([[I, 1j * I], [I, -1j * I]])
+    Minv = np.linalg.inv(M)
+    Wc = (Minv @ Wc @ Minv.conj().T).real
+    Wo = (M.conj().T @ Wo @ M).real
+    return A, B, Cr, (Wc + Wc.T) / 2.0, (Wo + Wo.T) / 2.0
+
+
+def sqrt_factor(W):
+    """L with W = L L^T for a symmetric positive semi-definite W."""
+    w, V = np.linalg.eigh(W)
+    return V * np.sqrt(np.clip(w, 0.0, None))
+
+
+def balanced_truncation(A, B, C, Wc, Wo, r):
+    """Square root balanced truncation to r states. Returns (Ar, Br, Cr)."""
+    Lc = sqrt_factor(Wc)
+    Lo = sqrt_factor(Wo)
+    U, s, Vt = np.linalg.svd(Lo.T @ Lc)
+    S = 1.0 / np.sqrt(s[:r])
+    Tr = Lc @ Vt[:r].T * S
+    Tl = (S[:, None] * U[:, :r].T) @ Lo.T
+    return Tl @ A @ Tr, Tl @ B, C @ Tr
+
+
+def modal_form(Ar, Br, Cr, c_scale):
+    """
+    Diagonalize a reduced real system back into engine modes. A complex conjugate eigenvalue pair
+    becomes one mode, a real eigenvalue one mode with a real pole.
+    Returns (dA (P'), dB (P', H), C (H, P'), eigenvector condition number).
+    """
+    mu, V = np.linalg.eig(Ar)
+    Vinv = np.linalg.inv(V)
+    Bm = Vinv @ Br
+    Cm = Cr @ V
+    tol = 1e-9 * max(1.0, np.max(np.abs(mu)))
+    keep = []
+    for k in range(len(mu)):
+        if mu[k].imag > tol:
+            keep.append((k, 2.0))
+        elif abs(mu[k].imag) <= tol:
+            keep.append((k, 1.0))
+    idx = np.array([k for k, _ in keep], dtype=int)
+    factor = np.array([f for _, f in keep])
+    dA = mu[idx]
+    dB = Bm[idx]
+    C = Cm[:, idx] * factor / c_scale
+    # balance the magnitudes of B and C per mode, the float32 engine loses less precision
+    scale = np.sqrt(np.linalg.norm(C, axis=0) / np.maximum(np.linalg.norm(dB, axis=1), 1e-30))
+    scale = np.where(scale > 0.0, scale, 1.0)
+    return dA, dB * scale[:, None], C / scale, np.linalg.cond(V)
+
+
+def frequency_response(dA, dB, C, c_scale, w):
+    """Engine transfer matrices H(e^jw) (len(w), H, H) of y = c_scale Re(C h)."""
+    a = np.concatenate([dA, dA.conj()])
+    b = np.vstack([dB, dB.conj()])
+    c = c_scale / 2.0 * np.hstack([C, C.conj()])
+    z = np.exp(1j * w)
+    # y = C h[n] with h[n] = dA h[n-1] + dB u[n]: H = C diag(z / (z - a)) B
+    g = z[:, None] / (z[:, None] - a[None, :])
+    return np.einsum('hp,fp,pk->fhk', c, g, b)
+
+
+def peak_gain(H):
+    """Largest singular value over all frequencies."""
+    return float(np.max(np.linalg.norm(H, ord=2, axis=(1, 2))))
+
+
+def to_continuous(dA, dB):
+    """Continuous A and B with dt = 1 that discretize back to dA, dB (inverse bilinear transform)."""
+    A = 2.0 * (dA - 1.0) / (dA + 1.0)
+    return A, dB * (1.0 - A / 2.0)[:, None]
+
+
+def reduce_layer(mamba, conj_sym, max_error=None, ssm_size=None, sr=TRAINED_SR):
+    """
+    Reduce one layer by balanced truncation of its discrete system at the trained rate.
+    The number of kept states is the smallest whose error bound 2 * sum(dropped Hankel singular
+    values) stays below max_error times the layer's peak gain, or the largest that fits ssm_size
+    modes.
+
+    Returns (dA, dB, C, info) with info the per-layer report entry.
+    """
+    dA, dB, C, c_scale = layer_system(mamba, conj_sym)
+    P = dA.shape[0]
+    A, B, Cr, Wc, Wo = real_realization(dA, dB, C, c_scale)
+    hsv = np.sqrt(np.clip(np.linalg.eigvals(Wc @ Wo).real, 0.0, None))
+    hsv = np.sort(hsv)[::-1]
+    tail = np.concatenate([np.cumsum(hsv[::-1])[::-1], [0.0]]) # tail[r] = sum(hsv[r:])
+
+    w = 2.0 * np.pi * np.geomspace(20.0, min(20000.0, 0.45 * sr), 256) / sr
+    H = frequency_response(dA, dB, C, c_scale, w)
+    gain = peak_gain(H)
+
+    def reduce_to(r):
+        if r >= 2 * P:
+            return dA, dB, C, 1.0
+        return modal_form(*balanced_truncation(A, B, Cr, Wc, Wo, r), c_scale)
+
+    if ssm_size is not None:
+        r = min(2 * ssm_size, 2 * P)
+        rA, rB, rC, cond = reduce_to(r)
+        while rA.shape[0] > ssm_size:
+            r -= 1
+            rA, rB, rC, cond = reduce_to(r)
+    else:
+        r = next(r for r in range(2 * P + 1) if 2.0 * tail[r] <= max_error * gain)
+        rA, rB, rC, cond = reduce_to(r)
+
+    error = peak_gain(H - frequency_response(rA, rB, rC, c_scale, w))
+    info = {
+        'modes': int(rA.shape[0]),
+        'original_modes': P,
+        'states': int(r),
+        'hankel_singular_values': hsv.tolist(),
+        'bound': float(2.0 * tail[r]),
+        'measured': error,
+        'peak_gain': gain,
+        'eigenvector_condition': float(cond),
+    }
+    return rA, rB, rC, info
+
+
+def reduce_model(model_data, max_error=1e-3, ssm_size=None):
+    """
+    Reduce the S5 state size of every layer of an exported model_weights.json (model2json.py).
+    All layers share the largest reduced size, smaller layers are padded with silent modes.
+    The result loads in the C++ engine (the size is read from the file) and in model2cpp.py.
+
+    Args:
+        model_data (dict):  parsed model_weights.json
+        max_error  (float): error budget per layer, relative to the layer's peak gain
+        ssm_size   (int):   fixed number of modes per layer instead of max_error
+    Returns:
+        (dict, list): reduced model data and one report entry per layer
+    """
+    out = copy.deepcopy(model_data)
+    layers = out['layers']
+    config = out.get('config', {})
+    conj_sym = config.get('conj_sym', True)
+    n_layers = len(layers) - 4
+
+    reduced = []
+    report = []
+    for i in range(n_layers):
+        dA, dB, C, info = reduce_layer(layers[i + 3]['parameters']['mamba'], conj_sym, max_error, ssm_size)
+        reduced.append((dA, dB, C))
+        report.append(info)
+
+    P = max(dA.shape[0] for dA, _, _ in reduced)
+    for i, (dA, dB, C) in enumerate(reduced):
+        A, B = to_continuous(dA, dB)
+        pad = P - A.shape[0]
+        A = np.concatenate([A, np.full(pad, -1.0)])
+        B = np.vstack([B, np.zeros((pad, B.shape[1]))])
+        C = np.hstack([C, np.zeros((C.shape[0], pad))])
+        mamba = layers[i + 3]['parameters']['mamba']
+        mamba['A_real'] = A.real.tolist()
+        mamba['A_imag'] = A.imag.tolist()
+        mamba['B_real'] = B.real.tolist()
+        mamba['B_imag'] = B.imag.tolist()
+        mamba['C_real'] = C.real.tolist()
+        mamba['C_imag'] = C.imag.tolist()
+        mamba['inv_dt'] = [INV_DT_ONE] * P
+
+    if 'config' in out:
+        out['config']['d_state'] = 2 * P if conj_sym else P
+    return out, report
+
+
+def print_report(report):
+    for i, info in enumerate(report):
+        print(f"layer {i}: {info['original_modes']} -> {info['modes']} modes ({info['states']} real states), "
+              f"error bound {info['bound']:.3e} ({info['bound'] / info['peak_gain']:.2e} of peak gain), "
+              f"measured {info['measured']:.3e}")
+        if info['eigenvector_condition'] > 1e4:
+            print(f"  warning: ill-conditioned modal basis ({info['eigenvector_condition']:.1e}), check the reduced model with accuracy_harness")
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Reduce the S5 state size of model_weights.json by balanced truncation.')
+    parser.add_argument('weights', help='model_weights.json written by model2json.py')
+    parser.add_argument('-o', '--output', default='model_weights_reduced.json')
+    parser.add_argument('--max-error', type=float, default=1e-3, help='error bound per layer, relative to its peak gain')
+    parser.add_argument('--ssm-size', type=int, default=None, help='keep this many modes per layer instead')
+    args = parser.parse_args()
+
+    with open(args.weights) as f:
+        model_data = json.load(f)
+    reduced, report = reduce_model(model_data, args.max_error, args.ssm_size)
+    print_report(report)
+    with open(args.output, 'w') as f:
+        json.dump(reduced, f, indent=1)
@@ -0,0 +1,141 @@
+import ctypes
+import os
+import sys
+import numpy as np
+
+_c_float_p = ctypes.POINTER(ctypes.c_float)
+
+
+def _default_library_path():
+    if sys.platform.startswith("win"):
+        name = "s5engine.dll"
+    elif sys.platform == "darwin":
+        name = "libs5engine.dylib"
+    else:
+        name = "libs5engine.so"
+    return os.environ.get("S5_ENGINE_LIB", os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "plugin", "NeuralAudioPlugin", "capi", name))
+
+
+def _load_library(path):
+    lib = ctypes.CDLL(path)
+    lib.s5_api_version.restype = ctypes.c_int
+    lib.s5_create.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+    lib.s5_create.restype = ctypes.c_void_p
+    lib.s5_create_error.restype = ctypes.c_char_p
+    lib.s5_destroy.argtypes = [ctypes.c_void_p]
+    lib.s5_set_sample_rate.argtypes = [ctypes.c_void_p, ctypes.c_double]
+    lib.s5_conditioning_size.argtypes = [ctypes.c_void_p]
+    lib.s5_conditioning_size.restype = ctypes.c_size_t
+    lib.s5_set_conditioning.argtypes = [ctypes.c_void_p, _c_float_p, ctypes.c_size_t]
+    lib.s5_process.argtypes = [ctypes.c_void_p, _c_float_p, _c_float_p, ctypes.c_size_t]
+    lib.s5_reset.argtypes = [ctypes.c_void_p]
+    lib.s5_process_sweep.argtypes = [ctypes.c_void_p, _c_float_p, ctypes.c_size_t, _c_float_p, ctypes.c_size_t, _c_float_p]
+    lib.s5_state_size.argtypes = [ctypes.c_void_p]
+    lib.s5_state_size.restype = ctypes.c_size_t
+    lib.s5_get_state.argtypes = [ctypes.c_void_p, _c_float_p, ctypes.c_size_t]
+    lib.s5_set_state.argtypes = [ctypes.c_void_p, _c_float_p, ctypes.c_size_t]
+    return lib
+
+
+def _as_float_buffer(x: np.ndarray, name: str):
+    if x.dtype != np.float32 or not x.flags['C_CONTIGUOUS']:
+        raise ValueError(f"{name} must be a C-contiguous float32 array")
+    return x.ctypes.data_as(_c_float_p)
+
+
+class S5Engine:
+    """
+    ctypes binding of the C++ inference engine (plugin/NeuralAudioPlugin/capi).
+    Build the shared library first, see plugin/NeuralAudioPlugin/capi/README.md.
+    One engine processes one mono channel, NumPy buffers are passed without copies.
+    """
+    _EXPECTED_API_VERSION = 2
+
+    def __init__(self, weights, lib_path=None):
+        """
+        Args:
+            weights  (str or bytes): path to model_weights.json, or its contents
+            lib_path (str):          shared library, defaults to $S5_ENGINE_LIB or the capi folder
+        """
+        self._lib = _load_library(lib_path or _default_library_path())
+        if self._lib.s5_api_version() != self._EXPECTED_API_VERSION:
+            raise RuntimeError(f"s5 engine API version {self._lib.s5_api_version()}, expected {self._EXPECTED_API_VERSION}")
+
+        if isinstance(weights, str):
+            with open(weights, "rb") as f:
+                weights = f.read()
+        self._handle = self._lib.s5_create(weights, len(weights))
+        if not self._handle:
+            raise RuntimeError(self._lib.s5_create_error().decode())
+
+    def close(self):
+        if getattr(self, "_handle", None):
+            self._lib.s5_destroy(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def _check(self, status, what):
+        if status != 0:
+            raise RuntimeError(f"{what} failed with status {status}")
+
+    def set_sample_rate(self, sample_rate: float):
+        """Discretize the model for sample_rate, resets the hidden state."""
+        self._check(self._lib.s5_set_sample_rate(self._handle, sample_rate), "s5_set_sample_rate")
+
+    def set_conditioning(self, *c):
+        """Set the conditioning values (drive, tone) in [-1, 1]."""
+        c = np.ascontiguousarray(c, dtype=np.float32)
+        self._check(self._lib.s5_set_conditioning(self._handle, _as_float_buffer(c, "c"), c.size), "s5_set_conditioning")
+
+    def process(self, x: np.ndarray, out: np.ndarray = None):
+        """
+        Args:
+            x   (float32): (L) input samples
+            out (float32): (L) optional output buffer, may be x itself for in-place processing
+        Returns:
+            out (float32): (L)
+        """
+        if out is None:
+            out = np.empty_like(x)
+        if out.shape != x.shape:
+            raise ValueError("out must have the same shape as x")
+        self._check(self._lib.s5_process(self._handle, _as_float_buffer(x, "x"), _as_float_buffer(out, "out"), x.size), "s5_process")
+        return out
+
+    def reset(self):
+        self._lib.s5_reset(self._handle)
+
+    def process_sweep(self, x: np.ndarray, c: np.ndarray) -> np.ndarray:
+        """
+        Render x at several conditioning settings in one pass, each from zero state.
+        The engine's own state and conditioning are left alone.
+        Args:
+            x (float32): (L) input samples
+            c:           (K, c_dim) conditioning values in [-1, 1], e.g. a drive/tone grid
+        Returns:
+            y (float32): (K, L), y[k] rendered at c[k]
+        """
+        c = np.ascontiguousarray(c, dtype=np.float32)
+        if c.ndim != 2 or c.shape[1] != self._lib.s5_conditioning_size(self._handle):
+            raise ValueError("c must have shape (K, c_dim)")
+        out = np.empty((c.shape[0], x.size), dtype=np.float32)
+        self._check(self._lib.s5_process_sweep(self._handle, _as_float_buffer(x, "x"), x.size, _as_float_buffer(c, "c"), c.shape[0],
+                                               _as_float_buffer(out, "out")), "s5_process_sweep")
+        return out
+
+    def get_state(self) -> np.ndarray:
+        state = np.empty(self._lib.s5_state_size(self._handle), dtype=np.float32)
+        self._check(self._lib.s5_get_state(self._handle, _as_float_buffer(state, "state"), state.size), "s5_get_state")
+        return state
+
+    def set_state(self, state: np.ndarray):
+        state = np.ascontiguousarray(state, dtype=np.float32)
+        self._check(self._lib.s5_set_state(self._handle, _as_float_buffer(state, "state"), state.size), "s5_set_state")
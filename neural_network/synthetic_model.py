@@ -0,0 +1,73 @@
+import argparse
+import itertools
+import json
+import os
+import numpy as np
+import torch
+
+from config import ModelParams
+from model.mamba import Mamba
+from model2json import model_2_json
+
+# Sample rate the C++ engine assumes for the exported dt (Model::discretize_bilinear)
+TRAINED_SR = 48000
+
+
+def make_params(d_model, d_state, n_layers, expand_factor, blocks=4, conj_sym=True, bias=False):
+    """
+    ModelParams for one size. d_inner and ssm_size are derived here, the class defaults are computed
+    from the default sizes. blocks is lowered until it divides d_state into HiPPO blocks of even size
+    (conj_sym keeps half of each block).
+    """
+    while blocks > 1 and (d_state % blocks != 0 or (conj_sym and (d_state // blocks) % 2 != 0)):
+        blocks -= 1
+    return ModelParams(d_model=d_model, d_state=d_state, n_layers=n_layers, expand_factor=expand_factor, blocks=blocks, conj_sym=conj_sym, bias=bias,
+                       d_inner=expand_factor * d_model, ssm_size=d_state // 2 if conj_sym else d_state)
+
+
+def max_pole_radius(model_data):
+    """Largest |dA| over all layers at the trained rate, below 1 when the recurrence is stable."""
+    radius = 0.0
+    for layer in model_data['layers']:
+        if layer.get('type') != 'residual':
+            continue
+        mamba = layer['parameters']['mamba']
+        A = np.array(mamba['A_real']) + 1j * np.array(mamba['A_imag'])
+        dt = np.logaddexp(0.0, np.array(mamba['inv_dt']))
+        radius = max(radius, float(np.max(np.abs((1.0 + dt / 2.0 * A) / (1.0 - dt / 2.0 * A)))))
+    return radius
+
+
+def make_synthetic(params, out_path, seed=0):
+    """
+    Untrained model of the given size with the training initialization: A from make_DPLR_HiPPO (negative
+    real parts, so the recurrence is stable at any dt), B, C, D and the projections random. Written as
+    out_path.json by model_2_json. Returns the largest pole radius.
+    """
+    torch.manual_seed(seed)
+    model = Mamba(params)
+    model_2_json(model, out_path)
+    with open(f"{out_path}.json") as f:
+        return max_pole_radius(json.load(f))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Write untrained weight files for a grid of model sizes, to measure their cost in the plugin '
+                                                 '(plugin/NeuralAudioPlugin/tools/cost_table.cpp) before training.')
+    parser.add_argument('--d-model', type=int, nargs='+', default=[8, 16, 32])
+    parser.add_argument('--d-state', type=int, nargs='+', default=[32, 64, 128])
+    parser.add_argument('--n-layers', type=int, nargs='+', default=[1, 2, 4])
+    parser.add_argument('--expand-factor', type=int, nargs='+', default=[2])
+    parser.add_argument('--blocks', type=int, default=ModelParams.blocks, help='HiPPO blocks of A, lowered where they do not divide d_state')
+    parser.add_argument('--no-conj-sym', action='store_true', help='keep the full complex state instead of half of it')
+    parser.add_argument('--bias', action='store_true', help='bias in the Mamba projections')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--out-dir', default='synthetic')
+    args = parser.parse_args()
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    for d_model, d_state, n_layers, expand_factor in itertools.product(args.d_model, args.d_state, args.n_layers, args.expand_factor):
+        params = make_params(d_model, d_state, n_layers, expand_factor, args.blocks, not args.no_conj_sym, args.bias)
+        name = f"d_model_{d_model}_d_state_{d_state}_n_layers_{n_layers}_exp_f_{expand_factor}"
+        radius = make_synthetic(params, os.path.join(args.out_dir, name), args.seed)
+        print(f"{name}.json: {params.blocks} blocks, max |dA| at {TRAINED_SR} Hz {radius:.6f}")
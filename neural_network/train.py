@@ -1,3 +1,4 @@
+import os
 import torch
 from torch.utils.data import DataLoader
 
@@ -5,7 +6,7 @@ from torch.utils.tensorboard import SummaryWriter
 from tqdm import tqdm
 
 from model.mamba import Mamba
-from utils import init_hidden, AudioSegmentDataset, Loss
+from utils import init_hidden, AudioSegmentDataset, ShardDataset, Loss
 from config import HyperParams, ModelParams
 from itertools import cycle
 
@@ -20,8 +21,15 @@ if __name__== "__main__":
     # preprocess.py creates both 48 kHz and 44.1 kHz datasets for testing during evaluation.
     # (We could train on both 48 kHz and 44.1 kHz but the model does not degrade when changing the sampling scale as we learn a continuous-time state-space
     # and discretize it with bilinear transformation.)
-    train_dataloader = DataLoader(AudioSegmentDataset(directory="dataset/train", sr="48000", p_zero=0.05), batch_size=HyperParams.batch_size, shuffle=True)
-    val_dataloader = DataLoader(AudioSegmentDataset(directory="dataset/val", sr="48000", p_zero=0.0), batch_size=HyperParams.batch_size, shuffle=False)
+    # Shards written by the C++ preprocessor (dataset/index.json) are read in place of the pickles of preprocess.py.
+    if os.path.exists("dataset/index.json"):
+        train_dataset = ShardDataset(directory="dataset", split="train", sr="48000", p_zero=0.05)
+        val_dataset = ShardDataset(directory="dataset", split="val", sr="48000", p_zero=0.0)
+    else:
+        train_dataset = AudioSegmentDataset(directory="dataset/train", sr="48000", p_zero=0.05)
+        val_dataset = AudioSegmentDataset(directory="dataset/val", sr="48000", p_zero=0.0)
+    train_dataloader = DataLoader(train_dataset, batch_size=HyperParams.batch_size, shuffle=True)
+    val_dataloader = DataLoader(val_dataset, batch_size=HyperParams.batch_size, shuffle=False)
     model = Mamba(ModelParams).to(device)
     optimizer = torch.optim.AdamW(model.parameters(), lr=HyperParams.lr)
     loss_fn = Loss(HyperParams.alpha)
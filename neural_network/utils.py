@@ -2,11 +2,13 @@ import torch
 from torch.utils.data import Dataset
 import auraloss
 import os
+import json
 import pickle
 from config import ModelParams, HyperParams
 from tqdm import tqdm
 import math
 import random
+import numpy as np
 
 
 def init_hidden(n_layers: int, batch_size: int, hidden_size: int, device: str):
@@ -41,6 +43,67 @@ class AudioSegmentDataset(Dataset):
         }
 
 
+class ShardDataset(Dataset):
+    """
+    Same items as AudioSegmentDataset, read from the shards written by the C++ preprocessor
+    (plugin/NeuralAudioPlugin/tools/dataset_shards.cpp). The shards are memory-mapped when first read
+    in each process (DataLoader workers included), and input, target and c are views of the mapped
+    records: the conditioning is stored once per segment and expanded to (segment_len, c_dim) without copying.
+    """
+    def __init__(self, directory, split, sr, p_zero):
+        with open(os.path.join(directory, "index.json")) as f:
+            index = json.load(f)
+        assert index['version'] == 1, f"unknown shard version {index['version']} in {directory}"
+        self.segment_len = index['segment_len']
+        assert self.segment_len == HyperParams.warm_up + HyperParams.seq_len, f"{directory} has segments of {self.segment_len} samples, run dataset_shards with the HyperParams"
+        self.c_dim = index['c_dim']
+        self.header_bytes = index['header_bytes']
+        self.dtype = np.dtype({'names': ['input', 'target', 'c'],
+                               'formats': [('<f4', self.segment_len), ('<f4', self.segment_len), ('<f4', self.c_dim)],
+                               'offsets': [0, 4 * self.segment_len, 8 * self.segment_len],
+                               'itemsize': index['record_bytes']})
+        shards = [s for s in index['shards'] if s['split'] == split and s['sample_rate'] == int(sr) and s['num_segments'] > 0]
+        self.paths = [os.path.join(directory, s['file']) for s in shards]
+        self.starts = np.cumsum([0] + [s['num_segments'] for s in shards])
+        self.records = None
+        self.p_zero = p_zero
+        print(f"Dataset initialized with {len(self)} segments in {len(self.paths)} shards. Zero-sample probability: {self.p_zero:.2f}")
+
+    def __len__(self):
+        return int(self.starts[-1])
+
+    def _map(self):
+        # copy-on-write: writable for torch.from_numpy, the file is only read
+        self.records = [np.memmap(path, dtype=self.dtype, mode='c', offset=self.header_bytes, shape=(int(self.starts[i + 1] - self.starts[i]),))
+                        for i, path in enumerate(self.paths)]
+
+    def __getstate__(self):
+        # the mappings are not sent to DataLoader workers, each maps the shards itself
+        state = self.__dict__.copy()
+        state['records'] = None
+        return state
+
+    def __getitem__(self, idx):
+        if random.random() < self.p_zero:
+            input_tensor = torch.zeros(self.segment_len, dtype=torch.float32)
+            target_tensor = torch.zeros(self.segment_len, dtype=torch.float32)
+            c_tensor = torch.rand(self.segment_len, self.c_dim, dtype=torch.float32) * 2 - 1
+        else:
+            if self.records is None:
+                self._map()
+            shard = int(np.searchsorted(self.starts, idx, side='right')) - 1
+            first = int(idx - self.starts[shard])
+            record = self.records[shard][first:first + 1] # a slice, so the fields are views of the mapping
+            input_tensor = torch.from_numpy(record['input'][0])
+            target_tensor = torch.from_numpy(record['target'][0])
+            c_tensor = torch.from_numpy(record['c'][0]).expand(self.segment_len, self.c_dim)
+        return {
+            'input': input_tensor,
+            'target': target_tensor,
+            'c': c_tensor,
+        }
+
+
 class Loss:
     def __init__(self, alpha: float):
         self.loss_fn1 = torch.nn.MSELoss()
@@ -108,4 +171,35 @@ def eval(model, loader, m_args: ModelParams, h_args: HyperParams, device):
 
     print(f"ESR value: {loss}")
     print(f"ESR_dB value: {10*math.log10(loss)}")
-    print(f"MR STFT value: {f_loss}")
\ No newline at end of file
+    print(f"MR STFT value: {f_loss}")
+
+
+def eval_engine(engine, loader, h_args: HyperParams, sample_rate):
+    """
+    Same metrics as eval, computed with the C++ inference engine instead of PyTorch.
+    Args:
+        engine      (s5_engine.S5Engine)
+        loader      (DataLoader): AudioSegmentDataset with constant conditioning per segment
+        h_args      (HyperParams)
+        sample_rate (int): sample rate of the dataset
+    """
+    mr_stft = auraloss.freq.MultiResolutionSTFTLoss(fft_sizes = [1024, 512, 256], hop_sizes = [120, 50, 25], win_lengths = [440, 240, 100], mag_distance = "L1")
+    engine.set_sample_rate(sample_rate)
+    targets = []
+    outputs = []
+    for batch in tqdm(loader, desc="Evaluating (C++ engine)"):
+        for x, y, c in zip(batch['input'].numpy(), batch['target'].numpy(), batch['c'].numpy()):
+            engine.reset()
+            engine.set_conditioning(*c[0])
+            out = engine.process(np.ascontiguousarray(x))
+            outputs.append(torch.from_numpy(out[h_args.warm_up:]))
+            targets.append(torch.from_numpy(y[h_args.warm_up:].copy()))
+
+    outputs = torch.stack(outputs, dim=0)
+    targets = torch.stack(targets, dim=0)
+    loss = ESR_loss(outputs.flatten(), targets.flatten()).item()
+    f_loss = mr_stft(outputs.unsqueeze(0), targets.unsqueeze(0)).item()
+
+    print(f"ESR value: {loss}")
+    print(f"ESR_dB value: {10*math.log10(loss)}")
+    print(f"MR STFT value: {f_loss}")
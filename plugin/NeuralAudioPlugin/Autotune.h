@@ -0,0 +1,587 @@
+#pragma once
+
+#include "Engine.h"
+#include "FiLM.h"
+#include "common.h"
+#include "tools/test_signals.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <intrin.h>
+#elif defined(__APPLE__)
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#else
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#endif
+
+// The ModelEngine configurations that can be chosen at load time. They render the same capture;
+// which one is fastest depends on the CPU (tools/microbench.cpp, accuracy_harness for their error).
+enum class EngineVariant
+{
+  Split = 0,   // fp32 weights, S5 state as [real | imaginary] batches, precompiled sizes
+  RuntimeDims, // as Split without the precompiled fast paths
+  Interleaved, // S5 state as (real, imaginary) lane pairs
+  Packed,      // S5 state with real and imaginary halves per batch
+  Fp16,        // all weight matrices as IEEE half precision
+  Bf16,        // all weight matrices as bfloat16
+  Fp16Ssm,     // C and dB as half precision, float projections
+  Bf16Ssm,     // C and dB as bfloat16, float projections
+  Count
+};
+
+// Names as in accuracy_harness and the autotune cache file
+inline const char* variantName(EngineVariant variant) noexcept
+{
+  static const char* const names[] = {"split_complex", "runtime_dims", "interleaved_complex", "packed_complex", "fp16", "bf16", "fp16_ssm", "bf16_ssm"};
+  const int i = static_cast<int>(variant);
+  return i >= 0 && i < static_cast<int>(EngineVariant::Count) ? names[i] : "";
+}
+
+inline bool parseVariant(const std::string& name, EngineVariant& variant) noexcept
+{
+  for (int i = 0; i < static_cast<int>(EngineVariant::Count); ++i)
+  {
+    if (name == variantName(static_cast<EngineVariant>(i)))
+    {
+      variant = static_cast<EngineVariant>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Float ModelEngine in an EngineVariant picked at load time, with the interface of ModelEngine
+template <std::size_t Alignment = xsimd::default_arch::alignment()>
+class TunedEngine
+{
+private:
+  struct Impl
+  {
+    virtual ~Impl() = default;
+    virtual bool initFromJson(const nlohmann::json& model_data) noexcept = 0;
+    virtual float processSample(const float& input, const float* gamma, const float* beta) noexcept = 0;
+    virtual void processBlock(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept = 0;
+    virtual void processBlockLayerMajor(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept = 0;
+    virtual bool hasLayerStages() const noexcept = 0;
+    virtual int activationSize() const noexcept = 0;
+    virtual void projectInput(const float* input, float* activations, int numSamples) noexcept = 0;
+    virtual void processLayers(float* activations, int numSamples, int first, int last, const float* gamma, const float* beta) noexcept = 0;
+    virtual void projectOutput(const float* activations, float* output, int numSamples) noexcept = 0;
+    virtual void discretize_bilinear(const float& sr) noexcept = 0;
+    virtual void reset() noexcept = 0;
+    virtual int stateSize() const noexcept = 0;
+    virtual void getState(float* state) const noexcept = 0;
+    virtual void setState(const float* state) noexcept = 0;
+    virtual const ModelConfig& getConfig() const noexcept = 0;
+    virtual const std::string& getLastError() const noexcept = 0;
+  };
+
+  template <typename Formats, typename Layout>
+  struct ImplT final : Impl
+  {
+    explicit ImplT(const EngineOptions& options)
+    : options(options)
+    {
+    }
+
+    EngineOptions options;
+    ModelEngine<float, Alignment, Formats, Layout> model;
+
+    bool initFromJson(const nlohmann::json& model_data) noexcept override { return model.initFromJson(model_data, options); }
+    float processSample(const float& input, const float* gamma, const float* beta) noexcept override { return model.processSample(input, gamma, beta); }
+    void processBlock(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept override
+    {
+      model.processBlock(input, output, numSamples, gamma, beta);
+    }
+    void processBlockLayerMajor(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept override
+    {
+      model.processBlockLayerMajor(input, output, numSamples, gamma, beta);
+    }
+    bool hasLayerStages() const noexcept override { return model.hasLayerStages(); }
+    int activationSize() const noexcept override { return model.activationSize(); }
+    void projectInput(const float* input, float* activations, int numSamples) noexcept override { model.projectInput(input, activations, numSamples); }
+    void processLayers(float* activations, int numSamples, int first, int last, const float* gamma, const float* beta) noexcept override
+    {
+      model.processLayers(activations, numSamples, first, last, gamma, beta);
+    }
+    void projectOutput(const float* activations, float* output, int numSamples) noexcept override { model.projectOutput(activations, output, numSamples); }
+    void discretize_bilinear(const float& sr) noexcept override { model.discretize_bilinear(sr); }
+    void reset() noexcept override { model.reset(); }
+    int stateSize() const noexcept override { return model.stateSize(); }
+    void getState(float* state) const noexcept override { model.getState(state); }
+    void setState(const float* state) noexcept override { model.setState(state); }
+    const ModelConfig& getConfig() const noexcept override { return model.getConfig(); }
+    const std::string& getLastError() const noexcept override { return model.getLastError(); }
+  };
+
+  std::unique_ptr<Impl> impl;
+  EngineVariant variant = EngineVariant::Split;
+  ModelConfig config;
+
+  // plugin loading
+  std::string lastError;
+
+  static Impl* create(EngineVariant variant) noexcept
+  {
+    using Fp32 = WeightFormats<Fp32Weights>;
+    using Layout = DefaultComplexLayout<float>;
+    switch (variant)
+    {
+    case EngineVariant::Split: return new (std::nothrow) ImplT<Fp32, SplitComplex>(EngineOptions());
+    case EngineVariant::RuntimeDims: return new (std::nothrow) ImplT<Fp32, SplitComplex>(EngineOptions{false});
+    case EngineVariant::Interleaved: return new (std::nothrow) ImplT<Fp32, InterleavedComplex>(EngineOptions());
+    case EngineVariant::Packed: return new (std::nothrow) ImplT<Fp32, PackedComplex>(EngineOptions());
+    case EngineVariant::Fp16: return new (std::nothrow) ImplT<WeightFormats<Fp16Weights>, Layout>(EngineOptions());
+    case EngineVariant::Bf16: return new (std::nothrow) ImplT<WeightFormats<Bf16Weights>, Layout>(EngineOptions());
+    case EngineVariant::Fp16Ssm: return new (std::nothrow) ImplT<WeightFormats<Fp32Weights, Fp16Weights>, Layout>(EngineOptions());
+    case EngineVariant::Bf16Ssm: return new (std::nothrow) ImplT<WeightFormats<Fp32Weights, Bf16Weights>, Layout>(EngineOptions());
+    default: return nullptr;
+    }
+  }
+
+public:
+  TunedEngine() noexcept = default;
+
+  // Load weights from a model_weights.json blob (as exported by model2json.py) into variant
+  bool initFromJson(const char* data, std::size_t size, EngineVariant variant = EngineVariant::Split) noexcept
+  {
+    try
+    {
+      return initFromJson(nlohmann::json::parse(data, data + size), variant);
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+  }
+
+  bool initFromJson(const nlohmann::json& model_data, EngineVariant variant = EngineVariant::Split) noexcept
+  {
+    impl.reset(create(variant));
+    if (!impl)
+    {
+      lastError = "Out of memory";
+      return false;
+    }
+    if (!impl->initFromJson(model_data))
+    {
+      lastError = impl->getLastError();
+      impl.reset();
+      return false;
+    }
+    this->variant = variant;
+    config = impl->getConfig();
+    return true;
+  }
+
+  bool isLoaded() const noexcept { return impl != nullptr; }
+  EngineVariant getVariant() const noexcept { return variant; }
+  const ModelConfig& getConfig() const noexcept { return config; }
+  const std::string& getLastError() const noexcept { return lastError; }
+
+  inline float processSample(const float& input, const float* gamma, const float* beta) noexcept { return impl->processSample(input, gamma, beta); }
+
+  inline void processBlock(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept
+  {
+    impl->processBlock(input, output, numSamples, gamma, beta);
+  }
+
+  // Host buffers of another precision, see ModelEngine
+  template <typename S>
+  inline void processBlock(const S* input, S* output, int numSamples, const float* gamma, const float* beta) noexcept
+  {
+    process_host_block<float>(input, output, numSamples, [&](float* buffer, int n) { impl->processBlock(buffer, buffer, n, gamma, beta); });
+  }
+
+  inline void processBlockLayerMajor(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept
+  {
+    impl->processBlockLayerMajor(input, output, numSamples, gamma, beta);
+  }
+
+  bool hasLayerStages() const noexcept { return impl && impl->hasLayerStages(); }
+  int getNumLayers() const noexcept { return config.num_layers; }
+  int activationSize() const noexcept { return impl ? impl->activationSize() : 0; }
+  inline void projectInput(const float* input, float* activations, int numSamples) noexcept { impl->projectInput(input, activations, numSamples); }
+  inline void processLayers(float* activations, int numSamples, int first, int last, const float* gamma, const float* beta) noexcept
+  {
+    impl->processLayers(activations, numSamples, first, last, gamma, beta);
+  }
+  inline void projectOutput(const float* activations, float* output, int numSamples) noexcept { impl->projectOutput(activations, output, numSamples); }
+
+  void discretize_bilinear(const float& sr) noexcept { impl->discretize_bilinear(sr); }
+  void reset() noexcept { impl->reset(); }
+
+  int stateSize() const noexcept { return impl ? impl->stateSize() : 0; }
+  void getState(float* state) const noexcept { impl->getState(state); }
+  void setState(const float* state) noexcept { impl->setState(state); }
+};
+
+// A tuned configuration: the engine variant and the block length of layer-major rendering
+struct TuneResult
+{
+  EngineVariant variant = EngineVariant::Split;
+  int offlineBlock = 0;     // samples per processBlockLayerMajor call, 0 for the whole host block
+  double nsPerSample = 0.0; // of the variant, per sample
+};
+
+struct TuneCandidate
+{
+  EngineVariant variant;
+  bool loaded = false;
+  double nsPerSample = 0.0;
+  double esr = 0.0; // worst error to signal ratio over the gate material against a double precision render
+  bool passed = false;
+};
+
+struct AutotuneSettings
+{
+  int samples = 16384;        // samples rendered per repeat
+  int repeats = 5;            // the fastest repeat counts
+  double gateSeconds = 0.25;  // length of each accuracy gate signal
+  double maxEsr = 1e-5;       // accuracy gate, kInaudible of accuracy_harness; the eco formats need 5e-2
+  double minGain = 0.03;      // speedup over the default variant to pick another one, against timing noise
+};
+
+// Benchmarks the engine variants on this CPU for a weight file and keeps the fastest one that is
+// within AutotuneSettings::maxEsr of a double precision render (the default variant unless another
+// one is minGain faster), then the fastest layer-major block length of that variant. The accuracy
+// gate takes the worst case over the material of accuracy_harness: the standard test signals at
+// 44.1 and 48 kHz with every knob at -1, 0 and 1. Results are
+// cached in a text file keyed by CPU, build architecture and weight file, one line per key, so
+// later instances find them without benchmarking:
+//
+//   <cpu>|<arch>|<fnv1a of the weights>-<size> <variant> <offline block> <ns per sample>
+class Autotuner
+{
+public:
+  explicit Autotuner(const AutotuneSettings& settings = AutotuneSettings())
+  : settings(settings)
+  {
+  }
+
+  const std::string& getLastError() const noexcept { return lastError; }
+
+  // Every variant of the last tune, in EngineVariant order
+  const std::vector<TuneCandidate>& getCandidates() const noexcept { return candidates; }
+
+  // Benchmark for the weight file. Allocates, renders for about 15 seconds with the default model.
+  bool tune(const char* data, std::size_t size, TuneResult& result)
+  {
+    candidates.clear();
+    try
+    {
+      const nlohmann::json model_data = nlohmann::json::parse(data, data + size);
+      FiLM<float> film;
+      ModelEngine<double> reference;
+      if (!film.initFromJson(model_data) || !reference.initFromJson(model_data))
+      {
+        lastError = film.getLastError().empty() ? reference.getLastError() : film.getLastError();
+        return false;
+      }
+      // conditioning for the reference, padded to whole double batches
+      const int d_model = reference.getConfig().d_model;
+      const int padded = ceil_div(d_model, static_cast<int>(xsimd::simd_type<double>::size)) * static_cast<int>(xsimd::simd_type<double>::size);
+      aligned_vector<double, xsimd::default_arch::alignment()> gamma(padded, 0.0), beta(padded, 0.0);
+
+      // accuracy gate material, rendered through the reference once
+      struct GateCase
+      {
+        double sampleRate;
+        std::vector<float> knobs;
+        const std::vector<float>* input;
+        std::vector<double> target;
+        double energy;
+      };
+      const float knobValues[] = {-1.0f, 0.0f, 1.0f};
+      const int numKnobs = film.getNumInputs();
+      int knobCombinations = 1;
+      for (int k = 0; k < numKnobs; ++k)
+        knobCombinations *= 3;
+      std::vector<std::pair<double, std::vector<float>>> signals;
+      for (double sr : {44100.0, 48000.0})
+        for (auto& signal : test_signals::standardSet(sr, settings.gateSeconds))
+          signals.emplace_back(sr, std::move(signal.samples));
+      std::vector<GateCase> gate;
+      for (const auto& signal : signals)
+      {
+        if (gate.empty() || gate.back().sampleRate != signal.first)
+          reference.discretize_bilinear(signal.first);
+        const std::vector<double> inputDouble(signal.second.begin(), signal.second.end());
+        for (int combination = 0; combination < knobCombinations; ++combination)
+        {
+          GateCase g{signal.first, std::vector<float>(numKnobs), &signal.second, std::vector<double>(inputDouble.size()), 0.0};
+          for (int k = 0, rest = combination; k < numKnobs; ++k, rest /= 3)
+            g.knobs[k] = knobValues[rest % 3];
+          film.processSample(g.knobs.data());
+          std::copy(film.getGamma(), film.getGamma() + d_model, gamma.begin());
+          std::copy(film.getBeta(), film.getBeta() + d_model, beta.begin());
+          reference.reset();
+          reference.processBlock(inputDouble.data(), g.target.data(), static_cast<int>(inputDouble.size()), gamma.data(), beta.data());
+          for (double y : g.target)
+            g.energy += y * y;
+          gate.push_back(std::move(g));
+        }
+      }
+
+      // white noise at a moderate level for the timing, so that no stage runs on denormals or saturates
+      std::vector<float> input(settings.samples), output(settings.samples);
+      std::uint32_t seed = 1;
+      for (int s = 0; s < settings.samples; ++s)
+      {
+        seed = seed * 1664525u + 1013904223u;
+        input[s] = 0.25f * (static_cast<float>(seed >> 8) / 8388608.0f - 1.0f);
+      }
+      const std::vector<float> centred(numKnobs, 0.0f);
+
+      for (int v = 0; v < static_cast<int>(EngineVariant::Count); ++v)
+      {
+        TuneCandidate c{static_cast<EngineVariant>(v)};
+        TunedEngine<> model;
+        c.loaded = model.initFromJson(model_data, c.variant);
+        if (c.loaded)
+        {
+          // worst case of the gate, stops at the first case over the limit
+          double sampleRate = 0.0;
+          std::vector<float> rendered;
+          for (const auto& g : gate)
+          {
+            if (g.sampleRate != sampleRate)
+            {
+              sampleRate = g.sampleRate;
+              model.discretize_bilinear(static_cast<float>(sampleRate));
+            }
+            model.reset();
+            film.processSample(g.knobs.data());
+            rendered.resize(g.input->size());
+            model.processBlock(g.input->data(), rendered.data(), static_cast<int>(rendered.size()), film.getGamma(), film.getBeta());
+            double error = 0.0;
+            for (std::size_t s = 0; s < rendered.size(); ++s)
+              error += (rendered[s] - g.target[s]) * (rendered[s] - g.target[s]);
+            c.esr = std::max(c.esr, g.energy > 0.0 ? error / g.energy : 0.0);
+            if (c.esr > settings.maxEsr)
+              break;
+          }
+          c.passed = c.esr <= settings.maxEsr;
+
+          model.discretize_bilinear(48000.0f);
+          model.reset();
+          film.processSample(centred.data());
+          c.nsPerSample = fastest([&] { model.processBlock(input.data(), output.data(), settings.samples, film.getGamma(), film.getBeta()); });
+        }
+        candidates.push_back(c);
+      }
+      auto score = [&](const TuneCandidate& c) { return c.variant == EngineVariant::Split ? c.nsPerSample * (1.0 - settings.minGain) : c.nsPerSample; };
+      const TuneCandidate* best = nullptr;
+      for (const auto& c : candidates)
+      {
+        if (c.passed && (!best || score(c) < score(*best)))
+          best = &c;
+      }
+      if (!best)
+      {
+        lastError = "no variant passed the accuracy gate";
+        return false;
+      }
+      result.variant = best->variant;
+      result.nsPerSample = best->nsPerSample;
+
+      // layer-major block length, the whole block (0) unless a shorter one is faster
+      TunedEngine<> model;
+      model.initFromJson(model_data, result.variant);
+      model.discretize_bilinear(48000.0f);
+      auto layerMajor = [&](int block) {
+        for (int offset = 0; offset < settings.samples; offset += block)
+          model.processBlockLayerMajor(input.data() + offset, output.data() + offset, std::min(block, settings.samples - offset), film.getGamma(), film.getBeta());
+      };
+      double bestBlock = fastest([&] { layerMajor(settings.samples); });
+      result.offlineBlock = 0;
+      for (int block : {64, 128, 256, 512, 1024, 2048})
+      {
+        const double ns = fastest([&] { layerMajor(block); });
+        if (ns < bestBlock)
+        {
+          bestBlock = ns;
+          result.offlineBlock = block;
+        }
+      }
+      return true;
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+  }
+
+  // Cache key of a weight file on this CPU and build
+  static std::string cacheKey(const char* data, std::size_t size)
+  {
+    char hash[40];
+    std::snprintf(hash, sizeof(hash), "%016llx-%llu", static_cast<unsigned long long>(fnv1a(data, size)), static_cast<unsigned long long>(size));
+    return cpuName() + "|" + xsimd::default_arch::name() + "|" + hash;
+  }
+
+  static bool lookup(const std::string& path, const std::string& key, TuneResult& result)
+  {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+      TuneResult r;
+      if (parseLine(line, key, r))
+      {
+        result = r;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Add or replace the entry of key. The file is rewritten through a temporary file, so a reader
+  // never sees it half written.
+  static bool store(const std::string& path, const std::string& key, const TuneResult& result)
+  {
+    std::vector<std::string> lines;
+    {
+      std::ifstream file(path);
+      std::string line;
+      TuneResult r;
+      while (std::getline(file, line))
+        if (!line.empty() && !parseLine(line, key, r))
+          lines.push_back(line);
+    }
+    char entry[64];
+    std::snprintf(entry, sizeof(entry), " %s %d %.1f", variantName(result.variant), result.offlineBlock, result.nsPerSample);
+    lines.push_back(key + entry);
+
+    makeParentDirectories(path);
+    const std::string temporary = path + ".tmp";
+    {
+      std::ofstream file(temporary, std::ios::trunc);
+      for (const auto& line : lines)
+        file << line << '\n';
+      if (!file)
+        return false;
+    }
+#if defined(_WIN32)
+    std::remove(path.c_str()); // rename does not replace on Windows
+#endif
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+  }
+
+  // Per-user cache location, NeuralAudioPlugin/autotune.txt in the platform's cache folder
+  static std::string defaultCachePath()
+  {
+    return user_path(user_folder::cache, "autotune.txt");
+  }
+
+  // CPU brand string, "unknown" where it cannot be read
+  static std::string cpuName()
+  {
+    std::string name;
+#if defined(_WIN32) && (defined(_M_X64) || defined(_M_IX86))
+    int regs[12];
+    __cpuid(regs, 0x80000000);
+    if (static_cast<unsigned>(regs[0]) >= 0x80000004u)
+    {
+      for (int i = 0; i < 3; ++i)
+        __cpuid(regs + 4 * i, 0x80000002 + i);
+      name.assign(reinterpret_cast<const char*>(regs), sizeof(regs));
+    }
+#elif defined(__APPLE__)
+    char brand[256];
+    std::size_t length = sizeof(brand);
+    if (sysctlbyname("machdep.cpu.brand_string", brand, &length, nullptr, 0) == 0)
+      name.assign(brand, length);
+#elif defined(__x86_64__) || defined(__i386__)
+    unsigned regs[12];
+    if (__get_cpuid_max(0x80000000u, nullptr) >= 0x80000004u)
+    {
+      for (unsigned i = 0; i < 3; ++i)
+        __get_cpuid(0x80000002u + i, regs + 4 * i, regs + 4 * i + 1, regs + 4 * i + 2, regs + 4 * i + 3);
+      name.assign(reinterpret_cast<const char*>(regs), sizeof(regs));
+    }
+#else
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (name.empty() && std::getline(cpuinfo, line))
+    {
+      if (line.compare(0, 10, "model name") == 0 || line.compare(0, 8, "CPU part") == 0)
+        name = line.substr(line.find(':') + 1);
+    }
+#endif
+    // printable, no separators of the cache format
+    std::string clean;
+    for (char ch : name)
+    {
+      if (ch == '\0')
+        break;
+      const bool space = ch == ' ' || ch == '\t' || ch == '|';
+      if (space && (clean.empty() || clean.back() == '_'))
+        continue;
+      clean += space ? '_' : ch;
+    }
+    while (!clean.empty() && clean.back() == '_')
+      clean.pop_back();
+    return clean.empty() ? "unknown" : clean;
+  }
+
+private:
+  template <typename F>
+  double fastest(F&& render) const
+  {
+    render(); // warm up caches and branch predictors
+    double best = 0.0;
+    for (int r = 0; r < settings.repeats; ++r)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      render();
+      const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / settings.samples;
+      best = r == 0 ? ns : std::min(best, ns);
+    }
+    return best;
+  }
+
+  static bool parseLine(const std::string& line, const std::string& key, TuneResult& result)
+  {
+    std::istringstream ss(line);
+    std::string k, name;
+    TuneResult r;
+    if (!(ss >> k >> name >> r.offlineBlock >> r.nsPerSample) || k != key || !parseVariant(name, r.variant))
+      return false;
+    result = r;
+    return true;
+  }
+
+  static void makeParentDirectories(const std::string& path)
+  {
+    for (std::size_t pos = path.find_first_of("/\\", 1); pos != std::string::npos; pos = path.find_first_of("/\\", pos + 1))
+    {
+      const std::string dir = path.substr(0, pos);
+#if defined(_WIN32)
+      _mkdir(dir.c_str());
+#else
+      mkdir(dir.c_str(), 0755);
+#endif
+    }
+  }
+
+  AutotuneSettings settings;
+  std::vector<TuneCandidate> candidates;
+  std::string lastError;
+};
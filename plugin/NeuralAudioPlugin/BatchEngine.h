@@ -0,0 +1,538 @@
+#pragma once
+
+#include "BatchedModel.h"
+#include "common.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+template <typename M>
+class BatchClient;
+
+// The plugin instances of one process that loaded the same weights at the same sample rate. Every
+// member gets one lane of a BatchedModel bank per channel. A member's block is submitted to its
+// lanes, and all pending lanes run together when a member that already has a block pending calls
+// again, i.e. once per host cycle when the host calls the instances in lockstep. Each member then
+// collects its slice, one call later, so members always report one block of latency.
+//
+// Lockstep detection: a cycle ends when a member calls for the second time. A cycle is good when
+// all of its calls came from one thread, at least half of the members called (some may be idle,
+// e.g. bypassed) and they brought at least minStreams channels, enough to fill half a bank.
+// Batching turns on when the smoothed share of good cycles rises above enterScore and off below
+// leaveScore; while it is off every member renders its own models, with the same latency. A member
+// that finds the lock taken calls concurrently with another one, so such a cycle turns batching
+// off at once and restarts the score.
+//
+// Batched, a channel costs about half as much as on its own models with AVX2 and the default
+// model; the results match them up to float rounding.
+class BatchGroup
+{
+public:
+  using Batched = BatchedModel<float>;
+  static constexpr int lanes = Batched::lanes;
+  static constexpr int maxChannels = 2;
+  static constexpr int minStreams = lanes / 2 > 2 ? lanes / 2 : 2;
+  static constexpr float scoreWeight = 0.1f;
+  static constexpr float enterScore = 0.9f;
+  static constexpr float leaveScore = 0.5f;
+
+  BatchGroup(const BatchGroup&) = delete;
+  BatchGroup& operator=(const BatchGroup&) = delete;
+
+  // Parse the weights and discretize them for sampleRate. Not real-time safe.
+  bool init(const char* data, std::size_t size, double sampleRate)
+  {
+    if (!model.initFromJson(data, size))
+      return false;
+    model.discretize_bilinear(static_cast<float>(sampleRate));
+    return true;
+  }
+
+  const std::string& getLastError() const noexcept { return model.getLastError(); }
+
+private:
+  template <typename M>
+  friend class BatchClient;
+  friend class BatchEngine;
+
+  BatchGroup() = default;
+
+  struct Bank
+  {
+    std::vector<float> input;  // [maxFrames][lanes]
+    std::vector<float> output; // [maxFrames][lanes]
+    std::vector<float> gamma;  // [d_model][lanes]
+    std::vector<float> beta;   // [d_model][lanes]
+    std::array<int, lanes> counts = {}; // samples pending per lane
+    bool pending = false;
+  };
+
+  struct Member
+  {
+    std::array<int, maxChannels> bank = {};
+    std::array<int, maxChannels> lane = {};
+    int maxFrames = 0;     // the member's latency
+    int pending = 0;       // samples submitted and not yet rendered
+    int numChannels = 0;   // channels of the pending block
+    int ready = 0;         // samples rendered and not yet collected
+    bool batched = false;  // the member's state lives in its lanes, touched by its client only
+    bool called = false;   // in the current cycle
+
+    // The rendered pending block, until the member collects it with the lock held
+    std::array<std::vector<float>, maxChannels> rendered; // [maxFrames]
+  };
+
+  // Allocate a member with zero state. Not real-time safe.
+  Member* join(int maxFrames)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Member> member(new Member());
+    for (int c = 0; c < maxChannels; ++c)
+    {
+      if (freeLanes.empty())
+      {
+        const int bank = model.addBank();
+        for (int l = lanes - 1; l >= 0; --l)
+          freeLanes.push_back({bank, l});
+      }
+      std::tie(member->bank[c], member->lane[c]) = freeLanes.back();
+      freeLanes.pop_back();
+      model.resetLane(member->bank[c], member->lane[c]);
+    }
+
+    member->maxFrames = std::max(1, maxFrames);
+    for (auto& rendered : member->rendered)
+      rendered.assign(member->maxFrames, 0.0f);
+    framesCapacity = std::max(framesCapacity, member->maxFrames);
+
+    const int d_model = model.getConfig().d_model;
+    banks.resize(model.getNumBanks());
+    for (Bank& bank : banks)
+    {
+      bank.input.resize(static_cast<std::size_t>(framesCapacity) * lanes, 0.0f);
+      bank.output.resize(static_cast<std::size_t>(framesCapacity) * lanes, 0.0f);
+      bank.gamma.resize(static_cast<std::size_t>(d_model) * lanes, 0.0f);
+      bank.beta.resize(static_cast<std::size_t>(d_model) * lanes, 0.0f);
+    }
+
+    members.push_back(std::move(member));
+    return members.back().get();
+  }
+
+  // Release the member's lanes. Its pending block is dropped. Not real-time safe.
+  void leave(Member* member)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int c = 0; c < maxChannels; ++c)
+    {
+      banks[member->bank[c]].counts[member->lane[c]] = 0;
+      freeLanes.push_back({member->bank[c], member->lane[c]});
+    }
+    if (member->called)
+      --cycleCalls;
+    members.erase(std::find_if(members.begin(), members.end(), [member](const std::unique_ptr<Member>& m) { return m.get() == member; }));
+  }
+
+  // Lockstep bookkeeping of a call, with the lock held
+  void noteCall(Member& member, int numChannels) noexcept
+  {
+    if (member.called)
+      endCycle();
+    member.called = true;
+
+    const std::thread::id thread = std::this_thread::get_id();
+    if (cycleCalls == 0)
+      cycleThread = thread;
+    else if (thread != cycleThread)
+      cycleSingleThread = false;
+    ++cycleCalls;
+    cycleStreams += numChannels;
+  }
+
+  void endCycle() noexcept
+  {
+    const bool contention = contended.exchange(false, std::memory_order_relaxed);
+    const bool good = !contention && cycleSingleThread && 2 * cycleCalls >= static_cast<int>(members.size()) && cycleStreams >= minStreams;
+    score = contention ? 0.0f : score + scoreWeight * ((good ? 1.0f : 0.0f) - score);
+    if (contention)
+      batching = false;
+    else if (!batching && score > enterScore)
+      batching = true;
+    else if (batching && score < leaveScore)
+      batching = false;
+
+    for (auto& member : members)
+      member->called = false;
+    cycleCalls = 0;
+    cycleStreams = 0;
+    cycleSingleThread = true;
+  }
+
+  // Queue a block of a member on its lanes, with the lock held. input holds numChannels channels of
+  // n <= maxFrames samples.
+  template <typename S>
+  void submit(Member& member, const S* const* input, int numChannels, int n, const float* gamma, const float* beta) noexcept
+  {
+    const int d_model = model.getConfig().d_model;
+    for (int c = 0; c < numChannels; ++c)
+    {
+      Bank& bank = banks[member.bank[c]];
+      const int lane = member.lane[c];
+      for (int s = 0; s < n; ++s)
+        bank.input[s * lanes + lane] = static_cast<float>(input[c][s]);
+      for (int j = 0; j < d_model; ++j)
+      {
+        bank.gamma[j * lanes + lane] = gamma[j];
+        bank.beta[j * lanes + lane] = beta[j];
+      }
+      bank.counts[lane] = n;
+      bank.pending = true;
+    }
+    member.pending = n;
+    member.numChannels = numChannels;
+  }
+
+  // Forget the block a member left in its lanes, rendered or not, with the lock held
+  void drop(Member& member) noexcept
+  {
+    for (int c = 0; c < maxChannels; ++c)
+      banks[member.bank[c]].counts[member.lane[c]] = 0;
+    member.pending = 0;
+    member.ready = 0;
+  }
+
+  // Run every bank with pending lanes and hand the results to their members, with the lock held
+  void flush() noexcept
+  {
+    for (int b = 0; b < static_cast<int>(banks.size()); ++b)
+    {
+      Bank& bank = banks[b];
+      if (!bank.pending)
+        continue;
+      const int n = *std::max_element(bank.counts.begin(), bank.counts.end());
+      model.processBlock(b, bank.input.data(), bank.output.data(), n, bank.counts.data(), bank.gamma.data(), bank.beta.data());
+    }
+
+    for (auto& m : members)
+    {
+      Member& member = *m;
+      if (member.pending == 0)
+        continue;
+      // channels the block does not have repeat the first one
+      for (int c = 0; c < maxChannels; ++c)
+      {
+        const int from = c < member.numChannels ? c : 0;
+        const Bank& bank = banks[member.bank[from]];
+        const int lane = member.lane[from];
+        for (int s = 0; s < member.pending; ++s)
+          member.rendered[c][s] = bank.output[s * lanes + lane];
+      }
+      member.ready = member.pending;
+      member.pending = 0;
+    }
+
+    for (Bank& bank : banks)
+    {
+      bank.counts.fill(0);
+      bank.pending = false;
+    }
+  }
+
+  std::mutex mutex;
+  Batched model;
+  std::vector<Bank> banks;
+  std::vector<std::pair<int, int>> freeLanes; // (bank, lane)
+  std::vector<std::unique_ptr<Member>> members;
+  int framesCapacity = 0;
+
+  bool batching = false;
+  float score = 0.0f;
+  int cycleCalls = 0;
+  int cycleStreams = 0;
+  bool cycleSingleThread = true;
+  std::thread::id cycleThread;
+  std::atomic<bool> contended{false}; // a member found the lock taken, set without the lock
+};
+
+// Process-wide registry of the batch groups, one per weight file and sample rate. Opt-in: only
+// instances built with NEURAL_AUDIO_BATCHED (config.h) register.
+class BatchEngine
+{
+public:
+  static BatchEngine& instance()
+  {
+    static BatchEngine engine;
+    return engine;
+  }
+
+  // The group running these weights at sampleRate, created on first use. Returns null if the
+  // weights do not load, with the reason in error. Not real-time safe.
+  std::shared_ptr<BatchGroup> getGroup(const char* data, std::size_t size, double sampleRate, std::string& error)
+  {
+    const Key key{fnv1a(data, size), size, sampleRate};
+    std::lock_guard<std::mutex> lock(mutex);
+    if (std::shared_ptr<BatchGroup> group = groups[key].lock())
+      return group;
+
+    std::shared_ptr<BatchGroup> group(new BatchGroup());
+    if (!group->init(data, size, sampleRate))
+    {
+      error = group->getLastError();
+      return nullptr;
+    }
+    groups[key] = group;
+
+    // forget the groups nobody uses anymore
+    for (auto it = groups.begin(); it != groups.end();)
+      it = it->second.expired() ? groups.erase(it) : std::next(it);
+    return group;
+  }
+
+private:
+  using Key = std::tuple<std::uint64_t, std::size_t, double>;
+
+  BatchEngine() = default;
+
+  std::mutex mutex;
+  std::map<Key, std::weak_ptr<BatchGroup>> groups;
+};
+
+// A plugin instance's membership in its BatchGroup. process renders through the group's lanes
+// while the group is batching and through the instance's own models (one per channel) otherwise,
+// moving the hidden state over when the mode changes. The output is delayed by getLatency() =
+// maxFrames samples in both modes. Results match the instance's models up to float rounding.
+//
+// The group's lock is taken on the audio thread for the bookkeeping, and held while a flush runs
+// the banks of every member. It is only tried, never waited for: on contention a member renders
+// its own models and its call misses the bookkeeping. A member whose state is in the lanes leaves
+// them first. It keeps a copy of its lanes' state from before its pending block, and of the block,
+// and renders that block again on its own models; the next call that gets the lock drops the
+// block from the lanes. The contention also ends batching.
+//
+// M is ModelEngine or CompiledModel (processBlock, activationSize, stateSize, getState, setState).
+template <typename M>
+class BatchClient
+{
+public:
+  static constexpr int maxChannels = BatchGroup::maxChannels;
+
+  BatchClient() = default;
+  BatchClient(const BatchClient&) = delete;
+  BatchClient& operator=(const BatchClient&) = delete;
+
+  ~BatchClient()
+  {
+    leave();
+  }
+
+  // Join the group of these weights and sampleRate with blocks of up to maxFrames samples (the
+  // latency), starting from zero state. models holds one model per channel, discretized for
+  // sampleRate. Returns false if the weights do not load. Not real-time safe.
+  bool join(const char* data, std::size_t size, double sampleRate, int maxFrames, M* models)
+  {
+    // a group we already belong to stays alive across the rejoin
+    const std::shared_ptr<BatchGroup> previous = group;
+    leave();
+    group = BatchEngine::instance().getGroup(data, size, sampleRate, lastError);
+    if (!group)
+      return false;
+    member = group->join(maxFrames);
+    this->models = models;
+    for (auto& buffer : buffers)
+      buffer.assign(member->maxFrames, 0.0f);
+    for (auto& channel : fifo)
+      channel.assign(member->maxFrames, 0.0f);
+    readPos = 0;
+    writePos = 0;
+    render.assign(member->maxFrames, 0.0f);
+    state.assign(std::max(models[0].stateSize(), group->model.stateSize()), 0.0f);
+    for (int c = 0; c < maxChannels; ++c)
+    {
+      laneState[c].assign(state.size(), 0.0f);
+      pendingInput[c].assign(member->maxFrames, 0.0f);
+    }
+    pendingGamma.assign(models[0].activationSize(), 0.0f);
+    pendingBeta.assign(models[0].activationSize(), 0.0f);
+    detached = false;
+    return true;
+  }
+
+  void leave()
+  {
+    if (group)
+      group->leave(member);
+    group.reset();
+    member = nullptr;
+  }
+
+  bool isJoined() const noexcept { return group != nullptr; }
+  int getLatency() const noexcept { return member ? member->maxFrames : 0; }
+  const std::string& getLastError() const noexcept { return lastError; }
+
+  // Render nFrames samples of nChans channels (1 or 2), gamma and beta being the conditioning of
+  // this block (d_model values each). Only after a successful join.
+  template <typename S>
+  void process(const S* const* inputs, S** outputs, int nChans, int nFrames, const float* gamma, const float* beta) noexcept
+  {
+    if (nChans <= 0)
+      return;
+    nChans = std::min(nChans, maxChannels);
+    for (int offset = 0; offset < nFrames; offset += member->maxFrames)
+      step(inputs, outputs, nChans, offset, std::min(member->maxFrames, nFrames - offset), gamma, beta);
+  }
+
+private:
+  template <typename S>
+  void step(const S* const* inputs, S** outputs, int nChans, int offset, int n, const float* gamma, const float* beta) noexcept
+  {
+    BatchGroup& g = *group;
+    BatchGroup::Member& m = *member;
+    const S* input[maxChannels] = {};
+    for (int c = 0; c < nChans; ++c)
+      input[c] = inputs[c] + offset;
+
+    std::unique_lock<std::mutex> lock(g.mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+      g.contended.store(true, std::memory_order_relaxed);
+      if (m.batched)
+        detach();
+    }
+    else
+    {
+      g.noteCall(m, nChans);
+      if (detached)
+      {
+        g.drop(m);
+        detached = false;
+      }
+      if (m.pending > 0)
+        g.flush();
+      if (m.ready > 0)
+      {
+        for (int c = 0; c < maxChannels; ++c)
+          store(c, m.rendered[c].data(), m.ready);
+        writePos = (writePos + m.ready) % m.maxFrames;
+        m.ready = 0;
+      }
+
+      // the state moves to the side the group runs on
+      if (m.batched != g.batching)
+      {
+        for (int c = 0; c < maxChannels; ++c)
+        {
+          if (g.batching)
+          {
+            models[c].getState(state.data());
+            g.model.setLaneState(m.bank[c], m.lane[c], state.data());
+          }
+          else
+          {
+            g.model.getLaneState(m.bank[c], m.lane[c], state.data());
+            models[c].setState(state.data());
+          }
+        }
+        m.batched = g.batching;
+      }
+    }
+
+    // the FIFO holds maxFrames samples less the pending block, enough for this one
+    for (int c = 0; c < nChans; ++c)
+    {
+      for (int s = 0, pos = readPos; s < n; ++s, pos = pos + 1 < m.maxFrames ? pos + 1 : 0)
+        buffers[c][s] = fifo[c][pos];
+    }
+    readPos = (readPos + n) % m.maxFrames;
+
+    if (m.batched)
+    {
+      // the copies a call without the lock renders from
+      for (int c = 0; c < maxChannels; ++c)
+        g.model.getLaneState(m.bank[c], m.lane[c], laneState[c].data());
+      for (int c = 0; c < nChans; ++c)
+        convert_block(input[c], pendingInput[c].data(), n);
+      std::copy(gamma, gamma + pendingGamma.size(), pendingGamma.begin());
+      std::copy(beta, beta + pendingBeta.size(), pendingBeta.begin());
+      pendingCount = n;
+      pendingChannels = nChans;
+      g.submit(m, input, nChans, n, gamma, beta);
+      lock.unlock();
+    }
+    else
+    {
+      if (lock.owns_lock())
+        lock.unlock();
+      renderOwn(input, nChans, n, gamma, beta);
+    }
+
+    for (int c = 0; c < nChans; ++c)
+      convert_block(buffers[c].data(), outputs[c] + offset, n);
+  }
+
+  // Move the state from the lanes to the models without the lock: restore the lanes' state from
+  // before the pending block and render the block again. A flush may render it in the lanes at the
+  // same time; the copy stays in the member until the next call with the lock drops it.
+  void detach() noexcept
+  {
+    for (int c = 0; c < maxChannels; ++c)
+      models[c].setState(laneState[c].data());
+    const float* input[maxChannels] = {};
+    for (int c = 0; c < pendingChannels; ++c)
+      input[c] = pendingInput[c].data();
+    renderOwn(input, pendingChannels, pendingCount, pendingGamma.data(), pendingBeta.data());
+    member->batched = false;
+    detached = true;
+  }
+
+  // Render a block on the models and queue it. Channels the block does not have repeat the first one.
+  template <typename S>
+  void renderOwn(const S* const* input, int nChans, int n, const float* gamma, const float* beta) noexcept
+  {
+    for (int c = 0; c < maxChannels; ++c)
+    {
+      if (c < nChans)
+      {
+        convert_block(input[c], render.data(), n);
+        models[c].processBlock(render.data(), render.data(), n, gamma, beta);
+      }
+      store(c, render.data(), n);
+    }
+    writePos = (writePos + n) % member->maxFrames;
+  }
+
+  // Write n samples of channel c at the FIFO's write position, which the caller then advances
+  void store(int c, const float* x, int n) noexcept
+  {
+    for (int s = 0, pos = writePos; s < n; ++s, pos = pos + 1 < member->maxFrames ? pos + 1 : 0)
+      fifo[c][pos] = x[s];
+  }
+
+  std::shared_ptr<BatchGroup> group;
+  BatchGroup::Member* member = nullptr;
+  M* models = nullptr;
+  std::array<std::vector<float>, maxChannels> buffers; // this block's output, [maxFrames]
+  std::vector<float> render; // one channel rendered by its model, [maxFrames]
+  std::vector<float> state;  // hidden state snapshot
+  std::string lastError;
+
+  // Rendered output waiting for the host, maxFrames samples minus the pending block
+  std::array<std::vector<float>, maxChannels> fifo; // [maxFrames]
+  int readPos = 0;
+  int writePos = 0;
+
+  // The lanes' state from before the pending block, and the block, while batched
+  std::array<std::vector<float>, maxChannels> laneState;
+  std::array<std::vector<float>, maxChannels> pendingInput; // [maxFrames]
+  aligned_vector<float, 64> pendingGamma; // [activationSize]
+  aligned_vector<float, 64> pendingBeta;
+  int pendingCount = 0;
+  int pendingChannels = 0;
+  bool detached = false; // the lanes still hold a pending block the models rendered
+};
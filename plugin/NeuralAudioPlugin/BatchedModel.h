@@ -0,0 +1,323 @@
+#pragma once
+
+#include "ScalarWeights.h"
+#include "common.h"
+#include "json.hpp"
+#include "xsimd/xsimd.hpp"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Runs many independent streams of one model at once, one SIMD lane per stream, e.g. the channels
+// of every plugin instance that loaded the same weight file (BatchEngine.h). Streams are grouped in
+// banks of `lanes` streams; each lane has its own hidden state and FiLM conditioning, the weights
+// are shared and broadcast, so every weight is one FMA for a whole bank and nothing is reduced
+// across lanes. Results match Model up to float rounding (the sums run in a different order).
+template <typename T>
+class BatchedModel
+{
+public:
+  using v_type = xsimd::simd_type<T>;
+  static constexpr int lanes = static_cast<int>(v_type::size);
+
+private:
+  using v_vector = aligned_vector<v_type, alignof(v_type)>;
+
+  // Model parameters
+  ModelConfig config;
+  int d_model = 0;
+  int d_inner = 0;
+  int ssm_size = 0;
+  int num_layers = 0;
+
+  ScalarWeights<T> weights;
+
+  // Hidden state of each bank, [layer][2 * ssm_size] lanes, real parts then imag parts
+  std::vector<v_vector> banks;
+
+  // buffers for intermediate results
+  v_vector x;      // [d_model]
+  v_vector res1;   // [d_model]
+  v_vector proj;   // [2 * d_inner], u then res
+  v_vector Bu;     // [2 * ssm_size], real then imag
+  v_vector y;      // [d_inner]
+  v_vector film;   // [2 * d_model], gamma then beta of the bank
+
+  // Plugin loading
+  std::string lastError;
+
+public:
+  BatchedModel() noexcept = default;
+
+  // Load weights from a model_weights.json blob (as exported by model2json.py)
+  bool initFromJson(const char* data, std::size_t size) noexcept
+  {
+    try
+    {
+      return initFromJson(nlohmann::json::parse(data, data + size));
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+    catch (...)
+    {
+      lastError = "Unknown error loading weights";
+      return false;
+    }
+  }
+
+  // Load weights from an already parsed model_weights.json
+  bool initFromJson(const nlohmann::json& model_data) noexcept
+  {
+    try
+    {
+      loadWeightsFromJson(model_data);
+      return true;
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+    catch (...)
+    {
+      lastError = "Unknown error loading weights";
+      return false;
+    }
+  }
+
+  const ModelConfig& getConfig() const noexcept { return config; }
+  const std::string& getLastError() const noexcept { return lastError; }
+
+  // Add a bank of `lanes` streams with zero state, returns its index. Allocates.
+  int addBank()
+  {
+    banks.emplace_back(2 * num_layers * ssm_size, v_type(T(0)));
+    return static_cast<int>(banks.size()) - 1;
+  }
+
+  int getNumBanks() const noexcept { return static_cast<int>(banks.size()); }
+
+  // Number of scalars in a hidden state snapshot of one lane, same layout as Model::getState
+  int stateSize() const noexcept { return 2 * num_layers * ssm_size; }
+
+  void resetLane(int bank, int lane) noexcept
+  {
+    for (v_type& h : banks[bank])
+    {
+      h = setLane(h, lane, T(0));
+    }
+  }
+
+  void getLaneState(int bank, int lane, T* state) const noexcept
+  {
+    alignas(alignof(v_type)) T buf[lanes];
+    for (std::size_t p = 0; p < banks[bank].size(); ++p)
+    {
+      banks[bank][p].store_aligned(buf);
+      state[p] = buf[lane];
+    }
+  }
+
+  void setLaneState(int bank, int lane, const T* state) noexcept
+  {
+    for (std::size_t p = 0; p < banks[bank].size(); ++p)
+    {
+      banks[bank][p] = setLane(banks[bank][p], lane, state[p]);
+    }
+  }
+
+  // Process the lanes of a bank. input and output are lane-interleaved ([numSamples][lanes]),
+  // gamma and beta the FiLM conditioning of each lane ([d_model][lanes]). Lane l runs, and advances
+  // its state, for its first counts[l] samples only; its output past that is unspecified.
+  // numSamples is the largest count.
+  void processBlock(int bank, const T* input, T* output, int numSamples, const int* counts, const T* gamma, const T* beta) noexcept
+  {
+    alignas(alignof(v_type)) T count_buf[lanes];
+    int min_count = numSamples;
+    for (int l = 0; l < lanes; ++l)
+    {
+      count_buf[l] = static_cast<T>(counts[l]);
+      min_count = std::min(min_count, counts[l]);
+    }
+    const v_type v_counts = xsimd::load_aligned(count_buf);
+    loadFilm(gamma, beta);
+
+    v_vector& b = banks[bank];
+    for (int s = 0; s < numSamples; ++s)
+    {
+      const v_type in = xsimd::load_unaligned(input + s * lanes);
+      v_type out;
+      if (s < min_count)
+        out = processSample<false>(b, in, v_counts, s);
+      else
+        out = processSample<true>(b, in, v_counts, s);
+      out.store_unaligned(output + s * lanes);
+    }
+  }
+
+  // Process the same input on every lane of a bank, e.g. one signal at several conditioning
+  // settings. output is lane-interleaved ([numSamples][lanes]), gamma and beta as in processBlock.
+  void processBlockBroadcast(int bank, const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept
+  {
+    loadFilm(gamma, beta);
+    v_vector& b = banks[bank];
+    const v_type counts(T(0));
+    for (int s = 0; s < numSamples; ++s)
+    {
+      processSample<false>(b, v_type(input[s]), counts, s).store_unaligned(output + s * lanes);
+    }
+  }
+
+  // Discretize A and B for the host sample rate, as Model::discretize_bilinear
+  void discretize_bilinear(const T& sr) noexcept { weights.discretize_bilinear(sr); }
+
+  const ScalarWeights<T>& getWeights() const noexcept { return weights; }
+
+private:
+  static v_type setLane(const v_type& v, int lane, T value) noexcept
+  {
+    alignas(alignof(v_type)) T buf[lanes];
+    v.store_aligned(buf);
+    buf[lane] = value;
+    return xsimd::load_aligned(buf);
+  }
+
+  void loadFilm(const T* gamma, const T* beta) noexcept
+  {
+    for (int j = 0; j < d_model; ++j)
+    {
+      film[j] = xsimd::load_unaligned(gamma + j * lanes);
+      film[d_model + j] = xsimd::load_unaligned(beta + j * lanes);
+    }
+  }
+
+  // out[r] = bias[r] + sum_c w[r][c] in[c] for r < n_rows (no bias when null), four rows at a time
+  // for independent FMA chains
+  static inline void rows(const T* w, const T* bias, const v_type* in, v_type* out, int n_rows, int n_cols) noexcept
+  {
+    int r = 0;
+    for (; r + 4 <= n_rows; r += 4)
+    {
+      const T* w0 = w + r * n_cols;
+      v_type a0(bias ? bias[r] : T(0)), a1(bias ? bias[r + 1] : T(0)), a2(bias ? bias[r + 2] : T(0)), a3(bias ? bias[r + 3] : T(0));
+      for (int c = 0; c < n_cols; ++c)
+      {
+        a0 += w0[c] * in[c];
+        a1 += w0[n_cols + c] * in[c];
+        a2 += w0[2 * n_cols + c] * in[c];
+        a3 += w0[3 * n_cols + c] * in[c];
+      }
+      out[r] = a0;
+      out[r + 1] = a1;
+      out[r + 2] = a2;
+      out[r + 3] = a3;
+    }
+    for (; r < n_rows; ++r)
+    {
+      v_type acc(bias ? bias[r] : T(0));
+      for (int c = 0; c < n_cols; ++c)
+      {
+        acc += w[r * n_cols + c] * in[c];
+      }
+      out[r] = acc;
+    }
+  }
+
+  // One sample of every lane. Masked: some lanes are past their count and keep their state.
+  template <bool Masked>
+  inline v_type processSample(v_vector& bank, const v_type& input, const v_type& counts, int s) noexcept
+  {
+    const auto active = counts > v_type(static_cast<T>(s));
+
+    for (int j = 0; j < d_model; ++j)
+    {
+      x[j] = weights.in_proj[j] * input + weights.in_bias[j];
+    }
+
+    for (int i = 0; i < num_layers; ++i)
+    {
+      const typename ScalarWeights<T>::Layer& layer = weights.layers[i];
+      v_type* h = bank.data() + 2 * i * ssm_size;
+
+      // Residual connection, FiLM conditioning and RMS norm
+      v_type sum(T(0));
+      for (int j = 0; j < d_model; ++j)
+      {
+        res1[j] = x[j];
+        x[j] = film[j] * x[j] + film[d_model + j];
+        sum += x[j] * x[j];
+      }
+      const v_type scale = v_type(T(1)) / xsimd::sqrt(layer.eps + sum / static_cast<T>(d_model));
+      for (int j = 0; j < d_model; ++j)
+      {
+        x[j] = layer.norm[j] * x[j] * scale;
+      }
+
+      // Mamba in proj and silu, [u | res]
+      rows(layer.in_proj.data(), layer.in_bias.data(), x.data(), proj.data(), 2 * d_inner, d_model);
+      for (int k = 0; k < 2 * d_inner; ++k)
+      {
+        proj[k] = proj[k] / (v_type(T(1)) + xsimd::exp(-proj[k]));
+      }
+      const v_type* u = proj.data();
+      const v_type* res2 = proj.data() + d_inner;
+
+      /* ================ S5 ================ */
+      // h[n] = Ah[n - 1] + Bu[n]
+      rows(layer.dB.data(), nullptr, u, Bu.data(), 2 * ssm_size, d_inner);
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        const v_type h_re = h[p];
+        const v_type h_im = h[ssm_size + p];
+        const v_type re = h_re * layer.dA_real[p] - h_im * layer.dA_imag[p] + Bu[p];
+        const v_type im = h_re * layer.dA_imag[p] + h_im * layer.dA_real[p] + Bu[ssm_size + p];
+        h[p] = Masked ? xsimd::select(active, re, h_re) : re;
+        h[ssm_size + p] = Masked ? xsimd::select(active, im, h_im) : im;
+      }
+
+      // y[n] = real(Ch[n]) + Du[n], times the res branch
+      rows(layer.C.data(), nullptr, h, y.data(), d_inner, 2 * ssm_size);
+      for (int k = 0; k < d_inner; ++k)
+      {
+        y[k] = (y[k] + layer.D[k] * u[k]) * res2[k];
+      }
+      /* ==================================== */
+
+      // Mamba out proj and residual connection
+      rows(layer.out_proj.data(), layer.out_bias.data(), y.data(), x.data(), d_model, d_inner);
+      for (int j = 0; j < d_model; ++j)
+      {
+        x[j] += res1[j];
+      }
+    }
+
+    v_type output(weights.out_bias);
+    for (int j = 0; j < d_model; ++j)
+    {
+      output += weights.out_proj[j] * x[j];
+    }
+    return output;
+  }
+
+  // Load weights from the parsed model_weights.json
+  void loadWeightsFromJson(const nlohmann::json& model_data)
+  {
+    weights.loadFromJson(model_data);
+    config = weights.config;
+    d_model = weights.d_model;
+    d_inner = weights.d_inner;
+    ssm_size = weights.ssm_size;
+    num_layers = weights.num_layers;
+
+    x.assign(d_model, v_type(T(0)));
+    res1.assign(d_model, v_type(T(0)));
+    proj.assign(2 * d_inner, v_type(T(0)));
+    Bu.assign(2 * ssm_size, v_type(T(0)));
+    y.assign(d_inner, v_type(T(0)));
+    film.assign(2 * d_model, v_type(T(0)));
+    banks.clear();
+  }
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "common.h"
+#include "xsimd/xsimd.hpp"
+#include <complex>
+
+constexpr int floor_log2(int n) noexcept { return n > 1 ? 1 + floor_log2(n / 2) : 0; }
+
+// Time-major scan of one S5 mode: the diagonal recurrence h[t] = a h[t - 1] + x[t] over B::size
+// consecutive samples held in the lanes of a (re, im) pair of batches. For states narrower than a
+// batch, where the mode-major step of ComplexLayout.h leaves most lanes as padding (see
+// Model::processLayerChunk).
+//
+// The lanes are scanned in log2(size) steps: step m adds a^(2^m) times the batch rotated up by
+// 2^m lanes, which makes lane k the sum of a^(k - j) x[j] over j <= k. The lanes that wrap around
+// get a zero coefficient, so the rotation needs no masking. The state before the batch, h[-1],
+// enters as a^(k + 1) h[-1] in lane k.
+template <typename B>
+struct ChunkedScan
+{
+  using T = typename B::value_type;
+  static constexpr int size = static_cast<int>(B::size);
+  static constexpr int steps = floor_log2(size);
+
+  // Coefficients of one mode
+  struct Mode
+  {
+    B step_re[steps > 0 ? steps : 1]; // a^(2^m) in the lanes k >= 2^m, zero below
+    B step_im[steps > 0 ? steps : 1];
+    B carry_re; // a^(k + 1) in lane k
+    B carry_im;
+  };
+
+  // Powers computed in double, the scan itself runs in T
+  static Mode coefficients(std::complex<double> a) noexcept
+  {
+    Mode mode;
+    alignas(B::arch_type::alignment()) T re[size];
+    alignas(B::arch_type::alignment()) T im[size];
+    std::complex<double> power = a; // a^(2^m)
+    for (int m = 0; m < steps; ++m)
+    {
+      for (int k = 0; k < size; ++k)
+      {
+        re[k] = k >= (1 << m) ? static_cast<T>(power.real()) : T(0);
+        im[k] = k >= (1 << m) ? static_cast<T>(power.imag()) : T(0);
+      }
+      mode.step_re[m] = B::load_aligned(re);
+      mode.step_im[m] = B::load_aligned(im);
+      power *= power;
+    }
+    power = a;
+    for (int k = 0; k < size; ++k)
+    {
+      re[k] = static_cast<T>(power.real());
+      im[k] = static_cast<T>(power.imag());
+      power *= a;
+    }
+    mode.carry_re = B::load_aligned(re);
+    mode.carry_im = B::load_aligned(im);
+    return mode;
+  }
+
+  // Lane k of (re, im) becomes h[k], from x[k] in lane k and the previous state h
+  static inline void scan(B& re, B& im, const Mode& mode, T h_re, T h_im) noexcept { scanSteps<0>(re, im, mode, h_re, h_im); }
+
+private:
+  template <unsigned D>
+  struct RotateUp
+  {
+    static constexpr unsigned get(unsigned i, unsigned n) { return (i + n - D % n) % n; }
+  };
+
+  template <int M>
+  static inline void scanSteps(B& re, B& im, const Mode& mode, T h_re, T h_im) noexcept
+  {
+    if constexpr (M < steps)
+    {
+      using mask_type = xsimd::as_unsigned_integer_t<T>;
+      constexpr auto rotate = xsimd::make_batch_constant<mask_type, RotateUp<(1u << M)>, typename B::arch_type>();
+      const B r_re = xsimd::swizzle(re, rotate);
+      const B r_im = xsimd::swizzle(im, rotate);
+      re += mode.step_re[M] * r_re - mode.step_im[M] * r_im;
+      im += mode.step_re[M] * r_im + mode.step_im[M] * r_re;
+      scanSteps<M + 1>(re, im, mode, h_re, h_im);
+    }
+    else
+    {
+      const B c_re(h_re), c_im(h_im);
+      re += mode.carry_re * c_re - mode.carry_im * c_im;
+      im += mode.carry_re * c_im + mode.carry_im * c_re;
+    }
+  }
+};
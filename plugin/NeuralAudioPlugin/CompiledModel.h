@@ -0,0 +1,502 @@
+#pragma once
+
+#include "common.h"
+#include "xsimd/xsimd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+
+// Engine for a model compiled into a header by neural_network/model2cpp.py.
+// W is the generated weight struct: all dimensions are compile time constants and the weights are
+// constexpr arrays, already transposed, padded, C scaled for conj_sym and discretized at the sample
+// rates given to model2cpp.py. Nothing is parsed or allocated at startup.
+//
+// Every row of a generated array is zero padded to a multiple of compiled_pad floats, so any SIMD
+// width up to AVX-512 can load whole batches, and the lanes past the true size are never touched.
+constexpr int compiled_pad = 16;
+
+constexpr int compiled_stride(int n) { return ceil_div(n, compiled_pad) * compiled_pad; }
+
+// Conditioning network (Linear -> ReLU -> Linear), shared by every channel
+template <typename W>
+class CompiledFiLM
+{
+private:
+  using v_type = xsimd::simd_type<float>;
+  static constexpr int v_size = static_cast<int>(v_type::size);
+  static_assert(compiled_pad % v_size == 0, "SIMD width must divide the compiled padding");
+
+  static constexpr int s_hidden = compiled_stride(W::d_hidden);
+  static constexpr int s_model = compiled_stride(W::d_model);
+  static constexpr int v_d_hidden = ceil_div(W::d_hidden, v_size);
+  static constexpr int v_d_model = ceil_div(W::d_model, v_size);
+
+  alignas(64) float hidden[s_hidden] = {};
+  alignas(64) float gamma[s_model] = {};
+  alignas(64) float beta[s_model] = {};
+
+public:
+  static constexpr int getNumInputs() noexcept { return W::c_in; }
+
+  // Process conditioning input (c_in values) and update gamma and beta
+  inline void processSample(const float* input) noexcept
+  {
+    // layer 1: Linear + ReLU
+    for (int i = 0; i < v_d_hidden; ++i)
+    {
+      v_type acc = xsimd::load_aligned(&W::film_in_proj[i * v_size]) * v_type(input[0]);
+      for (int j = 1; j < W::c_in; ++j)
+        acc += xsimd::load_aligned(&W::film_in_proj[j * s_hidden + i * v_size]) * v_type(input[j]);
+      acc = xsimd::max(acc + xsimd::load_aligned(&W::film_in_bias[i * v_size]), v_type(0.0f));
+      acc.store_aligned(hidden + i * v_size);
+    }
+
+    // layer 2: Linear, split into gamma and beta
+    for (int i = 0; i < v_d_model; ++i)
+    {
+      v_type g = xsimd::load_aligned(&W::film_out_bias[i * v_size]);
+      v_type b = xsimd::load_aligned(&W::film_out_bias[s_model + i * v_size]);
+      for (int k = 0; k < W::d_hidden; ++k)
+      {
+        g += hidden[k] * xsimd::load_aligned(&W::film_out_proj[k * 2 * s_model + i * v_size]);
+        b += hidden[k] * xsimd::load_aligned(&W::film_out_proj[k * 2 * s_model + s_model + i * v_size]);
+      }
+      g.store_aligned(gamma + i * v_size);
+      b.store_aligned(beta + i * v_size);
+    }
+  }
+
+  // Two knob conditioning (drive, tone)
+  inline void processSample(const float& input1, const float& input2) noexcept
+  {
+    static_assert(W::c_in == 2, "model does not take two conditioning inputs");
+    const float input[2] = {input1, input2};
+    processSample(input);
+  }
+
+  // Aligned, zero padded arrays, as expected by CompiledModel::processSample and Model::processSample
+  const float* getGamma() const noexcept { return gamma; }
+  const float* getBeta() const noexcept { return beta; }
+};
+
+template <typename W>
+class CompiledModel
+{
+private:
+  using v_type = xsimd::simd_type<float>;
+  static constexpr int v_size = static_cast<int>(v_type::size);
+  static_assert(compiled_pad % v_size == 0, "SIMD width must divide the compiled padding");
+
+  // Model parameters
+  static constexpr int d_model = W::d_model;
+  static constexpr int d_inner = W::d_inner;
+  static constexpr int ssm_size = W::ssm_size;
+  static constexpr int num_layers = W::num_layers;
+
+  // Row strides of the generated arrays
+  static constexpr int s_model = compiled_stride(d_model);
+  static constexpr int s_inner = compiled_stride(d_inner);
+  static constexpr int s_inner_2 = 2 * s_inner;
+  static constexpr int s_ssm = compiled_stride(ssm_size);
+
+  // Number of SIMD batches per vector
+  static constexpr int v_d_model = ceil_div(d_model, v_size);
+  static constexpr int v_d_inner = ceil_div(d_inner, v_size);
+  static constexpr int v_ssm_size = ceil_div(ssm_size, v_size);
+
+  // Number of valid lanes in batch j of a vector of length n
+  static constexpr int lanes(int j, int n) noexcept { return std::min(v_size, n - j * v_size); }
+
+  // Samples per chunk of processBlockLayerMajor
+  static constexpr int layer_major_chunk = 128;
+
+  // buffers for intermediate results
+  v_type tmp[v_d_model];
+  v_type chunk_activations[layer_major_chunk * v_d_model]; // processBlockLayerMajor
+
+  // Scratch of one layer, every layer has its own so that different layers can run on different
+  // threads (processLayers)
+  struct Scratch
+  {
+    v_type normed[v_d_model]; // FiLM and RMS norm of the layer input
+    v_type u[v_d_inner];
+    v_type res2[v_d_inner];
+    v_type y[v_d_inner];
+    v_type Bu_real[v_ssm_size];
+    v_type Bu_imag[v_ssm_size];
+  };
+  Scratch scratch[num_layers];
+
+  // Discretized A and B, point into the generated tables or into the buffers below
+  const float* dA_real = W::dA_real;
+  const float* dA_imag = W::dA_imag;
+  const float* dB_real = W::dB_real;
+  const float* dB_imag = W::dB_imag;
+
+  // Discretization for sample rates that were not compiled in
+  alignas(64) float dA_real_buf[num_layers * s_ssm] = {};
+  alignas(64) float dA_imag_buf[num_layers * s_ssm] = {};
+  alignas(64) float dB_real_buf[num_layers * d_inner * s_ssm] = {};
+  alignas(64) float dB_imag_buf[num_layers * d_inner * s_ssm] = {};
+
+  // Hidden state
+  v_type hidden_real[num_layers][v_ssm_size];
+  v_type hidden_imag[num_layers][v_ssm_size];
+
+public:
+  CompiledModel() noexcept { reset(); }
+  CompiledModel(const CompiledModel&) = delete; // may point into its own discretization buffers
+  CompiledModel& operator=(const CompiledModel&) = delete;
+
+  static constexpr int getNumLayers() noexcept { return num_layers; }
+
+  inline void reset() noexcept
+  {
+    for (int i = 0; i < num_layers; ++i)
+    {
+      std::fill(hidden_real[i], hidden_real[i] + v_ssm_size, v_type(0.0f));
+      std::fill(hidden_imag[i], hidden_imag[i] + v_ssm_size, v_type(0.0f));
+    }
+  }
+
+  // Number of scalars in a hidden state snapshot: [layer][real ssm_size, imag ssm_size]
+  static constexpr int stateSize() noexcept { return 2 * num_layers * ssm_size; }
+
+  void getState(float* state) const noexcept
+  {
+    alignas(64) float lanes_buf[v_size];
+    for (int i = 0; i < num_layers; ++i)
+    {
+      for (int j = 0; j < v_ssm_size; ++j)
+      {
+        hidden_real[i][j].store_aligned(lanes_buf);
+        std::copy(lanes_buf, lanes_buf + lanes(j, ssm_size), state + 2 * i * ssm_size + j * v_size);
+        hidden_imag[i][j].store_aligned(lanes_buf);
+        std::copy(lanes_buf, lanes_buf + lanes(j, ssm_size), state + (2 * i + 1) * ssm_size + j * v_size);
+      }
+    }
+  }
+
+  void setState(const float* state) noexcept
+  {
+    alignas(64) float lanes_buf[v_size];
+    for (int i = 0; i < num_layers; ++i)
+    {
+      for (int j = 0; j < v_ssm_size; ++j)
+      {
+        // padding lanes stay zero
+        const float* re = state + 2 * i * ssm_size + j * v_size;
+        std::fill(lanes_buf, lanes_buf + v_size, 0.0f);
+        std::copy(re, re + lanes(j, ssm_size), lanes_buf);
+        hidden_real[i][j] = xsimd::load_aligned(lanes_buf);
+        const float* im = state + (2 * i + 1) * ssm_size + j * v_size;
+        std::fill(lanes_buf, lanes_buf + v_size, 0.0f);
+        std::copy(im, im + lanes(j, ssm_size), lanes_buf);
+        hidden_imag[i][j] = xsimd::load_aligned(lanes_buf);
+      }
+    }
+  }
+
+  // in proj of one sample into the activations x ([v_d_model])
+  inline void inputProjection(const float& input, v_type* x) noexcept
+  {
+    const v_type v_input(input);
+    for (int i = 0; i < v_d_model; ++i)
+    {
+      x[i] = xsimd::load_aligned(&W::in_proj[i * v_size]) * v_input;
+      if (W::bias)
+        x[i] += xsimd::load_aligned(&W::in_bias[i * v_size]);
+    }
+  }
+
+  // x sigmoid(x)
+  static inline v_type silu(const v_type& x) noexcept { return x / (v_type(1.0f) + xsimd::exp(-x)); }
+
+  // Layer i of one sample, updates the activations x in place and advances the layer's state
+  inline void processLayer(int i, v_type* x, const float* gamma, const float* beta) noexcept
+  {
+    const float* W_in = W::in_proj_mamba + i * d_model * s_inner_2;
+    const float* W_out = W::out_proj_mamba + i * d_inner * s_model;
+    const float* dB_re = dB_real + i * d_inner * s_ssm;
+    const float* dB_im = dB_imag + i * d_inner * s_ssm;
+    const float* C_re = W::C_real + i * ssm_size * s_inner;
+    const float* C_im = W::C_imag + i * ssm_size * s_inner;
+    const float* dA_re = dA_real + i * s_ssm;
+    const float* dA_im = dA_imag + i * s_ssm;
+    const float* D_i = W::D + i * s_inner;
+    const float* norm_i = W::norm + i * s_model;
+    v_type* h_re = hidden_real[i];
+    v_type* h_im = hidden_imag[i];
+    Scratch& t = scratch[i];
+
+    // FiLM conditioning, x is kept as the residual
+    v_type v_tmp_RMS(0.0f);
+    for (int j = 0; j < v_d_model; ++j)
+    {
+      t.normed[j] = xsimd::load_aligned(gamma + j * v_size) * x[j] + xsimd::load_aligned(beta + j * v_size);
+      v_tmp_RMS += t.normed[j] * t.normed[j];
+    }
+
+    // RMS norm
+    const float sum_RMS = xsimd::reduce_add(v_tmp_RMS) / static_cast<float>(d_model); // padding lanes are zero
+    v_tmp_RMS = v_type(1.0f / std::sqrt(W::eps[i] + sum_RMS));
+    for (int j = 0; j < v_d_model; ++j)
+    {
+      t.normed[j] = xsimd::load_aligned(norm_i + j * v_size) * t.normed[j] * v_tmp_RMS;
+    }
+
+    // Mamba in proj, u and res halves. The bias and the first input start the sums, silu is
+    // applied with the last input.
+    const float* in = reinterpret_cast<const float*>(t.normed);
+    auto in_start = [&](int half, int k) {
+      const v_type first = in[0] * xsimd::load_aligned(W_in + half + k * v_size);
+      return W::bias ? xsimd::load_aligned(&W::in_proj_mamba_bias[i * s_inner_2 + half + k * v_size]) + first : first;
+    };
+    for (int k = 0; k < v_d_inner; ++k)
+    {
+      t.u[k] = in_start(0, k);
+      t.res2[k] = in_start(s_inner, k);
+    }
+
+    for (int q = 1; q < d_model - 1; ++q)
+    {
+      const float* row = W_in + q * s_inner_2;
+      const v_type in_q(in[q]);
+      for (int k = 0; k < v_d_inner; ++k)
+      {
+        t.u[k] += in_q * xsimd::load_aligned(row + k * v_size);
+        t.res2[k] += in_q * xsimd::load_aligned(row + s_inner + k * v_size);
+      }
+    }
+
+    for (int k = 0; k < v_d_inner; ++k)
+    {
+      if (d_model > 1)
+      {
+        const float* row = W_in + (d_model - 1) * s_inner_2;
+        t.u[k] += in[d_model - 1] * xsimd::load_aligned(row + k * v_size);
+        t.res2[k] += in[d_model - 1] * xsimd::load_aligned(row + s_inner + k * v_size);
+      }
+      t.u[k] = silu(t.u[k]);
+      t.res2[k] = silu(t.res2[k]);
+    }
+
+    /* ================ S5 ================ */
+    // h[n] = Ah[n - 1] + Bu[n]
+    // y[n] = real(Ch[n]) + Du[n]
+
+    // Bu[n], started by the first input
+    const float* u_in = reinterpret_cast<const float*>(t.u);
+    for (int k = 0; k < v_ssm_size; ++k)
+    {
+      t.Bu_real[k] = u_in[0] * xsimd::load_aligned(dB_re + k * v_size);
+      t.Bu_imag[k] = u_in[0] * xsimd::load_aligned(dB_im + k * v_size);
+    }
+
+    for (int q = 1; q < d_inner; ++q)
+    {
+      const int row = q * s_ssm;
+      const v_type u_q(u_in[q]);
+      for (int k = 0; k < v_ssm_size; ++k)
+      {
+        t.Bu_real[k] += u_q * xsimd::load_aligned(dB_re + row + k * v_size);
+        t.Bu_imag[k] += u_q * xsimd::load_aligned(dB_im + row + k * v_size);
+      }
+    }
+
+    // h[n]
+    for (int j = 0; j < v_ssm_size; ++j)
+    {
+      const v_type a_re = xsimd::load_aligned(dA_re + j * v_size);
+      const v_type a_im = xsimd::load_aligned(dA_im + j * v_size);
+      const v_type tmp1 = h_re[j];
+      const v_type tmp2 = h_im[j];
+      h_re[j] = tmp1 * a_re - tmp2 * a_im + t.Bu_real[j];
+      h_im[j] = tmp1 * a_im + tmp2 * a_re + t.Bu_imag[j];
+    }
+
+    // y[n], gated by res with the last mode. C holds the conj_sym factor.
+    const float* hr = reinterpret_cast<const float*>(h_re);
+    const float* hi = reinterpret_cast<const float*>(h_im);
+    for (int j = 0; j < v_d_inner; ++j)
+    {
+      t.y[j] = xsimd::load_aligned(D_i + j * v_size) * t.u[j];
+    }
+
+    for (int p = 0; p < ssm_size - 1; ++p)
+    {
+      const int row = p * s_inner;
+      const v_type h_re_p(hr[p]), h_im_p(hi[p]);
+      for (int k = 0; k < v_d_inner; ++k)
+      {
+        t.y[k] += h_re_p * xsimd::load_aligned(C_re + row + k * v_size) - h_im_p * xsimd::load_aligned(C_im + row + k * v_size);
+      }
+    }
+
+    constexpr int last_row = (ssm_size - 1) * s_inner;
+    for (int k = 0; k < v_d_inner; ++k)
+    {
+      t.y[k] = (t.y[k] + (hr[ssm_size - 1] * xsimd::load_aligned(C_re + last_row + k * v_size) - hi[ssm_size - 1] * xsimd::load_aligned(C_im + last_row + k * v_size))) * t.res2[k];
+    }
+    /* ==================================== */
+
+    // mamba out proj, on top of the residual connection
+    if (W::bias)
+    {
+      for (int j = 0; j < v_d_model; ++j)
+      {
+        x[j] = xsimd::load_aligned(&W::out_proj_mamba_bias[i * s_model + j * v_size]) + x[j];
+      }
+    }
+
+    const float* y_in = reinterpret_cast<const float*>(t.y);
+    for (int q = 0; q < d_inner; ++q)
+    {
+      const float* row = W_out + q * s_model;
+      const v_type y_q(y_in[q]);
+      for (int k = 0; k < v_d_model; ++k)
+      {
+        x[k] += y_q * xsimd::load_aligned(row + k * v_size);
+      }
+    }
+  }
+
+  // out proj of the activations of one sample
+  inline float outputProjection(const v_type* x) const noexcept
+  {
+    float output = W::out_bias;
+    for (int i = 0; i < v_d_model; ++i)
+    {
+      output += xsimd::reduce_add(x[i] * xsimd::load_aligned(&W::out_proj[i * v_size]));
+    }
+    return output;
+  }
+
+  // Process a single sample through the neural network.
+  // gamma and beta are aligned, zero padded arrays of at least v_d_model * v_size values (see CompiledFiLM).
+  inline float processSample(const float& input, const float* gamma, const float* beta) noexcept
+  {
+    inputProjection(input, tmp);
+    for (int i = 0; i < num_layers; ++i)
+    {
+      processLayer(i, tmp, gamma, beta);
+    }
+    return outputProjection(tmp);
+  }
+
+  // Process a block of samples with constant conditioning, input and output may alias
+  inline void processBlock(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept
+  {
+    for (int s = 0; s < numSamples; ++s)
+      output[s] = processSample(input[s], gamma, beta);
+  }
+
+  // Host buffers of another precision, see ModelEngine
+  template <typename S>
+  inline void processBlock(const S* input, S* output, int numSamples, const float* gamma, const float* beta) noexcept
+  {
+    process_host_block<float>(input, output, numSamples, [&](float* buffer, int n) { processBlock(buffer, buffer, n, gamma, beta); });
+  }
+
+  // Same result as processBlock, computed layer by layer over chunks of layer_major_chunk samples
+  // (see Model::processBlockLayerMajor), input and output may alias
+  inline void processBlockLayerMajor(const float* input, float* output, int numSamples, const float* gamma, const float* beta) noexcept
+  {
+    for (int start = 0; start < numSamples; start += layer_major_chunk)
+    {
+      const int n = std::min(layer_major_chunk, numSamples - start);
+      for (int s = 0; s < n; ++s)
+      {
+        inputProjection(input[start + s], chunk_activations + s * v_d_model);
+      }
+      for (int i = 0; i < num_layers; ++i)
+      {
+        for (int s = 0; s < n; ++s)
+        {
+          processLayer(i, chunk_activations + s * v_d_model, gamma, beta);
+        }
+      }
+      for (int s = 0; s < n; ++s)
+      {
+        output[start + s] = outputProjection(chunk_activations + s * v_d_model);
+      }
+    }
+  }
+
+  // The model in stages over a block (see Model::processLayers), activations holds numSamples *
+  // activationSize() floats, 64 byte aligned. Calls on disjoint layer ranges may run concurrently.
+  static constexpr int activationSize() noexcept { return v_d_model * v_size; }
+
+  inline void projectInput(const float* input, float* activations, int numSamples) noexcept
+  {
+    v_type* x = reinterpret_cast<v_type*>(activations);
+    for (int s = 0; s < numSamples; ++s)
+    {
+      inputProjection(input[s], x + s * v_d_model);
+    }
+  }
+
+  inline void processLayers(float* activations, int numSamples, int first, int last, const float* gamma, const float* beta) noexcept
+  {
+    v_type* x = reinterpret_cast<v_type*>(activations);
+    for (int i = first; i < last; ++i)
+    {
+      for (int s = 0; s < numSamples; ++s)
+      {
+        processLayer(i, x + s * v_d_model, gamma, beta);
+      }
+    }
+  }
+
+  inline void projectOutput(const float* activations, float* output, int numSamples) const noexcept
+  {
+    const v_type* x = reinterpret_cast<const v_type*>(activations);
+    for (int s = 0; s < numSamples; ++s)
+    {
+      output[s] = outputProjection(x + s * v_d_model);
+    }
+  }
+
+  // Select the discretization for the host sample rate. Compiled rates use the generated tables,
+  // any other rate is discretized here from the continuous A, B and dt.
+  void discretize_bilinear(const float& sr) noexcept
+  {
+    for (int r = 0; r < W::num_rates; ++r)
+    {
+      if (W::sample_rates[r] == sr)
+      {
+        dA_real = W::dA_real + r * num_layers * s_ssm;
+        dA_imag = W::dA_imag + r * num_layers * s_ssm;
+        dB_real = W::dB_real + r * num_layers * d_inner * s_ssm;
+        dB_imag = W::dB_imag + r * num_layers * d_inner * s_ssm;
+        return;
+      }
+    }
+
+    for (int i = 0; i < num_layers; ++i)
+    {
+      for (int j = 0; j < ssm_size; ++j)
+      {
+        const int l = i * s_ssm + j;
+        const float dt = 48000.0f / sr * std::log(1.0f + std::exp(W::inv_dt[l]));
+        const std::complex<float> A(W::A_real[l], W::A_imag[l]);
+        const std::complex<float> BL = 1.0f / (1.0f - dt / 2.0f * A);
+        const std::complex<float> dA = BL * (1.0f + dt / 2.0f * A);
+        dA_real_buf[l] = dA.real();
+        dA_imag_buf[l] = dA.imag();
+
+        for (int k = 0; k < d_inner; ++k)
+        {
+          const int idx = (i * d_inner + k) * s_ssm + j;
+          const std::complex<float> dB = BL * dt * std::complex<float>(W::B_real[idx], W::B_imag[idx]);
+          dB_real_buf[idx] = dB.real();
+          dB_imag_buf[idx] = dB.imag();
+        }
+      }
+    }
+    dA_real = dA_real_buf;
+    dA_imag = dA_imag_buf;
+    dB_real = dB_real_buf;
+    dB_imag = dB_imag_buf;
+  }
+};
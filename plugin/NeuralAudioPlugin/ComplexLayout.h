@@ -0,0 +1,115 @@
+#pragma once
+
+#include "common.h"
+#include "xsimd/xsimd.hpp"
+
+// Storage of the complex S5 data of a Model: the hidden state, the discretized A and B, and C.
+// A layer's complex vector of n modes is kept as real scalars in whole SIMD batches, with the real
+// and imaginary part of every mode at fixed scalar positions. B and C become real matrices over
+// these positions, so Bu and the C readout are single matrix products; only the diagonal
+// recurrence h = dA h + Bu depends on the layout. With a = Re(dA) at both positions of a mode and
+// b = -Im(dA) at the real and +Im(dA) at the imaginary position:
+//   h = a h + b swap(h) + Bu
+// where swap exchanges the real and imaginary part of every mode.
+//
+// A layout provides, for a batch type B:
+//   batches<B>(n)      number of batches for n modes
+//   re<B>(p, n)        scalar position of the real part of mode p
+//   im<B>(p, n)        scalar position of the imaginary part
+//   step<B>(h, a, b, Bu, batches)
+//
+// The choice is made per architecture by DefaultComplexLayout, from tools/microbench.cpp.
+
+// Real parts in the first half of the batches, imaginary parts in the second half (the layout
+// of the PyTorch model). swap pairs batch j with batch j + batches / 2, no permutes.
+struct SplitComplex
+{
+  template <typename B>
+  static constexpr int batches(int n) noexcept { return 2 * ceil_div(n, static_cast<int>(B::size)); }
+
+  template <typename B>
+  static constexpr int re(int p, int) noexcept { return p; }
+
+  template <typename B>
+  static constexpr int im(int p, int n) noexcept { return ceil_div(n, static_cast<int>(B::size)) * static_cast<int>(B::size) + p; }
+
+  template <typename B>
+  static inline void step(B* h, const B* a, const B* b, const B* Bu, int batches) noexcept
+  {
+    const int half = batches / 2;
+    for (int j = 0; j < half; ++j)
+    {
+      const B h_re = h[j];
+      const B h_im = h[j + half];
+      h[j] = a[j] * h_re + b[j] * h_im + Bu[j];
+      h[j + half] = a[j + half] * h_im + b[j + half] * h_re + Bu[j + half];
+    }
+  }
+};
+
+// (re, im) pairs of adjacent lanes, swap is a permute within each batch
+struct InterleavedComplex
+{
+  struct SwapPairs
+  {
+    static constexpr unsigned get(unsigned i, unsigned) { return i ^ 1u; }
+  };
+
+  template <typename B>
+  static constexpr int batches(int n) noexcept { return ceil_div(2 * n, static_cast<int>(B::size)); }
+
+  template <typename B>
+  static constexpr int re(int p, int) noexcept { return 2 * p; }
+
+  template <typename B>
+  static constexpr int im(int p, int) noexcept { return 2 * p + 1; }
+
+  template <typename B>
+  static inline void step(B* h, const B* a, const B* b, const B* Bu, int batches) noexcept
+  {
+    static_assert(B::size >= 2, "interleaved complex data needs at least two lanes");
+    using mask_type = xsimd::as_unsigned_integer_t<typename B::value_type>;
+    constexpr auto swap = xsimd::make_batch_constant<mask_type, SwapPairs, typename B::arch_type>();
+    for (int j = 0; j < batches; ++j)
+      h[j] = a[j] * h[j] + b[j] * xsimd::swizzle(h[j], swap) + Bu[j];
+  }
+};
+
+// Each batch holds size / 2 modes, real parts in the low half of the lanes and imaginary parts
+// in the high half, swap exchanges the halves (one permute across 128-bit lanes on AVX)
+struct PackedComplex
+{
+  struct SwapHalves
+  {
+    static constexpr unsigned get(unsigned i, unsigned n) { return (i + n / 2) % n; }
+  };
+
+  template <typename B>
+  static constexpr int batches(int n) noexcept { return ceil_div(2 * n, static_cast<int>(B::size)); }
+
+  template <typename B>
+  static constexpr int re(int p, int) noexcept
+  {
+    constexpr int half = static_cast<int>(B::size) / 2;
+    return (p / half) * static_cast<int>(B::size) + p % half;
+  }
+
+  template <typename B>
+  static constexpr int im(int p, int n) noexcept { return re<B>(p, n) + static_cast<int>(B::size) / 2; }
+
+  template <typename B>
+  static inline void step(B* h, const B* a, const B* b, const B* Bu, int batches) noexcept
+  {
+    static_assert(B::size >= 2, "packed complex data needs at least two lanes");
+    using mask_type = xsimd::as_unsigned_integer_t<typename B::value_type>;
+    constexpr auto swap = xsimd::make_batch_constant<mask_type, SwapHalves, typename B::arch_type>();
+    for (int j = 0; j < batches; ++j)
+      h[j] = a[j] * h[j] + b[j] * xsimd::swizzle(h[j], swap) + Bu[j];
+  }
+};
+
+// Layout used by the engine, picked per architecture with tools/microbench.cpp (complex_layout).
+// With the default model the three measured within noise on SSE2, SSE4.1, AVX2 and AVX-512, so
+// split is kept everywhere: it needs no permutes and matches the exported weights.
+template <typename T>
+using DefaultComplexLayout = SplitComplex;
@@ -0,0 +1,240 @@
+#pragma once
+
+#include "Model.h"
+#include <memory>
+#include <string>
+
+// Precompiled model sizes (d_model, d_inner, ssm_size). A weight file matching one of these runs
+// on a Model with compile-time dimensions, any other size falls back to the runtime-dimension Model.
+using EngineDefaultDims = FixedDims<16, 32, 32>; // config.py defaults
+using EngineSmallDims = FixedDims<8, 16, 16>;
+using EngineLargeDims = FixedDims<32, 64, 64>;
+using EngineReducedDims = FixedDims<16, 32, 16>; // defaults cut to 16 modes (neural_network/reduce_ssm.py)
+
+// How ModelEngine builds its model
+struct EngineOptions
+{
+  bool allowPrecompiled = true; // false always uses the runtime-dimension Model
+};
+
+// Type erased Model, picks the fastest implementation for the dimensions in the weight file.
+// Formats selects the weight matrix storage, e.g. WeightFormats<Fp32Weights, Fp16Weights>, Layout
+// the storage of the complex S5 data (ComplexLayout.h).
+template <typename T, std::size_t Alignment = xsimd::default_arch::alignment(), typename Formats = WeightFormats<Fp32Weights>,
+          typename Layout = DefaultComplexLayout<T>>
+class ModelEngine
+{
+private:
+  struct Impl
+  {
+    virtual ~Impl() = default;
+    virtual bool initFromJson(const nlohmann::json& model_data) noexcept = 0;
+    virtual T processSample(const T& input, const T* gamma, const T* beta) noexcept = 0;
+    virtual void processBlock(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept = 0;
+    virtual void processBlockLayerMajor(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept = 0;
+    virtual int activationSize() const noexcept = 0;
+    virtual void projectInput(const T* input, T* activations, int numSamples) noexcept = 0;
+    virtual void processLayers(T* activations, int numSamples, int first, int last, const T* gamma, const T* beta) noexcept = 0;
+    virtual void projectOutput(const T* activations, T* output, int numSamples) noexcept = 0;
+    virtual void discretize_bilinear(const T& sr) noexcept = 0;
+    virtual void reset() noexcept = 0;
+    virtual int stateSize() const noexcept = 0;
+    virtual void getState(T* state) const noexcept = 0;
+    virtual void setState(const T* state) noexcept = 0;
+    virtual const ModelConfig& getConfig() const noexcept = 0;
+    virtual const std::string& getLastError() const noexcept = 0;
+    virtual MemoryFootprint footprint() const noexcept = 0;
+    virtual std::size_t arenaBytes() const noexcept = 0;
+    virtual bool placeArena(void* memory, std::size_t bytes) noexcept = 0;
+    virtual Impl* shareWeights() const = 0;
+  };
+
+  template <typename Dims>
+  struct ImplT final : Impl
+  {
+    Model<T, Alignment, Dims, Formats, Layout> model;
+
+    bool initFromJson(const nlohmann::json& model_data) noexcept override { return model.initFromJson(model_data); }
+    T processSample(const T& input, const T* gamma, const T* beta) noexcept override { return model.processSample(input, gamma, beta); }
+    void processBlock(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept override { model.processBlock(input, output, numSamples, gamma, beta); }
+    void processBlockLayerMajor(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept override
+    {
+      model.processBlockLayerMajor(input, output, numSamples, gamma, beta);
+    }
+    int activationSize() const noexcept override { return model.activationSize(); }
+    void projectInput(const T* input, T* activations, int numSamples) noexcept override { model.projectInput(input, activations, numSamples); }
+    void processLayers(T* activations, int numSamples, int first, int last, const T* gamma, const T* beta) noexcept override
+    {
+      model.processLayers(activations, numSamples, first, last, gamma, beta);
+    }
+    void projectOutput(const T* activations, T* output, int numSamples) noexcept override { model.projectOutput(activations, output, numSamples); }
+    void discretize_bilinear(const T& sr) noexcept override { model.discretize_bilinear(sr); }
+    void reset() noexcept override { model.reset(); }
+    int stateSize() const noexcept override { return model.stateSize(); }
+    void getState(T* state) const noexcept override { model.getState(state); }
+    void setState(const T* state) noexcept override { model.setState(state); }
+    const ModelConfig& getConfig() const noexcept override { return model.getConfig(); }
+    const std::string& getLastError() const noexcept override { return model.getLastError(); }
+    MemoryFootprint footprint() const noexcept override { return model.footprint(); }
+    std::size_t arenaBytes() const noexcept override { return model.arenaBytes(); }
+    bool placeArena(void* memory, std::size_t bytes) noexcept override { return model.placeArena(memory, bytes); }
+    Impl* shareWeights() const override
+    {
+      std::unique_ptr<ImplT> shared(new ImplT());
+      shared->model.shareWeights(model);
+      return shared.release();
+    }
+  };
+
+  std::unique_ptr<Impl> impl;
+  bool precompiled = false;
+  ModelConfig config;
+
+  // plugin loading
+  std::string lastError;
+
+  template <typename Dims>
+  bool tryCreate(const ModelConfig& c) noexcept
+  {
+    if (impl || !Dims::matches(c))
+      return false;
+    impl.reset(new (std::nothrow) ImplT<Dims>());
+    return impl != nullptr;
+  }
+
+public:
+  ModelEngine() noexcept = default;
+
+  // Load weights from a model_weights.json blob (as exported by model2json.py)
+  bool initFromJson(const char* data, std::size_t size, const EngineOptions& options = EngineOptions()) noexcept
+  {
+    try
+    {
+      return initFromJson(nlohmann::json::parse(data, data + size), options);
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+    catch (...)
+    {
+      lastError = "Unknown error loading weights";
+      return false;
+    }
+  }
+
+  // Load weights from an already parsed model_weights.json
+  bool initFromJson(const nlohmann::json& model_data, const EngineOptions& options = EngineOptions()) noexcept
+  {
+    impl.reset();
+    precompiled = false;
+    try
+    {
+      config = ModelConfig::fromJson(model_data);
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+
+    if (options.allowPrecompiled)
+      precompiled = tryCreate<EngineDefaultDims>(config) || tryCreate<EngineSmallDims>(config) || tryCreate<EngineLargeDims>(config) ||
+                    tryCreate<EngineReducedDims>(config);
+    if (!impl)
+      impl.reset(new (std::nothrow) ImplT<RuntimeDims>());
+    if (!impl)
+    {
+      lastError = "Out of memory";
+      return false;
+    }
+
+    if (!impl->initFromJson(model_data))
+    {
+      lastError = impl->getLastError();
+      impl.reset();
+      return false;
+    }
+    return true;
+  }
+
+  bool isLoaded() const noexcept { return impl != nullptr; }
+
+  // True when the weight file matched one of the precompiled sizes
+  bool isPrecompiled() const noexcept { return precompiled; }
+
+  const ModelConfig& getConfig() const noexcept { return config; }
+  const std::string& getLastError() const noexcept { return lastError; }
+
+  inline T processSample(const T& input, const T* gamma, const T* beta) noexcept { return impl->processSample(input, gamma, beta); }
+
+  inline void processBlock(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept
+  {
+    impl->processBlock(input, output, numSamples, gamma, beta);
+  }
+
+  // processBlock on host buffers of another precision, e.g. IPlug2's double samples, converted a
+  // chunk at a time (process_host_block). input and output may alias.
+  template <typename S>
+  inline void processBlock(const S* input, S* output, int numSamples, const T* gamma, const T* beta) noexcept
+  {
+    process_host_block<T>(input, output, numSamples, [&](T* buffer, int n) { impl->processBlock(buffer, buffer, n, gamma, beta); });
+  }
+
+  // Same result as processBlock, computed one layer at a time over the block for throughput
+  // (offline rendering)
+  inline void processBlockLayerMajor(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept
+  {
+    impl->processBlockLayerMajor(input, output, numSamples, gamma, beta);
+  }
+
+  // The model in stages over a block, for running groups of layers on different threads (see
+  // Model::processLayers)
+  bool hasLayerStages() const noexcept { return impl != nullptr; }
+  int getNumLayers() const noexcept { return config.num_layers; }
+  int activationSize() const noexcept { return impl ? impl->activationSize() : 0; }
+  inline void projectInput(const T* input, T* activations, int numSamples) noexcept { impl->projectInput(input, activations, numSamples); }
+  inline void processLayers(T* activations, int numSamples, int first, int last, const T* gamma, const T* beta) noexcept
+  {
+    impl->processLayers(activations, numSamples, first, last, gamma, beta);
+  }
+  inline void projectOutput(const T* activations, T* output, int numSamples) noexcept { impl->projectOutput(activations, output, numSamples); }
+
+  void discretize_bilinear(const T& sr) noexcept { impl->discretize_bilinear(sr); }
+  void reset() noexcept { impl->reset(); }
+
+  int stateSize() const noexcept { return impl ? impl->stateSize() : 0; }
+  void getState(T* state) const noexcept { impl->getState(state); }
+  void setState(const T* state) noexcept { impl->setState(state); }
+
+  // Hot/cold memory of the loaded model (see WeightArena.h)
+  MemoryFootprint footprint() const noexcept { return impl ? impl->footprint() : MemoryFootprint(); }
+
+  // Move the model's weight arena into caller provided memory, 64 byte aligned and at least
+  // arenaBytes() long, e.g. huge pages. The state stays with the model.
+  std::size_t arenaBytes() const noexcept { return impl ? impl->arenaBytes() : 0; }
+  bool placeArena(void* memory, std::size_t bytes) noexcept { return impl && impl->placeArena(memory, bytes); }
+
+  // Run on the weights of source without copying them (Model::shareWeights), with this engine's own
+  // state. source has to stay loaded and unchanged while this engine runs, and discretize_bilinear
+  // does nothing here.
+  bool shareWeights(const ModelEngine& source) noexcept
+  {
+    impl.reset();
+    precompiled = source.precompiled;
+    config = source.config;
+    try
+    {
+      if (source.impl)
+        impl.reset(source.impl->shareWeights());
+    }
+    catch (...)
+    {
+      impl.reset();
+    }
+    if (!impl)
+      lastError = source.impl ? "Out of memory" : "No model to share";
+    return impl != nullptr;
+  }
+};
@@ -3,10 +3,11 @@
 // https://github.com/jatinchowdhury18/RTNeural
 #pragma once
 
+#include "ModelConfig.h"
 #include "common.h"
 #include "json.hpp"
-#include "model_weights.h"
 #include "xsimd/xsimd.hpp"
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -14,77 +15,68 @@ template <typename T, std::size_t Alignment = xsimd::default_arch::alignment()>
 class FiLM
 {
 private:
-  // FiLM parameters
-  static constexpr int c_in = 2;
-  static constexpr int d_hidden = 4;
-  static constexpr int d_model = 16;
-  static constexpr int d_model_2 = 2 * d_model;
-
   // SIMD types and alignment
   using v_type = xsimd::simd_type<T>;
-  static constexpr std::size_t alignment = Alignment;
+  static constexpr std::size_t alignment = Alignment > alignof(v_type) ? Alignment : alignof(v_type);
   static constexpr int v_size = static_cast<int>(v_type::size);
-  static constexpr int v_c_in = ceil_div(c_in, v_size);
-  static constexpr int v_d_hidden = ceil_div(d_hidden, v_size);
-  static constexpr int v_d_model = ceil_div(d_model, v_size);
-  static constexpr int v_d_model_2 = ceil_div(d_model_2, v_size);
+  using v_vector = aligned_vector<v_type, alignment>;
+
+  // FiLM parameters, read from the weight file
+  int c_in = 0;
+  int d_hidden = 0;
+  int d_model = 0;
+  int v_d_hidden = 0;
+  int v_d_model = 0;
 
   // FiLM layers: Linear -> ReLU -> Linear
-  alignas(alignment) v_type in_proj[c_in][v_d_hidden];
-  alignas(alignment) v_type out_proj[d_hidden][v_d_model_2];
-  alignas(alignment) v_type in_bias[v_d_hidden];
-  alignas(alignment) v_type out_bias[v_d_model_2];
+  v_vector in_proj;  // [c_in][v_d_hidden]
+  v_vector out_proj; // [d_hidden][2 * v_d_model], gamma and beta halves padded to whole batches
+  v_vector in_bias;  // [v_d_hidden]
+  v_vector out_bias; // [2 * v_d_model]
 
   // buffers for intermediate results
-  alignas(alignment) v_type tmp1[v_d_hidden];
-  alignas(alignment) v_type tmp2[v_d_model_2];
-
-  // preallocated inputs
-  alignas(alignment) v_type v_in0;
-  alignas(alignment) v_type v_in1;
+  v_vector tmp1; // [v_d_hidden]
+  v_vector tmp2; // [2 * v_d_model]
 
   // linear projection buffers
   alignas(alignment) T scalar_in[v_size] = {};
-  static constexpr int v_size_d_hidden = std::min(v_size, d_hidden);
+
+  // output buffers
+  aligned_vector<T, alignment> gamma;
+  aligned_vector<T, alignment> beta;
 
   // plugin loading
   std::string lastError;
 
 public:
-  FiLM() noexcept
+  FiLM() noexcept = default;
+
+  // Load weights from a model_weights.json blob (as exported by model2json.py)
+  bool initFromJson(const char* data, std::size_t size) noexcept
   {
-    // Initialize all to zero
-    auto zero = v_type(T(0));
-    for (int i = 0; i < c_in; ++i)
-      for (int j = 0; j < v_d_hidden; ++j)
-        in_proj[i][j] = zero;
-    for (int i = 0; i < d_hidden; ++i)
-      for (int j = 0; j < v_d_model_2; ++j)
-        out_proj[i][j] = zero;
-    for (int i = 0; i < v_d_hidden; ++i)
-      in_bias[i] = zero;
-    for (int i = 0; i < v_d_model_2; ++i)
-      out_bias[i] = zero;
-    for (int i = 0; i < v_d_hidden; ++i)
-      tmp1[i] = zero;
-    for (int i = 0; i < v_d_model_2; ++i)
-      tmp2[i] = zero;
-    v_in0 = zero;
-    v_in1 = zero;
-    for (int i = 0; i < v_size; ++i)
-      scalar_in[i] = T(0);
-    for (int i = 0; i < v_d_model; ++i)
+    try
     {
-      gamma[i] = zero;
-      beta[i] = zero;
+      loadWeightsFromJson(nlohmann::json::parse(data, data + size));
+      return true;
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+    catch (...)
+    {
+      lastError = "Unknown error loading weights";
+      return false;
     }
   }
 
-  bool initFromWeights() noexcept
+  // Load weights from an already parsed model_weights.json
+  bool initFromJson(const nlohmann::json& model_data) noexcept
   {
     try
     {
-      loadWeightsFromFile();
+      loadWeightsFromJson(model_data);
       return true;
     }
     catch (const std::exception& e)
@@ -101,81 +93,112 @@ public:
 
   const std::string& getLastError() const noexcept { return lastError; }
 
-  // Process conditioning input and update gamma and beta
-  inline void processSample(const float& input1, const float& input2) noexcept
-  {
-    // reuse preallocated SIMD registers
-    v_in0 = xsimd::batch<T, xsimd::default_arch>(input1);
-    v_in1 = xsimd::batch<T, xsimd::default_arch>(input2);
+  // Number of conditioning inputs
+  int getNumInputs() const noexcept { return c_in; }
 
+  // Process conditioning input (c_in values) and update gamma and beta
+  inline void processSample(const float* input) noexcept
+  {
     // layer 1: Linear + ReLU
     for (int i = 0; i < v_d_hidden; ++i)
     {
-      tmp1[i] = in_proj[0][i] * v_in0 + in_proj[1][i] * v_in1 + in_bias[i];
-      tmp1[i] = xsimd::max(tmp1[i], v_type(T(0)));
+      tmp1[i] = in_proj[i] * v_type(static_cast<T>(input[0]));
+      for (int j = 1; j < c_in; ++j)
+        tmp1[i] += in_proj[j * v_d_hidden + i] * v_type(static_cast<T>(input[j]));
+      tmp1[i] = xsimd::max(tmp1[i] + in_bias[i], v_type(T(0)));
     }
 
     // layer 2: Linear
+    const int v_d_model_2 = 2 * v_d_model;
     for (int i = 0; i < v_d_model_2; ++i)
       tmp2[i] = out_bias[i];
 
     for (int i = 0; i < v_d_hidden; ++i)
     {
       tmp1[i].store_aligned(scalar_in);
+      const int n = std::min(v_size, d_hidden - i * v_size);
       for (int j = 0; j < v_d_model_2; ++j)
-        for (int k = 0; k < v_size_d_hidden; ++k)
-          tmp2[j] += scalar_in[k] * out_proj[i * v_size + k][j];
+        for (int k = 0; k < n; ++k)
+          tmp2[j] += scalar_in[k] * out_proj[(i * v_size + k) * v_d_model_2 + j];
     }
 
     // split into gamma and beta
     for (int i = 0; i < v_d_model; ++i)
     {
-      gamma[i] = tmp2[i];
-      beta[i] = tmp2[i + v_d_model];
+      tmp2[i].store_aligned(gamma.data() + i * v_size);
+      tmp2[i + v_d_model].store_aligned(beta.data() + i * v_size);
     }
   }
 
-  // output buffers
-  alignas(alignment) v_type gamma[v_d_model];
-  alignas(alignment) v_type beta[v_d_model];
+  // Two knob conditioning (drive, tone), requires getNumInputs() == 2
+  inline void processSample(const float& input1, const float& input2) noexcept
+  {
+    const float input[2] = {input1, input2};
+    processSample(input);
+  }
+
+  // Aligned, zero padded arrays of ceil(d_model / v_size) * v_size values, as expected by Model::processSample
+  const T* getGamma() const noexcept { return gamma.data(); }
+  const T* getBeta() const noexcept { return beta.data(); }
 
 private:
-  void loadWeightsFromFile()
+  void loadWeightsFromJson(const nlohmann::json& model_data)
   {
-    std::string json_string(reinterpret_cast<const char*>(model_weights_json), model_weights_json_len);
-    nlohmann::json model_data = nlohmann::json::parse(json_string);
-
-    auto W1 = model_data["layers"][0]["weights"][0];
-    auto B1 = model_data["layers"][0]["weights"][1];
-    auto W2 = model_data["layers"][1]["weights"][0];
-    auto B2 = model_data["layers"][1]["weights"][1];
+    const ModelConfig config = ModelConfig::fromJson(model_data);
+    c_in = config.c_in;
+    d_hidden = config.d_hidden;
+    d_model = config.d_model;
+    v_d_hidden = ceil_div(d_hidden, v_size);
+    v_d_model = ceil_div(d_model, v_size);
+    const int v_d_model_2 = 2 * v_d_model;
+
+    const v_type zero = v_type(T(0));
+    in_proj.assign(c_in * v_d_hidden, zero);
+    out_proj.assign(d_hidden * v_d_model_2, zero);
+    in_bias.assign(v_d_hidden, zero);
+    out_bias.assign(v_d_model_2, zero);
+    tmp1.assign(v_d_hidden, zero);
+    tmp2.assign(v_d_model_2, zero);
+    gamma.assign(v_d_model * v_size, T(0));
+    beta.assign(v_d_model * v_size, T(0));
+
+    const auto& layers = model_data.at("layers");
+    const auto& W1 = layers.at(0).at("weights").at(0);
+    const auto& B1 = layers.at(0).at("weights").at(1);
+    const auto& W2 = layers.at(1).at("weights").at(0);
+    const auto& B2 = layers.at(1).at("weights").at(1);
 
     // layer weights
     std::vector<T> flat1(d_hidden);
     for (int i = 0; i < c_in; ++i)
     {
       for (int j = 0; j < d_hidden; ++j)
-        flat1[j] = static_cast<T>(W1[j][i]);
-      set_values<T, alignment>(flat1, in_proj[i], d_hidden, v_d_hidden);
+        flat1[j] = static_cast<T>(W1.at(j).at(i));
+      set_values<T, alignment>(flat1, &in_proj[i * v_d_hidden], d_hidden, v_d_hidden);
     }
 
-    std::vector<T> flat2(d_model_2);
+    std::vector<T> flat2(d_model);
     for (int i = 0; i < d_hidden; ++i)
     {
-      for (int j = 0; j < d_model_2; ++j)
-        flat2[j] = static_cast<T>(W2[j][i]);
-      set_values<T, alignment>(flat2, out_proj[i], d_model_2, v_d_model_2);
+      for (int half = 0; half < 2; ++half)
+      {
+        for (int j = 0; j < d_model; ++j)
+          flat2[j] = static_cast<T>(W2.at(half * d_model + j).at(i));
+        set_values<T, alignment>(flat2, &out_proj[i * v_d_model_2 + half * v_d_model], d_model, v_d_model);
+      }
     }
 
     // biases
     std::vector<T> fb1(d_hidden);
     for (int i = 0; i < d_hidden; ++i)
-      fb1[i] = static_cast<T>(B1[i]);
-    set_values<T, alignment>(fb1, in_bias, d_hidden, v_d_hidden);
+      fb1[i] = static_cast<T>(B1.at(i));
+    set_values<T, alignment>(fb1, in_bias.data(), d_hidden, v_d_hidden);
 
-    std::vector<T> fb2(d_model_2);
-    for (int i = 0; i < d_model_2; ++i)
-      fb2[i] = static_cast<T>(B2[i]);
-    set_values<T, alignment>(fb2, out_bias, d_model_2, v_d_model_2);
+    for (int half = 0; half < 2; ++half)
+    {
+      for (int i = 0; i < d_model; ++i)
+        flat2[i] = static_cast<T>(B2.at(half * d_model + i));
+      set_values<T, alignment>(flat2, &out_bias[half * v_d_model], d_model, v_d_model);
+    }
   }
-};
\ No newline at end of file
+};
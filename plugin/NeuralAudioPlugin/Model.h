@@ -3,157 +3,203 @@
 // https://github.com/jatinchowdhury18/RTNeural
 #pragma once
 
+#include "ChunkedScan.h"
+#include "ComplexLayout.h"
+#include "ModelConfig.h"
+#include "StructuredProjection.h"
+#include "WeightArena.h"
+#include "WeightStorage.h"
 #include "common.h"
 #include "json.hpp"
-#include "model_weights.h"
 #include "xsimd/xsimd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-template <typename T, std::size_t Alignment = xsimd::default_arch::alignment()>
+// Layer dimensions known at compile time, the projection loops get fully unrolled
+template <int DModel, int DInner, int SsmSize>
+struct FixedDims
+{
+  static constexpr int d_model = DModel;
+  static constexpr int d_inner = DInner;
+  static constexpr int ssm_size = SsmSize;
+
+  FixedDims() = default;
+  explicit FixedDims(const ModelConfig& config)
+  {
+    if (!matches(config))
+      throw std::runtime_error("model dimensions do not match the precompiled engine");
+  }
+
+  static bool matches(const ModelConfig& config) noexcept
+  {
+    return config.d_model == d_model && config.d_inner() == d_inner && config.ssm_size() == ssm_size;
+  }
+};
+
+// Layer dimensions read from the weight file, generic fallback for any model size
+struct RuntimeDims
+{
+  int d_model = 0;
+  int d_inner = 0;
+  int ssm_size = 0;
+
+  RuntimeDims() = default;
+  explicit RuntimeDims(const ModelConfig& config)
+  : d_model(config.d_model)
+  , d_inner(config.d_inner())
+  , ssm_size(config.ssm_size())
+  {
+  }
+
+  static bool matches(const ModelConfig&) noexcept { return true; }
+};
+
+// Formats selects the storage of the large weight matrices (see WeightStorage.h), Layout the
+// storage of the complex S5 data (see ComplexLayout.h)
+template <typename T, std::size_t Alignment = xsimd::default_arch::alignment(), typename Dims = RuntimeDims, typename Formats = WeightFormats<Fp32Weights>,
+          typename Layout = DefaultComplexLayout<T>>
 class Model
 {
 private:
-  // Model parameters
-  // no bias and use conjugate symmetry
-  static constexpr int d_model = 16;
-  static constexpr int d_state = 64;
-  static constexpr int exp_f = 2;
-  static constexpr int d_inner = exp_f * d_model;
-  static constexpr int d_inner_2 = 2 * d_inner;
-  static constexpr int ssm_size = d_state / 2;
-  static constexpr int num_layers = 2;
-
   // SIMD types and alignment
   using v_type = xsimd::simd_type<T>;
-  static constexpr std::size_t alignment = Alignment;
+  static constexpr std::size_t alignment = Alignment > alignof(v_type) ? Alignment : alignof(v_type);
   static constexpr int v_size = static_cast<int>(v_type::size);
-  static constexpr int v_d_model = ceil_div(d_model, v_size);
-  static constexpr int v_d_inner = ceil_div(d_inner, v_size);
-  static constexpr int v_d_inner_2 = ceil_div(d_inner_2, v_size);
-  static constexpr int v_ssm_size = ceil_div(ssm_size, v_size);
+  using v_vector = aligned_vector<v_type, alignment>;
+  using proj_view = WeightView<T, typename Formats::proj, alignment>;
+  using ssm_view = WeightView<T, typename Formats::ssm, alignment>;
+  using structured_proj = StructuredProjection<T, typename Formats::proj, alignment>;
 
-  // buffers for intermediate results
-  alignas(alignment) v_type tmp[v_d_model];
-  alignas(alignment) v_type res1[v_d_model];
-  alignas(alignment) v_type res2[v_d_inner];
-  alignas(alignment) v_type mamba_proj[v_d_inner_2];
-  alignas(alignment) v_type u[v_d_inner];
-  alignas(alignment) v_type y[v_d_inner];
-  alignas(alignment) v_type Bu_real[v_ssm_size];
-  alignas(alignment) v_type Bu_imag[v_ssm_size];
-
-  alignas(alignment) v_type BL_real[v_ssm_size];
-  alignas(alignment) v_type BL_imag[v_ssm_size];
-
-  alignas(alignment) v_type v_input;
-  alignas(alignment) v_type v_tmp_RMS;
-  T output;
-  T sum_RMS;
-
-  // linear projection buffers
-  alignas(alignment) T scalar_in[v_size] = {T(0)};
-  alignas(alignment) T scalar_in2[v_size] = {T(0)};
-  static constexpr int v_size_d_model = std::min(v_size, d_model);
-  static constexpr int v_size_d_inner = std::min(v_size, d_inner);
-  static constexpr int v_size_ssm_size = std::min(v_size, ssm_size);
-
-  // Model weights
-  alignas(alignment) v_type in_proj[v_d_model];
-  alignas(alignment) v_type out_proj[v_d_model];
-
-  alignas(alignment) v_type in_proj_mamba[num_layers][d_model][v_d_inner_2]; // [layer][in][v_out]
-  alignas(alignment) v_type out_proj_mamba[num_layers][d_inner][v_d_model];
-
-  alignas(alignment) v_type A_real[num_layers][v_ssm_size];
-  alignas(alignment) v_type A_imag[num_layers][v_ssm_size];
-  alignas(alignment) v_type B_real[num_layers][d_inner][v_ssm_size];
-  alignas(alignment) v_type B_imag[num_layers][d_inner][v_ssm_size];
-  alignas(alignment) v_type C_real[num_layers][ssm_size][v_d_inner];
-  alignas(alignment) v_type C_imag[num_layers][ssm_size][v_d_inner];
-  alignas(alignment) v_type D[num_layers][v_d_inner];
-
-  alignas(alignment) v_type inv_dt[num_layers][v_ssm_size];
-  alignas(alignment) v_type dt[v_ssm_size];
-  alignas(alignment) v_type dA_real[num_layers][v_ssm_size];
-  alignas(alignment) v_type dA_imag[num_layers][v_ssm_size];
-  alignas(alignment) v_type dB_real[num_layers][d_inner][v_ssm_size];
-  alignas(alignment) v_type dB_imag[num_layers][d_inner][v_ssm_size];
-
-  alignas(alignment) v_type norm[num_layers][v_d_model];
-  T eps[num_layers];
-
-  // Hidden state
-  alignas(alignment) v_type hidden_real[num_layers][v_ssm_size];
-  alignas(alignment) v_type hidden_imag[num_layers][v_ssm_size];
+  // Samples per chunk of processBlockLayerMajor, the activations stay within L1
+  static constexpr int layer_major_chunk = 128;
 
-  // Plugin loading
-  std::string lastError;
+  // Model parameters
+  ModelConfig config;
+  Dims dims;
+  int num_layers = 0;
 
-public:
-  Model() noexcept
-  {
-    // Initialize all to zero
-    const v_type zero = v_type(T(0));
+  // Number of SIMD batches per vector. The in proj output is laid out as [u | res], each half
+  // padded to whole batches so that chunking works for any d_inner.
+  int v_d_model() const noexcept { return ceil_div(dims.d_model, v_size); }
+  int v_d_inner() const noexcept { return ceil_div(dims.d_inner, v_size); }
+  int v_d_inner_2() const noexcept { return 2 * v_d_inner(); }
+  int v_ssm_size() const noexcept { return ceil_div(dims.ssm_size, v_size); }
+  int v_state() const noexcept { return Layout::template batches<v_type>(dims.ssm_size); } // complex S5 vectors
 
-    // buffers
-    for (int i = 0; i < v_d_model; ++i)
-      tmp[i] = res1[i] = zero;
-    for (int i = 0; i < v_d_inner_2; ++i)
-      mamba_proj[i] = zero;
-    for (int i = 0; i < v_d_inner; ++i)
-      u[i] = res2[i] = y[i] = zero;
-    for (int i = 0; i < v_ssm_size; ++i)
-      Bu_real[i] = Bu_imag[i] = zero;
-    v_input = v_tmp_RMS = zero;
-    for (int i = 0; i < v_size; ++i)
-      scalar_in[i] = scalar_in2[i] = T(0);
-    output = sum_RMS = T(0);
-
-    // weights & parameters
-    for (int i = 0; i < v_d_model; ++i)
-      in_proj[i] = out_proj[i] = zero;
-    for (int L = 0; L < num_layers; ++L)
-    {
-      eps[L] = T(0);
-      for (int i = 0; i < d_model; ++i)
-        for (int j = 0; j < v_d_inner_2; ++j)
-          in_proj_mamba[L][i][j] = zero;
+  // Number of valid lanes in batch j of a vector of length n
+  static int lanes(int j, int n) noexcept { return std::min(v_size, n - j * v_size); }
 
-      for (int i = 0; i < d_inner; ++i)
-        for (int j = 0; j < v_d_model; ++j)
-          out_proj_mamba[L][i][j] = zero;
+  // processBlockLayerMajor scans the state across time (processLayerChunk) when it is narrower
+  // than a batch, most lanes of the mode-major step would be padding
+  bool time_scan() const noexcept { return dims.ssm_size < v_size; }
 
-      for (int i = 0; i < v_ssm_size; ++i)
-      {
-        A_real[L][i] = A_imag[L][i] = inv_dt[L][i] = zero;
-        hidden_real[L][i] = hidden_imag[L][i] = zero;
-        dA_real[L][i] = dA_imag[L][i] = zero;
-      }
+  // buffers for intermediate results
+  v_vector tmp;
+  v_vector chunk_activations; // [layer_major_chunk][v_d_model], processBlockLayerMajor
+
+  v_vector BL_real;
+  v_vector BL_imag;
+  v_vector dt;
+  std::vector<T> state_buf_a; // [v_state * v_size], discretize_bilinear and setState
+  std::vector<T> state_buf_b;
+
+  // processLayerChunk, only allocated with time_scan()
+  v_vector chunk_proj; // [layer_major_chunk][v_d_inner_2]
+  aligned_vector<T, alignment> scan_u; // [d_inner][layer_major_chunk]
+  aligned_vector<T, alignment> scan_y; // [d_inner][layer_major_chunk]
+
+  // Hot data of one layer, in the order processSample reads it: views into the weight arena, which
+  // processing only reads, and into the state arena for the hidden state and scratch. Every layer
+  // has its own scratch, so different layers can run on different threads (processLayers).
+  struct LayerData
+  {
+    v_type* normed;        // [v_d_model], state arena, scratch: the normalized input, then the out proj sums
+    v_type* mamba_proj;    // [v_d_inner_2], state arena, scratch: u then res, after silu
+    v_type* Bu;            // [v_state], state arena, scratch
+    v_type* y;             // [v_d_inner], state arena, scratch
+    v_type* hidden;        // [v_state], state arena
+    v_type* norm;          // [v_d_model]
+    v_type* in_proj_bias;  // [v_d_inner_2]
+    proj_view in_proj;     // [d_model][v_d_inner_2]
+    ssm_view dB;           // [d_inner][v_state]
+    v_type* dA_a;          // [v_state], Re(dA)
+    v_type* dA_b;          // [v_state], -Im(dA) at the real and Im(dA) at the imaginary positions
+    v_type* D;             // [v_d_inner]
+    ssm_view C;            // [v_state * v_size][v_d_inner]: Re(C) and -Im(C) rows, scaled by 2 with conj_sym
+    v_type* out_proj_bias; // [v_d_model]
+    proj_view out_proj;    // [d_inner][v_d_model]
+    T eps;
+  };
+
+  // Hot data: one allocation holding the weights of in_proj and in_bias, the layers, then out_proj,
+  // and a per instance one with the layers' state and scratch. Only the weights can be placed.
+  WeightArena<alignment> arena;
+  WeightArena<alignment> state_arena;
+  v_type* in_proj = nullptr;  // [v_d_model]
+  v_type* in_bias = nullptr;  // [v_d_model]
+  std::vector<LayerData> layers;
+  v_type* out_proj = nullptr; // [v_d_model]
+  T out_bias = T(0);
+  std::vector<structured_proj> in_proj_structured;  // [layer], low-rank or block-sparse if factored at export
+  std::vector<structured_proj> out_proj_structured; // [layer]
+
+  // S5 data of one layer per mode for processLayerChunk, set by discretize_bilinear
+  struct ScanLayer
+  {
+    aligned_vector<typename ChunkedScan<v_type>::Mode, alignment> modes; // [ssm_size]
+    std::vector<T> dB; // [ssm_size][re, im][d_inner]
+    std::vector<T> C;  // [ssm_size][re, im][d_inner], the rows of LayerData::C
+    std::vector<T> D;  // [d_inner]
+  };
+  std::vector<ScanLayer> scan_layers; // [layer], with time_scan()
+
+  // Cold data, only read by discretize_bilinear
+  v_vector A_real; // [layer][v_ssm_size]
+  v_vector A_imag;
+  // B stays float in every format: it is not read per sample and rounding it would round dB twice
+  WeightMatrix<T, Fp32Weights, alignment> B_real; // [layer][d_inner][v_ssm_size]
+  WeightMatrix<T, Fp32Weights, alignment> B_imag;
+  v_vector inv_dt; // [layer][v_ssm_size]
 
-      for (int i = 0; i < d_inner; ++i)
-        for (int j = 0; j < v_ssm_size; ++j)
-        {
-          B_real[L][i][j] = B_imag[L][i][j] = zero;
-          dB_real[L][i][j] = dB_imag[L][i][j] = zero;
-        }
+  // Plugin loading
+  std::string lastError;
 
-      for (int i = 0; i < ssm_size; ++i)
-        for (int j = 0; j < v_d_inner; ++j)
-          C_real[L][i][j] = C_imag[L][i][j] = zero;
+public:
+  Model() noexcept = default;
 
-      for (int i = 0; i < v_d_inner; ++i)
-        D[L][i] = zero;
-      for (int i = 0; i < v_d_model; ++i)
-        norm[L][i] = zero;
+  // The layer views point into the model's own arenas
+  Model(const Model&) = delete;
+  Model& operator=(const Model&) = delete;
+
+  // Load weights from a model_weights.json blob (as exported by model2json.py)
+  bool initFromJson(const char* data, std::size_t size) noexcept
+  {
+    try
+    {
+      loadWeightsFromJson(nlohmann::json::parse(data, data + size));
+      return true;
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+    catch (...)
+    {
+      lastError = "Unknown error loading weights";
+      return false;
     }
   }
 
-  bool initFromWeights() noexcept
+  // Load weights from an already parsed model_weights.json
+  bool initFromJson(const nlohmann::json& model_data) noexcept
   {
     try
     {
-      loadWeightsFromFile();
+      loadWeightsFromJson(model_data);
       return true;
     }
     catch (const std::exception& e)
@@ -170,232 +216,856 @@ public:
 
   inline void reset() noexcept
   {
-    const v_type zero = v_type(T(0));
+    for (auto& layer : layers)
+    {
+      std::fill(layer.hidden, layer.hidden + v_state(), v_type(T(0)));
+    }
+  }
+
+  const ModelConfig& getConfig() const noexcept { return config; }
+
+  // Number of scalars in a hidden state snapshot: [layer][real ssm_size, imag ssm_size]
+  int stateSize() const noexcept { return 2 * num_layers * dims.ssm_size; }
+
+  void getState(T* state) const noexcept
+  {
+    const int ssm_size = dims.ssm_size;
+    alignas(alignment) T lanes_buf[v_size];
+    auto scalar = [&](const v_type* x, int pos) {
+      x[pos / v_size].store_aligned(lanes_buf);
+      return lanes_buf[pos % v_size];
+    };
     for (int i = 0; i < num_layers; ++i)
-      for (int j = 0; j < v_ssm_size; ++j)
-        hidden_real[i][j] = hidden_imag[i][j] = zero;
+    {
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        state[2 * i * ssm_size + p] = scalar(layers[i].hidden, Layout::template re<v_type>(p, ssm_size));
+        state[(2 * i + 1) * ssm_size + p] = scalar(layers[i].hidden, Layout::template im<v_type>(p, ssm_size));
+      }
+    }
+  }
+
+  void setState(const T* state) noexcept
+  {
+    const int ssm_size = dims.ssm_size;
+    const int v_state = this->v_state();
+    for (int i = 0; i < num_layers; ++i)
+    {
+      // padding lanes stay zero
+      std::fill(state_buf_a.begin(), state_buf_a.end(), T(0));
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        state_buf_a[Layout::template re<v_type>(p, ssm_size)] = state[2 * i * ssm_size + p];
+        state_buf_a[Layout::template im<v_type>(p, ssm_size)] = state[(2 * i + 1) * ssm_size + p];
+      }
+      set_values<T, alignment>(state_buf_a, layers[i].hidden, v_state * v_size, v_state);
+    }
   }
 
   const std::string& getLastError() const noexcept { return lastError; }
 
-  // Process a single sample through the neural network
-  inline T processSample(const T& input, const v_type (&gamma)[v_d_model], const v_type (&beta)[v_d_model]) noexcept
+  // Bytes of the weight arena, for placeArena
+  std::size_t arenaBytes() const noexcept { return arena.bytes(); }
+
+  // Move the weights read per sample into caller provided memory (aligned to 64 bytes, at least
+  // arenaBytes()), e.g. huge pages. The memory has to outlive the model or the next initFromJson.
+  // The hidden state and scratch stay in the model's own allocation, so processing only reads the
+  // placed memory; discretize_bilinear rewrites its discretized part.
+  bool placeArena(void* memory, std::size_t bytes) noexcept
+  {
+    if (!arena.place(memory, bytes))
+      return false;
+    layoutArena();
+    return true;
+  }
+
+  // Run on the weights of source, loaded and discretized, without copying them: the weight views
+  // point into the arena of source, which has to outlive this model and stay unchanged. The hidden
+  // state, scratch and structured projections (which keep scratch) are this model's own. The
+  // parameters of discretize_bilinear are not shared, it does nothing here: share a model
+  // discretized at the new rate instead.
+  void shareWeights(const Model& source)
+  {
+    config = source.config;
+    dims = source.dims;
+    num_layers = source.num_layers;
+    allocateState();
+    in_proj_structured = source.in_proj_structured;
+    out_proj_structured = source.out_proj_structured;
+    arena.share(source.arena);
+    layoutArena();
+    for (int i = 0; i < num_layers; ++i)
+      layers[i].eps = source.layers[i].eps;
+    out_bias = source.out_bias;
+    scan_layers = source.scan_layers;
+
+    A_real.clear();
+    A_imag.clear();
+    B_real.assign(0);
+    B_imag.assign(0);
+    inv_dt.clear();
+  }
+
+  MemoryFootprint footprint() const noexcept
   {
-    v_input = xsimd::batch<T, xsimd::default_arch>(input);
-    output = T(0);
+    MemoryFootprint f;
+    f.hot_bytes = arena.bytes();
+    f.state_bytes = state_arena.bytes();
+    f.cold_bytes = (A_real.size() + A_imag.size() + inv_dt.size() + BL_real.size() + BL_imag.size() + dt.size()) * sizeof(v_type) + B_real.bytes() + B_imag.bytes();
+    f.touched_bytes = f.hot_bytes + f.state_bytes;
+    for (int i = 0; i < num_layers; ++i)
+      f.touched_bytes += in_proj_structured[i].bytes() + out_proj_structured[i].bytes();
+    return f;
+  }
 
-    // in proj
-    for (int i = 0; i < v_d_model; ++i)
+  // in proj of one sample into the activations x ([v_d_model])
+  inline void inputProjection(const T& input, v_type* x) noexcept
+  {
+    const v_type v_input(input);
+    for (int i = 0; i < v_d_model(); ++i)
     {
-      tmp[i] = in_proj[i] * v_input;
+      x[i] = in_proj[i] * v_input + in_bias[i];
     }
+  }
 
-    for (int i = 0; i < num_layers; ++i)
+  // x sigmoid(x)
+  static inline v_type silu(const v_type& x) noexcept { return x / (v_type(T(1)) + xsimd::exp(-x)); }
+
+  // Front of layer i for one sample: FiLM, RMS norm, then the in proj with silu into proj
+  // ([v_d_inner_2], u then res). x is left as it is, it is the layer's residual.
+  inline void layerInput(int i, const v_type* x, const T* gamma, const T* beta, v_type* proj) noexcept
+  {
+    const int d_model = dims.d_model;
+    const int v_d_model = this->v_d_model();
+    const int v_d_inner_2 = this->v_d_inner_2();
+
+    const LayerData& layer = layers[i];
+    const v_type* norm_i = layer.norm;
+    v_type* normed = layer.normed;
+
+    // FiLM conditioning
+    v_type v_tmp_RMS(T(0));
+    for (int j = 0; j < v_d_model; ++j)
     {
-      // Residual connection
-      for (int j = 0; j < v_d_model; ++j)
+      normed[j] = xsimd::load_aligned(gamma + j * v_size) * x[j] + xsimd::load_aligned(beta + j * v_size);
+      v_tmp_RMS += normed[j] * normed[j];
+    }
+
+    // RMS norm
+    const T sum_RMS = xsimd::reduce_add(v_tmp_RMS) / static_cast<T>(d_model); // padding lanes are zero
+    v_tmp_RMS = v_type(T(1) / std::sqrt(layer.eps + sum_RMS));
+
+    for (int j = 0; j < v_d_model; ++j)
+    {
+      normed[j] = norm_i[j] * normed[j] * v_tmp_RMS;
+    }
+
+    // Mamba in proj, silu
+    if (!in_proj_structured[i].isDense())
+    {
+      for (int j = 0; j < v_d_inner_2; ++j)
       {
-        res1[j] = tmp[j];
+        proj[j] = layer.in_proj_bias[j];
       }
-
-      // FiLM conditioning
-      for (int j = 0; j < v_d_model; ++j)
+      in_proj_structured[i].apply(normed, proj);
+      for (int j = 0; j < v_d_inner_2; ++j)
       {
-        tmp[j] = gamma[j] * tmp[j] + beta[j];
+        proj[j] = silu(proj[j]);
       }
+    }
+    else
+    {
+      // The bias and the first input start the sums, silu is applied with the last input
+      const T* in = reinterpret_cast<const T*>(normed);
+      const int last = d_model - 1;
+      if (last > 0)
+      {
+        for (int k = 0; k < v_d_inner_2; ++k)
+        {
+          proj[k] = layer.in_proj_bias[k] + in[0] * layer.in_proj.load(k);
+        }
+      }
+      for (int q = 1; q < last; ++q)
+      {
+        const v_type in_q(in[q]);
+        for (int k = 0; k < v_d_inner_2; ++k)
+        {
+          proj[k] += in_q * layer.in_proj.load(q * v_d_inner_2 + k);
+        }
+      }
+      const v_type* sum = last > 0 ? proj : layer.in_proj_bias;
+      for (int k = 0; k < v_d_inner_2; ++k)
+      {
+        proj[k] = silu(sum[k] + in[last] * layer.in_proj.load(last * v_d_inner_2 + k));
+      }
+    }
+  }
+
+  // Back of layer i for one sample: the out proj of the gated y ([v_d_inner]), added to the
+  // residual x
+  inline void layerOutput(int i, v_type* x, const v_type* y) noexcept
+  {
+    const int d_inner = dims.d_inner;
+    const int v_d_model = this->v_d_model();
 
-      // RMS norm
-      v_tmp_RMS = v_type(T(0));
+    const LayerData& layer = layers[i];
+    v_type* sum = layer.normed; // free after the in proj
+
+    // Mamba out proj, residual connection
+    if (!out_proj_structured[i].isDense())
+    {
       for (int j = 0; j < v_d_model; ++j)
       {
-        v_tmp_RMS += tmp[j] * tmp[j];
+        sum[j] = layer.out_proj_bias[j];
       }
-      sum_RMS = xsimd::reduce_add(v_tmp_RMS) / static_cast<T>(d_model); // expects d_model is a multiple of v_size
-      v_tmp_RMS = v_type(T(1) / std::sqrt(eps[i] + sum_RMS));
-
+      out_proj_structured[i].apply(y, sum);
       for (int j = 0; j < v_d_model; ++j)
       {
-        tmp[j] = norm[i][j] * tmp[j] * v_tmp_RMS;
+        x[j] += sum[j];
       }
-
-      // Mamba in proj
-      for (int j = 0; j < v_d_inner_2; ++j)
+    }
+    else
+    {
+      // The bias and the first input start the sums, the residual is added with the last input
+      const T* in = reinterpret_cast<const T*>(y);
+      const int last = d_inner - 1;
+      if (last > 0)
       {
-        mamba_proj[j] = v_type(T(0));
+        for (int k = 0; k < v_d_model; ++k)
+        {
+          sum[k] = layer.out_proj_bias[k] + in[0] * layer.out_proj.load(k);
+        }
       }
-
-      for (int j = 0; j < v_d_model; ++j)
+      for (int q = 1; q < last; ++q)
       {
-        tmp[j].store_aligned(scalar_in);
-        for (int k = 0; k < v_d_inner_2; ++k)
+        const v_type in_q(in[q]);
+        for (int k = 0; k < v_d_model; ++k)
         {
-          for (int l = 0; l < v_size_d_model; ++l)
-          {
-            mamba_proj[k] += scalar_in[l] * in_proj_mamba[i][j * v_size + l][k];
-          }
+          sum[k] += in_q * layer.out_proj.load(q * v_d_model + k);
         }
       }
-
-      // silu
-      for (int j = 0; j < v_d_inner_2; ++j)
+      const v_type* from = last > 0 ? sum : layer.out_proj_bias;
+      for (int k = 0; k < v_d_model; ++k)
       {
-        mamba_proj[j] = mamba_proj[j] / (v_type(T(1)) + xsimd::exp(-mamba_proj[j]));
+        x[k] += from[k] + in[last] * layer.out_proj.load(last * v_d_model + k);
       }
+    }
+  }
 
-      // chunk
-      for (int j = 0; j < v_d_inner; ++j)
+  // Layer i of one sample, updates the activations x in place and advances the layer's state
+  inline void processLayer(int i, v_type* x, const T* gamma, const T* beta) noexcept
+  {
+    const int d_inner = dims.d_inner;
+    const int v_d_inner = this->v_d_inner();
+    const int v_state = this->v_state();
+    const int half_state = v_state / 2;
+
+    const LayerData& layer = layers[i];
+    const v_type* D_i = layer.D;
+    v_type* h = layer.hidden;
+    const v_type* u = layer.mamba_proj;
+    const v_type* res = u + v_d_inner;
+    v_type* Bu = layer.Bu;
+    v_type* y = layer.y;
+
+    layerInput(i, x, gamma, beta, layer.mamba_proj);
+
+    /* ================ S5 ================ */
+    // h[n] = Ah[n - 1] + Bu[n]
+    // y[n] = real(Ch[n]) + Du[n]
+
+    // Bu[n], B as a real matrix over the layout's scalar positions, started by the first input.
+    // The two halves of the state are accumulated together for twice the independent FMAs per
+    // input scalar (and in y[n]).
+    const T* u_in = reinterpret_cast<const T*>(u);
+    for (int k = 0; k < v_state; ++k)
+    {
+      Bu[k] = u_in[0] * layer.dB.load(k);
+    }
+    for (int q = 1; q < d_inner; ++q)
+    {
+      const v_type u_q(u_in[q]);
+      for (int k = 0; k < half_state; ++k)
+      {
+        Bu[k] += u_q * layer.dB.load(q * v_state + k);
+        Bu[k + half_state] += u_q * layer.dB.load(q * v_state + k + half_state);
+      }
+      if (v_state % 2 != 0)
       {
-        u[j] = mamba_proj[j];
-        res2[j] = mamba_proj[j + v_d_inner];
+        Bu[v_state - 1] += u_q * layer.dB.load(q * v_state + v_state - 1);
       }
+    }
 
-      /* ================ S5 ================ */
-      // h[n] = Ah[n - 1] + Bu[n]
-      // y[n] = real(Ch[n]) + Du[n]
+    // h[n]
+    Layout::step(h, layer.dA_a, layer.dA_b, Bu, v_state);
 
-      // Bu[n]
-      for (int j = 0; j < v_ssm_size; ++j)
+    // y[n], gated by res with the last row of C. C holds the conj_sym factor, zero rows at
+    // padding positions.
+    const T* h_in = reinterpret_cast<const T*>(h);
+    const int pairs = half_state * v_size;          // rows of the two halves, read together
+    const int odd = 2 * pairs;                      // first row of the odd batch
+    const int tail = v_state % 2 != 0 ? v_size : 0; // rows of the odd batch
+    for (int k = 0; k < v_d_inner; ++k)
+    {
+      y[k] = D_i[k] * u[k];
+    }
+
+    for (int p = 0; p < (tail != 0 ? pairs : pairs - 1); ++p)
+    {
+      const v_type h_p(h_in[p]), h_pairs_p(h_in[p + pairs]);
+      for (int k = 0; k < v_d_inner; ++k)
       {
-        Bu_real[j] = v_type(T(0));
-        Bu_imag[j] = v_type(T(0));
+        y[k] += h_p * layer.C.load(p * v_d_inner + k) + h_pairs_p * layer.C.load((p + pairs) * v_d_inner + k);
       }
-
-      for (int j = 0; j < v_d_inner; ++j)
+    }
+    for (int p = odd; p < odd + tail - 1; ++p)
+    {
+      const v_type h_p(h_in[p]);
+      for (int k = 0; k < v_d_inner; ++k)
       {
-        u[j].store_aligned(scalar_in);
-        for (int k = 0; k < v_ssm_size; ++k)
-        {
-          for (int l = 0; l < v_size_d_inner; ++l)
-          {
-            Bu_real[k] += scalar_in[l] * dB_real[i][j * v_size + l][k];
-            Bu_imag[k] += scalar_in[l] * dB_imag[i][j * v_size + l][k];
-          }
-        }
+        y[k] += h_p * layer.C.load(p * v_d_inner + k);
       }
+    }
+    for (int k = 0; k < v_d_inner; ++k)
+    {
+      const v_type last = tail != 0 ? h_in[odd + tail - 1] * layer.C.load((odd + tail - 1) * v_d_inner + k)
+                                    : h_in[pairs - 1] * layer.C.load((pairs - 1) * v_d_inner + k) + h_in[odd - 1] * layer.C.load((odd - 1) * v_d_inner + k);
+      y[k] = (y[k] + last) * res[k];
+    }
+    /* ==================================== */
 
-      // h[n]
-      for (int j = 0; j < v_ssm_size; ++j)
+    layerOutput(i, x, y);
+  }
+
+  // Layer i over a chunk of n <= layer_major_chunk samples (x: [n][v_d_model]) with the S5 block
+  // vectorized across time, for states narrower than a batch (time_scan()). The in proj runs per
+  // sample as in processLayer, then every mode is scanned over the chunk a batch of samples at a
+  // time (ChunkedScan.h), with the state of the last sample carried to the next batch.
+  inline void processLayerChunk(int i, v_type* x, int n, const T* gamma, const T* beta) noexcept
+  {
+    using Scan = ChunkedScan<v_type>;
+    const int d_inner = dims.d_inner;
+    const int ssm_size = dims.ssm_size;
+    const int v_d_model = this->v_d_model();
+    const int v_d_inner = this->v_d_inner();
+    const int v_d_inner_2 = this->v_d_inner_2();
+    const int v_n = ceil_div(n, v_size);
+    constexpr int stride = layer_major_chunk; // per channel in scan_u and scan_y
+
+    const LayerData& layer = layers[i];
+    const ScanLayer& scan = scan_layers[i];
+    T* h = reinterpret_cast<T*>(layer.hidden);
+    alignas(alignment) T scalar_in[v_size];
+
+    for (int s = 0; s < n; ++s)
+    {
+      layerInput(i, x + s * v_d_model, gamma, beta, chunk_proj.data() + s * v_d_inner_2);
+    }
+
+    // u[n] to time-major [d_inner][samples], the lanes past the chunk zeroed
+    for (int s = 0; s < n; ++s)
+    {
+      const T* u_s = reinterpret_cast<const T*>(chunk_proj.data() + s * v_d_inner_2);
+      for (int c = 0; c < d_inner; ++c)
       {
-        auto tmp1 = hidden_real[i][j];
-        auto tmp2 = hidden_imag[i][j];
-        hidden_real[i][j] = tmp1 * dA_real[i][j] - tmp2 * dA_imag[i][j] + Bu_real[j];
-        hidden_imag[i][j] = tmp1 * dA_imag[i][j] + tmp2 * dA_real[i][j] + Bu_imag[j];
+        scan_u[c * stride + s] = u_s[c];
       }
+    }
+    for (int c = 0; c < d_inner; ++c)
+    {
+      std::fill(scan_u.begin() + c * stride + n, scan_u.begin() + c * stride + v_n * v_size, T(0));
+    }
 
-      // y[n]
-      for (int j = 0; j < v_d_inner; ++j)
+    // y[n] = Du[n] + sum over the modes of real(Ch[n])
+    for (int c = 0; c < d_inner; ++c)
+    {
+      const v_type D_c(scan.D[c]);
+      for (int t = 0; t < v_n; ++t)
       {
-        y[j] = D[i][j] * u[j];
+        (D_c * v_type::load_aligned(&scan_u[c * stride + t * v_size])).store_aligned(&scan_y[c * stride + t * v_size]);
       }
+    }
 
-      for (int j = 0; j < v_ssm_size; ++j)
+    for (int p = 0; p < ssm_size; ++p)
+    {
+      const typename Scan::Mode& mode = scan.modes[p];
+      const T* dB_re = &scan.dB[2 * p * d_inner];
+      const T* dB_im = dB_re + d_inner;
+      const T* C_re = &scan.C[2 * p * d_inner];
+      const T* C_im = C_re + d_inner;
+      const int re = Layout::template re<v_type>(p, ssm_size);
+      const int im = Layout::template im<v_type>(p, ssm_size);
+      T h_re = h[re];
+      T h_im = h[im];
+      for (int t = 0; t < v_n; ++t)
       {
-        hidden_real[i][j].store_aligned(scalar_in);
-        hidden_imag[i][j].store_aligned(scalar_in2);
-        for (int k = 0; k < v_d_inner; ++k)
+        // Bu[n] of the batch
+        v_type x_re(T(0)), x_im(T(0));
+        for (int c = 0; c < d_inner; ++c)
         {
-          for (int l = 0; l < v_size_ssm_size; ++l)
-          {
-            y[k] += v_type(T(2)) * (scalar_in[l] * C_real[i][j * v_size + l][k] - scalar_in2[l] * C_imag[i][j * v_size + l][k]); // use conj_sym
-          }
+          const v_type u_c = v_type::load_aligned(&scan_u[c * stride + t * v_size]);
+          x_re += dB_re[c] * u_c;
+          x_im += dB_im[c] * u_c;
+        }
+
+        // h[n]
+        Scan::scan(x_re, x_im, mode, h_re, h_im);
+        const int last = t == v_n - 1 ? (n - 1) % v_size : v_size - 1;
+        x_re.store_aligned(scalar_in);
+        h_re = scalar_in[last];
+        x_im.store_aligned(scalar_in);
+        h_im = scalar_in[last];
+
+        // y[n], C holds the conj_sym factor
+        for (int c = 0; c < d_inner; ++c)
+        {
+          T* y_c = &scan_y[c * stride + t * v_size];
+          (v_type::load_aligned(y_c) + x_re * C_re[c] + x_im * C_im[c]).store_aligned(y_c);
         }
       }
-      /* ==================================== */
+      h[re] = h_re;
+      h[im] = h_im;
+    }
 
-      // Residual connection
-      for (int j = 0; j < v_d_inner; ++j)
+    // y[n] back to sample-major and gated by res, the padding lanes zeroed
+    for (int s = 0; s < n; ++s)
+    {
+      T* y_s = reinterpret_cast<T*>(layer.y);
+      const T* res_s = reinterpret_cast<const T*>(chunk_proj.data() + s * v_d_inner_2 + v_d_inner);
+      for (int c = 0; c < d_inner; ++c)
       {
-        y[j] *= res2[j];
+        y_s[c] = scan_y[c * stride + s] * res_s[c];
       }
+      std::fill(y_s + d_inner, y_s + v_d_inner * v_size, T(0));
+      layerOutput(i, x + s * v_d_model, layer.y);
+    }
+  }
 
-      // mamba out proj
-      for (int j = 0; j < v_d_model; ++j)
+  // out proj of the activations of one sample
+  inline T outputProjection(const v_type* x) noexcept
+  {
+    T output = out_bias;
+    for (int i = 0; i < v_d_model(); ++i)
+    {
+      output += xsimd::reduce_add(x[i] * out_proj[i]);
+    }
+    return output;
+  }
+
+  // Process a single sample through the neural network.
+  // gamma and beta are aligned, zero padded arrays of ceil(d_model / v_size) * v_size values (see FiLM).
+  inline T processSample(const T& input, const T* gamma, const T* beta) noexcept
+  {
+    inputProjection(input, tmp.data());
+    for (int i = 0; i < num_layers; ++i)
+    {
+      processLayer(i, tmp.data(), gamma, beta);
+    }
+    return outputProjection(tmp.data());
+  }
+
+  // Process a block of samples with constant conditioning, input and output may alias
+  inline void processBlock(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept
+  {
+    for (int s = 0; s < numSamples; ++s)
+      output[s] = processSample(input[s], gamma, beta);
+  }
+
+  // Same result as processBlock, computed layer by layer over chunks of layer_major_chunk samples:
+  // one layer's weights stay in cache for the whole chunk instead of alternating with the other
+  // layers every sample. For throughput (offline rendering), input and output may alias. States
+  // narrower than a batch are scanned across time (processLayerChunk), equal to processBlock up to
+  // rounding.
+  inline void processBlockLayerMajor(const T* input, T* output, int numSamples, const T* gamma, const T* beta) noexcept
+  {
+    const int v_d_model = this->v_d_model();
+    const bool time_scan = this->time_scan();
+    for (int start = 0; start < numSamples; start += layer_major_chunk)
+    {
+      const int n = std::min(layer_major_chunk, numSamples - start);
+      for (int s = 0; s < n; ++s)
       {
-        tmp[j] = v_type(T(0));
+        inputProjection(input[start + s], chunk_activations.data() + s * v_d_model);
       }
-
-      for (int j = 0; j < v_d_inner; ++j)
+      for (int i = 0; i < num_layers; ++i)
       {
-        y[j].store_aligned(scalar_in);
-        for (int k = 0; k < v_d_model; ++k)
+        if (time_scan)
         {
-          for (int l = 0; l < v_size_d_inner; ++l)
-          {
-            tmp[k] += scalar_in[l] * out_proj_mamba[i][j * v_size + l][k];
-          }
+          processLayerChunk(i, chunk_activations.data(), n, gamma, beta);
+          continue;
+        }
+        for (int s = 0; s < n; ++s)
+        {
+          processLayer(i, chunk_activations.data() + s * v_d_model, gamma, beta);
         }
       }
-
-      // Residual connection
-      for (int j = 0; j < v_d_model; ++j)
+      for (int s = 0; s < n; ++s)
       {
-        tmp[j] += res1[j];
+        output[start + s] = outputProjection(chunk_activations.data() + s * v_d_model);
       }
     }
+  }
+
+  // The model in stages over a block, for running groups of layers on different threads (see
+  // Pipeline.h). activations holds numSamples * activationSize() values, aligned like the model;
+  // processLayers runs layers [first, last) layer by layer over the block. Calls on disjoint layer
+  // ranges may run concurrently, every layer has its own state and scratch.
+  int activationSize() const noexcept { return v_d_model() * v_size; }
 
-    // out proj
-    for (int i = 0; i < v_d_model; ++i)
+  inline void projectInput(const T* input, T* activations, int numSamples) noexcept
+  {
+    v_type* x = reinterpret_cast<v_type*>(activations);
+    for (int s = 0; s < numSamples; ++s)
     {
-      output += xsimd::reduce_add(tmp[i] * out_proj[i]);
+      inputProjection(input[s], x + s * v_d_model());
     }
+  }
 
-    return output;
+  inline void processLayers(T* activations, int numSamples, int first, int last, const T* gamma, const T* beta) noexcept
+  {
+    v_type* x = reinterpret_cast<v_type*>(activations);
+    for (int i = first; i < last; ++i)
+    {
+      for (int s = 0; s < numSamples; ++s)
+      {
+        processLayer(i, x + s * v_d_model(), gamma, beta);
+      }
+    }
+  }
+
+  inline void projectOutput(const T* activations, T* output, int numSamples) noexcept
+  {
+    const v_type* x = reinterpret_cast<const v_type*>(activations);
+    for (int s = 0; s < numSamples; ++s)
+    {
+      output[s] = outputProjection(x + s * v_d_model());
+    }
   }
 
   void discretize_bilinear(const T& sr) noexcept
   {
-    // Discretize the continuous-time A and B variables for all layers
+    if (A_real.empty()) // sharing the weights of another model (shareWeights)
+      return;
+    const int d_inner = dims.d_inner;
+    const int ssm_size = dims.ssm_size;
+    const int v_ssm_size = this->v_ssm_size();
+    const int v_state = this->v_state();
+    alignas(alignment) T re_buf[v_size];
+    alignas(alignment) T im_buf[v_size];
+
+    // Discretize the continuous-time A and B variables for all layers, in batches of modes, and
+    // scatter the results to the positions of the complex layout
     for (int i = 0; i < num_layers; ++i)
     {
+      LayerData& layer = layers[i];
+      const int l = i * v_ssm_size;
       for (int j = 0; j < v_ssm_size; ++j)
       {
-        dt[j] = v_type(T(48000)) / v_type(T(sr)) * xsimd::log(v_type(T(1)) + xsimd::exp(inv_dt[i][j]));
+        dt[j] = v_type(T(48000)) / v_type(T(sr)) * xsimd::log(v_type(T(1)) + xsimd::exp(inv_dt[l + j]));
       }
 
       // dA
+      std::fill(state_buf_a.begin(), state_buf_a.end(), T(0));
+      std::fill(state_buf_b.begin(), state_buf_b.end(), T(0));
       for (int j = 0; j < v_ssm_size; ++j)
       {
         auto dt_div_2 = dt[j] / v_type(T(2));
-        auto denom_c = v_type(T(1)) - dt_div_2 * A_real[i][j];
-        auto denom_d = -dt_div_2 * A_imag[i][j];
+        auto denom_c = v_type(T(1)) - dt_div_2 * A_real[l + j];
+        auto denom_d = -dt_div_2 * A_imag[l + j];
         auto denom = denom_c * denom_c + denom_d * denom_d;
 
         BL_real[j] = denom_c / denom;
         BL_imag[j] = -denom_d / denom;
 
-        auto tmp1 = v_type(T(1)) + dt_div_2 * A_real[i][j];
-        auto tmp2 = dt_div_2 * A_imag[i][j];
-        dA_real[i][j] = BL_real[j] * tmp1 - BL_imag[j] * tmp2;
-        dA_imag[i][j] = BL_real[j] * tmp2 + BL_imag[j] * tmp1;
+        auto tmp1 = v_type(T(1)) + dt_div_2 * A_real[l + j];
+        auto tmp2 = dt_div_2 * A_imag[l + j];
+        (BL_real[j] * tmp1 - BL_imag[j] * tmp2).store_aligned(re_buf);
+        (BL_real[j] * tmp2 + BL_imag[j] * tmp1).store_aligned(im_buf);
+        for (int m = 0; m < lanes(j, ssm_size); ++m)
+        {
+          const int p = j * v_size + m;
+          const int re = Layout::template re<v_type>(p, ssm_size);
+          const int im = Layout::template im<v_type>(p, ssm_size);
+          state_buf_a[re] = state_buf_a[im] = re_buf[m];
+          state_buf_b[re] = -im_buf[m];
+          state_buf_b[im] = im_buf[m];
+        }
       }
+      set_values<T, alignment>(state_buf_a, layer.dA_a, v_state * v_size, v_state);
+      set_values<T, alignment>(state_buf_b, layer.dA_b, v_state * v_size, v_state);
 
       // dB
-      for (int j = 0; j < v_ssm_size; ++j)
+      for (int k = 0; k < d_inner; ++k)
       {
-        for (int k = 0; k < d_inner; ++k)
+        std::fill(state_buf_a.begin(), state_buf_a.end(), T(0));
+        for (int j = 0; j < v_ssm_size; ++j)
         {
-          dB_real[i][k][j] = BL_real[j] * dt[j] * B_real[i][k][j] - BL_imag[j] * dt[j] * B_imag[i][k][j];
-          dB_imag[i][k][j] = BL_real[j] * dt[j] * B_imag[i][k][j] + BL_imag[j] * dt[j] * B_real[i][k][j];
+          const int idx = (i * d_inner + k) * v_ssm_size + j;
+          const v_type B_re = B_real.load(idx);
+          const v_type B_im = B_imag.load(idx);
+          (BL_real[j] * dt[j] * B_re - BL_imag[j] * dt[j] * B_im).store_aligned(re_buf);
+          (BL_real[j] * dt[j] * B_im + BL_imag[j] * dt[j] * B_re).store_aligned(im_buf);
+          for (int m = 0; m < lanes(j, ssm_size); ++m)
+          {
+            const int p = j * v_size + m;
+            state_buf_a[Layout::template re<v_type>(p, ssm_size)] = re_buf[m];
+            state_buf_a[Layout::template im<v_type>(p, ssm_size)] = im_buf[m];
+          }
         }
+        layer.dB.set(state_buf_a, k * v_state, v_state * v_size, v_state);
+      }
+
+      if (time_scan())
+      {
+        prepareScan(i);
       }
     }
   }
 
 private:
-  // Load weights from the embedded model_weights.h file
-  void loadWeightsFromFile()
+  // Per mode data of layer i for processLayerChunk, from the layer's discretized (and stored) S5 data
+  void prepareScan(int i)
+  {
+    using Scan = ChunkedScan<v_type>;
+    const int d_inner = dims.d_inner;
+    const int ssm_size = dims.ssm_size;
+    const int v_d_inner = this->v_d_inner();
+    const int v_state = this->v_state();
+    const LayerData& layer = layers[i];
+    ScanLayer& scan = scan_layers[i];
+    alignas(alignment) T lanes_buf[v_size];
+    auto scalar = [&](v_type x, int lane) {
+      x.store_aligned(lanes_buf);
+      return lanes_buf[lane];
+    };
+
+    scan.modes.resize(ssm_size);
+    scan.dB.assign(2 * ssm_size * d_inner, T(0));
+    scan.C.assign(2 * ssm_size * d_inner, T(0));
+    scan.D.assign(d_inner, T(0));
+    for (int p = 0; p < ssm_size; ++p)
+    {
+      const int re = Layout::template re<v_type>(p, ssm_size);
+      const int im = Layout::template im<v_type>(p, ssm_size);
+      const T a_re = scalar(layer.dA_a[re / v_size], re % v_size);
+      const T a_im = scalar(layer.dA_b[im / v_size], im % v_size);
+      scan.modes[p] = Scan::coefficients(std::complex<double>(a_re, a_im));
+      for (int c = 0; c < d_inner; ++c)
+      {
+        scan.dB[2 * p * d_inner + c] = scalar(layer.dB.load(c * v_state + re / v_size), re % v_size);
+        scan.dB[(2 * p + 1) * d_inner + c] = scalar(layer.dB.load(c * v_state + im / v_size), im % v_size);
+        scan.C[2 * p * d_inner + c] = scalar(layer.C.load(re * v_d_inner + c / v_size), c % v_size);
+        scan.C[(2 * p + 1) * d_inner + c] = scalar(layer.C.load(im * v_d_inner + c / v_size), c % v_size);
+      }
+    }
+    for (int c = 0; c < d_inner; ++c)
+    {
+      scan.D[c] = scalar(layer.D[c / v_size], c % v_size);
+    }
+  }
+
+  // Buffers, hidden state and scratch of this instance
+  void allocateState()
+  {
+    const v_type zero = v_type(T(0));
+    const int d_inner = dims.d_inner;
+    const int L = num_layers;
+
+    // buffers
+    tmp.assign(v_d_model(), zero);
+    chunk_activations.assign(layer_major_chunk * v_d_model(), zero);
+    BL_real.assign(v_ssm_size(), zero);
+    BL_imag.assign(v_ssm_size(), zero);
+    dt.assign(v_ssm_size(), zero);
+    state_buf_a.assign(v_state() * v_size, T(0));
+    state_buf_b.assign(v_state() * v_size, T(0));
+    const int scan_chunk = time_scan() ? layer_major_chunk : 0;
+    chunk_proj.assign(scan_chunk * v_d_inner_2(), zero);
+    scan_u.assign(scan_chunk * d_inner, T(0));
+    scan_y.assign(scan_chunk * d_inner, T(0));
+    scan_layers.assign(time_scan() ? L : 0, ScanLayer());
+
+    // state and scratch, zeroed by the arena
+    layers.assign(L, LayerData());
+    layoutState();
+    state_arena.allocate();
+    layoutState();
+  }
+
+  void allocate()
+  {
+    const v_type zero = v_type(T(0));
+    const int d_inner = dims.d_inner;
+    const int L = num_layers;
+
+    allocateState();
+
+    // weights, zeroed by the arena
+    layoutArena();
+    arena.allocate();
+    layoutArena();
+    out_bias = T(0);
+
+    // cold data
+    A_real.assign(L * v_ssm_size(), zero);
+    A_imag.assign(L * v_ssm_size(), zero);
+    B_real.assign(L * d_inner * v_ssm_size());
+    B_imag.assign(L * d_inner * v_ssm_size());
+    inv_dt.assign(L * v_ssm_size(), zero);
+  }
+
+  // Point the weight views into the arena, in the order processSample reads them. A structured
+  // projection runs on its own weights, its dense view gets no space.
+  void layoutArena() noexcept
+  {
+    using proj_type = typename proj_view::stored_type;
+    using ssm_type = typename ssm_view::stored_type;
+    const int d_model = dims.d_model;
+    const int d_inner = dims.d_inner;
+
+    arena.rewind();
+    in_proj = arena.template take<v_type>(v_d_model());
+    in_bias = arena.template take<v_type>(v_d_model());
+    for (int i = 0; i < num_layers; ++i)
+    {
+      LayerData& layer = layers[i];
+      layer.norm = arena.template take<v_type>(v_d_model());
+      layer.in_proj_bias = arena.template take<v_type>(v_d_inner_2());
+      layer.in_proj = proj_view(arena.template take<proj_type>(in_proj_structured[i].isDense() ? proj_view::elements(d_model * v_d_inner_2()) : 0));
+      layer.dB = ssm_view(arena.template take<ssm_type>(ssm_view::elements(d_inner * v_state())));
+      layer.dA_a = arena.template take<v_type>(v_state());
+      layer.dA_b = arena.template take<v_type>(v_state());
+      layer.D = arena.template take<v_type>(v_d_inner());
+      layer.C = ssm_view(arena.template take<ssm_type>(ssm_view::elements(v_state() * v_size * v_d_inner())));
+      layer.out_proj_bias = arena.template take<v_type>(v_d_model());
+      layer.out_proj = proj_view(arena.template take<proj_type>(out_proj_structured[i].isDense() ? proj_view::elements(d_inner * v_d_model()) : 0));
+    }
+    out_proj = arena.template take<v_type>(v_d_model());
+  }
+
+  // Point the state and scratch views into the state arena, layer by layer
+  void layoutState() noexcept
+  {
+    state_arena.rewind();
+    for (auto& layer : layers)
+    {
+      layer.normed = state_arena.template take<v_type>(v_d_model());
+      layer.mamba_proj = state_arena.template take<v_type>(v_d_inner_2());
+      layer.Bu = state_arena.template take<v_type>(v_state());
+      layer.y = state_arena.template take<v_type>(v_d_inner());
+      layer.hidden = state_arena.template take<v_type>(v_state());
+    }
+  }
+
+  // Low-rank factors {"U": [n_out][rank], "V": [rank][n_in]} of a projection with weights U V.
+  // The outputs are split into halves of half_size rows, each padded to v_half batches.
+  void loadLowRank(const nlohmann::json& factors, structured_proj& proj, int n_in, int n_out, int half_size, int v_half)
+  {
+    const auto& U = factors.at("U");
+    const auto& V = factors.at("V");
+    const int rank = static_cast<int>(V.size());
+    if (rank == 0 || static_cast<int>(U.size()) != n_out || static_cast<int>(V.at(0).size()) != n_in)
+      throw std::runtime_error("low-rank factors do not match the projection size");
+
+    const int v_out = (n_out / half_size) * v_half;
+    std::vector<T> vt(n_in * rank);
+    std::vector<T> ut(rank * v_out * v_size, T(0));
+    for (int k = 0; k < rank; ++k)
+    {
+      for (int j = 0; j < n_in; ++j)
+        vt[j * rank + k] = static_cast<T>(V[k][j]);
+      for (int o = 0; o < n_out; ++o)
+        ut[k * v_out * v_size + (o / half_size) * v_half * v_size + o % half_size] = static_cast<T>(U[o][k]);
+    }
+    proj.setLowRank(vt, ut, n_in, rank, v_out);
+  }
+
+  // in proj weights ([2 * d_inner][d_model]) into dst, the rows split into the u and res halves,
+  // each padded to whole batches
+  void setInProj(const nlohmann::json& weights, proj_view dst) const
+  {
+    const int d_inner = dims.d_inner;
+    std::vector<T> flat(d_inner);
+    for (int j = 0; j < dims.d_model; ++j)
+    {
+      for (int half = 0; half < 2; ++half)
+      {
+        for (int k = 0; k < d_inner; ++k)
+        {
+          flat[k] = static_cast<T>(weights[half * d_inner + k][j]);
+        }
+        dst.set(flat, j * v_d_inner_2() + half * v_d_inner(), d_inner, v_d_inner());
+      }
+    }
+  }
+
+  // out proj weights ([d_model][d_inner]) into dst
+  void setOutProj(const nlohmann::json& weights, proj_view dst) const
+  {
+    const int d_model = dims.d_model;
+    std::vector<T> flat(d_model);
+    for (int j = 0; j < dims.d_inner; ++j)
+    {
+      for (int k = 0; k < d_model; ++k)
+      {
+        flat[k] = static_cast<T>(weights[k][j]);
+      }
+      dst.set(flat, j * v_d_model(), d_model, v_d_model());
+    }
+  }
+
+  // The kernel of a Mamba projection {"weights", "low_rank", "block"} from factor_projections.py:
+  // its factors, or the weight batches pruned to zero if it was pruned in blocks of a multiple of
+  // v_size outputs (a pattern pruned for narrower batches leaves few whole batches zero).
+  template <typename SetDense>
+  void loadStructured(const nlohmann::json& proj_data, structured_proj& proj, int n_in, int n_out, int half_size, int v_half, SetDense setDense)
   {
-    // Read the embedded JSON data from model_weights.h
-    // model_weights_json is declared as: unsigned char model_weights_json[]
-    // model_weights_json_len is declared as: unsigned int model_weights_json_len
+    if (proj_data.contains("low_rank"))
+      loadLowRank(proj_data.at("low_rank"), proj, n_in, n_out, half_size, v_half);
+    if (!proj.isDense() || proj_data.value("block", v_size) % v_size != 0)
+      return;
+
+    const int v_out = (n_out / half_size) * v_half;
+    WeightMatrix<T, typename Formats::proj, alignment> dense;
+    dense.assign(n_in * v_out);
+    setDense(proj_data.at("weights"), dense.view());
+    proj.detectBlockSparse(dense.view(), n_in, v_out);
+  }
+
+  // Load weights from the parsed model_weights.json
+  void loadWeightsFromJson(const nlohmann::json& model_data)
+  {
+    config = ModelConfig::fromJson(model_data);
+    dims = Dims(config);
+    num_layers = config.num_layers;
+
+    // factors or pruned blocks from factor_projections.py, picked before the arena is laid out
+    in_proj_structured.assign(num_layers, structured_proj());
+    out_proj_structured.assign(num_layers, structured_proj());
+    for (int i = 0; i < num_layers; ++i)
+    {
+      const auto& mamba = model_data.at("layers").at(i + 3).at("parameters").at("mamba");
+      loadStructured(mamba.at("in_proj"), in_proj_structured[i], dims.d_model, 2 * dims.d_inner, dims.d_inner, v_d_inner(),
+                     [this](const nlohmann::json& w, proj_view dst) { setInProj(w, dst); });
+      loadStructured(mamba.at("out_proj"), out_proj_structured[i], dims.d_inner, dims.d_model, dims.d_model, v_d_model(),
+                     [this](const nlohmann::json& w, proj_view dst) { setOutProj(w, dst); });
+    }
+    allocate();
 
-    // Create string from the embedded binary data
-    std::string json_string(reinterpret_cast<const char*>(model_weights_json), model_weights_json_len);
-    nlohmann::json model_data = nlohmann::json::parse(json_string);
+    const int d_model = dims.d_model;
+    const int d_inner = dims.d_inner;
+    const int ssm_size = dims.ssm_size;
+    const int v_d_model = this->v_d_model();
+    const int v_d_inner = this->v_d_inner();
+    const int v_ssm_size = this->v_ssm_size();
+    const T c_scale = config.conj_sym ? T(2) : T(1);
+    const auto& layers = model_data.at("layers");
 
     // FilM weights at layers 0 and 1
-    auto in_proj_weights = model_data["layers"][2]["weights"][0];
-    auto out_proj_weights = model_data["layers"][num_layers + 3]["weights"][0];
+    const auto& in_proj_layer = layers.at(2).at("weights");
+    const auto& out_proj_layer = layers.at(num_layers + 3).at("weights");
+    const auto& in_proj_weights = in_proj_layer.at(0);
+    const auto& out_proj_weights = out_proj_layer.at(0);
 
     std::vector<T> in_proj_flat_weights(d_model);
     std::vector<T> out_proj_flat_weights(d_model);
@@ -407,39 +1077,53 @@ private:
     set_values<T, alignment>(in_proj_flat_weights, in_proj, d_model, v_d_model);
     set_values<T, alignment>(out_proj_flat_weights, out_proj, d_model, v_d_model);
 
+    if (config.bias)
+    {
+      std::vector<T> in_bias_flat(d_model);
+      for (int i = 0; i < d_model; ++i)
+        in_bias_flat[i] = static_cast<T>(in_proj_layer.at(1)[i]);
+      set_values<T, alignment>(in_bias_flat, in_bias, d_model, v_d_model);
+      out_bias = static_cast<T>(out_proj_layer.at(1)[0]);
+    }
+
     for (int i = 0; i < num_layers; ++i)
     {
-      auto mamba_in_proj_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["in_proj"]["weights"];
-      auto A_real_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["A_real"];
-      auto A_imag_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["A_imag"];
-      auto B_real_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["B_real"];
-      auto B_imag_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["B_imag"];
-      auto C_real_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["C_real"];
-      auto C_imag_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["C_imag"];
-      auto D_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["D"];
-      auto inv_dt_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["inv_dt"];
-      auto norm_weights = model_data["layers"][i + 3]["parameters"]["norm"]["weight"];
-      auto eps_weight = model_data["layers"][i + 3]["parameters"]["norm"]["eps"];
-      auto mamba_out_proj_weights = model_data["layers"][i + 3]["parameters"]["mamba"]["out_proj"]["weights"];
-
-      std::vector<T> mamba_in_proj_flat_weights(d_inner_2);
-      for (int j = 0; j < d_model; ++j)
+      LayerData& layer = this->layers[i];
+      const auto& mamba = layers.at(i + 3).at("parameters").at("mamba");
+      const auto& mamba_in_proj_weights = mamba.at("in_proj").at("weights");
+      const auto& A_real_weights = mamba.at("A_real");
+      const auto& A_imag_weights = mamba.at("A_imag");
+      const auto& B_real_weights = mamba.at("B_real");
+      const auto& B_imag_weights = mamba.at("B_imag");
+      const auto& C_real_weights = mamba.at("C_real");
+      const auto& C_imag_weights = mamba.at("C_imag");
+      const auto& D_weights = mamba.at("D");
+      const auto& inv_dt_weights = mamba.at("inv_dt");
+      const auto& norm_weights = layers.at(i + 3).at("parameters").at("norm").at("weight");
+      const auto& eps_weight = layers.at(i + 3).at("parameters").at("norm").at("eps");
+      const auto& mamba_out_proj_weights = mamba.at("out_proj").at("weights");
+
+      if (in_proj_structured[i].isDense())
+        setInProj(mamba_in_proj_weights, layer.in_proj);
+      if (out_proj_structured[i].isDense())
+        setOutProj(mamba_out_proj_weights, layer.out_proj);
+
+      if (config.bias)
       {
-        for (int k = 0; k < d_inner_2; ++k)
+        std::vector<T> mamba_in_proj_flat_weights(d_inner);
+        std::vector<T> mamba_out_proj_flat_weights(d_model);
+        const auto& in_b = mamba.at("in_proj").at("bias");
+        for (int half = 0; half < 2; ++half)
         {
-          mamba_in_proj_flat_weights[k] = static_cast<T>(mamba_in_proj_weights[k][j]);
+          for (int k = 0; k < d_inner; ++k)
+            mamba_in_proj_flat_weights[k] = static_cast<T>(in_b[half * d_inner + k]);
+          set_values<T, alignment>(mamba_in_proj_flat_weights, layer.in_proj_bias + half * v_d_inner, d_inner, v_d_inner);
         }
-        set_values<T, alignment>(mamba_in_proj_flat_weights, in_proj_mamba[i][j], d_inner_2, v_d_inner_2);
-      }
 
-      std::vector<T> mamba_out_proj_flat_weights(d_model);
-      for (int j = 0; j < d_inner; ++j)
-      {
+        const auto& out_b = mamba.at("out_proj").at("bias");
         for (int k = 0; k < d_model; ++k)
-        {
-          mamba_out_proj_flat_weights[k] = static_cast<T>(mamba_out_proj_weights[k][j]);
-        }
-        set_values<T, alignment>(mamba_out_proj_flat_weights, out_proj_mamba[i][j], d_model, v_d_model);
+          mamba_out_proj_flat_weights[k] = static_cast<T>(out_b[k]);
+        set_values<T, alignment>(mamba_out_proj_flat_weights, layer.out_proj_bias, d_model, v_d_model);
       }
 
       std::vector<T> norm_flat_weights(d_model);
@@ -447,8 +1131,8 @@ private:
       {
         norm_flat_weights[j] = static_cast<T>(norm_weights[j]);
       }
-      set_values<T, alignment>(norm_flat_weights, norm[i], d_model, v_d_model);
-      eps[i] = static_cast<T>(eps_weight);
+      set_values<T, alignment>(norm_flat_weights, layer.norm, d_model, v_d_model);
+      layer.eps = static_cast<T>(eps_weight);
 
       std::vector<T> A_real_flat_weights(ssm_size);
       std::vector<T> A_imag_flat_weights(ssm_size);
@@ -457,8 +1141,8 @@ private:
         A_real_flat_weights[j] = static_cast<T>(A_real_weights[j]);
         A_imag_flat_weights[j] = static_cast<T>(A_imag_weights[j]);
       }
-      set_values<T, alignment>(A_real_flat_weights, A_real[i], ssm_size, v_ssm_size);
-      set_values<T, alignment>(A_imag_flat_weights, A_imag[i], ssm_size, v_ssm_size);
+      set_values<T, alignment>(A_real_flat_weights, &A_real[i * v_ssm_size], ssm_size, v_ssm_size);
+      set_values<T, alignment>(A_imag_flat_weights, &A_imag[i * v_ssm_size], ssm_size, v_ssm_size);
 
       std::vector<T> B_real_flat_weights(ssm_size);
       std::vector<T> B_imag_flat_weights(ssm_size);
@@ -469,21 +1153,22 @@ private:
           B_real_flat_weights[k] = static_cast<T>(B_real_weights[k][j]);
           B_imag_flat_weights[k] = static_cast<T>(B_imag_weights[k][j]);
         }
-        set_values<T, alignment>(B_real_flat_weights, B_real[i][j], ssm_size, v_ssm_size);
-        set_values<T, alignment>(B_imag_flat_weights, B_imag[i][j], ssm_size, v_ssm_size);
+        B_real.set(B_real_flat_weights, (i * d_inner + j) * v_ssm_size, ssm_size, v_ssm_size);
+        B_imag.set(B_imag_flat_weights, (i * d_inner + j) * v_ssm_size, ssm_size, v_ssm_size);
       }
 
+      // fold the conjugate symmetry factor into C, Re(C h) = Re(C) Re(h) - Im(C) Im(h)
       std::vector<T> C_real_flat_weights(d_inner);
       std::vector<T> C_imag_flat_weights(d_inner);
       for (int j = 0; j < ssm_size; ++j)
       {
         for (int k = 0; k < d_inner; ++k)
         {
-          C_real_flat_weights[k] = static_cast<T>(C_real_weights[k][j]);
-          C_imag_flat_weights[k] = static_cast<T>(C_imag_weights[k][j]);
+          C_real_flat_weights[k] = c_scale * static_cast<T>(C_real_weights[k][j]);
+          C_imag_flat_weights[k] = -c_scale * static_cast<T>(C_imag_weights[k][j]);
         }
-        set_values<T, alignment>(C_real_flat_weights, C_real[i][j], d_inner, v_d_inner);
-        set_values<T, alignment>(C_imag_flat_weights, C_imag[i][j], d_inner, v_d_inner);
+        layer.C.set(C_real_flat_weights, Layout::template re<v_type>(j, ssm_size) * v_d_inner, d_inner, v_d_inner);
+        layer.C.set(C_imag_flat_weights, Layout::template im<v_type>(j, ssm_size) * v_d_inner, d_inner, v_d_inner);
       }
 
       std::vector<T> D_flat_weights(d_inner);
@@ -491,14 +1176,17 @@ private:
       {
         D_flat_weights[j] = static_cast<T>(D_weights[j]);
       }
-      set_values<T, alignment>(D_flat_weights, D[i], d_inner, v_d_inner);
+      set_values<T, alignment>(D_flat_weights, layer.D, d_inner, v_d_inner);
 
       std::vector<T> inv_dt_flat_weights(ssm_size);
       for (int j = 0; j < ssm_size; ++j)
       {
         inv_dt_flat_weights[j] = static_cast<T>(inv_dt_weights[j]);
       }
-      set_values<T, alignment>(inv_dt_flat_weights, inv_dt[i], ssm_size, v_ssm_size);
+      set_values<T, alignment>(inv_dt_flat_weights, &inv_dt[i * v_ssm_size], ssm_size, v_ssm_size);
     }
+
+    // discretize at the training rate until the host rate is known
+    discretize_bilinear(T(48000));
   }
-};
\ No newline at end of file
+};
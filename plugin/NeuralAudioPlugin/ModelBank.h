@@ -0,0 +1,526 @@
+#pragma once
+
+#include "Engine.h"
+#include "FiLM.h"
+#include "common.h"
+#include "json.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
+
+// A capture file (model_weights.json) built for one sample rate, shared by every instance of the
+// process that plays it at that rate. The JSON is dropped once the weights are built. The engines
+// of an instance run on the weight arena of model (ModelEngine::shareWeights) with their own
+// hidden state and scratch, and copy film, which keeps its smoothing state.
+template <std::size_t Alignment>
+struct CaptureSource
+{
+  std::string name;                    // file name without the extension
+  double sampleRate = 0.0;             // model is discretized for it
+  FiLM<float, Alignment> film;         // loaded, not run
+  ModelEngine<float, Alignment> model; // loaded and discretized, never run: only read by the instances
+};
+
+// Process-wide registry of the built captures, by content and sample rate. A capture stays built
+// while an instance holds it.
+template <std::size_t Alignment>
+class CaptureCache
+{
+public:
+  static CaptureCache& instance()
+  {
+    static CaptureCache cache;
+    return cache;
+  }
+
+  // The capture of data built for sampleRate, built on first use. Returns null if the file does not
+  // load, with the reason in error. Not real-time safe.
+  using Source = CaptureSource<Alignment>;
+
+  std::shared_ptr<const Source> get(const std::string& name, const char* data, std::size_t size, double sampleRate, std::string& error)
+  {
+    const Key key{fnv1a(data, size), size, sampleRate};
+    std::lock_guard<std::mutex> lock(mutex);
+    if (std::shared_ptr<const Source> source = sources[key].lock())
+      return source;
+
+    std::shared_ptr<Source> source(new Source());
+    source->name = name;
+    source->sampleRate = sampleRate;
+    try
+    {
+      const nlohmann::json parsed = nlohmann::json::parse(data, data + size);
+      if (!source->film.initFromJson(parsed))
+      {
+        error = name + ": " + source->film.getLastError();
+        return nullptr;
+      }
+      if (!source->model.initFromJson(parsed))
+      {
+        error = name + ": " + source->model.getLastError();
+        return nullptr;
+      }
+    }
+    catch (const std::exception& e)
+    {
+      error = name + ": " + e.what();
+      return nullptr;
+    }
+    source->model.discretize_bilinear(static_cast<float>(sampleRate));
+    sources[key] = source;
+
+    // forget the captures nobody uses anymore
+    for (auto it = sources.begin(); it != sources.end();)
+      it = it->second.expired() ? sources.erase(it) : std::next(it);
+    return source;
+  }
+
+private:
+  using Key = std::tuple<std::uint64_t, std::size_t, double>;
+
+  CaptureCache() = default;
+
+  std::mutex mutex;
+  std::map<Key, std::weak_ptr<const Source>> sources;
+};
+
+// A set of captures one instance can switch between while it plays. A background thread, woken by
+// prepare and request, loads the selected capture (its shared weights through CaptureCache and this
+// instance's engines on them) and hands it over in a single pending slot; the audio thread takes
+// it, runs it silently next to the active capture for warmupSamples so that its state settles on
+// the live input, then crossfades with equal power over fadeSamples and publishes it as the active
+// capture.
+//
+// The audio thread never allocates, locks or parses: it exchanges pointers and pushes the capture
+// it leaves onto a lock-free retired list. Retired captures are freed on the loader thread, at the
+// next request or prepare, once the only other reader, the thread calling readActive, is past the
+// epoch they were retired in.
+//
+// The plugin (NEURAL_AUDIO_MODEL_BANK) lists the built-in capture and the model_weights.json files
+// of defaultFolder() when an instance is created, up to kMaxCaptures in all. Its engines keep only
+// hidden state and scratch; the bank renders both channels at full quality, in place of the tier,
+// bypass and offline paths.
+template <std::size_t Alignment = 16>
+class ModelBank
+{
+public:
+  using Model = ModelEngine<float, Alignment>;
+  using Film = FiLM<float, Alignment>;
+  static constexpr int maxChannels = 2;
+  static constexpr int warmupSamples = 2048;
+  static constexpr int fadeSamples = 1024;
+
+  // numInputs: conditioning inputs of the plugin, captures with another FiLM are rejected
+  explicit ModelBank(int numInputs)
+  : numInputs(numInputs)
+  , fadeIn(fadeSamples)
+  , fadeOut(fadeSamples)
+  {
+    for (int k = 0; k < fadeSamples; ++k)
+    {
+      const double angle = 1.5707963267948966 * (k + 0.5) / fadeSamples;
+      fadeIn[k] = static_cast<float>(std::sin(angle));
+      fadeOut[k] = static_cast<float>(std::cos(angle));
+    }
+    thread = std::thread([this] { loop(); });
+  }
+
+  ~ModelBank()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    thread.join();
+    delete current;
+    delete incoming;
+    delete pending.exchange(nullptr);
+    for (Slot* slot = retired.exchange(nullptr); slot;)
+      delete std::exchange(slot, slot->next);
+  }
+
+  ModelBank(const ModelBank&) = delete;
+  ModelBank& operator=(const ModelBank&) = delete;
+
+  // Add a capture held in memory, e.g. the built-in model_weights.h. data must outlive the bank.
+  // Not real-time safe, before the first prepare.
+  void addCapture(const std::string& name, const char* data, std::size_t size)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.push_back({name, std::string(), data, size});
+  }
+
+  // Add the .json files of folder in name order, at most maxCaptures. Returns the number added.
+  // Not real-time safe, before the first prepare.
+  int addFolder(const std::string& folder, int maxCaptures)
+  {
+    std::vector<std::string> files = listFiles(folder, ".json");
+    std::sort(files.begin(), files.end());
+    files.resize(std::min<std::size_t>(files.size(), std::max(0, maxCaptures)));
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const std::string& file : files)
+      entries.push_back({file.substr(0, file.size() - 5), folder + separator + file, nullptr, 0});
+    return static_cast<int>(files.size());
+  }
+
+  int getNumCaptures() const noexcept { return static_cast<int>(entries.size()); }
+  const std::string& getName(int index) const noexcept { return entries[index].name; }
+
+  // The last load failure, empty if there was none
+  std::string getLastError() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lastError;
+  }
+
+  // Load the selected capture for sampleRate if it is not active at that rate yet, reset the active
+  // one otherwise. A switch in progress is dropped. Not real-time safe, while the audio thread is
+  // not processing. Returns false if there is no active capture.
+  bool prepare(double sampleRate)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    rate = sampleRate;
+    ++generation; // a load running on the loader thread is stale
+    delete pending.exchange(nullptr);
+    if (incoming)
+      retire(std::exchange(incoming, nullptr));
+    transition = 0;
+
+    const int index = requested.load(std::memory_order_relaxed);
+    if (current && current->index == index && current->source->sampleRate == rate)
+    {
+      for (Model& model : current->model)
+        model.reset();
+    }
+    else if (Slot* slot = load(index, rate, lastError))
+    {
+      Slot* previous = std::exchange(current, slot);
+      active.store(current);
+      if (previous)
+        retire(previous);
+    }
+    loaded = index; // also when it failed, the loader does not retry
+    reclaim();
+    return current != nullptr;
+  }
+
+  // Set capture index, loaded by the next prepare or request. Real-time safe.
+  void select(int index) noexcept { requested.store(index, std::memory_order_relaxed); }
+
+  // Request capture index and wake the loader if it is not loaded yet or retired captures wait to
+  // be freed. Not real-time safe (takes the loader's lock, which it does not hold while loading),
+  // e.g. from the UI thread on idle, which also picks up a select made on the audio thread.
+  void request(int index)
+  {
+    requested.store(index, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (index == loaded && retired.load(std::memory_order_relaxed) == nullptr)
+        return;
+      woken = true;
+    }
+    wake.notify_one();
+  }
+
+  // Render nFrames samples of nChans channels (1 or 2) at the conditioning of this block (numInputs
+  // values). Passes the input through while no capture is loaded. Real-time safe.
+  template <typename S>
+  void process(const S* const* inputs, S** outputs, int nChans, int nFrames, const float* conditioning) noexcept
+  {
+    nChans = std::min(nChans, maxChannels);
+    if (!incoming)
+    {
+      incoming = pending.exchange(nullptr, std::memory_order_acquire);
+      transition = 0;
+      if (incoming && !current)
+      {
+        current = std::exchange(incoming, nullptr);
+        active.store(current);
+      }
+    }
+    if (!current)
+    {
+      for (int c = 0; c < nChans; ++c)
+        std::copy(inputs[c], inputs[c] + nFrames, outputs[c]);
+      return;
+    }
+
+    current->film.processSample(conditioning);
+    if (incoming)
+      incoming->film.processSample(conditioning);
+    for (int c = 0; c < nChans; ++c)
+    {
+      Model& model = current->model[c];
+      const float* gamma = current->film.getGamma();
+      const float* beta = current->film.getBeta();
+      for (int s = 0; s < nFrames; ++s)
+      {
+        const float input = static_cast<float>(inputs[c][s]);
+        float output = model.processSample(input, gamma, beta);
+        if (incoming)
+        {
+          const float next = incoming->model[c].processSample(input, incoming->film.getGamma(), incoming->film.getBeta());
+          const int k = transition + s - warmupSamples;
+          if (k >= fadeSamples)
+            output = next;
+          else if (k >= 0)
+            output = fadeOut[k] * output + fadeIn[k] * next;
+        }
+        outputs[c][s] = output;
+      }
+    }
+
+    if (incoming)
+    {
+      transition += nFrames;
+      if (transition >= warmupSamples + fadeSamples)
+      {
+        Slot* previous = current;
+        current = std::exchange(incoming, nullptr);
+        active.store(current);
+        retire(previous);
+      }
+    }
+  }
+
+  // Call f(const CaptureSource<Alignment>&) with the active capture, returns false if there is
+  // none. Safe while the audio thread switches, from one thread at a time (the UI thread).
+  template <typename F>
+  bool readActive(F&& f) const
+  {
+    readerEpoch.store(epoch.load());
+    const Slot* slot = active.load();
+    if (slot)
+      f(*slot->source);
+    readerEpoch.store(0);
+    return slot != nullptr;
+  }
+
+  // Per user folder scanned for capture files
+  static std::string defaultFolder()
+  {
+#if defined(_WIN32) || defined(__APPLE__)
+    return user_path(user_folder::data, "Captures");
+#else
+    return user_path(user_folder::data, "captures");
+#endif
+  }
+
+private:
+#if defined(_WIN32)
+  static constexpr char separator = '\\';
+#else
+  static constexpr char separator = '/';
+#endif
+
+  struct Entry
+  {
+    std::string name;
+    std::string path;           // empty for captures in memory
+    const char* data = nullptr; // captures in memory
+    std::size_t size = 0;
+  };
+
+  // A capture loaded for this instance
+  struct Slot
+  {
+    int index = 0;
+    std::shared_ptr<const CaptureSource<Alignment>> source; // weights shared with other instances
+    Film film;
+    std::array<Model, maxChannels> model;
+    std::uint64_t retiredIn = 0; // epoch
+    Slot* next = nullptr;        // retired list
+  };
+
+  // Names of the files in folder ending in extension, empty if folder cannot be read
+  static std::vector<std::string> listFiles(const std::string& folder, const std::string& extension)
+  {
+    std::vector<std::string> files;
+    auto matches = [&](const std::string& name) {
+      return name.size() > extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0;
+    };
+    if (folder.empty())
+      return files;
+#if defined(_WIN32)
+    _finddata_t found;
+    const intptr_t handle = _findfirst((folder + "\\*" + extension).c_str(), &found);
+    if (handle == -1)
+      return files;
+    do
+    {
+      if (!(found.attrib & _A_SUBDIR) && matches(found.name))
+        files.push_back(found.name);
+    } while (_findnext(handle, &found) == 0);
+    _findclose(handle);
+#else
+    if (DIR* dir = opendir(folder.c_str()))
+    {
+      while (const dirent* found = readdir(dir))
+      {
+        if (found->d_name[0] != '.' && matches(found->d_name))
+          files.push_back(found->d_name);
+      }
+      closedir(dir);
+    }
+#endif
+    return files;
+  }
+
+  // Build capture index for sampleRate, null on failure with the reason in error. Only reads the
+  // entries, which do not change once the captures are added.
+  Slot* load(int index, double sampleRate, std::string& error) const
+  {
+    if (index < 0 || index >= static_cast<int>(entries.size()))
+      return nullptr;
+    const Entry& entry = entries[index];
+
+    std::string contents;
+    const char* data = entry.data;
+    std::size_t size = entry.size;
+    if (!entry.path.empty())
+    {
+      std::ifstream file(entry.path, std::ios::binary);
+      if (!file)
+      {
+        error = "cannot read " + entry.path;
+        return nullptr;
+      }
+      std::ostringstream ss;
+      ss << file.rdbuf();
+      contents = ss.str();
+      data = contents.data();
+      size = contents.size();
+    }
+
+    std::unique_ptr<Slot> slot(new Slot());
+    slot->index = index;
+    slot->source = CaptureCache<Alignment>::instance().get(entry.name, data, size, sampleRate, error);
+    if (!slot->source)
+      return nullptr;
+    slot->film = slot->source->film;
+    if (slot->film.getNumInputs() != numInputs)
+    {
+      error = entry.name + ": FiLM expects " + std::to_string(slot->film.getNumInputs()) + " conditioning inputs";
+      return nullptr;
+    }
+    for (Model& model : slot->model)
+    {
+      if (!model.shareWeights(slot->source->model))
+      {
+        error = entry.name + ": " + model.getLastError();
+        return nullptr;
+      }
+    }
+    return slot.release();
+  }
+
+  // Push slot onto the retired list, lock-free. The slot must be unpublished (active) already.
+  void retire(Slot* slot) noexcept
+  {
+    slot->retiredIn = epoch.fetch_add(1);
+    slot->next = retired.load(std::memory_order_relaxed);
+    while (!retired.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  // Free the retired slots the reader cannot hold anymore, keep the others. Called with the mutex
+  // held, the only consumer of the list.
+  void reclaim()
+  {
+    Slot* slot = retired.exchange(nullptr, std::memory_order_acquire);
+    const std::uint64_t reading = readerEpoch.load();
+    while (slot)
+    {
+      Slot* next = slot->next;
+      if (reading == 0 || reading > slot->retiredIn)
+        delete slot;
+      else
+      {
+        slot->next = retired.load(std::memory_order_relaxed);
+        while (!retired.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+      }
+      slot = next;
+    }
+  }
+
+  void loop()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!quit)
+    {
+      wake.wait(lock, [this] { return woken || quit; });
+      woken = false;
+      reclaim();
+      const int index = requested.load(std::memory_order_relaxed);
+      if (quit || rate <= 0.0 || index == loaded)
+        continue;
+      loaded = index; // once, also when it fails
+
+      // load without the lock, so request does not wait for it
+      const double loadRate = rate;
+      const std::uint64_t loadGeneration = generation;
+      std::string error;
+      lock.unlock();
+      std::unique_ptr<Slot> slot(load(index, loadRate, error));
+      lock.lock();
+      if (generation != loadGeneration) // prepare ran meanwhile
+        continue;
+      if (!error.empty())
+        lastError = error;
+      if (slot)
+        delete pending.exchange(slot.release(), std::memory_order_acq_rel); // a capture the audio thread did not take yet
+    }
+  }
+
+  const int numInputs;
+  std::vector<Entry> entries;
+  std::vector<float> fadeIn;  // [fadeSamples], equal power
+  std::vector<float> fadeOut;
+
+  // Audio thread
+  Slot* current = nullptr;  // rendered
+  Slot* incoming = nullptr; // warming up, then fading in
+  int transition = 0;       // samples incoming has run
+
+  // Handover
+  std::atomic<int> requested{0};
+  std::atomic<Slot*> pending{nullptr};  // loaded, not taken by the audio thread yet
+  std::atomic<Slot*> active{nullptr};   // published current, for readActive
+  std::atomic<Slot*> retired{nullptr};  // lock-free stack through Slot::next
+  std::atomic<std::uint64_t> epoch{1};
+  mutable std::atomic<std::uint64_t> readerEpoch{0}; // epoch the reader started in, 0 when idle
+
+  // Loader thread
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  double rate = 0.0;
+  int loaded = -1;              // last index built
+  std::uint64_t generation = 0; // prepare calls
+  bool woken = false;           // request has work
+  bool quit = false;
+  std::string lastError;
+  std::thread thread; // started in the constructor, after the members above
+};
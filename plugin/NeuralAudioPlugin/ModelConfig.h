@@ -0,0 +1,89 @@
+#pragma once
+
+#include "json.hpp"
+#include <stdexcept>
+#include <string>
+
+// Model hyperparameters (neural_network/config.py), read from the weight file.
+// Files written by model2json.py carry a "config" section; for older files the dimensions are
+// inferred from the weight shapes, assuming conj_sym=True as before.
+struct ModelConfig
+{
+  int d_model = 16;
+  int d_state = 64;
+  int exp_f = 2;
+  int num_layers = 2;
+  int c_in = 2;
+  int d_hidden = 4;
+  bool bias = false;
+  bool conj_sym = true;
+
+  int d_inner() const noexcept { return exp_f * d_model; }
+  int ssm_size() const noexcept { return conj_sym ? d_state / 2 : d_state; }
+
+  static ModelConfig fromJson(const nlohmann::json& model_data)
+  {
+    const auto& layers = model_data.at("layers");
+    if (layers.size() < 4)
+      throw std::runtime_error("weight file has too few layers");
+
+    ModelConfig config;
+    const auto& film_in = layers.at(0).at("weights").at(0);
+    const auto& in_proj = layers.at(2).at("weights").at(0);
+    const auto& first = layers.at(3).at("parameters");
+    const auto& mamba = first.at("mamba");
+
+    if (model_data.contains("config"))
+    {
+      const auto& c = model_data.at("config");
+      config.d_model = c.at("d_model").get<int>();
+      config.d_state = c.at("d_state").get<int>();
+      config.exp_f = c.at("expand_factor").get<int>();
+      config.num_layers = c.at("n_layers").get<int>();
+      config.c_in = c.at("c_dim").get<int>();
+      config.d_hidden = c.at("film_hidden").get<int>();
+      config.bias = c.at("bias").get<bool>();
+      config.conj_sym = c.at("conj_sym").get<bool>();
+    }
+    else
+    {
+      config.d_model = static_cast<int>(in_proj.size());
+      config.exp_f = static_cast<int>(mamba.at("in_proj").at("weights").size()) / (2 * config.d_model);
+      config.num_layers = static_cast<int>(layers.size()) - 4;
+      config.c_in = static_cast<int>(film_in.at(0).size());
+      config.d_hidden = static_cast<int>(film_in.size());
+      config.bias = !mamba.at("in_proj").at("bias").is_null();
+      config.conj_sym = true;
+      config.d_state = 2 * static_cast<int>(mamba.at("A_real").size());
+    }
+
+    // check the weight shapes against the configuration
+    auto expect = [](bool ok, const char* what) {
+      if (!ok)
+        throw std::runtime_error(std::string("weight file does not match its configuration: ") + what);
+    };
+    expect(config.d_model > 0 && config.d_state > 0 && config.exp_f > 0 && config.num_layers > 0 && config.c_in > 0 && config.d_hidden > 0, "dimensions must be positive");
+    expect(!config.conj_sym || config.d_state % 2 == 0, "d_state must be even with conj_sym");
+    expect(static_cast<int>(layers.size()) == config.num_layers + 4, "n_layers");
+    expect(static_cast<int>(film_in.size()) == config.d_hidden && static_cast<int>(film_in.at(0).size()) == config.c_in, "FiLM input layer");
+    expect(static_cast<int>(layers.at(1).at("weights").at(0).size()) == 2 * config.d_model, "FiLM output layer");
+    expect(static_cast<int>(in_proj.size()) == config.d_model, "d_model");
+    for (int i = 0; i < config.num_layers; ++i)
+    {
+      const auto& m = layers.at(i + 3).at("parameters").at("mamba");
+      expect(static_cast<int>(m.at("in_proj").at("weights").size()) == 2 * config.d_inner(), "expand_factor");
+      expect(static_cast<int>(m.at("A_real").size()) == config.ssm_size(), "d_state");
+      expect(static_cast<int>(m.at("C_real").size()) == config.d_inner() && static_cast<int>(m.at("C_real").at(0).size()) == config.ssm_size(), "C");
+      expect(m.at("in_proj").at("bias").is_null() != config.bias && m.at("out_proj").at("bias").is_null() != config.bias, "bias");
+      expect(static_cast<int>(m.at("in_proj").at("weights").at(0).size()) == config.d_model, "in_proj");
+      expect(static_cast<int>(m.at("out_proj").at("weights").size()) == config.d_model && static_cast<int>(m.at("out_proj").at("weights").at(0).size()) == config.d_inner(), "out_proj");
+      expect(static_cast<int>(m.at("A_imag").size()) == config.ssm_size() && static_cast<int>(m.at("inv_dt").size()) == config.ssm_size(), "A, inv_dt");
+      expect(static_cast<int>(m.at("B_real").size()) == config.ssm_size() && static_cast<int>(m.at("B_real").at(0).size()) == config.d_inner(), "B");
+      expect(m.at("B_imag").size() == m.at("B_real").size() && m.at("C_imag").size() == m.at("C_real").size(), "B_imag, C_imag");
+      expect(static_cast<int>(m.at("D").size()) == config.d_inner(), "D");
+      expect(static_cast<int>(layers.at(i + 3).at("parameters").at("norm").at("weight").size()) == config.d_model, "norm");
+    }
+    expect(static_cast<int>(layers.at(config.num_layers + 3).at("weights").at(0).at(0).size()) == config.d_model, "output layer");
+    return config;
+  }
+};
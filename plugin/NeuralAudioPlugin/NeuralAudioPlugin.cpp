@@ -1,6 +1,33 @@
 #include "NeuralAudioPlugin.h"
 #include "IPlug_include_in_plug_src.h"
 #include "IControls.h"
+#if !defined(NEURAL_AUDIO_COMPILED_MODEL) || defined(NEURAL_AUDIO_BATCHED) || defined(NEURAL_AUDIO_LINEAR_BYPASS) || defined(NEURAL_AUDIO_MODEL_BANK) || \
+  defined(NEURAL_AUDIO_DOUBLE_OFFLINE)
+#include "model_weights.h"
+#endif
+#ifdef NEURAL_AUDIO_ECO_TIER
+#include "model_weights_eco.h"
+#endif
+#include <algorithm>
+#include <chrono>
+
+#if defined(NEURAL_AUDIO_BATCHED) && defined(NEURAL_AUDIO_PIPELINED)
+#error "NEURAL_AUDIO_BATCHED and NEURAL_AUDIO_PIPELINED are exclusive"
+#endif
+#if defined(NEURAL_AUDIO_AUTOTUNE) && defined(NEURAL_AUDIO_COMPILED_MODEL)
+#error "NEURAL_AUDIO_AUTOTUNE chooses between the runtime engines, comment out NEURAL_AUDIO_COMPILED_MODEL"
+#endif
+#if defined(NEURAL_AUDIO_MODEL_BANK) && (defined(NEURAL_AUDIO_PIPELINED) || defined(NEURAL_AUDIO_BATCHED))
+#error "NEURAL_AUDIO_MODEL_BANK renders on its own engines, without the pipelined and batched modes"
+#endif
+#if defined(NEURAL_AUDIO_DOUBLE_OFFLINE) && (defined(NEURAL_AUDIO_PIPELINED) || defined(NEURAL_AUDIO_BATCHED))
+#error "NEURAL_AUDIO_DOUBLE_OFFLINE replaces the offline path, which the pipelined and batched modes do not use"
+#endif
+
+namespace
+{
+const char* const kTierNames[kNumTiers] = {"Full quality", "Eco"};
+}
 
 NeuralAudioPlugin::NeuralAudioPlugin(const InstanceInfo& info)
 : iplug::Plugin(info, MakeConfig(kNumParams, kNumPresets))
@@ -9,6 +36,16 @@ NeuralAudioPlugin::NeuralAudioPlugin(const InstanceInfo& info)
 {
   GetParam(kDrive)->InitDouble("Drive", 0., 0., 100.0, 0.01, "%");
   GetParam(kTone)->InitDouble("Tone", 0., 0., 100.0, 0.01, "%");
+#ifdef NEURAL_AUDIO_MODEL_BANK
+  // the host needs the list now, captures added to the folder later show up in new instances
+  mBank.addCapture("Built-in", reinterpret_cast<const char*>(model_weights_json), model_weights_json_len);
+  mBank.addFolder(ModelBank<16>::defaultFolder(), kMaxCaptures - 1);
+  GetParam(kCapture)->InitEnum("Capture", 0, mBank.getNumCaptures());
+  for (int i = 0; i < mBank.getNumCaptures(); ++i)
+  {
+    GetParam(kCapture)->SetDisplayText(i, mBank.getName(i).c_str());
+  }
+#endif
 
 
 
@@ -29,30 +66,134 @@ NeuralAudioPlugin::NeuralAudioPlugin(const InstanceInfo& info)
     IRECT knobRect = b.GetCentredInside(100);
     pGraphics->AttachControl(new IVKnobControl(knobRect.GetHShifted(-70), kDrive));
     pGraphics->AttachControl(new IVKnobControl(knobRect.GetHShifted(70), kTone));
+    // Active quality tier
+    if (mTiers.getNumTiers() > 1)
+    {
+      pGraphics->AttachControl(new ITextControl(b.GetFromBottom(40.f), kTierNames[mDisplayedTier.load()], IText(16.f)), kCtrlTagTier);
+    }
+    mShownTier = -1;
+#ifdef NEURAL_AUDIO_MODEL_BANK
+    // capture selection, and the capture playing (after the switch)
+    pGraphics->AttachControl(new ICaptionControl(b.GetFromTop(40.f).GetCentredInside(200.f, 24.f), kCapture, IText(16.f), DEFAULT_FGCOLOR));
+    pGraphics->AttachControl(new ITextControl(b.GetFromTop(70.f).GetFromBottom(24.f), "", IText(14.f)), kCtrlTagCapture);
+    mShownCapture.clear();
+#endif
   };
 #endif
 
-  mModelsOK = mFilm.initFromWeights();
+#ifdef NEURAL_AUDIO_COMPILED_MODEL
+  // compiled model, nothing to load
+  mModelsOK = true;
+#else
+  // model_weights_json is declared in model_weights.h as: unsigned char model_weights_json[]
+  const char* weights = reinterpret_cast<const char*>(model_weights_json);
+  const std::size_t weightsLen = model_weights_json_len;
+
+  mModelsOK = mFilm.initFromJson(weights, weightsLen);
   if (!mModelsOK)
   {
     mModelError = "FiLM load failed: " + mFilm.getLastError();
   }
+  else if (mFilm.getNumInputs() != kNumConditioning)
+  {
+    mModelsOK = false;
+    mModelError = "FiLM expects " + std::to_string(mFilm.getNumInputs()) + " conditioning inputs";
+  }
+
+#ifdef NEURAL_AUDIO_AUTOTUNE
+  const std::string tuneKey = Autotuner::cacheKey(weights, weightsLen);
+  TuneResult tuned;
+  const bool cached = Autotuner::lookup(Autotuner::defaultCachePath(), tuneKey, tuned);
+  mOfflineBlock = tuned.offlineBlock;
+#endif
 
   for (int ch = 0; ch < 2 && mModelsOK; ++ch)
   {
-    if (!mModel[ch].initFromWeights())
+#ifdef NEURAL_AUDIO_AUTOTUNE
+    const bool loaded = mModel[ch].initFromJson(weights, weightsLen, tuned.variant);
+#else
+    const bool loaded = mModel[ch].initFromJson(weights, weightsLen);
+#endif
+    if (!loaded)
     {
       mModelsOK = false;
       mModelError = "Model[" + std::to_string(ch) + "] load failed: " + mModel[ch].getLastError();
     }
   }
 
+#ifdef NEURAL_AUDIO_AUTOTUNE
+  if (mModelsOK && !cached)
+  {
+    mTuneWorker.reset(new WorkerThread());
+    mTuneWorker->run([this, weights, weightsLen, tuneKey] {
+      Autotuner tuner;
+      if (!tuner.tune(weights, weightsLen, mTuneResult))
+      {
+        DBGMSG("NeuralAudioPlugin autotune failed: %s", tuner.getLastError().c_str());
+        return;
+      }
+      if (!Autotuner::store(Autotuner::defaultCachePath(), tuneKey, mTuneResult))
+        DBGMSG("NeuralAudioPlugin autotune result not cached");
+      mTuneDone.store(true, std::memory_order_release);
+    });
+  }
+#endif
+#endif
+
+#ifdef NEURAL_AUDIO_ECO_TIER
+  if (mModelsOK)
+  {
+    // model_weights_eco_json is declared in model_weights_eco.h (model2cpp.py --eco)
+    const char* eco = reinterpret_cast<const char*>(model_weights_eco_json);
+    const std::size_t ecoLen = model_weights_eco_json_len;
+    bool ecoOK = mEcoFilm.initFromJson(eco, ecoLen) && mEcoFilm.getNumInputs() == kNumConditioning;
+    for (int ch = 0; ch < 2 && ecoOK; ++ch)
+    {
+      ecoOK = mEcoModel[ch].initFromJson(eco, ecoLen);
+    }
+    if (ecoOK)
+      mTiers.setNumTiers(kNumTiers);
+    else
+      DBGMSG("NeuralAudioPlugin eco tier disabled: %s", mEcoModel[0].getLastError().c_str());
+  }
+#endif
+
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+  if (mModelsOK)
+  {
+    const char* weights = reinterpret_cast<const char*>(model_weights_json);
+    mDoubleOK = mFilmDouble.initFromJson(weights, model_weights_json_len) && mFilmDouble.getNumInputs() == kNumConditioning;
+    for (int ch = 0; ch < 2 && mDoubleOK; ++ch)
+    {
+      // the state snapshots have the same layout, the sizes tell whether it is the same capture
+      mDoubleOK = mModelDouble[ch].initFromJson(weights, model_weights_json_len) && mModelDouble[ch].stateSize() == mModel[ch].stateSize();
+    }
+    if (mDoubleOK)
+      mStateDouble.resize(mModelDouble[0].stateSize());
+    else
+      DBGMSG("NeuralAudioPlugin double precision offline path disabled: %s", mModelDouble[0].getLastError().c_str());
+  }
+#endif
+
+#ifdef NEURAL_AUDIO_LINEAR_BYPASS
+  if (mModelsOK)
+  {
+    if (!mBypass.initFromJson(reinterpret_cast<const char*>(model_weights_json), model_weights_json_len))
+      DBGMSG("NeuralAudioPlugin linear bypass disabled: %s", mBypass.getLastError().c_str());
+  }
+#endif
+
   if (!mModelsOK)
   {
     DBGMSG("NeuralAudioPlugin initialization error: %s", mModelError.c_str());
   }
   else
   {
+    int stateSize = mModel[0].stateSize();
+#ifdef NEURAL_AUDIO_ECO_TIER
+    stateSize = std::max(stateSize, mEcoModel[0].stateSize());
+#endif
+    mStateBuffer.resize(stateSize);
     DBGMSG("NeuralAudioPlugin initialized successfull");
   }
 }
@@ -64,11 +205,48 @@ void NeuralAudioPlugin::OnReset()
   if (!mModelsOK)
     return;
 
+#ifdef NEURAL_AUDIO_MODEL_BANK
+  // a restored session loads its capture here, without a switch
+  mBank.select(GetParam(kCapture)->Int());
+  if (!mBank.prepare(sr))
+    DBGMSG("NeuralAudioPlugin capture bank: %s", mBank.getLastError().c_str());
+#endif
+
+#ifdef NEURAL_AUDIO_AUTOTUNE
+  if (mTuneDone.exchange(false, std::memory_order_acquire))
+  {
+    // the models are not processing during a reset, they can be replaced
+    for (int ch = 0; ch < 2; ++ch)
+    {
+      TunedEngine<16> model;
+      if (model.initFromJson(reinterpret_cast<const char*>(model_weights_json), model_weights_json_len, mTuneResult.variant))
+        mModel[ch] = std::move(model);
+    }
+    mOfflineBlock = mTuneResult.offlineBlock;
+    mLastSampleRate = 0.0; // discretize the new models below
+    DBGMSG("NeuralAudioPlugin autotuned: %s", variantName(mTuneResult.variant));
+  }
+#endif
+
+#ifdef NEURAL_AUDIO_PIPELINED
+  // stops the stages in flight before the models change
+  mPipeline.prepare(mModel.data(), GetBlockSize(), sr);
+  SetLatency(mPipeline.getLatency());
+#endif
+
   if (sr != mLastSampleRate)
   {
     for (int ch = 0; ch < 2; ++ch)
     {
       mModel[ch].discretize_bilinear((float)sr);
+#ifdef NEURAL_AUDIO_ECO_TIER
+      if (mTiers.getNumTiers() > 1)
+        mEcoModel[ch].discretize_bilinear((float)sr);
+#endif
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+      if (mDoubleOK)
+        mModelDouble[ch].discretize_bilinear(sr);
+#endif
       DBGMSG("Model[%d] discretized at %f Hz", ch, sr);
     }
     mLastSampleRate = sr;
@@ -77,9 +255,131 @@ void NeuralAudioPlugin::OnReset()
   for (int ch = 0; ch < 2; ++ch)
   {
     mModel[ch].reset();
+#ifdef NEURAL_AUDIO_ECO_TIER
+    if (mTiers.getNumTiers() > 1)
+      mEcoModel[ch].reset();
+#endif
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+    if (mDoubleOK)
+      mModelDouble[ch].reset();
+#endif
+  }
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+  mDoubleActive = false;
+#endif
+
+#ifdef NEURAL_AUDIO_BATCHED
+  // the models are discretized for sr and reset, the group's lanes start from zero as well
+  if (mBatch.join(reinterpret_cast<const char*>(model_weights_json), model_weights_json_len, sr, GetBlockSize(), mModel.data()))
+    SetLatency(mBatch.getLatency());
+  else
+  {
+    SetLatency(0);
+    DBGMSG("NeuralAudioPlugin batching disabled: %s", mBatch.getLastError().c_str());
+  }
+#endif
+
+#ifdef NEURAL_AUDIO_LINEAR_BYPASS
+  // linearized for the current knobs, the later ones on the bypass's worker
+  mFilm.processSample(GetParam(kDrive)->Value() / 100. * 2. - 1., GetParam(kTone)->Value() / 100. * 2. - 1.);
+  mBypass.prepare(sr, mFilm.getGamma(), mFilm.getBeta());
+#endif
+
+  // start over at full quality
+  mTiers.reset();
+  mTransitionRemaining = 0;
+  mDisplayedTier = kTierFull;
+}
+
+void NeuralAudioPlugin::OnIdle()
+{
+#ifdef NEURAL_AUDIO_MODEL_BANK
+  // the loader sleeps until a capture is requested, this also covers host automation
+  mBank.request(GetParam(kCapture)->Int());
+#endif
+#if IPLUG_EDITOR
+  const int tier = mDisplayedTier.load(std::memory_order_relaxed);
+  if (tier != mShownTier && GetUI())
+  {
+    if (IControl* label = GetUI()->GetControlWithTag(kCtrlTagTier))
+    {
+      label->As<ITextControl>()->SetStr(kTierNames[tier]);
+      label->SetDirty(false);
+    }
+    mShownTier = tier;
+  }
+#ifdef NEURAL_AUDIO_MODEL_BANK
+  std::string playing;
+  mBank.readActive([&](const CaptureSource<16>& capture) { playing = capture.name; });
+  if (playing != mShownCapture && GetUI())
+  {
+    if (IControl* label = GetUI()->GetControlWithTag(kCtrlTagCapture))
+    {
+      label->As<ITextControl>()->SetStr(("Playing: " + playing).c_str());
+      label->SetDirty(false);
+    }
+    mShownCapture = playing;
+  }
+#endif
+#endif
+}
+
+// Calls f(model, film) with channel c's model of a quality tier
+template <typename F>
+auto NeuralAudioPlugin::WithTier(int tier, int c, F&& f)
+{
+#ifdef NEURAL_AUDIO_ECO_TIER
+  if (tier == kTierEco)
+    return f(mEcoModel[c], mEcoFilm);
+#endif
+  return f(mModel[c], mFilm);
+}
+
+// The idle mModel[1] of a tier continues from the state both channels share
+void NeuralAudioPlugin::SyncChannels(int tier)
+{
+  WithTier(tier, 0, [&](auto& model, auto&) { model.getState(mStateBuffer.data()); });
+  WithTier(tier, 1, [&](auto& model, auto&) { model.setState(mStateBuffer.data()); });
+}
+
+// Hand over from the previous tier to mTiers.getActive(): the new tier starts from zero state and
+// warms up on the input of the following blocks while the previous one plays, then they crossfade
+// (ProcessBlock). Nothing is rendered here, the warm-up is spread over the blocks it takes.
+void NeuralAudioPlugin::SwitchTier(int previous)
+{
+  const int tier = mTiers.getActive();
+  for (int c = 0; c < 2; ++c)
+  {
+    WithTier(tier, c, [](auto& model, auto&) { model.reset(); });
   }
+  mPreviousTier = previous;
+  mTransitionRemaining = kTierTransitionSamples;
+  mDisplayedTier = tier;
+}
 
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+// Hand the hidden state of both channels over between the float and double models
+void NeuralAudioPlugin::SwitchPrecision(bool toDouble)
+{
+  const int n = static_cast<int>(mStateDouble.size());
+  for (int c = 0; c < 2; ++c)
+  {
+    if (toDouble)
+    {
+      mModel[c].getState(mStateBuffer.data());
+      convert_block(mStateBuffer.data(), mStateDouble.data(), n);
+      mModelDouble[c].setState(mStateDouble.data());
+    }
+    else
+    {
+      mModelDouble[c].getState(mStateDouble.data());
+      convert_block(mStateDouble.data(), mStateBuffer.data(), n);
+      mModel[c].setState(mStateBuffer.data());
+    }
+  }
+  mDoubleActive = toDouble;
 }
+#endif
 
 #if IPLUG_DSP
 void NeuralAudioPlugin::ProcessBlock(sample** inputs, sample** outputs, int nFrames)
@@ -98,17 +398,176 @@ void NeuralAudioPlugin::ProcessBlock(sample** inputs, sample** outputs, int nFra
     return;
   }
 
+  const auto start = std::chrono::steady_clock::now();
+
   const float c1 = GetParam(kDrive)->Value() / 100. * 2. - 1.;
   const float c2 = GetParam(kTone)->Value() / 100. * 2. - 1.;
+#ifdef NEURAL_AUDIO_MODEL_BANK
+  const float conditioning[kNumConditioning] = {c1, c2};
+  mBank.process(inputs, outputs, nChans, nFrames, conditioning);
+  return;
+#endif
   mFilm.processSample(c1, c2);
+#ifdef NEURAL_AUDIO_ECO_TIER
+  mEcoFilm.processSample(c1, c2);
+#endif
+
+#ifdef NEURAL_AUDIO_PIPELINED
+  mPipeline.process(inputs, outputs, nChans, nFrames, mFilm.getGamma(), mFilm.getBeta(), !GetRenderingOffline());
+  return;
+#endif
+#ifdef NEURAL_AUDIO_BATCHED
+  if (mBatch.isJoined())
+  {
+    mBatch.process(inputs, outputs, nChans, nFrames, mFilm.getGamma(), mFilm.getBeta());
+    return;
+  }
+#endif
+
+  const bool shared = nChans == 2 && bit_identical(inputs[0], inputs[1], nFrames);
+  if (mChannelsShared && !shared)
+  {
+    SyncChannels(mTiers.getActive());
+    if (mTransitionRemaining > 0)
+      SyncChannels(mPreviousTier);
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+    if (mDoubleActive)
+    {
+      mModelDouble[0].getState(mStateDouble.data());
+      mModelDouble[1].setState(mStateDouble.data());
+    }
+#endif
+#ifdef NEURAL_AUDIO_LINEAR_BYPASS
+    mBypass.syncChannels();
+#endif
+  }
+  mChannelsShared = shared;
+  const int nModels = shared ? 1 : nChans;
+
+  // bounces always render at full quality
+  const bool offline = GetRenderingOffline();
+  if (offline && mTiers.getActive() != kTierFull)
+  {
+    const int previous = mTiers.getActive();
+    mTiers.select(kTierFull);
+    SwitchTier(previous);
+  }
+
+#ifdef NEURAL_AUDIO_LINEAR_BYPASS
+  mBypass.update(mFilm.getGamma(), mFilm.getBeta());
+  const bool bypass = mBypass.isEnabled() && !offline && mTiers.getActive() == kTierFull && mTransitionRemaining == 0;
+  for (int c = 0; c < nModels && mBypass.isEnabled() && !bypass; c++)
+  {
+    mBypass.track(c, inputs[c], nFrames, mModel[c]);
+  }
+#else
+  const bool bypass = false;
+#endif
+
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+  if (mDoubleOK && (offline && mTransitionRemaining == 0) != mDoubleActive)
+    SwitchPrecision(!mDoubleActive);
+  if (mDoubleActive)
+    mFilmDouble.processSample(c1, c2);
+#endif
+
+  if (offline && mTransitionRemaining == 0)
+  {
+    ProcessBlockOffline(inputs, outputs, nFrames, nModels);
+  }
+  else
+  {
+    const int tier = mTiers.getActive();
+    const bool measured = mTransitionRemaining == 0; // the block's time is the tier's own cost
+#ifdef NEURAL_AUDIO_LINEAR_BYPASS
+    for (int c = 0; c < nModels && bypass; c++)
+    {
+      mBypass.process(c, inputs[c], outputs[c], nFrames, mModel[c], mFilm.getGamma(), mFilm.getBeta());
+    }
+#endif
+    // whole channels through the block API, on the host's samples (process_host_block)
+    const int previousN = std::min(nFrames, mTransitionRemaining);
+    const int elapsed = kTierTransitionSamples - mTransitionRemaining; // samples since the switch
+    for (int c = 0; c < nModels && !bypass; c++)
+    {
+      // the previous tier reads the input first, the host may pass the same buffer as output
+      float* previous = mPreviousBuffer.data();
+      if (previousN > 0)
+      {
+        convert_block(inputs[c], previous, previousN);
+        WithTier(mPreviousTier, c, [&](auto& model, auto& film) { model.processBlock(previous, previous, previousN, film.getGamma(), film.getBeta()); });
+      }
+      WithTier(tier, c, [&](auto& model, auto& film) { model.processBlock(inputs[c], outputs[c], nFrames, film.getGamma(), film.getBeta()); });
+      for (int s = 0; s < previousN; s++)
+      {
+        // the previous tier plays while the new one warms up, then a linear crossfade, the tiers
+        // render the same capture
+        const int k = elapsed + s - kTierWarmupSamples;
+        const float output = static_cast<float>(outputs[c][s]);
+        outputs[c][s] = k < 0 ? previous[s] : output + static_cast<float>(kTierFadeSamples - k) / kTierFadeSamples * (previous[s] - output);
+      }
+    }
+    mTransitionRemaining -= previousN;
+
+    if (!offline && measured && mTiers.getNumTiers() > 1)
+    {
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (mTiers.update(seconds, nFrames, GetSampleRate()) != tier)
+        SwitchTier(tier);
+    }
+  }
 
-  for (int s = 0; s < nFrames; s++)
+  if (shared)
   {
-    for (int c = 0; c < nChans; c++)
+    std::copy(outputs[0], outputs[0] + nFrames, outputs[1]);
+  }
+}
+
+void NeuralAudioPlugin::ProcessBlockOffline(sample** inputs, sample** outputs, int nFrames, int nModels)
+{
+  // allocating is fine offline
+  for (auto& buffer : mOfflineBuffer)
+  {
+    if (static_cast<int>(buffer.size()) < nFrames)
+      buffer.resize(nFrames);
+  }
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+  for (auto& buffer : mOfflineDoubleBuffer)
+  {
+    if (mDoubleActive && static_cast<int>(buffer.size()) < nFrames)
+      buffer.resize(nFrames);
+  }
+#endif
+  if (nModels > 1 && !mOfflineWorker)
+  {
+    mOfflineWorker.reset(new WorkerThread());
+  }
+
+  auto renderWith = [&](int c, auto& model, auto& film, auto* buffer) {
+    convert_block(inputs[c], buffer, nFrames);
+    const int block = mOfflineBlock > 0 ? mOfflineBlock : nFrames;
+    for (int offset = 0; offset < nFrames; offset += block)
     {
-      float input = inputs[c][s];
-      outputs[c][s] = mModel[c].processSample(input, mFilm.gamma, mFilm.beta);
+      model.processBlockLayerMajor(buffer + offset, buffer + offset, std::min(block, nFrames - offset), film.getGamma(), film.getBeta());
     }
+    convert_block(buffer, outputs[c], nFrames);
+  };
+  auto render = [&](int c) {
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+    if (mDoubleActive)
+      return renderWith(c, mModelDouble[c], mFilmDouble, mOfflineDoubleBuffer[c].data());
+#endif
+    renderWith(c, mModel[c], mFilm, mOfflineBuffer[c].data());
+  };
+
+  if (nModels > 1)
+  {
+    mOfflineWorker->run([&] { render(1); });
+  }
+  render(0);
+  if (nModels > 1)
+  {
+    mOfflineWorker->wait();
   }
 }
 #endif
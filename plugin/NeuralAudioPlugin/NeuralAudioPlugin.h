@@ -1,9 +1,33 @@
 #pragma once
 
 #include "IPlug_include_in_plug_hdr.h"
-#include "Model.h"
+#include "Engine.h"
 #include "FiLM.h"
+#include "QualityTiers.h"
+#include "WorkerThread.h"
 #include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#ifdef NEURAL_AUDIO_COMPILED_MODEL
+#include "model_compiled.h"
+#endif
+#ifdef NEURAL_AUDIO_AUTOTUNE
+#include "Autotune.h"
+#endif
+#ifdef NEURAL_AUDIO_PIPELINED
+#include "Pipeline.h"
+#endif
+#ifdef NEURAL_AUDIO_BATCHED
+#include "BatchEngine.h"
+#endif
+#ifdef NEURAL_AUDIO_LINEAR_BYPASS
+#include "SmallSignal.h"
+#endif
+#ifdef NEURAL_AUDIO_MODEL_BANK
+#include "ModelBank.h"
+#endif
 
 const int kNumPresets = 1;
 
@@ -11,9 +35,32 @@ enum EParams
 {
   kDrive = 0,
   kTone,
+#ifdef NEURAL_AUDIO_MODEL_BANK
+  kCapture,
+#endif
   kNumParams
 };
 
+// Parameters feeding the FiLM conditioning, drive and tone
+const int kNumConditioning = kTone + 1;
+
+// Most captures the Capture parameter lists, the built-in one included (NEURAL_AUDIO_MODEL_BANK)
+const int kMaxCaptures = 64;
+
+enum ECtrlTags
+{
+  kCtrlTagTier = 0,
+  kCtrlTagCapture
+};
+
+// Quality tiers, from the full capture to the cheapest (QualityTiers.h)
+enum ETiers
+{
+  kTierFull = 0,
+  kTierEco,
+  kNumTiers
+};
+
 using namespace iplug;
 using namespace igraphics;
 
@@ -26,11 +73,111 @@ public:
   void ProcessBlock(sample** inputs, sample** outputs, int nFrames) override;
 #endif
   void OnReset() override;
+  void OnIdle() override;
 private:
+#ifdef NEURAL_AUDIO_COMPILED_MODEL
+  CompiledFiLM<CompiledWeights> mFilm;                  // weights baked in by model2cpp.py
+  std::array<CompiledModel<CompiledWeights>, 2> mModel; // two models, one per channel
+#elif defined(NEURAL_AUDIO_AUTOTUNE)
+  FiLM<float, 16> mFilm;                    // 16 bytes alignment for SIMD operations
+  std::array<TunedEngine<16>, 2> mModel;    // engine variant tuned for this CPU, one per channel
+#else
   FiLM<float, 16> mFilm;                  // 16 bytes alignment for SIMD operations
-  std::array<Model<float, 16>, 2> mModel; // two models, one per channel
+  std::array<ModelEngine<float, 16>, 2> mModel; // two models, one per channel
+#endif
+#ifdef NEURAL_AUDIO_ECO_TIER
+  FiLM<float, 16> mEcoFilm;                        // cheaper capture from model_weights_eco.h
+  std::array<ModelEngine<float, 16>, 2> mEcoModel; // tier kTierEco, one per channel
+#endif
   bool mModelsOK = false;
   std::string mModelError;
 
+  // Quality tiers: when processing gets close to the real-time budget the plugin steps down to a
+  // cheaper capture (NEURAL_AUDIO_ECO_TIER in config.h), and back up when there is room again.
+  // The next tier starts from zero state and warms up on the live input for kTierWarmupSamples
+  // while the previous one keeps playing, then the two are crossfaded over kTierFadeSamples.
+  static constexpr int kTierWarmupSamples = 2048;
+  static constexpr int kTierFadeSamples = 512;
+  static constexpr int kTierTransitionSamples = kTierWarmupSamples + kTierFadeSamples;
+  TierSelector mTiers;
+  int mPreviousTier = kTierFull;          // playing, then fading out while mTransitionRemaining > 0
+  int mTransitionRemaining = 0;
+  std::array<float, kTierTransitionSamples> mPreviousBuffer; // previous tier's output during the transition
+  std::atomic<int> mDisplayedTier{kTierFull}; // active tier, for the UI
+  int mShownTier = -1;
+
+  template <typename F>
+  auto WithTier(int tier, int c, F&& f);
+  void SwitchTier(int previous);
+  void SyncChannels(int tier);
+
+  // Mono sources on a stereo bus: while both inputs are bit-identical only mModel[0] runs and its
+  // output is copied, mModel[1] takes over its state when the channels diverge
+  bool mChannelsShared = false;
+  std::vector<float> mStateBuffer; // hidden state snapshot, [mModel[0].stateSize()]
+
+  // Offline rendering (bounces) has no real-time deadline: blocks run through the layer-major
+  // path, the second channel on a worker thread. Same models and results as real time, equal up to
+  // float rounding for states narrower than a SIMD batch (see Model::processBlockLayerMajor), and
+  // the state carries over seamlessly when the host switches.
+#if IPLUG_DSP
+  void ProcessBlockOffline(sample** inputs, sample** outputs, int nFrames, int nModels);
+#endif
+  std::array<std::vector<float>, 2> mOfflineBuffer; // float copy of one channel's block
+  std::unique_ptr<WorkerThread> mOfflineWorker;     // started on the first offline stereo block
+  int mOfflineBlock = 0;                            // samples per layer-major call, 0 for the host block
+
+#ifdef NEURAL_AUDIO_DOUBLE_OFFLINE
+  // Double precision bounces (NEURAL_AUDIO_DOUBLE_OFFLINE in config.h): offline blocks run through
+  // a Model<double> on the host's double samples. The hidden state is handed over between the float
+  // and double models when the host switches, so a bounce continues from what was playing. The
+  // result differs from the float model by float rounding (about 6e-5 with the default model) and
+  // takes about 2.2x as long with AVX2, half as many lanes fit a batch.
+  FiLM<double, 16> mFilmDouble;
+  std::array<ModelEngine<double, 16>, 2> mModelDouble;
+  std::array<std::vector<double>, 2> mOfflineDoubleBuffer; // double copy of one channel's block
+  std::vector<double> mStateDouble;                        // hidden state snapshot, [mModelDouble[0].stateSize()]
+  bool mDoubleOK = false;
+  bool mDoubleActive = false; // the double models hold the current state
+  void SwitchPrecision(bool toDouble);
+#endif
+
+#ifdef NEURAL_AUDIO_AUTOTUNE
+  // Autotuning (NEURAL_AUDIO_AUTOTUNE in config.h): the models load the variant cached for this CPU
+  // and weight file. Without an entry they start as the default variant while mTuneWorker tunes,
+  // and switch to its result at the next reset.
+  TuneResult mTuneResult;             // written by the worker
+  std::atomic<bool> mTuneDone{false}; // mTuneResult is ready to be applied
+  std::unique_ptr<WorkerThread> mTuneWorker;
+#endif
+
+#ifdef NEURAL_AUDIO_PIPELINED
+  // Pipelined mode (NEURAL_AUDIO_PIPELINED in config.h): the models run on worker threads with one
+  // block of reported latency, real time and offline. It always renders the full tier on both
+  // channels, without the mono dedupe.
+  RealtimePipeline<decltype(mModel)::value_type> mPipeline;
+#endif
+
+#ifdef NEURAL_AUDIO_BATCHED
+  // Batched mode (NEURAL_AUDIO_BATCHED in config.h): instances with the same weights share the
+  // lanes of one BatchedModel while the host calls them in lockstep, with one block of reported
+  // latency. Like the pipelined mode it renders the full tier on both channels.
+  BatchClient<decltype(mModel)::value_type> mBatch;
+#endif
+
+#ifdef NEURAL_AUDIO_LINEAR_BYPASS
+  // Small-signal bypass (NEURAL_AUDIO_LINEAR_BYPASS in config.h): at full quality in real time, a
+  // channel whose input stays below the validated level is rendered by the linearized model
+  LinearBypass<decltype(mModel)::value_type> mBypass;
+#endif
+
+#ifdef NEURAL_AUDIO_MODEL_BANK
+  // Capture bank (NEURAL_AUDIO_MODEL_BANK in config.h): the built-in capture and the files of the
+  // user's capture folder, switched by the Capture parameter with a crossfade. It renders on its
+  // own engines, both channels at full quality.
+  ModelBank<16> mBank{kNumConditioning};
+  std::string mShownCapture;
+#endif
+
   double mLastSampleRate = 0.0;
 };
\ No newline at end of file
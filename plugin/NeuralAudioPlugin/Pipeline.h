@@ -0,0 +1,379 @@
+#pragma once
+
+#include "common.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#include <pthread/qos.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Best effort, a worker keeps its normal priority when the system refuses (e.g. no rtprio rights on
+// Linux). Threads are not pinned to cores, the scheduler keeps them apart when cores are free.
+inline void raiseThreadPriority() noexcept
+{
+#if defined(_WIN32)
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#elif defined(__APPLE__)
+  pthread_set_qos_class_self_np(QOS_CLASS_USER_INTERACTIVE, 0);
+#else
+  sched_param param{};
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+  pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+}
+
+// A worker thread of RealtimePipeline (and LinearBypass) running one fixed job per post. The handoff
+// is a single job slot, a lock-free SPSC queue of depth one: the audio thread posts, the worker
+// claims and completes the job, and the audio thread can take back a job the worker has not
+// started. After a job the worker spins for spinTime, then sleeps until the next post; only that
+// wake-up takes a lock.
+class RealtimeWorker
+{
+public:
+  static constexpr std::chrono::microseconds spinTime{1000};
+
+  // background: keep the normal thread priority, for jobs without a deadline
+  explicit RealtimeWorker(std::function<void()> job, bool background = false)
+  : job(std::move(job))
+  , background(background)
+  , thread([this] { loop(); })
+  {
+  }
+
+  ~RealtimeWorker()
+  {
+    quit = true;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+    }
+    wake.notify_one();
+    thread.join();
+  }
+
+  RealtimeWorker(const RealtimeWorker&) = delete;
+  RealtimeWorker& operator=(const RealtimeWorker&) = delete;
+
+  // Start the job, the previous one has to be finished
+  void post() noexcept
+  {
+    state = kPosted;
+    if (sleeping)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      wake.notify_one();
+    }
+  }
+
+  bool isDone() const noexcept { return state.load(std::memory_order_acquire) == kDone; }
+
+  // Wait for the posted job. Returns false if the worker had not started it: the job is taken back
+  // and the caller has to run it.
+  bool finish() noexcept
+  {
+    int expected = kPosted;
+    if (state.compare_exchange_strong(expected, kIdle))
+      return false;
+    while (state.load(std::memory_order_acquire) != kDone)
+      std::this_thread::yield();
+    state.store(kIdle, std::memory_order_relaxed);
+    return true;
+  }
+
+private:
+  enum
+  {
+    kIdle,
+    kPosted,
+    kRunning,
+    kDone
+  };
+
+  void loop()
+  {
+    if (!background)
+      raiseThreadPriority();
+    auto idleSince = std::chrono::steady_clock::now();
+    for (;;)
+    {
+      int expected = kPosted;
+      if (state.compare_exchange_strong(expected, kRunning))
+      {
+        job();
+        state.store(kDone, std::memory_order_release);
+        idleSince = std::chrono::steady_clock::now();
+        continue;
+      }
+      if (quit)
+        return;
+      if (std::chrono::steady_clock::now() - idleSince < spinTime)
+      {
+        std::this_thread::yield();
+        continue;
+      }
+
+      // post stores the state before it reads sleeping, so either it sees the flag or the
+      // predicate sees the post
+      std::unique_lock<std::mutex> lock(mutex);
+      sleeping = true;
+      wake.wait(lock, [this] { return state == kPosted || quit; });
+      sleeping = false;
+      idleSince = std::chrono::steady_clock::now();
+    }
+  }
+
+  std::function<void()> job;
+  bool background;
+  std::atomic<int> state{kIdle};
+  std::atomic<bool> sleeping{false};
+  std::atomic<bool> quit{false};
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::thread thread; // last, starts after the members above are initialized
+};
+
+// Runs the models of a plugin instance on worker threads with one block of added latency. Each
+// host block n is split in two stages: the front (in proj and the first half of the layers) runs
+// on one worker per channel while the audio thread runs the back (the other layers and the out
+// proj) of block n - 1, so a channel's layers overlap across blocks. Different layers of a model
+// never share state or scratch, so the stages of one model can run at the same time.
+//
+// The output is the input rendered by the models, delayed by getLatency() = maxFrames samples for
+// any sequence of block sizes. Host blocks are processed as they come, the out proj results go
+// through a FIFO holding exactly getLatency() samples between calls.
+//
+// Watchdog: a worker that has not finished its front stage when the next block arrives missed its
+// deadline. A job it has not started is taken back and run on the audio thread, one it is running
+// is waited for (the model state has to stay consistent). After a miss every stage runs inline on
+// the audio thread, with the same latency, for fallbackSeconds. Offline rendering has no deadline.
+// Machines with a single core always run inline.
+//
+// M is ModelEngine or CompiledModel (projectInput, processLayers, projectOutput, activationSize).
+template <typename M>
+class RealtimePipeline
+{
+public:
+  static constexpr int maxChannels = 2;
+  static constexpr double fallbackSeconds = 5.0;
+
+  RealtimePipeline() = default;
+  RealtimePipeline(const RealtimePipeline&) = delete;
+  RealtimePipeline& operator=(const RealtimePipeline&) = delete;
+
+  ~RealtimePipeline()
+  {
+    reset();
+  }
+
+  // Allocate for blocks of up to maxFrames samples (the latency) and start the workers. models
+  // holds one model per channel. Not real-time safe; nothing may be running (e.g. OnReset).
+  void prepare(M* models, int maxFrames, double sampleRate)
+  {
+    reset();
+    this->models = models;
+    numLayers = models[0].getNumLayers();
+    split = (numLayers + 1) / 2;
+    activationSize = models[0].activationSize();
+    latency = std::max(1, maxFrames);
+    fallbackSamples = static_cast<long long>(fallbackSeconds * sampleRate);
+
+    for (Block& block : blocks)
+    {
+      block.gamma.assign(activationSize, 0.0f);
+      block.beta.assign(activationSize, 0.0f);
+      for (int c = 0; c < maxChannels; ++c)
+      {
+        block.input[c].assign(latency, 0.0f);
+        block.activations[c].assign(static_cast<std::size_t>(latency) * activationSize, 0.0f);
+      }
+    }
+    for (auto& fifo : output)
+      fifo.assign(latency, 0.0f);
+    stage.assign(latency, 0.0f);
+
+    // the audio thread is busy with the back stages, every other core takes a channel
+    const int cores = static_cast<int>(std::thread::hardware_concurrency());
+    const int numWorkers = std::max(0, std::min(maxChannels, cores - 1));
+    for (int c = static_cast<int>(workers.size()); c < numWorkers; ++c)
+      workers.emplace_back(new RealtimeWorker([this, c] { front(blocks[frontBlock], c); }));
+
+    clear();
+  }
+
+  // Finish the stages in flight and start over with silence in the FIFO. Not real-time safe.
+  void reset() noexcept
+  {
+    for (int c = 0; c < maxChannels; ++c)
+    {
+      if (posted[c])
+        workers[c]->finish();
+      posted[c] = false;
+    }
+    clear();
+  }
+
+  int getLatency() const noexcept { return latency; }
+
+  // True while the watchdog keeps every stage on the audio thread
+  bool isInline() const noexcept { return cooldown > 0 || workers.empty(); }
+
+  // Render nFrames samples of nChans channels (1 or 2), gamma and beta being the conditioning of
+  // this block (at least activationSize values each). The host thread waits for the workers only
+  // when realtime is false.
+  template <typename S>
+  void process(const S* const* inputs, S** outputs, int nChans, int nFrames, const float* gamma, const float* beta, bool realtime) noexcept
+  {
+    if (nChans <= 0)
+      return;
+    nChans = std::min(nChans, maxChannels);
+    for (int offset = 0; offset < nFrames; offset += latency)
+      step(inputs, outputs, nChans, offset, std::min(latency, nFrames - offset), gamma, beta, realtime);
+  }
+
+private:
+  struct Block
+  {
+    int numSamples = 0; // 0 when there is no block
+    int numChannels = 0;
+    aligned_vector<float, 64> gamma;
+    aligned_vector<float, 64> beta;
+    std::array<aligned_vector<float, 64>, maxChannels> input;       // [maxFrames]
+    std::array<aligned_vector<float, 64>, maxChannels> activations; // [maxFrames][activationSize]
+  };
+
+  void clear() noexcept
+  {
+    for (Block& block : blocks)
+      block.numSamples = 0;
+    for (auto& fifo : output)
+      std::fill(fifo.begin(), fifo.end(), 0.0f);
+    readPos = writePos = 0;
+    current = 0;
+    cooldown = 0;
+  }
+
+  void front(Block& block, int c) noexcept
+  {
+    float* activations = block.activations[c].data();
+    models[c].projectInput(block.input[c].data(), activations, block.numSamples);
+    models[c].processLayers(activations, block.numSamples, 0, split, block.gamma.data(), block.beta.data());
+  }
+
+  // Into the FIFO, channels the block does not have repeat the first one
+  void back(Block& block) noexcept
+  {
+    const int n = block.numSamples;
+    for (int c = 0; c < maxChannels; ++c)
+    {
+      if (c < block.numChannels)
+      {
+        float* activations = block.activations[c].data();
+        models[c].processLayers(activations, n, split, numLayers, block.gamma.data(), block.beta.data());
+        models[c].projectOutput(activations, stage.data(), n);
+      }
+      for (int s = 0, pos = writePos; s < n; ++s, pos = pos + 1 < latency ? pos + 1 : 0)
+        output[c][pos] = stage[s];
+    }
+    writePos = (writePos + n) % latency;
+  }
+
+  // Wait for the front stages of block; returns true if a worker missed its deadline
+  bool finishFront(Block& block) noexcept
+  {
+    bool missed = false;
+    for (int c = 0; c < block.numChannels; ++c)
+    {
+      if (!posted[c])
+        continue;
+      posted[c] = false;
+      missed |= !workers[c]->isDone();
+      if (!workers[c]->finish())
+        front(block, c);
+    }
+    return missed;
+  }
+
+  template <typename S>
+  void step(const S* const* inputs, S** outputs, int nChans, int offset, int n, const float* gamma, const float* beta, bool realtime) noexcept
+  {
+    Block& previous = blocks[current ^ 1];
+    Block& next = blocks[current];
+
+    if (previous.numSamples > 0 && finishFront(previous) && realtime)
+      cooldown = fallbackSamples;
+
+    next.numSamples = n;
+    next.numChannels = nChans;
+    std::copy(gamma, gamma + activationSize, next.gamma.begin());
+    std::copy(beta, beta + activationSize, next.beta.begin());
+    for (int c = 0; c < nChans; ++c)
+      convert_block(inputs[c] + offset, next.input[c].data(), n);
+
+    // the front of this block on the workers, overlapping the back of the previous one here
+    const bool threaded = !realtime || cooldown == 0;
+    frontBlock = current;
+    for (int c = 0; c < nChans; ++c)
+    {
+      if (threaded && c < static_cast<int>(workers.size()))
+      {
+        workers[c]->post();
+        posted[c] = true;
+      }
+    }
+    if (previous.numSamples > 0)
+      back(previous);
+    for (int c = 0; c < nChans; ++c)
+    {
+      if (!posted[c])
+        front(next, c);
+    }
+
+    for (int c = 0; c < nChans; ++c)
+    {
+      for (int s = 0, pos = readPos; s < n; ++s, pos = pos + 1 < latency ? pos + 1 : 0)
+        outputs[c][offset + s] = static_cast<S>(output[c][pos]);
+    }
+    readPos = (readPos + n) % latency;
+
+    if (realtime && cooldown > 0)
+      cooldown = std::max(0LL, cooldown - n);
+    current ^= 1;
+  }
+
+  M* models = nullptr;
+  int numLayers = 0;
+  int split = 0; // layers [0, split) run in the front stage
+  int activationSize = 0;
+  int latency = 1;
+  long long fallbackSamples = 0;
+  long long cooldown = 0; // samples left in the inline fallback
+
+  std::array<Block, 2> blocks;
+  int current = 0;    // block filled by the next step, the other one is in flight
+  int frontBlock = 0; // block of the posted front stages, read by the workers
+  std::array<bool, maxChannels> posted = {};
+
+  std::array<std::vector<float>, maxChannels> output; // FIFO of the rendered samples, [latency]
+  int readPos = 0;
+  int writePos = 0;
+  std::vector<float> stage; // out proj of one channel, [latency]
+
+  std::vector<std::unique_ptr<RealtimeWorker>> workers; // last, destroyed first
+};
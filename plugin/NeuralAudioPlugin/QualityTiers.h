@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+
+// Thresholds of TierSelector, loads are fractions of the real-time budget
+struct TierSettings
+{
+  double downgradeLoad = 0.7;
+  double upgradeLoad = 0.35;
+  double holdSeconds = 2.0;
+  double smoothing = 0.05; // weight of the newest block in the smoothed load
+};
+
+// Picks the active quality tier of the plugin from the measured processing time of each block
+// against its real-time budget (nFrames / sample rate). Tier 0 is the full model, higher tiers are
+// cheaper. The load is smoothed over blocks; the selector steps down a tier when it stays above
+// downgradeLoad, and back up when the better tier's cost, scaled from the current load by the
+// measured cost ratio of the two tiers, would stay below upgradeLoad. After every switch it holds
+// for holdSeconds, so a tier is never left before its cost is known.
+class TierSelector
+{
+public:
+  static constexpr int maxTiers = 4;
+
+private:
+  TierSettings settings;
+  int numTiers = 1;
+  int active = 0;
+  double load = 0.0;
+  double held = 0.0;                       // seconds since the last switch
+  std::array<double, maxTiers> cost = {};  // smoothed seconds per sample of each tier, 0 until measured
+
+public:
+  explicit TierSelector(const TierSettings& settings = TierSettings())
+  : settings(settings)
+  {
+  }
+
+  void setNumTiers(int n) noexcept
+  {
+    numTiers = std::max(1, std::min(n, maxTiers));
+    reset();
+  }
+
+  // Back to the full model with no measurements, e.g. after a sample rate change
+  void reset() noexcept
+  {
+    active = 0;
+    load = 0.0;
+    held = 0.0;
+    cost.fill(0.0);
+  }
+
+  // Force a tier, e.g. the full model while rendering offline
+  void select(int tier) noexcept
+  {
+    tier = std::max(0, std::min(tier, numTiers - 1));
+    if (tier != active)
+      switchTo(tier);
+  }
+
+  int getNumTiers() const noexcept { return numTiers; }
+  int getActive() const noexcept { return active; }
+  double getLoad() const noexcept { return load; }
+
+  // Report a block of nFrames rendered by the active tier alone in the given time. Returns the tier
+  // to switch to, or the active one.
+  int update(double seconds, int nFrames, double sampleRate) noexcept
+  {
+    if (nFrames <= 0 || sampleRate <= 0.0)
+      return active;
+
+    const double budget = nFrames / sampleRate;
+    const double blockCost = seconds / nFrames;
+    cost[active] = cost[active] > 0.0 ? cost[active] + settings.smoothing * (blockCost - cost[active]) : blockCost;
+    load += settings.smoothing * (seconds / budget - load);
+    held += budget;
+
+    if (held < settings.holdSeconds)
+      return active;
+
+    if (load > settings.downgradeLoad && active + 1 < numTiers)
+      return switchTo(active + 1);
+    if (active > 0 && cost[active - 1] > 0.0 && load * cost[active - 1] / cost[active] < settings.upgradeLoad)
+      return switchTo(active - 1);
+    return active;
+  }
+
+private:
+  int switchTo(int tier) noexcept
+  {
+    // the load of the new tier, until it is measured
+    if (cost[tier] > 0.0)
+      load *= cost[tier] / cost[active];
+    active = tier;
+    held = 0.0;
+    return active;
+  }
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "ModelConfig.h"
+#include "json.hpp"
+#include <cmath>
+#include <complex>
+#include <vector>
+
+// The weights of a model as plain scalar arrays, discretized for one sample rate. Read by the
+// engines that do not use the SIMD batch layout of Model: BatchedModel broadcasts every weight to
+// its lanes, SmallSignal.h linearizes the network.
+template <typename T>
+struct ScalarWeights
+{
+  // Model parameters
+  ModelConfig config;
+  int d_model = 0;
+  int d_inner = 0;
+  int ssm_size = 0;
+  int num_layers = 0;
+
+  // Weights of one layer
+  struct Layer
+  {
+    std::vector<T> norm;     // [d_model]
+    T eps = T(0);
+    std::vector<T> in_proj;  // [2 * d_inner][d_model], u rows then res rows
+    std::vector<T> in_bias;  // [2 * d_inner]
+    std::vector<T> A_real;   // [ssm_size], continuous time
+    std::vector<T> A_imag;
+    std::vector<T> inv_dt;   // [ssm_size]
+    std::vector<T> B_real;   // [ssm_size][d_inner], continuous time
+    std::vector<T> B_imag;
+    std::vector<T> dA_real;  // [ssm_size], discretized
+    std::vector<T> dA_imag;
+    std::vector<T> dB;       // [2 * ssm_size][d_inner], discretized, real rows then imag rows
+    std::vector<T> C;        // [d_inner][2 * ssm_size], Re(C) then -Im(C), scaled by 2 with conj_sym
+    std::vector<T> D;        // [d_inner]
+    std::vector<T> out_proj; // [d_model][d_inner]
+    std::vector<T> out_bias; // [d_model]
+  };
+
+  std::vector<T> in_proj; // [d_model]
+  std::vector<T> in_bias; // [d_model]
+  std::vector<Layer> layers;
+  std::vector<T> out_proj; // [d_model]
+  T out_bias = T(0);
+
+  // Discretize A and B for the host sample rate, as Model::discretize_bilinear
+  void discretize_bilinear(const T& sr) noexcept
+  {
+    for (auto& layer : layers)
+    {
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        const T dt = T(48000) / sr * std::log(T(1) + std::exp(layer.inv_dt[p]));
+        const std::complex<T> A(layer.A_real[p], layer.A_imag[p]);
+        const std::complex<T> BL = T(1) / (T(1) - dt / T(2) * A);
+        const std::complex<T> dA = BL * (T(1) + dt / T(2) * A);
+        layer.dA_real[p] = dA.real();
+        layer.dA_imag[p] = dA.imag();
+        for (int k = 0; k < d_inner; ++k)
+        {
+          const std::complex<T> dB = BL * dt * std::complex<T>(layer.B_real[p * d_inner + k], layer.B_imag[p * d_inner + k]);
+          layer.dB[p * d_inner + k] = dB.real();
+          layer.dB[(ssm_size + p) * d_inner + k] = dB.imag();
+        }
+      }
+    }
+  }
+
+  // Load from the parsed model_weights.json (see Model::loadWeightsFromJson), discretized at the
+  // training rate until discretize_bilinear. Throws on malformed files.
+  void loadFromJson(const nlohmann::json& model_data)
+  {
+    config = ModelConfig::fromJson(model_data);
+    d_model = config.d_model;
+    d_inner = config.d_inner();
+    ssm_size = config.ssm_size();
+    num_layers = config.num_layers;
+    const T c_scale = config.conj_sym ? T(2) : T(1);
+    const auto& json_layers = model_data.at("layers");
+
+    // FilM weights at layers 0 and 1
+    const auto& in_layer = json_layers.at(2).at("weights");
+    const auto& out_layer = json_layers.at(num_layers + 3).at("weights");
+    in_proj.assign(d_model, T(0));
+    in_bias.assign(d_model, T(0));
+    out_proj.assign(d_model, T(0));
+    out_bias = T(0);
+    for (int j = 0; j < d_model; ++j)
+    {
+      in_proj[j] = static_cast<T>(in_layer.at(0)[j][0]);
+      out_proj[j] = static_cast<T>(out_layer.at(0)[0][j]);
+      if (config.bias)
+        in_bias[j] = static_cast<T>(in_layer.at(1)[j]);
+    }
+    if (config.bias)
+      out_bias = static_cast<T>(out_layer.at(1)[0]);
+
+    layers.assign(num_layers, Layer());
+    for (int i = 0; i < num_layers; ++i)
+    {
+      Layer& layer = layers[i];
+      const auto& params = json_layers.at(i + 3).at("parameters");
+      const auto& mamba = params.at("mamba");
+
+      layer.norm.resize(d_model);
+      for (int j = 0; j < d_model; ++j)
+        layer.norm[j] = static_cast<T>(params.at("norm").at("weight")[j]);
+      layer.eps = static_cast<T>(params.at("norm").at("eps"));
+
+      const auto& w_in = mamba.at("in_proj").at("weights");
+      layer.in_proj.resize(2 * d_inner * d_model);
+      layer.in_bias.assign(2 * d_inner, T(0));
+      for (int k = 0; k < 2 * d_inner; ++k)
+      {
+        for (int j = 0; j < d_model; ++j)
+          layer.in_proj[k * d_model + j] = static_cast<T>(w_in[k][j]);
+        if (config.bias)
+          layer.in_bias[k] = static_cast<T>(mamba.at("in_proj").at("bias")[k]);
+      }
+
+      const auto& w_out = mamba.at("out_proj").at("weights");
+      layer.out_proj.resize(d_model * d_inner);
+      layer.out_bias.assign(d_model, T(0));
+      for (int j = 0; j < d_model; ++j)
+      {
+        for (int k = 0; k < d_inner; ++k)
+          layer.out_proj[j * d_inner + k] = static_cast<T>(w_out[j][k]);
+        if (config.bias)
+          layer.out_bias[j] = static_cast<T>(mamba.at("out_proj").at("bias")[j]);
+      }
+
+      layer.A_real.resize(ssm_size);
+      layer.A_imag.resize(ssm_size);
+      layer.inv_dt.resize(ssm_size);
+      layer.B_real.resize(ssm_size * d_inner);
+      layer.B_imag.resize(ssm_size * d_inner);
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        layer.A_real[p] = static_cast<T>(mamba.at("A_real")[p]);
+        layer.A_imag[p] = static_cast<T>(mamba.at("A_imag")[p]);
+        layer.inv_dt[p] = static_cast<T>(mamba.at("inv_dt")[p]);
+        for (int k = 0; k < d_inner; ++k)
+        {
+          layer.B_real[p * d_inner + k] = static_cast<T>(mamba.at("B_real")[p][k]);
+          layer.B_imag[p * d_inner + k] = static_cast<T>(mamba.at("B_imag")[p][k]);
+        }
+      }
+      layer.dA_real.assign(ssm_size, T(0));
+      layer.dA_imag.assign(ssm_size, T(0));
+      layer.dB.assign(2 * ssm_size * d_inner, T(0));
+
+      // Re(C h) = Re(C) Re(h) - Im(C) Im(h)
+      layer.C.resize(d_inner * 2 * ssm_size);
+      layer.D.resize(d_inner);
+      for (int k = 0; k < d_inner; ++k)
+      {
+        for (int p = 0; p < ssm_size; ++p)
+        {
+          layer.C[k * 2 * ssm_size + p] = c_scale * static_cast<T>(mamba.at("C_real")[k][p]);
+          layer.C[k * 2 * ssm_size + ssm_size + p] = -c_scale * static_cast<T>(mamba.at("C_imag")[k][p]);
+        }
+        layer.D[k] = static_cast<T>(mamba.at("D")[k]);
+      }
+    }
+
+    discretize_bilinear(T(48000));
+  }
+};
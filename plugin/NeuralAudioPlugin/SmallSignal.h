@@ -0,0 +1,738 @@
+#pragma once
+
+#include "BatchedModel.h"
+#include "Pipeline.h"
+#include "common.h"
+#include "xsimd/xsimd.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <memory>
+#include <vector>
+
+// Small-signal linearization of the model for one FiLM conditioning. Around the operating point of
+// zero input (the steady state the biases settle to) the network is a linear system whose poles
+// are the discretized A of every layer, so it is exactly a bank of complex one-pole filters:
+//
+//   y[n] = dc + direct e[n] + Re(sum_m residue_m s_m[n]),  s_m[n] = pole_m s_m[n - 1] + e[n]
+//
+// The model's hidden state follows from the modal state as steadyState + stateMap [Re s; Im s],
+// so full inference can resume where the filter left off.
+template <typename T>
+struct LinearModel
+{
+  using v_type = xsimd::simd_type<T>;
+  using v_vector = aligned_vector<v_type, alignof(v_type)>;
+
+  int numModes = 0;
+  T dc = T(0);
+  T direct = T(0);
+  v_vector pole_real; // [ceil(numModes / v_size)], padding modes are zero
+  v_vector pole_imag;
+  v_vector residue_real;
+  v_vector residue_imag;
+  std::vector<T> steadyState; // Model::getState layout
+  std::vector<T> stateMap;    // [steadyState.size()][2 * numModes], real then imaginary parts of s
+
+  // Largest input peak at which the filter matched the model within the tolerance, 0 if none
+  T threshold = T(0);
+};
+
+// Settings of the threshold validation in Linearizer
+struct LinearizerSettings
+{
+  int numLevels = 8;        // peak levels from maxLevel down in 6 dB steps
+  double maxLevel = 0.25;   // -12 dBFS
+  int testSamples = 2048;   // test signal length
+  double tolerance = 0.01;  // RMS error relative to the signal, -40 dB
+  double minPoleDistance = 1e-5; // closer poles of different layers count as repeated
+};
+
+// Builds the LinearModel of the loaded weights for a conditioning, and validates the level up to
+// which it holds by rendering a test signal at numLevels levels through a BatchedModel (one lane
+// per level, started from the steady state). The analysis runs in double precision. Allocates.
+template <typename T>
+class Linearizer
+{
+public:
+  explicit Linearizer(const LinearizerSettings& settings = LinearizerSettings())
+  : settings(settings)
+  {
+  }
+
+  bool initFromJson(const char* data, std::size_t size) noexcept { return model.initFromJson(data, size); }
+  const std::string& getLastError() const noexcept { return model.getLastError(); }
+  const ModelConfig& getConfig() const noexcept { return model.getConfig(); }
+
+  void discretize_bilinear(const T& sr) noexcept
+  {
+    model.discretize_bilinear(sr);
+    sampleRate = static_cast<double>(sr);
+  }
+
+  // Linearize for the conditioning gamma, beta (d_model values each) and validate the threshold.
+  // Returns false, with a threshold of 0, if two layers share a pole (see analyze).
+  bool linearize(const T* gamma, const T* beta, LinearModel<T>& out)
+  {
+    if (!analyze(gamma, beta, out))
+    {
+      out.threshold = T(0);
+      return false;
+    }
+    validate(gamma, beta, out);
+    return true;
+  }
+
+private:
+  using complex = std::complex<double>;
+
+  static double sigmoid(double x) { return 1.0 / (1.0 + std::exp(-x)); }
+  static double silu(double x) { return x * sigmoid(x); }
+  static double siluDerivative(double x)
+  {
+    const double s = sigmoid(x);
+    return s * (1.0 + x * (1.0 - s));
+  }
+
+  // A signal as its impulse response to the input: value0 at n = 0 plus Re(sum_m mode_m pole_m^n).
+  // One row of d values per mode.
+  struct Response
+  {
+    std::vector<double> value0;  // [d]
+    std::vector<complex> modes;  // [numModes][d]
+  };
+
+  // Returns false if a pole of one layer (nearly) repeats one of an earlier layer: the response then
+  // has n pole^n terms, which a bank of one-pole filters cannot render, and the partial fractions
+  // below would divide by the pole distance. Those terms are left at zero so out stays finite.
+  bool analyze(const T* gamma, const T* beta, LinearModel<T>& out)
+  {
+    const ScalarWeights<T>& w = model.getWeights();
+    const int d_model = w.d_model;
+    const int d_inner = w.d_inner;
+    const int P = w.ssm_size;
+    const int L = w.num_layers;
+    const int N = L * P;
+    const int stateSize = 2 * L * P;
+
+    std::vector<complex> poles(N);
+    for (int i = 0; i < L; ++i)
+      for (int p = 0; p < P; ++p)
+        poles[i * P + p] = complex(w.layers[i].dA_real[p], w.layers[i].dA_imag[p]);
+
+    out.numModes = N;
+    out.steadyState.assign(stateSize, T(0));
+    out.stateMap.assign(static_cast<std::size_t>(stateSize) * 2 * N, T(0));
+
+    // operating point x and the response of dx to the input
+    std::vector<double> x(d_model);
+    Response dx{std::vector<double>(d_model), std::vector<complex>(static_cast<std::size_t>(N) * d_model)};
+    for (int j = 0; j < d_model; ++j)
+    {
+      x[j] = w.in_bias[j];
+      dx.value0[j] = w.in_proj[j];
+    }
+
+    std::vector<double> v(d_model), p(2 * d_inner), act(2 * d_inner), slope(2 * d_inner), y_pre(d_inner);
+    Response dn{std::vector<double>(d_model), std::vector<complex>(static_cast<std::size_t>(N) * d_model)};
+    Response dp{std::vector<double>(2 * d_inner), std::vector<complex>(static_cast<std::size_t>(N) * 2 * d_inner)};
+    Response dy{std::vector<double>(d_inner), std::vector<complex>(static_cast<std::size_t>(N) * d_inner)};
+    std::vector<complex> a(static_cast<std::size_t>(P) * N), b(static_cast<std::size_t>(P) * N); // h_p = sum_m a s_m + b conj(s_m)
+    bool distinct = true;
+
+    for (int i = 0; i < L; ++i)
+    {
+      const typename ScalarWeights<T>::Layer& layer = w.layers[i];
+
+      // FiLM and RMS norm: dn = diag(norm) / r (I - v v^T / (d r^2)) diag(gamma) dx
+      double sum = 0.0;
+      for (int j = 0; j < d_model; ++j)
+      {
+        v[j] = gamma[j] * x[j] + beta[j];
+        sum += v[j] * v[j];
+      }
+      const double r = std::sqrt(layer.eps + sum / d_model);
+      auto norm = [&](const auto* in, auto* result) {
+        auto dot = in[0] * 0.0;
+        for (int j = 0; j < d_model; ++j)
+          dot += v[j] * static_cast<double>(gamma[j]) * in[j];
+        for (int j = 0; j < d_model; ++j)
+          result[j] = layer.norm[j] / r * (static_cast<double>(gamma[j]) * in[j] - v[j] * dot / (d_model * r * r));
+      };
+      norm(dx.value0.data(), dn.value0.data());
+      for (int m = 0; m < i * P; ++m)
+        norm(dx.modes.data() + m * d_model, dn.modes.data() + m * d_model);
+
+      // in proj and silu of [u | res]
+      auto project = [&](const auto* in, auto* result, bool bias) {
+        for (int k = 0; k < 2 * d_inner; ++k)
+        {
+          auto acc = in[0] * 0.0 + (bias ? static_cast<double>(layer.in_bias[k]) : 0.0);
+          for (int j = 0; j < d_model; ++j)
+            acc += static_cast<double>(layer.in_proj[k * d_model + j]) * in[j];
+          result[k] = acc;
+        }
+      };
+      std::vector<double> n_star(d_model);
+      for (int j = 0; j < d_model; ++j)
+        n_star[j] = layer.norm[j] * v[j] / r;
+      project(n_star.data(), p.data(), true);
+      for (int k = 0; k < 2 * d_inner; ++k)
+      {
+        act[k] = silu(p[k]);
+        slope[k] = siluDerivative(p[k]);
+      }
+      project(dn.value0.data(), dp.value0.data(), false);
+      for (int k = 0; k < 2 * d_inner; ++k)
+        dp.value0[k] *= slope[k];
+      for (int m = 0; m < i * P; ++m)
+      {
+        complex* row = dp.modes.data() + m * 2 * d_inner;
+        project(dn.modes.data() + m * d_model, row, false);
+        for (int k = 0; k < 2 * d_inner; ++k)
+          row[k] *= slope[k];
+      }
+      const double* u = act.data();
+      const double* res = act.data() + d_inner;
+
+      // S5: the steady state h = dB u / (1 - dA), and the response of dh through partial
+      // fractions, pole^n * nu^n = (nu pole^n - mu mu^n) / (nu - mu) for the pole mu of state p
+      std::fill(a.begin(), a.end(), complex(0.0));
+      std::fill(b.begin(), b.end(), complex(0.0));
+      std::vector<complex> h(P);
+      for (int q = 0; q < P; ++q)
+      {
+        const complex mu = poles[i * P + q];
+        auto dB = [&](int k) { return complex(layer.dB[q * d_inner + k], layer.dB[(P + q) * d_inner + k]); };
+
+        complex drive(0.0), drive0(0.0);
+        for (int k = 0; k < d_inner; ++k)
+        {
+          drive += dB(k) * u[k];
+          drive0 += dB(k) * dp.value0[k];
+        }
+        h[q] = drive / (1.0 - mu);
+        out.steadyState[2 * i * P + q] = static_cast<T>(h[q].real());
+        out.steadyState[(2 * i + 1) * P + q] = static_cast<T>(h[q].imag());
+
+        complex own = drive0;
+        for (int m = 0; m < i * P; ++m)
+        {
+          const complex* U = dp.modes.data() + m * 2 * d_inner;
+          complex alpha(0.0), alpha_conj(0.0);
+          for (int k = 0; k < d_inner; ++k)
+          {
+            alpha += 0.5 * dB(k) * U[k];
+            alpha_conj += 0.5 * dB(k) * std::conj(U[k]);
+          }
+          const complex nu = poles[m];
+          const complex nu_conj = std::conj(nu);
+          if (std::abs(nu - mu) < settings.minPoleDistance || std::abs(nu_conj - mu) < settings.minPoleDistance)
+          {
+            distinct = false;
+            continue;
+          }
+          a[q * N + m] = alpha * nu / (nu - mu);
+          b[q * N + m] = alpha_conj * nu_conj / (nu_conj - mu);
+          own -= alpha * mu / (nu - mu) + alpha_conj * mu / (nu_conj - mu);
+        }
+        a[q * N + i * P + q] += own;
+
+        // Re h = (Re a + Re b) Re s + (Im b - Im a) Im s, Im h = (Im a + Im b) Re s + (Re a - Re b) Im s
+        T* re = out.stateMap.data() + static_cast<std::size_t>(2 * i * P + q) * 2 * N;
+        T* im = out.stateMap.data() + static_cast<std::size_t>((2 * i + 1) * P + q) * 2 * N;
+        for (int m = 0; m <= i * P + q; ++m)
+        {
+          const complex am = a[q * N + m], bm = b[q * N + m];
+          re[m] = static_cast<T>(am.real() + bm.real());
+          re[N + m] = static_cast<T>(bm.imag() - am.imag());
+          im[m] = static_cast<T>(am.imag() + bm.imag());
+          im[N + m] = static_cast<T>(am.real() - bm.real());
+        }
+      }
+
+      // y = (Re(C h) + D u) * res, C row k as Re(C) and -Im(C)
+      auto C = [&](int k, int q) { return complex(layer.C[k * 2 * P + q], -layer.C[k * 2 * P + P + q]); };
+      for (int k = 0; k < d_inner; ++k)
+      {
+        complex ch(0.0);
+        for (int q = 0; q < P; ++q)
+          ch += C(k, q) * h[q];
+        y_pre[k] = ch.real() + layer.D[k] * u[k];
+      }
+      for (int k = 0; k < d_inner; ++k)
+      {
+        dy.value0[k] = res[k] * layer.D[k] * dp.value0[k] + y_pre[k] * dp.value0[d_inner + k];
+        for (int m = 0; m < (i + 1) * P; ++m)
+        {
+          complex ca(0.0), cb(0.0);
+          for (int q = 0; q < P; ++q)
+          {
+            ca += C(k, q) * a[q * N + m];
+            cb += C(k, q) * b[q * N + m];
+          }
+          const complex* U = dp.modes.data() + m * 2 * d_inner;
+          const complex dU = m < i * P ? U[k] : complex(0.0);
+          const complex dRes = m < i * P ? U[d_inner + k] : complex(0.0);
+          dy.modes[m * d_inner + k] = res[k] * (ca + std::conj(cb) + static_cast<double>(layer.D[k]) * dU) + y_pre[k] * dRes;
+        }
+      }
+
+      // out proj and residual connection
+      for (int j = 0; j < d_model; ++j)
+      {
+        double acc = layer.out_bias[j] + x[j];
+        double acc0 = dx.value0[j];
+        for (int k = 0; k < d_inner; ++k)
+        {
+          acc += layer.out_proj[j * d_inner + k] * y_pre[k] * res[k];
+          acc0 += layer.out_proj[j * d_inner + k] * dy.value0[k];
+        }
+        x[j] = acc;
+        dx.value0[j] = acc0;
+      }
+      for (int m = 0; m < (i + 1) * P; ++m)
+      {
+        complex* row = dx.modes.data() + m * d_model;
+        const complex* in = dy.modes.data() + m * d_inner;
+        for (int j = 0; j < d_model; ++j)
+        {
+          complex acc = row[j];
+          for (int k = 0; k < d_inner; ++k)
+            acc += static_cast<double>(layer.out_proj[j * d_inner + k]) * in[k];
+          row[j] = acc;
+        }
+      }
+    }
+
+    // out proj
+    double dc = w.out_bias, direct = 0.0;
+    for (int j = 0; j < d_model; ++j)
+    {
+      dc += w.out_proj[j] * x[j];
+      direct += w.out_proj[j] * dx.value0[j];
+    }
+    out.dc = static_cast<T>(dc);
+    out.direct = static_cast<T>(direct);
+
+    constexpr int v_size = static_cast<int>(LinearModel<T>::v_type::size);
+    const int v_modes = ceil_div(N, v_size);
+    std::vector<T> pr(v_modes * v_size, T(0)), pi(pr.size(), T(0)), rr(pr.size(), T(0)), ri(pr.size(), T(0));
+    for (int m = 0; m < N; ++m)
+    {
+      complex residue(0.0);
+      for (int j = 0; j < d_model; ++j)
+        residue += static_cast<double>(w.out_proj[j]) * dx.modes[m * d_model + j];
+      pr[m] = static_cast<T>(poles[m].real());
+      pi[m] = static_cast<T>(poles[m].imag());
+      rr[m] = static_cast<T>(residue.real());
+      ri[m] = static_cast<T>(residue.imag());
+    }
+    out.pole_real.resize(v_modes);
+    out.pole_imag.resize(v_modes);
+    out.residue_real.resize(v_modes);
+    out.residue_imag.resize(v_modes);
+    for (int m = 0; m < v_modes; ++m)
+    {
+      out.pole_real[m] = xsimd::load_unaligned(pr.data() + m * v_size);
+      out.pole_imag[m] = xsimd::load_unaligned(pi.data() + m * v_size);
+      out.residue_real[m] = xsimd::load_unaligned(rr.data() + m * v_size);
+      out.residue_imag[m] = xsimd::load_unaligned(ri.data() + m * v_size);
+    }
+    return distinct;
+  }
+
+  void validate(const T* gamma, const T* beta, LinearModel<T>& out);
+
+  LinearizerSettings settings;
+  BatchedModel<T> model;
+  double sampleRate = 48000.0;
+};
+
+// The LinearModel as a filter, one per channel. The modal state depends on the poles only, so it
+// stays valid when the LinearModel is rebuilt for another conditioning at the same sample rate.
+template <typename T>
+class ModalFilter
+{
+public:
+  using v_type = xsimd::simd_type<T>;
+
+  // Allocate for numModes modes (LinearModel::numModes) and clear the state
+  void prepare(int numModes)
+  {
+    state_real.assign(ceil_div(numModes, static_cast<int>(v_type::size)), v_type(T(0)));
+    state_imag.assign(state_real.size(), v_type(T(0)));
+  }
+
+  void reset() noexcept
+  {
+    std::fill(state_real.begin(), state_real.end(), v_type(T(0)));
+    std::fill(state_imag.begin(), state_imag.end(), v_type(T(0)));
+  }
+
+  inline void processBlock(const LinearModel<T>& model, const T* input, T* output, int numSamples) noexcept
+  {
+    const int v_modes = static_cast<int>(state_real.size());
+    for (int s = 0; s < numSamples; ++s)
+    {
+      const v_type e(input[s]);
+      v_type acc(T(0));
+      for (int m = 0; m < v_modes; ++m)
+      {
+        const v_type re = model.pole_real[m] * state_real[m] - model.pole_imag[m] * state_imag[m] + e;
+        const v_type im = model.pole_real[m] * state_imag[m] + model.pole_imag[m] * state_real[m];
+        state_real[m] = re;
+        state_imag[m] = im;
+        acc += model.residue_real[m] * re - model.residue_imag[m] * im;
+      }
+      output[s] = model.dc + model.direct * input[s] + xsimd::reduce_add(acc);
+    }
+  }
+
+  // Hidden state of the model matching the modal state, Model::getState layout
+  void getModelState(const LinearModel<T>& model, T* state) const noexcept
+  {
+    constexpr int v_size = static_cast<int>(v_type::size);
+    const int N = model.numModes;
+    alignas(alignof(v_type)) T re[v_size], im[v_size];
+    const int size = static_cast<int>(model.steadyState.size());
+    for (int r = 0; r < size; ++r)
+      state[r] = model.steadyState[r];
+    for (int m = 0; m < static_cast<int>(state_real.size()); ++m)
+    {
+      state_real[m].store_aligned(re);
+      state_imag[m].store_aligned(im);
+      for (int l = 0; l < v_size && m * v_size + l < N; ++l)
+      {
+        const int mode = m * v_size + l;
+        for (int r = 0; r < size; ++r)
+        {
+          const T* row = model.stateMap.data() + static_cast<std::size_t>(r) * 2 * N;
+          state[r] += row[mode] * re[l] + row[N + mode] * im[l];
+        }
+      }
+    }
+  }
+
+private:
+  aligned_vector<v_type, alignof(v_type)> state_real;
+  aligned_vector<v_type, alignof(v_type)> state_imag;
+};
+
+template <typename T>
+void Linearizer<T>::validate(const T* gamma, const T* beta, LinearModel<T>& out)
+{
+  constexpr int lanes = BatchedModel<T>::lanes;
+  const int d_model = model.getConfig().d_model;
+  const int n = settings.testSamples;
+  const int numBanks = ceil_div(settings.numLevels, lanes);
+  while (model.getNumBanks() < numBanks)
+    model.addBank();
+
+  // a chord of decaying partials around the guitar range, peak 1
+  std::vector<T> test(n), linear(n);
+  double peak = 0.0;
+  for (int s = 0; s < n; ++s)
+  {
+    const double w = 2.0 * 3.14159265358979323846 * s / sampleRate;
+    const double x = std::sin(110.0 * w) + 0.5 * std::sin(440.0 * w + 1.0) + 0.25 * std::sin(1760.0 * w + 2.0);
+    test[s] = static_cast<T>(x);
+    peak = std::max(peak, std::abs(x));
+  }
+  for (auto& x : test)
+    x = static_cast<T>(x / peak);
+
+  ModalFilter<T> filter;
+  filter.prepare(out.numModes);
+  filter.processBlock(out, test.data(), linear.data(), n);
+
+  std::vector<T> input(static_cast<std::size_t>(n) * lanes), output(input.size());
+  std::vector<T> g(static_cast<std::size_t>(d_model) * lanes), bt(g.size());
+  std::vector<int> counts(lanes, n);
+  for (int j = 0; j < d_model; ++j)
+  {
+    std::fill(g.begin() + j * lanes, g.begin() + (j + 1) * lanes, gamma[j]);
+    std::fill(bt.begin() + j * lanes, bt.begin() + (j + 1) * lanes, beta[j]);
+  }
+
+  // levels from the loudest down, the threshold is the loudest one from which every quieter
+  // level passes
+  out.threshold = T(0);
+  bool passing = true;
+  std::vector<double> levels(settings.numLevels);
+  std::vector<bool> passed(settings.numLevels);
+  for (int b = 0; b < numBanks; ++b)
+  {
+    for (int l = 0; l < lanes; ++l)
+    {
+      const int level = std::min(b * lanes + l, settings.numLevels - 1);
+      levels[level] = settings.maxLevel * std::pow(0.5, level);
+      model.setLaneState(b, l, out.steadyState.data());
+      for (int s = 0; s < n; ++s)
+        input[s * lanes + l] = static_cast<T>(levels[level] * test[s]);
+    }
+    model.processBlock(b, input.data(), output.data(), n, counts.data(), g.data(), bt.data());
+    for (int l = 0; l < lanes && b * lanes + l < settings.numLevels; ++l)
+    {
+      const int level = b * lanes + l;
+      double error = 0.0, signal = 0.0;
+      for (int s = 0; s < n; ++s)
+      {
+        const double expected = levels[level] * (linear[s] - out.dc);
+        const double diff = output[s * lanes + l] - out.dc - expected;
+        error += diff * diff;
+        signal += expected * expected;
+      }
+      passed[level] = signal > 0.0 && error <= settings.tolerance * settings.tolerance * signal;
+    }
+  }
+  for (int level = settings.numLevels - 1; level >= 0 && passing; --level)
+  {
+    passing = passed[level];
+    if (passing)
+      out.threshold = static_cast<T>(levels[level]);
+  }
+}
+
+// Real-time small-signal bypass of a plugin's models: while a channel's input stays below the
+// validated threshold of the LinearModel for the current conditioning, the modal filter renders it
+// instead of the model. The filter runs on every block, so it is warm whenever the input gets
+// quiet. It takes over with a crossfade of fadeSamples once its output matches the model's; on
+// leaving, the model continues from the hidden state matching the filter's.
+//
+// The linearization depends on the knobs: a change of the conditioning starts a new one on a
+// worker thread (about 10 ms for the default model), the channels run the model until it is done.
+// The modal state only depends on the poles, it carries over to the new LinearModel.
+//
+// The threshold depends on the conditioning: over the drive and tone range of the default model it
+// lies between -54 and -30 dBFS, and at some settings no level passes, so the filter never takes
+// over. Below it a channel costs about 1/80 of the model.
+//
+// M is ModelEngine or CompiledModel (processBlock, setState).
+template <typename M>
+class LinearBypass
+{
+public:
+  static constexpr int maxChannels = 2;
+  static constexpr int fadeSamples = 128;
+  static constexpr double releaseSeconds = 0.05; // envelope release of the input peak
+  static constexpr float entryError = 1e-4f;      // largest model to filter difference to enter, -80 dBFS
+
+  // Load the weights for the linearization from a model_weights.json blob. Allocates.
+  bool initFromJson(const char* data, std::size_t size)
+  {
+    if (!linearizer.initFromJson(data, size))
+      return false;
+    const ModelConfig& config = linearizer.getConfig();
+    numModes = config.num_layers * config.ssm_size();
+    state.resize(2 * numModes);
+    for (auto& g : conditioning)
+      g.resize(2 * config.d_model);
+    worker.reset(new RealtimeWorker(
+      [this] {
+        const int back = 1 - front;
+        const int d_model = static_cast<int>(conditioning[back].size()) / 2;
+        linearizer.linearize(conditioning[back].data(), conditioning[back].data() + d_model, linear[back]);
+      },
+      true));
+    return true;
+  }
+
+  const std::string& getLastError() const noexcept { return linearizer.getLastError(); }
+
+  // Loaded, the plugin runs the model alone otherwise
+  bool isEnabled() const noexcept { return worker != nullptr; }
+
+  // Sample rate change or reset of the models: linearize for gamma, beta in place and start the
+  // channels over from the steady state. Not real-time, waits for a linearization in flight.
+  void prepare(double sampleRate, const float* gamma, const float* beta)
+  {
+    if (!worker)
+      return;
+    if (running)
+    {
+      worker->finish(); // a job not started yet is dropped, linear[front] is rebuilt below
+      running = false;
+    }
+    linearizer.discretize_bilinear(static_cast<float>(sampleRate));
+    setConditioning(conditioning[front], gamma, beta);
+    linearizer.linearize(gamma, beta, linear[front]);
+    release = std::exp(-1.0 / (releaseSeconds * sampleRate));
+    for (Channel& ch : channels)
+    {
+      ch.filter.prepare(numModes);
+      ch.envelope = 0.0f;
+      ch.linear = false;
+      ch.stale = false;
+      ch.fade = 0;
+    }
+  }
+
+  // Once per block with the current conditioning: picks up a finished linearization and starts
+  // the next one when the conditioning changed. The handover is the worker's atomic job slot, so
+  // this does not lock or allocate (only a post to a sleeping worker takes its lock to wake it).
+  void update(const float* gamma, const float* beta) noexcept
+  {
+    if (!worker)
+      return;
+    if (running && worker->isDone())
+    {
+      worker->finish(); // returns at once
+      running = false;
+      front = 1 - front;
+    }
+    ready = matches(conditioning[front], gamma, beta);
+    if (!ready && !running)
+    {
+      setConditioning(conditioning[1 - front], gamma, beta);
+      running = true;
+      worker->post();
+    }
+  }
+
+  // Render channel c at full quality: the modal filter while the input is small, the model
+  // otherwise, crossfading between the two
+  template <typename S>
+  void process(int c, const S* input, S* output, int numSamples, M& model, const float* gamma, const float* beta) noexcept
+  {
+    Channel& ch = channels[c];
+    const LinearModel<float>& lm = linear[front];
+    for (int offset = 0; offset < numSamples; offset += chunkSize)
+    {
+      const int n = std::min(chunkSize, numSamples - offset);
+      measure(ch, input + offset, n);
+
+      const bool quiet = ready && ch.envelope < lm.threshold;
+      if (!quiet && ch.linear)
+      {
+        // the model continues from the filter's state without a step, a crossfade in progress is
+        // reversed from where it is
+        ch.fade = ch.stale ? 0 : fadeSamples - ch.fade;
+        if (ch.stale)
+          restore(ch, model);
+        ch.linear = false;
+      }
+      ch.filter.processBlock(lm, modelIn.data(), linearOut.data(), n);
+
+      if (ch.linear && ch.fade == 0)
+      {
+        ch.stale = true;
+        for (int s = 0; s < n; ++s)
+          output[offset + s] = linearOut[s];
+        continue;
+      }
+
+      // the filter takes over once it renders what the model does, e.g. not before the model
+      // has settled after a conditioning change
+      model.processBlock(modelIn.data(), modelOut.data(), n, gamma, beta);
+      if (quiet && !ch.linear && agrees(n))
+      {
+        ch.linear = true;
+        ch.fade = fadeSamples - ch.fade;
+      }
+      for (int s = 0; s < n; ++s)
+      {
+        const float target = ch.linear ? linearOut[s] : modelOut[s];
+        if (ch.fade > 0)
+        {
+          const float previous = ch.linear ? modelOut[s] : linearOut[s];
+          output[offset + s] = target + static_cast<float>(ch.fade) / fadeSamples * (previous - target);
+          ch.fade--;
+        }
+        else
+          output[offset + s] = target;
+      }
+    }
+  }
+
+  // Channel c rendered by the model elsewhere (another tier, offline): the model takes its state
+  // back if the filter was rendering, and the filter keeps following the input
+  template <typename S>
+  void track(int c, const S* input, int numSamples, M& model) noexcept
+  {
+    Channel& ch = channels[c];
+    if (ch.stale)
+      restore(ch, model);
+    ch.linear = false;
+    ch.fade = 0;
+    for (int offset = 0; offset < numSamples; offset += chunkSize)
+    {
+      const int n = std::min(chunkSize, numSamples - offset);
+      measure(ch, input + offset, n);
+      ch.filter.processBlock(linear[front], modelIn.data(), linearOut.data(), n);
+    }
+  }
+
+  // Channel 1 continues as channel 0, for the mono dedupe
+  void syncChannels() noexcept { channels[1] = channels[0]; }
+
+private:
+  static constexpr int chunkSize = 256;
+
+  struct Channel
+  {
+    ModalFilter<float> filter;
+    float envelope = 0.0f; // input peak with release
+    bool linear = false;   // the filter renders, or is being faded to
+    bool stale = false;    // the model skipped samples, its state is behind
+    int fade = 0;          // crossfade samples left
+  };
+
+  static bool matches(const std::vector<float>& c, const float* gamma, const float* beta) noexcept
+  {
+    const std::size_t d_model = c.size() / 2;
+    return std::equal(gamma, gamma + d_model, c.begin()) && std::equal(beta, beta + d_model, c.begin() + d_model);
+  }
+
+  static void setConditioning(std::vector<float>& c, const float* gamma, const float* beta) noexcept
+  {
+    const std::size_t d_model = c.size() / 2;
+    std::copy(gamma, gamma + d_model, c.begin());
+    std::copy(beta, beta + d_model, c.begin() + d_model);
+  }
+
+  // Copy n <= chunkSize samples of input to modelIn and follow their peak
+  template <typename S>
+  void measure(Channel& ch, const S* input, int n) noexcept
+  {
+    convert_block(input, modelIn.data(), n);
+    float peak = 0.0f;
+    for (int s = 0; s < n; ++s)
+      peak = std::max(peak, std::abs(modelIn[s]));
+    ch.envelope = std::max(peak, ch.envelope * static_cast<float>(std::pow(release, n)));
+  }
+
+  bool agrees(int n) const noexcept
+  {
+    for (int s = 0; s < n; ++s)
+    {
+      if (std::abs(modelOut[s] - linearOut[s]) > entryError)
+        return false;
+    }
+    return true;
+  }
+
+  void restore(Channel& ch, M& model) noexcept
+  {
+    ch.filter.getModelState(linear[front], state.data());
+    model.setState(state.data());
+    ch.stale = false;
+  }
+
+  Linearizer<float> linearizer; // used by the worker while running
+  std::array<LinearModel<float>, 2> linear;
+  std::array<std::vector<float>, 2> conditioning; // gamma then beta each LinearModel is for
+  int front = 0;                                  // the audio thread's LinearModel, the worker writes the other
+  bool ready = false;                             // linear[front] is for the current conditioning
+  bool running = false;                           // a linearization is posted to the worker
+  std::unique_ptr<RealtimeWorker> worker;
+
+  std::array<Channel, maxChannels> channels;
+  int numModes = 0;
+  double release = 0.0;
+  std::vector<float> state; // model hidden state on leaving
+  std::array<float, chunkSize> modelIn;
+  std::array<float, chunkSize> modelOut;
+  std::array<float, chunkSize> linearOut;
+};
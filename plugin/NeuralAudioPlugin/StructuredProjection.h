@@ -0,0 +1,185 @@
+#pragma once
+
+#include "WeightStorage.h"
+#include "common.h"
+#include "xsimd/xsimd.hpp"
+#include <algorithm>
+#include <vector>
+
+// Replacement kernel for a Mamba projection that was factored or pruned at export
+// (neural_network/factor_projections.py). The input is a vector of n_in scalars in SIMD batches,
+// the output v_out batches laid out like the dense weights ([n_in][v_out]), accumulated into y.
+//   LowRank:     y += U (V x), V^T stored as [n_in][v_rank] and U^T as [rank][v_out]
+//   BlockSparse: y += W x over the non-zero weight batches only, found when loading
+// A projection stays Dense (the Model's unrolled loop) unless the structure saves work.
+template <typename T, typename Format, std::size_t Alignment>
+class StructuredProjection
+{
+public:
+  enum class Kind
+  {
+    Dense,
+    LowRank,
+    BlockSparse
+  };
+
+private:
+  using v_type = xsimd::simd_type<T>;
+  static constexpr int v_size = static_cast<int>(v_type::size);
+  using matrix = WeightMatrix<T, Format, Alignment>;
+  using view = WeightView<T, Format, Alignment>;
+
+  Kind kind = Kind::Dense;
+  int n_in = 0;
+  int v_out = 0;
+  int rank = 0;
+  int v_rank = 0;
+
+  matrix first;                 // LowRank: V^T, BlockSparse: the non-zero batches in input order
+  matrix second;                // LowRank: U^T
+  std::vector<int> row_start;   // BlockSparse: [n_in + 1] offsets into first and block_index
+  std::vector<int> block_index; // BlockSparse: output batch of each stored batch
+  aligned_vector<v_type, Alignment> t; // LowRank: V x
+
+  static int lanes(int j, int n) noexcept { return std::min(v_size, n - j * v_size); }
+
+public:
+  Kind getKind() const noexcept { return kind; }
+  bool isDense() const noexcept { return kind == Kind::Dense; }
+
+  // Number of bytes used by the replacement weights
+  std::size_t bytes() const noexcept { return first.bytes() + second.bytes() + block_index.size() * sizeof(int) + row_start.size() * sizeof(int); }
+
+  // Multiply-adds (in SIMD batches) per sample, relative to the dense projection
+  double costRatio() const noexcept
+  {
+    const double dense = static_cast<double>(n_in) * v_out;
+    switch (kind)
+    {
+    case Kind::LowRank:
+      return (static_cast<double>(n_in) * v_rank + static_cast<double>(rank) * v_out) / dense;
+    case Kind::BlockSparse:
+      return static_cast<double>(block_index.size()) / dense;
+    default:
+      return 1.0;
+    }
+  }
+
+  // Use the factors y = U V x. vt holds V^T as [n_in][rank], ut holds U^T as [rank][v_out * v_size]
+  // in the output layout of the dense weights. Stays dense if the factors do not save work.
+  void setLowRank(const std::vector<T>& vt, const std::vector<T>& ut, int inputs, int factor_rank, int out_batches)
+  {
+    const int rank_batches = ceil_div(factor_rank, v_size);
+    if (inputs * rank_batches + factor_rank * out_batches >= inputs * out_batches)
+      return;
+
+    kind = Kind::LowRank;
+    n_in = inputs;
+    v_out = out_batches;
+    rank = factor_rank;
+    v_rank = rank_batches;
+    first.assign(n_in * v_rank);
+    second.assign(rank * v_out);
+    std::vector<T> row(rank);
+    for (int j = 0; j < n_in; ++j)
+    {
+      std::copy(vt.begin() + j * rank, vt.begin() + (j + 1) * rank, row.begin());
+      first.set(row, j * v_rank, rank, v_rank);
+    }
+    row.resize(v_out * v_size);
+    for (int k = 0; k < rank; ++k)
+    {
+      std::copy(ut.begin() + k * v_out * v_size, ut.begin() + (k + 1) * v_out * v_size, row.begin());
+      second.set(row, k * v_out, v_out * v_size, v_out);
+    }
+    t.assign(v_rank, v_type(T(0)));
+  }
+
+  // Look for weight batches that are entirely zero in the dense projection (pruned at export) and
+  // skip them if at least a quarter of the work goes away.
+  void detectBlockSparse(const view& dense, int inputs, int out_batches)
+  {
+    if (kind != Kind::Dense)
+      return;
+
+    std::vector<int> starts(inputs + 1, 0);
+    std::vector<int> index;
+    for (int j = 0; j < inputs; ++j)
+    {
+      for (int k = 0; k < out_batches; ++k)
+      {
+        if (xsimd::any(dense.load(j * out_batches + k) != v_type(T(0))))
+          index.push_back(k);
+      }
+      starts[j + 1] = static_cast<int>(index.size());
+    }
+    if (4 * index.size() > 3 * static_cast<std::size_t>(inputs) * out_batches)
+      return;
+
+    kind = Kind::BlockSparse;
+    n_in = inputs;
+    v_out = out_batches;
+    first.assign(static_cast<int>(index.size()));
+    for (int j = 0; j < inputs; ++j)
+    {
+      for (int s = starts[j]; s < starts[j + 1]; ++s)
+        first.store(dense.load(j * out_batches + index[s]), s);
+    }
+    row_start = std::move(starts);
+    block_index = std::move(index);
+  }
+
+  inline void apply(const v_type* x, v_type* y) noexcept
+  {
+    alignas(Alignment) T scalar_in[v_size];
+    if (kind == Kind::LowRank)
+    {
+      for (int k = 0; k < v_rank; ++k)
+      {
+        t[k] = v_type(T(0));
+      }
+
+      for (int j = 0; j < ceil_div(n_in, v_size); ++j)
+      {
+        x[j].store_aligned(scalar_in);
+        const int n = lanes(j, n_in);
+        for (int k = 0; k < v_rank; ++k)
+        {
+          for (int l = 0; l < n; ++l)
+          {
+            t[k] += scalar_in[l] * first.load((j * v_size + l) * v_rank + k);
+          }
+        }
+      }
+
+      for (int j = 0; j < v_rank; ++j)
+      {
+        t[j].store_aligned(scalar_in);
+        const int n = lanes(j, rank);
+        for (int k = 0; k < v_out; ++k)
+        {
+          for (int l = 0; l < n; ++l)
+          {
+            y[k] += scalar_in[l] * second.load((j * v_size + l) * v_out + k);
+          }
+        }
+      }
+    }
+    else if (kind == Kind::BlockSparse)
+    {
+      for (int j = 0; j < ceil_div(n_in, v_size); ++j)
+      {
+        x[j].store_aligned(scalar_in);
+        const int n = lanes(j, n_in);
+        for (int l = 0; l < n; ++l)
+        {
+          const int row = j * v_size + l;
+          for (int s = row_start[row]; s < row_start[row + 1]; ++s)
+          {
+            y[block_index[s]] += scalar_in[l] * first.load(s);
+          }
+        }
+      }
+    }
+  }
+};
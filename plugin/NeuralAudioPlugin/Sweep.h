@@ -0,0 +1,120 @@
+#pragma once
+
+#include "BatchedModel.h"
+#include "FiLM.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Offline render of one input at many conditioning settings in a single pass, e.g. a grid of
+// drive/tone positions to audition a capture. Every setting gets a lane of a BatchedModel with its
+// own FiLM conditioning and hidden state; the input, its in proj and the weight loads are shared
+// by the lanes of a bank. Results match a Model per setting up to float rounding.
+template <typename T>
+class ConditioningSweep
+{
+public:
+  static constexpr int lanes = BatchedModel<T>::lanes;
+  static constexpr int blockSize = 256;
+
+  // Load weights from a model_weights.json blob (as exported by model2json.py), discretized for
+  // 48 kHz until discretize_bilinear
+  bool initFromJson(const char* data, std::size_t size) noexcept
+  {
+    try
+    {
+      return initFromJson(nlohmann::json::parse(data, data + size));
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+  }
+
+  // Load weights from an already parsed model_weights.json
+  bool initFromJson(const nlohmann::json& model_data) noexcept
+  {
+    try
+    {
+      if (!film.initFromJson(model_data))
+      {
+        lastError = "FiLM load failed: " + film.getLastError();
+        return false;
+      }
+      if (!model.initFromJson(model_data))
+      {
+        lastError = "Model load failed: " + model.getLastError();
+        return false;
+      }
+      return true;
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+  }
+
+  const std::string& getLastError() const noexcept { return lastError; }
+
+  // Conditioning values per setting (c_dim of the model)
+  int getNumInputs() const noexcept { return film.getNumInputs(); }
+
+  void discretize_bilinear(const T& sr) noexcept { model.discretize_bilinear(sr); }
+
+  // Render numSamples of input at count settings, each from zero state. conditions holds
+  // getNumInputs() values in [-1, 1] per setting, outputs[k] receives setting k. Allocates on the
+  // first render of a larger count.
+  void render(const T* input, int numSamples, const float* conditions, int count, T* const* outputs)
+  {
+    const int numBanks = (count + lanes - 1) / lanes;
+    const int d_model = model.getConfig().d_model;
+    while (model.getNumBanks() < numBanks)
+      model.addBank();
+    gamma.resize(static_cast<std::size_t>(numBanks) * d_model * lanes);
+    beta.resize(gamma.size());
+    block.resize(static_cast<std::size_t>(blockSize) * lanes);
+
+    // lanes past count repeat the last setting
+    for (int b = 0; b < numBanks; ++b)
+    {
+      for (int l = 0; l < lanes; ++l)
+      {
+        const int k = std::min(b * lanes + l, count - 1);
+        film.processSample(conditions + k * getNumInputs());
+        for (int j = 0; j < d_model; ++j)
+        {
+          gamma[(b * d_model + j) * lanes + l] = film.getGamma()[j];
+          beta[(b * d_model + j) * lanes + l] = film.getBeta()[j];
+        }
+        model.resetLane(b, l);
+      }
+    }
+
+    for (int offset = 0; offset < numSamples; offset += blockSize)
+    {
+      const int n = std::min(blockSize, numSamples - offset);
+      for (int b = 0; b < numBanks; ++b)
+      {
+        model.processBlockBroadcast(b, input + offset, block.data(), n, gamma.data() + b * d_model * lanes, beta.data() + b * d_model * lanes);
+        for (int l = 0; l < lanes && b * lanes + l < count; ++l)
+        {
+          T* output = outputs[b * lanes + l] + offset;
+          for (int s = 0; s < n; ++s)
+            output[s] = block[s * lanes + l];
+        }
+      }
+    }
+  }
+
+private:
+  FiLM<T> film;
+  BatchedModel<T> model;
+  std::vector<T> gamma; // [bank][d_model][lanes]
+  std::vector<T> beta;
+  std::vector<T> block; // [blockSize][lanes], output of one bank
+
+  // plugin loading
+  std::string lastError;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Memory used by a loaded model
+struct MemoryFootprint
+{
+  std::size_t hot_bytes = 0;     // the weight arena: weights read by processSample
+  std::size_t state_bytes = 0;   // hidden state and scratch written by processSample, per instance
+  std::size_t cold_bytes = 0;    // parameters only read when loading or re-discretizing
+  std::size_t touched_bytes = 0; // read per sample, weights and state without the dense projections that structured kernels replace
+};
+
+// One contiguous allocation for the data processSample reads, laid out by the model in the order
+// it is read. Every array starts on a cache line. The layout is taken twice: once on an empty
+// arena to measure it (take returns nullptr), then on the allocated memory. It only depends on
+// the model dimensions, so the model can take it again after the arena moves (place). A model keeps
+// its hidden state and scratch in a second arena that is never placed, so a placed one is only
+// read while processing.
+template <std::size_t Alignment>
+class WeightArena
+{
+public:
+  static constexpr std::size_t alignment = Alignment > 64 ? Alignment : 64;
+
+private:
+  aligned_vector<unsigned char, alignment> owned;
+  unsigned char* base = nullptr;
+  std::size_t size = 0;
+  std::size_t cursor = 0;
+
+public:
+  WeightArena() = default;
+  WeightArena(const WeightArena&) = delete;
+  WeightArena& operator=(const WeightArena&) = delete;
+
+  // Start a layout pass at the beginning of the arena
+  void rewind() noexcept { cursor = 0; }
+
+  // Next count elements of the layout
+  template <typename S>
+  S* take(std::size_t count) noexcept
+  {
+    S* p = base != nullptr ? reinterpret_cast<S*>(base + cursor) : nullptr;
+    cursor += ceil_div(count * sizeof(S), alignment) * alignment;
+    return p;
+  }
+
+  // Allocate zeroed memory for the layout measured since rewind
+  void allocate()
+  {
+    size = cursor;
+    owned.assign(size, 0);
+    base = owned.data();
+  }
+
+  // Move the arena into caller provided memory (huge pages, memory shared between instances of one
+  // sample rate), which has to stay valid as long as the model uses it. Fails if the memory is too
+  // small or not aligned. The model takes its layout again afterwards.
+  bool place(void* memory, std::size_t bytes) noexcept
+  {
+    if (memory == nullptr || bytes < size || reinterpret_cast<std::uintptr_t>(memory) % alignment != 0)
+      return false;
+    if (size > 0)
+      std::memmove(memory, base, size);
+    base = static_cast<unsigned char*>(memory);
+    aligned_vector<unsigned char, alignment>().swap(owned);
+    return true;
+  }
+
+  // Read the arena of source, which has to stay valid and unchanged while this one is used. The
+  // model takes its layout again afterwards.
+  void share(const WeightArena& source) noexcept
+  {
+    base = source.base;
+    size = source.size;
+    aligned_vector<unsigned char, alignment>().swap(owned);
+  }
+
+  std::size_t bytes() const noexcept { return size; }
+  const void* data() const noexcept { return base; }
+};
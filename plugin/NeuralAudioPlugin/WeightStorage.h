@@ -0,0 +1,311 @@
+#pragma once
+
+#include "common.h"
+#include "xsimd/xsimd.hpp"
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#if defined(__F16C__) || defined(__AVX2__) || defined(__AVX512F__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Storage formats for the large weight matrices of Model (projections, B, C and the discretized B).
+// Weights are widened to the compute type when loaded, accumulation and the hidden state stay in
+// full precision. A format provides:
+//   stored_type<T>            element type of the weight arrays
+//   encode<T>(value)          convert one weight for storage
+//   decode<T>(stored)         convert one stored weight back
+//   load<Batch>(ptr)          load Batch::size aligned stored weights as a Batch
+
+// Full precision, the weights are kept as T
+struct Fp32Weights
+{
+  template <typename T>
+  using stored_type = T;
+
+  template <typename T>
+  static T encode(T value) noexcept { return value; }
+
+  template <typename T>
+  static T decode(T value) noexcept { return value; }
+
+  template <typename Batch>
+  static Batch load(const typename Batch::value_type* p) noexcept { return Batch::load_aligned(p); }
+};
+
+namespace weight_storage
+{
+inline std::uint32_t floatBits(float x) noexcept
+{
+  std::uint32_t u;
+  std::memcpy(&u, &x, sizeof(u));
+  return u;
+}
+
+inline float bitsFloat(std::uint32_t u) noexcept
+{
+  float x;
+  std::memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+// IEEE 754 binary16, round to nearest even
+inline std::uint16_t floatToHalf(float value) noexcept
+{
+  const std::uint32_t x = floatBits(value);
+  const std::uint16_t sign = static_cast<std::uint16_t>((x >> 16) & 0x8000u);
+  const std::uint32_t absx = x & 0x7fffffffu;
+
+  if (absx >= 0x7f800000u) // inf or nan
+    return static_cast<std::uint16_t>(sign | 0x7c00u | (absx > 0x7f800000u ? 0x200u : 0u));
+  if (absx >= 0x477ff000u) // rounds to a value above 65504
+    return static_cast<std::uint16_t>(sign | 0x7c00u);
+  if (absx < 0x38800000u) // subnormal half or zero
+  {
+    // add 0.5 so the float adder does the rounding
+    const float f = bitsFloat(absx) + 0.5f;
+    return static_cast<std::uint16_t>(sign | (floatBits(f) - 0x3f000000u));
+  }
+
+  const std::uint32_t odd = (absx >> 13) & 1u;
+  return static_cast<std::uint16_t>(sign | ((absx - 0x38000000u + 0xfffu + odd) >> 13));
+}
+
+inline float halfToFloat(std::uint16_t h) noexcept
+{
+  const std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000u) << 16;
+  const std::uint32_t exp = (h >> 10) & 0x1fu;
+  const std::uint32_t mant = h & 0x3ffu;
+
+  if (exp == 0) // zero or subnormal
+    return bitsFloat(sign | floatBits(static_cast<float>(mant) * (1.0f / 16777216.0f)));
+  if (exp == 31) // inf or nan
+    return bitsFloat(sign | 0x7f800000u | (mant << 13));
+  return bitsFloat(sign | ((exp + 112u) << 23) | (mant << 13));
+}
+
+// bfloat16, round to nearest even
+inline std::uint16_t floatToBf16(float value) noexcept
+{
+  const std::uint32_t x = floatBits(value);
+  if ((x & 0x7fffffffu) > 0x7f800000u) // keep nan a nan
+    return static_cast<std::uint16_t>((x >> 16) | 0x40u);
+  return static_cast<std::uint16_t>((x + 0x7fffu + ((x >> 16) & 1u)) >> 16);
+}
+
+inline float bf16ToFloat(std::uint16_t b) noexcept { return bitsFloat(static_cast<std::uint32_t>(b) << 16); }
+} // namespace weight_storage
+
+// Half precision (IEEE binary16). Widened with F16C / AVX-512 or NEON where available, AVX2 or
+// SSE2 bit manipulation otherwise.
+// 11 bits of mantissa, range up to 65504.
+struct Fp16Weights
+{
+  template <typename T>
+  using stored_type = std::uint16_t;
+
+  template <typename T>
+  static std::uint16_t encode(T value) noexcept
+  {
+    static_assert(std::is_same<T, float>::value, "half precision storage needs float compute");
+    return weight_storage::floatToHalf(value);
+  }
+
+  template <typename T>
+  static T decode(std::uint16_t value) noexcept { return weight_storage::halfToFloat(value); }
+
+  template <typename Batch>
+  static Batch load(const std::uint16_t* p) noexcept
+  {
+    static_assert(std::is_same<typename Batch::value_type, float>::value, "half precision storage needs float compute");
+    constexpr std::size_t n = Batch::size;
+#if defined(__AVX512F__)
+    if constexpr (n == 16)
+      return Batch(_mm512_cvtph_ps(_mm256_load_si256(reinterpret_cast<const __m256i*>(p))));
+#endif
+#if defined(__F16C__)
+    if constexpr (n == 8)
+      return Batch(_mm256_cvtph_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(p))));
+    if constexpr (n == 4)
+      return Batch(_mm_cvtph_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+#endif
+#if defined(__AVX2__)
+    if constexpr (n == 8)
+    {
+      // no F16C: the SSE2 rebias below on 8 lanes
+      const __m256i h = _mm256_cvtepu16_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(p)));
+      const __m256i sign = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x8000)), 16);
+      __m256i o = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x7fff)), 13);
+      const __m256i exp = _mm256_and_si256(o, _mm256_set1_epi32(0x0f800000));
+      o = _mm256_add_epi32(o, _mm256_set1_epi32(0x38000000));
+      o = _mm256_add_epi32(o, _mm256_and_si256(_mm256_cmpeq_epi32(exp, _mm256_set1_epi32(0x0f800000)), _mm256_set1_epi32(0x38000000)));
+      const __m256i denorm = _mm256_cmpeq_epi32(exp, _mm256_setzero_si256());
+      const __m256 fixed = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_add_epi32(o, _mm256_set1_epi32(1 << 23))), _mm256_castsi256_ps(_mm256_set1_epi32(0x38800000)));
+      const __m256 f = _mm256_blendv_ps(_mm256_castsi256_ps(o), fixed, _mm256_castsi256_ps(denorm));
+      return Batch(_mm256_or_ps(f, _mm256_castsi256_ps(sign)));
+    }
+#endif
+#if defined(__SSE2__)
+    if constexpr (n == 4)
+    {
+      // no F16C: rebias the exponent, then fix up zero / subnormal and inf / nan lanes
+      const __m128i h = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128());
+      const __m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+      __m128i o = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7fff)), 13);
+      const __m128i exp = _mm_and_si128(o, _mm_set1_epi32(0x0f800000));
+      o = _mm_add_epi32(o, _mm_set1_epi32(0x38000000));
+      o = _mm_add_epi32(o, _mm_and_si128(_mm_cmpeq_epi32(exp, _mm_set1_epi32(0x0f800000)), _mm_set1_epi32(0x38000000)));
+      const __m128i denorm = _mm_cmpeq_epi32(exp, _mm_setzero_si128());
+      const __m128 fixed = _mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(o, _mm_set1_epi32(1 << 23))), _mm_castsi128_ps(_mm_set1_epi32(0x38800000)));
+      const __m128 f = _mm_or_ps(_mm_and_ps(_mm_castsi128_ps(denorm), fixed), _mm_andnot_ps(_mm_castsi128_ps(denorm), _mm_castsi128_ps(o)));
+      return Batch(_mm_or_ps(f, _mm_castsi128_ps(sign)));
+    }
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    if constexpr (n == 4)
+      return Batch(vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(p))));
+#endif
+    // scalar fallback
+    alignas(64) float tmp[n];
+    for (std::size_t i = 0; i < n; ++i)
+      tmp[i] = weight_storage::halfToFloat(p[i]);
+    return Batch::load_aligned(tmp);
+  }
+};
+
+// bfloat16: float with the low 16 mantissa bits dropped. Same range as float, 8 bits of mantissa.
+// Widening is a 16 bit shift, vectorized with SSE2 / AVX2 / AVX-512 or NEON.
+struct Bf16Weights
+{
+  template <typename T>
+  using stored_type = std::uint16_t;
+
+  template <typename T>
+  static std::uint16_t encode(T value) noexcept
+  {
+    static_assert(std::is_same<T, float>::value, "bfloat16 storage needs float compute");
+    return weight_storage::floatToBf16(value);
+  }
+
+  template <typename T>
+  static T decode(std::uint16_t value) noexcept { return weight_storage::bf16ToFloat(value); }
+
+  template <typename Batch>
+  static Batch load(const std::uint16_t* p) noexcept
+  {
+    static_assert(std::is_same<typename Batch::value_type, float>::value, "bfloat16 storage needs float compute");
+    constexpr std::size_t n = Batch::size;
+#if defined(__AVX512F__)
+    if constexpr (n == 16)
+      return Batch(_mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(p))), 16)));
+#endif
+#if defined(__AVX2__)
+    if constexpr (n == 8)
+      return Batch(_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(p))), 16)));
+#endif
+#if defined(__SSE2__)
+    if constexpr (n == 4)
+      return Batch(_mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))));
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    if constexpr (n == 4)
+      return Batch(vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(p), 16)));
+#endif
+    // scalar fallback
+    alignas(64) float tmp[n];
+    for (std::size_t i = 0; i < n; ++i)
+      tmp[i] = weight_storage::bf16ToFloat(p[i]);
+    return Batch::load_aligned(tmp);
+  }
+};
+
+// Weight formats of a Model: Proj for the Mamba in/out projections, Ssm for B, C and the
+// discretized B. The projections are the more sensitive to rounding (their error passes through
+// the recurrence), so they can be kept at full precision while the SSM matrices are compressed.
+template <typename Proj, typename Ssm = Proj>
+struct WeightFormats
+{
+  using proj = Proj;
+  using ssm = Ssm;
+};
+
+// Weight matrix in a storage format over memory owned elsewhere (a WeightMatrix or a WeightArena):
+// flat scalars in whole SIMD batches of T, addressed by batch index
+template <typename T, typename Format, std::size_t Alignment>
+class WeightView
+{
+private:
+  using v_type = xsimd::simd_type<T>;
+  static constexpr int v_size = static_cast<int>(v_type::size);
+
+public:
+  using stored_type = typename Format::template stored_type<T>;
+
+private:
+  stored_type* data = nullptr;
+
+public:
+  WeightView() = default;
+  explicit WeightView(stored_type* memory) noexcept
+  : data(memory)
+  {
+  }
+
+  // Number of stored elements of batch_count batches
+  static std::size_t elements(int batch_count) noexcept { return static_cast<std::size_t>(batch_count) * v_size; }
+
+  // Load batch b, widened to T
+  inline v_type load(int b) const noexcept { return Format::template load<v_type>(data + b * v_size); }
+
+  // Store batch b
+  void store(const v_type& v, int b) noexcept
+  {
+    alignas(Alignment) T lanes_buf[v_size];
+    v.store_aligned(lanes_buf);
+    for (int l = 0; l < v_size; ++l)
+      data[b * v_size + l] = Format::template encode<T>(lanes_buf[l]);
+  }
+
+  // Like set_values: write total_size weights starting at batch b, zero padded to batch_count batches
+  void set(const std::vector<T>& weights, int b, int total_size, int batch_count)
+  {
+    for (int idx = 0; idx < batch_count * v_size; ++idx)
+      data[b * v_size + idx] = Format::template encode<T>(idx < total_size ? weights[idx] : T(0));
+  }
+};
+
+// Weight matrix in a storage format that owns its weights
+template <typename T, typename Format, std::size_t Alignment>
+class WeightMatrix
+{
+private:
+  using v_type = xsimd::simd_type<T>;
+  using view_type = WeightView<T, Format, Alignment>;
+  using stored_type = typename view_type::stored_type;
+
+  aligned_vector<stored_type, Alignment> data;
+
+public:
+  // Resize to batch_count zeroed batches
+  void assign(int batch_count) { data.assign(view_type::elements(batch_count), Format::template encode<T>(T(0))); }
+
+  // Number of bytes used by the weights
+  std::size_t bytes() const noexcept { return data.size() * sizeof(stored_type); }
+
+  view_type view() noexcept { return view_type(data.data()); }
+  const view_type view() const noexcept { return view_type(const_cast<stored_type*>(data.data())); }
+
+  // Load batch b, widened to T
+  inline v_type load(int b) const noexcept { return view().load(b); }
+
+  // Store batch b
+  void store(const v_type& v, int b) noexcept { view().store(v, b); }
+
+  // Like set_values: write total_size weights starting at batch b, zero padded to batch_count batches
+  void set(const std::vector<T>& weights, int b, int total_size, int batch_count) { view().set(weights, b, total_size, batch_count); }
+};
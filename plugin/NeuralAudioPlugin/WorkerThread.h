@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A thread that runs one job at a time, for work that may block the caller (offline rendering,
+// where there is no real-time deadline). run hands the job over, wait blocks until it is done.
+class WorkerThread
+{
+public:
+  WorkerThread()
+  : thread([this] { loop(); })
+  {
+  }
+
+  ~WorkerThread()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    thread.join();
+  }
+
+  WorkerThread(const WorkerThread&) = delete;
+  WorkerThread& operator=(const WorkerThread&) = delete;
+
+  // Start job on the worker, the previous job has to be finished (wait)
+  void run(std::function<void()> job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending = std::move(job);
+      busy = true;
+    }
+    wake.notify_all();
+  }
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return !busy; });
+  }
+
+private:
+  void loop()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+      wake.wait(lock, [this] { return quit || pending; });
+      if (quit)
+        return;
+      auto job = std::move(pending);
+      pending = nullptr;
+      lock.unlock();
+      job();
+      lock.lock();
+      busy = false;
+      done.notify_all();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::function<void()> pending;
+  bool busy = false;
+  bool quit = false;
+  std::thread thread; // last, starts after the members above are initialized
+};
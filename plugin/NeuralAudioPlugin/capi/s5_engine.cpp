@@ -0,0 +1,161 @@
+#include "s5_engine.h"
+
+#include "../Engine.h"
+#include "../FiLM.h"
+#include "../Sweep.h"
+
+#include <algorithm>
+#include <climits>
+#include <exception>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+struct s5_engine
+{
+  FiLM<float> film;
+  ModelEngine<float> model;
+  std::vector<float> c;
+  ConditioningSweep<float> sweep;
+};
+
+namespace
+{
+thread_local std::string createError;
+}
+
+int s5_api_version(void) { return S5_ENGINE_API_VERSION; }
+
+s5_engine* s5_create(const char* weights, size_t size)
+{
+  if (!weights || size == 0)
+  {
+    createError = "no weights given";
+    return nullptr;
+  }
+
+  // no exception may cross the C boundary
+  try
+  {
+    std::unique_ptr<s5_engine> engine(new s5_engine());
+    const nlohmann::json model_data = nlohmann::json::parse(weights, weights + size);
+    if (!engine->film.initFromJson(model_data))
+    {
+      createError = "FiLM load failed: " + engine->film.getLastError();
+      return nullptr;
+    }
+    if (!engine->model.initFromJson(model_data))
+    {
+      createError = "Model load failed: " + engine->model.getLastError();
+      return nullptr;
+    }
+    if (!engine->sweep.initFromJson(model_data))
+    {
+      createError = "Sweep load failed: " + engine->sweep.getLastError();
+      return nullptr;
+    }
+
+    engine->model.discretize_bilinear(48000.0f);
+    engine->model.reset();
+    engine->c.assign(engine->film.getNumInputs(), 0.0f);
+    engine->film.processSample(engine->c.data());
+    return engine.release();
+  }
+  catch (const std::bad_alloc&)
+  {
+    createError = "out of memory";
+  }
+  catch (const std::exception& e)
+  {
+    createError = e.what();
+  }
+  catch (...)
+  {
+    createError = "unknown error loading weights";
+  }
+  return nullptr;
+}
+
+const char* s5_create_error(void) { return createError.c_str(); }
+
+void s5_destroy(s5_engine* engine) { delete engine; }
+
+int s5_set_sample_rate(s5_engine* engine, double sample_rate)
+{
+  if (!engine || !(sample_rate > 0.0))
+    return S5_ERROR_INVALID_ARGUMENT;
+  engine->model.discretize_bilinear(static_cast<float>(sample_rate));
+  engine->model.reset();
+  engine->sweep.discretize_bilinear(static_cast<float>(sample_rate));
+  return S5_OK;
+}
+
+size_t s5_conditioning_size(const s5_engine* engine) { return engine ? engine->c.size() : 0; }
+
+int s5_set_conditioning(s5_engine* engine, const float* c, size_t count)
+{
+  if (!engine || !c || count != engine->c.size())
+    return S5_ERROR_INVALID_ARGUMENT;
+  engine->c.assign(c, c + count);
+  engine->film.processSample(engine->c.data());
+  return S5_OK;
+}
+
+int s5_process(s5_engine* engine, const float* input, float* output, size_t num_samples)
+{
+  if (!engine || (num_samples > 0 && (!input || !output)))
+    return S5_ERROR_INVALID_ARGUMENT;
+  // processBlock counts samples in int
+  for (size_t offset = 0; offset < num_samples;)
+  {
+    const int n = static_cast<int>(std::min<size_t>(num_samples - offset, INT_MAX));
+    engine->model.processBlock(input + offset, output + offset, n, engine->film.getGamma(), engine->film.getBeta());
+    offset += n;
+  }
+  return S5_OK;
+}
+
+void s5_reset(s5_engine* engine)
+{
+  if (engine)
+    engine->model.reset();
+}
+
+int s5_process_sweep(s5_engine* engine, const float* input, size_t num_samples, const float* c, size_t count, float* output)
+{
+  if (!engine || !c || count == 0 || (num_samples > 0 && (!input || !output)))
+    return S5_ERROR_INVALID_ARGUMENT;
+  if (num_samples > INT_MAX || count > INT_MAX)
+    return S5_ERROR_INVALID_ARGUMENT;
+  try
+  {
+    std::vector<float*> outputs(count);
+    for (size_t k = 0; k < count; ++k)
+      outputs[k] = output + k * num_samples;
+    engine->sweep.render(input, static_cast<int>(num_samples), c, static_cast<int>(count), outputs.data());
+  }
+  catch (const std::bad_alloc&)
+  {
+    return S5_ERROR_OUT_OF_MEMORY;
+  }
+  return S5_OK;
+}
+
+size_t s5_state_size(const s5_engine* engine) { return engine ? static_cast<size_t>(engine->model.stateSize()) : 0; }
+
+int s5_get_state(const s5_engine* engine, float* state, size_t size)
+{
+  if (!engine || !state || size != s5_state_size(engine))
+    return S5_ERROR_INVALID_ARGUMENT;
+  engine->model.getState(state);
+  return S5_OK;
+}
+
+int s5_set_state(s5_engine* engine, const float* state, size_t size)
+{
+  if (!engine || !state || size != s5_state_size(engine))
+    return S5_ERROR_INVALID_ARGUMENT;
+  engine->model.setState(state);
+  return S5_OK;
+}
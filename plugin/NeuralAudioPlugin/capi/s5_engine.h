@@ -0,0 +1,70 @@
+/* Stable C API of the S5 Mamba inference engine (Model.h / FiLM.h).
+ * One engine instance processes one mono channel. Instances are independent and may be used
+ * from different threads, but a single instance must not be used concurrently.
+ * All functions returning int return S5_OK on success or a negative S5_ERROR_* code. */
+#ifndef S5_ENGINE_H
+#define S5_ENGINE_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+  #if defined(S5_ENGINE_BUILD)
+    #define S5_API __declspec(dllexport)
+  #else
+    #define S5_API __declspec(dllimport)
+  #endif
+#else
+  #define S5_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define S5_ENGINE_API_VERSION 2
+
+enum
+{
+  S5_OK = 0,
+  S5_ERROR_INVALID_ARGUMENT = -1,
+  S5_ERROR_LOAD_FAILED = -2,
+  S5_ERROR_OUT_OF_MEMORY = -3
+};
+
+typedef struct s5_engine s5_engine;
+
+S5_API int s5_api_version(void);
+
+/* Create an engine from a model_weights.json blob. Returns NULL on failure, see s5_create_error. */
+S5_API s5_engine* s5_create(const char* weights, size_t size);
+/* Reason of the last failed s5_create on the calling thread */
+S5_API const char* s5_create_error(void);
+S5_API void s5_destroy(s5_engine* engine);
+
+/* Discretize the model for the given sample rate, also resets the hidden state */
+S5_API int s5_set_sample_rate(s5_engine* engine, double sample_rate);
+/* Number of conditioning values expected by s5_set_conditioning (c_dim of the model, 2 for drive, tone) */
+S5_API size_t s5_conditioning_size(const s5_engine* engine);
+/* Conditioning values in [-1, 1] */
+S5_API int s5_set_conditioning(s5_engine* engine, const float* c, size_t count);
+
+/* Process num_samples samples, input and output may alias */
+S5_API int s5_process(s5_engine* engine, const float* input, float* output, size_t num_samples);
+S5_API void s5_reset(s5_engine* engine);
+
+/* Render the same input at count conditioning settings in one pass, for offline auditioning of a
+ * knob grid. c holds count * s5_conditioning_size values, setting k is written to
+ * output + k * num_samples. Every setting starts from zero state, the engine's own state and
+ * conditioning are left alone. num_samples and count are at most INT_MAX. */
+S5_API int s5_process_sweep(s5_engine* engine, const float* input, size_t num_samples, const float* c, size_t count, float* output);
+
+/* Hidden state snapshot/restore, size is the number of floats */
+S5_API size_t s5_state_size(const s5_engine* engine);
+S5_API int s5_get_state(const s5_engine* engine, float* state, size_t size);
+S5_API int s5_set_state(s5_engine* engine, const float* state, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
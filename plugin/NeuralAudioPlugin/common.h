@@ -3,6 +3,11 @@
 // https://github.com/jatinchowdhury18/RTNeural
 #pragma once
 #include "xsimd/xsimd.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
 #include <vector>
 
 template <typename T>
@@ -11,6 +16,10 @@ constexpr T ceil_div(T x, T y)
     return (x + y - 1) / y;
 }
 
+// std::vector with SIMD aligned storage, at least the natural alignment of the element type
+template <typename T, std::size_t Alignment>
+using aligned_vector = std::vector<T, xsimd::aligned_allocator<T, (Alignment > alignof(T) ? Alignment : alignof(T))>>;
+
 template <typename T, std::size_t Alignment>
 void set_values(
     const std::vector<T>& weights,
@@ -38,4 +47,138 @@ void set_values(
 
         simd_weights[batch_idx] = xsimd::load_aligned(tmp);
     }
-}
\ No newline at end of file
+}
+
+// True if the n samples of a and b have identical bit patterns (so -0 differs from 0 and equal
+// NaNs match), compared a SIMD batch at a time
+template <typename S>
+bool bit_identical(const S* a, const S* b, int n) noexcept
+{
+    using b_type = xsimd::batch<S>;
+    using u_type = xsimd::as_unsigned_integer_t<S>;
+    constexpr int v_size = static_cast<int>(b_type::size);
+
+    int i = 0;
+    for (; i + v_size <= n; i += v_size) {
+        const auto x = xsimd::bitwise_cast<u_type>(b_type::load_unaligned(a + i));
+        const auto y = xsimd::bitwise_cast<u_type>(b_type::load_unaligned(b + i));
+        if (xsimd::any(x != y))
+            return false;
+    }
+    for (; i < n; ++i) {
+        u_type x, y;
+        std::memcpy(&x, a + i, sizeof(S));
+        std::memcpy(&y, b + i, sizeof(S));
+        if (x != y)
+            return false;
+    }
+    return true;
+}
+
+// FNV-1a hash of a byte string, e.g. to recognize the same weight file across instances
+inline std::uint64_t fnv1a(const char* data, std::size_t size) noexcept
+{
+    std::uint64_t h = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Per-user folders of the plugin: cache for data that can be rebuilt, data for the user's files
+enum class user_folder { cache, data };
+
+// Path of name under the plugin's folder in the platform's per-user location (%LOCALAPPDATA% or
+// %APPDATA%, ~/Library/Caches or ~/Library/Application Support, $XDG_CACHE_HOME or
+// $XDG_DATA_HOME with the ~/.cache and ~/.local/share fallbacks). Empty when the environment does
+// not name one.
+inline std::string user_path(user_folder folder, const std::string& name)
+{
+    auto env = [](const char* variable) {
+        const char* value = std::getenv(variable);
+        return std::string(value ? value : "");
+    };
+#if defined(_WIN32)
+    const std::string base = env(folder == user_folder::cache ? "LOCALAPPDATA" : "APPDATA");
+    return base.empty() ? std::string() : base + "\\NeuralAudioPlugin\\" + name;
+#elif defined(__APPLE__)
+    const std::string home = env("HOME");
+    const char* sub = folder == user_folder::cache ? "/Library/Caches" : "/Library/Application Support";
+    return home.empty() ? std::string() : home + sub + "/NeuralAudioPlugin/" + name;
+#else
+    std::string base = env(folder == user_folder::cache ? "XDG_CACHE_HOME" : "XDG_DATA_HOME");
+    if (base.empty() && !env("HOME").empty())
+        base = env("HOME") + (folder == user_folder::cache ? "/.cache" : "/.local/share");
+    return base.empty() ? std::string() : base + "/NeuralAudioPlugin/" + name;
+#endif
+}
+
+// Convert n samples between the host's precision and the engine's (IPlug2's double samples and
+// float), four at a time with cvtpd2ps/cvtps2pd (two with SSE2, NEON on AArch64). xsimd has no
+// conversion between batches of different lane counts.
+inline void convert_block(const double* in, float* out, int n) noexcept
+{
+    int i = 0;
+#if XSIMD_WITH_AVX
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i, _mm256_cvtpd_ps(_mm256_loadu_pd(in + i)));
+#elif XSIMD_WITH_SSE2
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(in + i)), _mm_cvtpd_ps(_mm_loadu_pd(in + i + 2))));
+#elif XSIMD_WITH_NEON64
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(out + i, vcombine_f32(vcvt_f32_f64(vld1q_f64(in + i)), vcvt_f32_f64(vld1q_f64(in + i + 2))));
+#endif
+    for (; i < n; ++i)
+        out[i] = static_cast<float>(in[i]);
+}
+
+inline void convert_block(const float* in, double* out, int n) noexcept
+{
+    int i = 0;
+#if XSIMD_WITH_AVX
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps(in + i)));
+#elif XSIMD_WITH_SSE2
+    for (; i + 4 <= n; i += 4) {
+        const __m128 x = _mm_loadu_ps(in + i);
+        _mm_storeu_pd(out + i, _mm_cvtps_pd(x));
+        _mm_storeu_pd(out + i + 2, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+    }
+#elif XSIMD_WITH_NEON64
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t x = vld1q_f32(in + i);
+        vst1q_f64(out + i, vcvt_f64_f32(vget_low_f32(x)));
+        vst1q_f64(out + i + 2, vcvt_high_f64_f32(x));
+    }
+#endif
+    for (; i < n; ++i)
+        out[i] = static_cast<double>(in[i]);
+}
+
+// Same precision, a copy (in and out may be the same buffer)
+template <typename T>
+inline void convert_block(const T* in, T* out, int n) noexcept
+{
+    if (in != out)
+        std::copy(in, in + n, out);
+}
+
+// Samples per chunk of process_host_block, converted on the stack
+constexpr int host_chunk = 256;
+
+// Run process(T* buffer, int n) in place over the samples of input converted to T, a chunk at a
+// time, and write the results to output in the host's precision. input and output may alias: a
+// chunk is read before it is written. For the engines' processBlock overloads on host buffers.
+template <typename T, typename S, typename F>
+inline void process_host_block(const S* input, S* output, int numSamples, F&& process) noexcept
+{
+    alignas(64) T buffer[host_chunk];
+    for (int offset = 0; offset < numSamples; offset += host_chunk) {
+        const int n = std::min(host_chunk, numSamples - offset);
+        convert_block(input + offset, buffer, n);
+        process(buffer, n);
+        convert_block(buffer, output + offset, n);
+    }
+}
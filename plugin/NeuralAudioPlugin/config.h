@@ -18,6 +18,34 @@
 #define PLUG_CHANNEL_IO "1-1 2-2"
 
 #define PLUG_LATENCY 0
+
+// Use the model compiled by neural_network/model2cpp.py (model_compiled.h) instead of loading
+// model_weights.h at startup. Comment out to load the weight file at runtime.
+#define NEURAL_AUDIO_COMPILED_MODEL 1
+// Step down to the cheaper capture in model_weights_eco.h (model2cpp.py --eco) when processing gets
+// close to the real-time budget (QualityTiers.h). Uncomment to build with the eco tier.
+// #define NEURAL_AUDIO_ECO_TIER 1
+// Render on worker threads with one block of added latency (Pipeline.h), for live rigs with spare
+// cores. Uncomment to build the pipelined mode.
+// #define NEURAL_AUDIO_PIPELINED 1
+// Batch the instances of a session that run the same weights into shared SIMD lanes, with one block
+// of added latency (BatchEngine.h). Needs model_weights.h. Uncomment to build the batched mode.
+// #define NEURAL_AUDIO_BATCHED 1
+// Render quiet passages with the model's small-signal linearization, a bank of one-pole filters
+// (SmallSignal.h), below the level where it was validated against the model. Needs
+// model_weights.h, no effect in the pipelined and batched modes. Uncomment to build the bypass.
+// #define NEURAL_AUDIO_LINEAR_BYPASS 1
+// Load the engine variant measured fastest on this CPU for the weight file (Autotune.h). The first
+// instance tunes on a worker thread and caches the result per user, tools/autotune.cpp does it on
+// demand. Loads model_weights.h: comment out NEURAL_AUDIO_COMPILED_MODEL. Uncomment to build it.
+// #define NEURAL_AUDIO_AUTOTUNE 1
+// Switch between the built-in capture and the model_weights.json files of the user's capture folder
+// while playing (ModelBank.h), chosen by a Capture parameter and crossfaded. Needs model_weights.h,
+// renders in place of the tier, bypass and offline paths. Uncomment to build the capture bank.
+// #define NEURAL_AUDIO_MODEL_BANK 1
+// Render bounces with a double precision model on the host's double samples, for offline mastering.
+// Needs model_weights.h, not with the pipelined and batched modes. Uncomment to build it.
+// #define NEURAL_AUDIO_DOUBLE_OFFLINE 1
 #define PLUG_TYPE 0
 #define PLUG_DOES_MIDI_IN 0
 #define PLUG_DOES_MIDI_OUT 0
@@ -0,0 +1,970 @@
+// Accuracy-vs-speed evaluation harness.
+// Renders fixed test material through the reference engine configuration and through every
+// registered variant, and scores each variant with ESR, peak error and MR-STFT distance.
+// Exits with a non-zero status if any selected variant exceeds its thresholds. With --reference
+// the reference engine is also gated against PyTorch; the per-variant PyTorch scores are
+// informational, each variant is gated against the reference engine only.
+// Before rendering, the fused layer stages of Model (and CompiledModel) are checked one sample
+// at a time against the layer as written before the fusion, on the weight file and on generated
+// edge cases (d_model = 1, an odd number of complex state batches).
+//
+// usage: accuracy_harness <model_weights.json> [options]
+//   --reference <reference.json>  also score against PyTorch outputs exported by model2json.export_reference
+//   --variant <name>              only evaluate the given variant (repeatable)
+//   --candidate <weights.json>    score another weight file of the same capture against the reference,
+//                                 e.g. one factored by factor_projections.py (repeatable, eco thresholds)
+//   --seconds <s>                 length of each generated test signal (default 1.0)
+//   --esr <max>                   override the ESR threshold of every variant
+//   --peak-db <max>               override the peak error threshold (dBFS) of every variant
+//   --mrstft <max>                override the MR-STFT threshold of every variant
+//   --list                        list the registered variants
+//
+// Build with -DHARNESS_COMPILED_MODEL and the folder of model_compiled.h (model2cpp.py) on the
+// include path to also score the compiled engine. It must be generated from the same weight file.
+
+#include "../Engine.h"
+#include "../FiLM.h"
+#include "audio_metrics.h"
+#ifdef HARNESS_COMPILED_MODEL
+#include "model_compiled.h"
+#endif
+#include "test_signals.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+// Common interface over every engine configuration the harness can render
+class Renderer
+{
+public:
+  virtual ~Renderer() = default;
+  virtual bool load(const std::string& json) = 0;
+  virtual void prepare(double sampleRate) = 0;
+  virtual void render(const float* input, float* output, int numSamples, float c1, float c2) = 0;
+  const std::string& getLastError() const { return lastError; }
+
+protected:
+  std::string lastError;
+};
+
+template <typename T, typename Formats = WeightFormats<Fp32Weights>, typename Layout = DefaultComplexLayout<T>>
+class ModelRenderer : public Renderer
+{
+public:
+  explicit ModelRenderer(const EngineOptions& options = EngineOptions())
+  : options(options)
+  {
+  }
+
+  bool load(const std::string& json) override
+  {
+    if (!film.initFromJson(json.data(), json.size()))
+    {
+      lastError = "FiLM load failed: " + film.getLastError();
+      return false;
+    }
+    if (film.getNumInputs() != 2)
+    {
+      lastError = "the harness renders two knob models only";
+      return false;
+    }
+    if (!model.initFromJson(json.data(), json.size(), options))
+    {
+      lastError = "Model load failed: " + model.getLastError();
+      return false;
+    }
+    return true;
+  }
+
+  void prepare(double sampleRate) override
+  {
+    model.discretize_bilinear(static_cast<T>(sampleRate));
+    model.reset();
+  }
+
+  void render(const float* input, float* output, int numSamples, float c1, float c2) override
+  {
+    film.processSample(c1, c2);
+    for (int i = 0; i < numSamples; ++i)
+      output[i] = static_cast<float>(model.processSample(static_cast<T>(input[i]), film.getGamma(), film.getBeta()));
+  }
+
+  MemoryFootprint footprint() const { return model.footprint(); }
+
+private:
+  EngineOptions options;
+  FiLM<T> film;
+  ModelEngine<T, xsimd::default_arch::alignment(), Formats, Layout> model;
+};
+
+#ifdef HARNESS_COMPILED_MODEL
+class CompiledRenderer : public Renderer
+{
+public:
+  bool load(const std::string& json) override
+  {
+    // the weights are baked in, only check that they belong to this weight file
+    try
+    {
+      const ModelConfig config = ModelConfig::fromJson(nlohmann::json::parse(json));
+      if (config.d_model != CompiledWeights::d_model || config.d_inner() != CompiledWeights::d_inner || config.ssm_size() != CompiledWeights::ssm_size || config.num_layers != CompiledWeights::num_layers)
+      {
+        lastError = "model_compiled.h was generated from a different model";
+        return false;
+      }
+    }
+    catch (const std::exception& e)
+    {
+      lastError = e.what();
+      return false;
+    }
+    return true;
+  }
+
+  void prepare(double sampleRate) override
+  {
+    model.discretize_bilinear(static_cast<float>(sampleRate));
+    model.reset();
+  }
+
+  void render(const float* input, float* output, int numSamples, float c1, float c2) override
+  {
+    film.processSample(c1, c2);
+    model.processBlock(input, output, numSamples, film.getGamma(), film.getBeta());
+  }
+
+private:
+  CompiledFiLM<CompiledWeights> film;
+  CompiledModel<CompiledWeights> model;
+};
+#endif
+
+struct Limits
+{
+  double maxEsr;
+  double maxPeakDb;
+  double maxMrStft;
+};
+
+struct Variant
+{
+  const char* name;
+  const char* description;
+  Limits limits;
+  std::function<std::unique_ptr<Renderer>()> make;
+  std::string weights; // weight file to render instead of the reference one
+};
+
+// Default thresholds for a configuration to count as inaudible: error at least 50 dB below
+// the signal, no sample off by more than -60 dBFS and a spectral distance well below the
+// MR-STFT values seen between a trained model and its target.
+constexpr Limits kInaudible = {1e-5, -60.0, 2e-2};
+
+// Thresholds for reduced quality modes that are selected by the user ("eco"): the error may be
+// audible on quiet material but stays more than 13 dB below the signal.
+constexpr Limits kEco = {5e-2, -26.0, 0.3};
+
+// Thresholds for the shipped engine against the PyTorch model
+constexpr Limits kPyTorchLimits = {1e-5, -60.0, 2e-2};
+
+// Every configuration that trades exactness for speed registers itself here with the
+// thresholds it has to meet before it may be enabled in production.
+std::vector<Variant> registeredVariants()
+{
+  return {
+    {"double", "double precision engine, bounds the float32 rounding error", kInaudible, [] { return std::unique_ptr<Renderer>(new ModelRenderer<double>()); }, {}},
+    {"runtime_dims", "generic engine without the precompiled fast paths", kInaudible, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float>(EngineOptions{false})); }, {}},
+    {"fp16", "all weight matrices stored as IEEE half precision (eco quality)", kEco, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float, WeightFormats<Fp16Weights>>()); }, {}},
+    {"bf16", "all weight matrices stored as bfloat16 (eco quality)", kEco, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float, WeightFormats<Bf16Weights>>()); }, {}},
+    {"fp16_ssm", "C and dB stored as half precision, float projections", kInaudible, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float, WeightFormats<Fp32Weights, Fp16Weights>>()); }, {}},
+    {"bf16_ssm", "C and dB stored as bfloat16, float projections (eco quality)", kEco, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float, WeightFormats<Fp32Weights, Bf16Weights>>()); }, {}},
+    {"split_complex", "S5 state as [real | imaginary] batches", kInaudible, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float, WeightFormats<Fp32Weights>, SplitComplex>()); }, {}},
+    {"interleaved_complex", "S5 state as (real, imaginary) lane pairs", kInaudible, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float, WeightFormats<Fp32Weights>, InterleavedComplex>()); }, {}},
+    {"packed_complex", "S5 state with real and imaginary halves per batch", kInaudible, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float, WeightFormats<Fp32Weights>, PackedComplex>()); }, {}},
+#ifdef HARNESS_COMPILED_MODEL
+    {"compiled", "model2cpp.py engine, weights and discretization baked in", kInaudible, [] { return std::unique_ptr<Renderer>(new CompiledRenderer()); }, {}},
+#endif
+  };
+}
+
+struct Case
+{
+  std::string name;
+  double sampleRate;
+  float c1, c2;
+  std::vector<float> input;
+  std::vector<float> expected; // PyTorch output, empty for generated material
+};
+
+struct Score
+{
+  double esr = 0.0;
+  double peak = 0.0;
+  double mrStft = 0.0;
+
+  void accumulateWorst(const Score& other)
+  {
+    esr = std::max(esr, other.esr);
+    peak = std::max(peak, other.peak);
+    mrStft = std::max(mrStft, other.mrStft);
+  }
+
+  bool passes(const Limits& limits) const
+  {
+    return esr <= limits.maxEsr && metrics::amplitudeToDb(peak) <= limits.maxPeakDb && mrStft <= limits.maxMrStft;
+  }
+};
+
+bool readFile(const std::string& path, std::string& contents)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  std::ostringstream ss;
+  ss << file.rdbuf();
+  contents = ss.str();
+  return true;
+}
+
+bool readFloats(const std::string& path, std::vector<float>& samples)
+{
+  std::string raw;
+  if (!readFile(path, raw))
+    return false;
+  samples.resize(raw.size() / sizeof(float));
+  std::memcpy(samples.data(), raw.data(), samples.size() * sizeof(float));
+  return true;
+}
+
+std::string directoryOf(const std::string& path)
+{
+  const auto pos = path.find_last_of("/\\");
+  return pos == std::string::npos ? std::string() : path.substr(0, pos + 1);
+}
+
+bool loadReferenceCases(const std::string& manifestPath, std::vector<Case>& cases)
+{
+  std::string text;
+  if (!readFile(manifestPath, text))
+    return false;
+
+  const nlohmann::json manifest = nlohmann::json::parse(text);
+  const std::string dir = directoryOf(manifestPath);
+  for (const auto& entry : manifest.at("cases"))
+  {
+    Case c;
+    c.name = entry.at("name").get<std::string>();
+    c.sampleRate = entry.at("sample_rate").get<double>();
+    c.c1 = entry.at("c").at(0).get<float>();
+    c.c2 = entry.at("c").at(1).get<float>();
+    if (!readFloats(dir + entry.at("input").get<std::string>(), c.input) || !readFloats(dir + entry.at("output").get<std::string>(), c.expected))
+      return false;
+    if (c.input.size() != c.expected.size())
+      return false;
+    cases.push_back(std::move(c));
+  }
+  return true;
+}
+
+std::vector<Case> generatedCases(double seconds)
+{
+  const double sampleRates[] = {44100.0, 48000.0};
+  const float knobs[] = {-1.0f, 0.0f, 1.0f};
+
+  std::vector<Case> cases;
+  for (double sr : sampleRates)
+    for (const auto& signal : test_signals::standardSet(sr, seconds))
+      for (float drive : knobs)
+        for (float tone : knobs)
+        {
+          std::ostringstream name;
+          name << signal.name << "_d" << drive << "_t" << tone << "_" << static_cast<int>(sr);
+          cases.push_back({name.str(), sr, drive, tone, signal.samples, {}});
+        }
+  return cases;
+}
+
+Score score(const std::vector<float>& output, const std::vector<float>& target)
+{
+  static const metrics::MultiResolutionSTFTLoss mrStft;
+  Score s;
+  s.esr = metrics::esr(output.data(), target.data(), target.size());
+  s.peak = metrics::peakError(output.data(), target.data(), target.size());
+  s.mrStft = mrStft.compute(output.data(), target.data(), target.size());
+  return s;
+}
+
+void printScore(const char* label, const Score& s, const Limits& limits)
+{
+  std::printf("  %-28s ESR %10.3e (%7.1f dB)  peak %7.1f dBFS  MR-STFT %8.5f  [%s]\n", label, s.esr, metrics::powerToDb(s.esr), metrics::amplitudeToDb(s.peak), s.mrStft, s.passes(limits) ? "PASS" : "FAIL");
+}
+
+// Render every case, nsPerSample receives the average render time (prepare excluded)
+std::vector<std::vector<float>> renderAll(Renderer& renderer, const std::vector<Case>& cases, double& nsPerSample)
+{
+  std::vector<std::vector<float>> outputs;
+  std::chrono::steady_clock::duration elapsed{};
+  std::size_t samples = 0;
+  for (const auto& c : cases)
+  {
+    std::vector<float> out(c.input.size());
+    renderer.prepare(c.sampleRate);
+    const auto start = std::chrono::steady_clock::now();
+    renderer.render(c.input.data(), out.data(), static_cast<int>(out.size()), c.c1, c.c2);
+    elapsed += std::chrono::steady_clock::now() - start;
+    samples += out.size();
+    outputs.push_back(std::move(out));
+  }
+  nsPerSample = samples ? std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(samples) : 0.0;
+  return outputs;
+}
+
+// Per-stage check of the fused layer of Model and CompiledModel against the layer as it was
+// written before the epilogues were fused: separate passes for the res1 copy, FiLM, RMS norm, the
+// in proj into mamba_proj, silu, the chunk into u and res2, S5, the gate y *= res2 and the out
+// proj onto res1. The reference runs in double from the weight file and its own discretization.
+class ReferenceLayers
+{
+public:
+  using complex = std::complex<double>;
+
+  explicit ReferenceLayers(const nlohmann::json& model_data)
+  : config(ModelConfig::fromJson(model_data))
+  {
+    const int d_model = config.d_model;
+    const int d_inner = config.d_inner();
+    const int ssm_size = config.ssm_size();
+    const double c_scale = config.conj_sym ? 2.0 : 1.0;
+    const auto& json_layers = model_data.at("layers");
+    for (int i = 0; i < config.num_layers; ++i)
+    {
+      const auto& parameters = json_layers.at(i + 3).at("parameters");
+      const auto& mamba = parameters.at("mamba");
+      Layer l;
+      l.norm = parameters.at("norm").at("weight").get<std::vector<double>>();
+      l.eps = parameters.at("norm").at("eps").get<double>();
+      l.in_proj = mamba.at("in_proj").at("weights").get<std::vector<std::vector<double>>>();
+      l.in_bias = config.bias ? mamba.at("in_proj").at("bias").get<std::vector<double>>() : std::vector<double>(2 * d_inner, 0.0);
+      l.out_proj = mamba.at("out_proj").at("weights").get<std::vector<std::vector<double>>>();
+      l.out_bias = config.bias ? mamba.at("out_proj").at("bias").get<std::vector<double>>() : std::vector<double>(d_model, 0.0);
+      l.D = mamba.at("D").get<std::vector<double>>();
+      l.inv_dt = mamba.at("inv_dt").get<std::vector<double>>();
+      l.A.resize(ssm_size);
+      l.B.assign(ssm_size, std::vector<complex>(d_inner));
+      l.C.assign(d_inner, std::vector<complex>(ssm_size));
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        l.A[p] = {mamba.at("A_real")[p].get<double>(), mamba.at("A_imag")[p].get<double>()};
+        for (int c = 0; c < d_inner; ++c)
+        {
+          l.B[p][c] = {mamba.at("B_real")[p][c].get<double>(), mamba.at("B_imag")[p][c].get<double>()};
+          l.C[c][p] = c_scale * complex(mamba.at("C_real")[c][p].get<double>(), mamba.at("C_imag")[c][p].get<double>());
+        }
+      }
+      layers.push_back(std::move(l));
+    }
+  }
+
+  const ModelConfig& getConfig() const { return config; }
+
+  // Bilinear discretization as in Model::discretize_bilinear, clears the state
+  void discretize(double sampleRate)
+  {
+    for (auto& l : layers)
+    {
+      const int ssm_size = config.ssm_size();
+      l.dA.resize(ssm_size);
+      l.dB.assign(ssm_size, std::vector<complex>(config.d_inner()));
+      l.h.assign(ssm_size, complex(0.0));
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        const double dt = 48000.0 / sampleRate * std::log1p(std::exp(l.inv_dt[p]));
+        const complex BL = 1.0 / (1.0 - dt / 2.0 * l.A[p]);
+        l.dA[p] = BL * (1.0 + dt / 2.0 * l.A[p]);
+        for (int c = 0; c < config.d_inner(); ++c)
+          l.dB[p][c] = BL * dt * l.B[p][c];
+      }
+    }
+  }
+
+  // Front of layer i: res1, FiLM, RMS norm, in proj, silu and the chunk into u and res2
+  void layerInput(int i, const std::vector<double>& x, const double* gamma, const double* beta)
+  {
+    const Layer& l = layers[i];
+    const int d_model = config.d_model;
+    const int d_inner = config.d_inner();
+
+    res1 = x;
+    std::vector<double> film(d_model);
+    for (int j = 0; j < d_model; ++j)
+      film[j] = gamma[j] * x[j] + beta[j];
+
+    double sum = 0.0;
+    for (int j = 0; j < d_model; ++j)
+      sum += film[j] * film[j];
+    const double scale = 1.0 / std::sqrt(l.eps + sum / d_model);
+    for (int j = 0; j < d_model; ++j)
+      film[j] = l.norm[j] * film[j] * scale;
+
+    std::vector<double> mamba_proj(l.in_bias);
+    for (int k = 0; k < 2 * d_inner; ++k)
+      for (int j = 0; j < d_model; ++j)
+        mamba_proj[k] += l.in_proj[k][j] * film[j];
+
+    for (auto& v : mamba_proj)
+      v = v / (1.0 + std::exp(-v));
+
+    u.assign(mamba_proj.begin(), mamba_proj.begin() + d_inner);
+    res2.assign(mamba_proj.begin() + d_inner, mamba_proj.end());
+  }
+
+  // S5 step of layer i on u, then the gate by res2
+  void s5(int i)
+  {
+    Layer& l = layers[i];
+    const int d_inner = config.d_inner();
+    const int ssm_size = config.ssm_size();
+
+    std::vector<complex> Bu(ssm_size, complex(0.0));
+    for (int p = 0; p < ssm_size; ++p)
+      for (int c = 0; c < d_inner; ++c)
+        Bu[p] += l.dB[p][c] * u[c];
+
+    for (int p = 0; p < ssm_size; ++p)
+      l.h[p] = l.dA[p] * l.h[p] + Bu[p];
+
+    y.assign(d_inner, 0.0);
+    for (int c = 0; c < d_inner; ++c)
+    {
+      y[c] = l.D[c] * u[c];
+      for (int p = 0; p < ssm_size; ++p)
+        y[c] += (l.C[c][p] * l.h[p]).real();
+    }
+
+    for (int c = 0; c < d_inner; ++c)
+      y[c] *= res2[c];
+  }
+
+  // Back of layer i: out proj of the gated y onto res1
+  std::vector<double> layerOutput(int i, const std::vector<double>& gated) const
+  {
+    const Layer& l = layers[i];
+    std::vector<double> x(config.d_model);
+    for (int k = 0; k < config.d_model; ++k)
+    {
+      x[k] = l.out_bias[k] + res1[k];
+      for (int c = 0; c < config.d_inner(); ++c)
+        x[k] += l.out_proj[k][c] * gated[c];
+    }
+    return x;
+  }
+
+  const std::vector<complex>& hidden(int i) const { return layers[i].h; }
+
+  // Continue layer i from a state snapshot of the engine ([real ssm_size, imag ssm_size]), so each
+  // check covers one step and the float discretization does not accumulate
+  void setHidden(int i, const float* state)
+  {
+    const int ssm_size = config.ssm_size();
+    for (int p = 0; p < ssm_size; ++p)
+      layers[i].h[p] = {state[p], state[ssm_size + p]};
+  }
+
+  // Stage results of the last layerInput and s5
+  std::vector<double> res1, u, res2, y;
+
+private:
+  struct Layer
+  {
+    std::vector<double> norm, in_bias, out_bias, D, inv_dt;
+    std::vector<std::vector<double>> in_proj, out_proj; // [out][in] as in the weight file
+    double eps = 0.0;
+    std::vector<complex> A, dA, h;
+    std::vector<std::vector<complex>> B, dB; // [ssm_size][d_inner]
+    std::vector<std::vector<complex>> C;     // [d_inner][ssm_size], conj_sym factor included
+  };
+
+  ModelConfig config;
+  std::vector<Layer> layers;
+};
+
+// Largest difference of a stage over the run, relative to the largest reference value of the stage
+struct StageError
+{
+  const char* name;
+  double diff = 0.0;
+  double scale = 0.0;
+
+  void add(const float* value, const double* expected, int n)
+  {
+    for (int j = 0; j < n; ++j)
+    {
+      diff = std::max(diff, std::abs(value[j] - expected[j]));
+      scale = std::max(scale, std::abs(expected[j]));
+    }
+  }
+
+  double error() const { return scale > 0.0 ? diff / scale : diff; }
+};
+
+// The fused stages match the reference up to float rounding
+constexpr double kStageTolerance = 1e-5;
+
+// Samples and sample rate of the stage check, and the knobs it is run with
+constexpr int kStageSamples = 512;
+constexpr double kStageSampleRate = 44100.0;
+
+// Deterministic values in [-1, 1) for the stage material and the edge case models
+class StageNoise
+{
+public:
+  explicit StageNoise(unsigned seed)
+  : state(seed)
+  {
+  }
+
+  double next()
+  {
+    state = state * 1664525u + 1013904223u;
+    return static_cast<double>(state >> 8) / static_cast<double>(1u << 23) - 1.0;
+  }
+
+private:
+  unsigned state;
+};
+
+// FiLM output of the stage check: gamma around 1, beta around 0, zero in the padding lanes
+void stageConditioning(int d_model, int padded, aligned_vector<float, 64>& gamma, aligned_vector<float, 64>& beta, std::vector<double>& gammaRef, std::vector<double>& betaRef)
+{
+  StageNoise noise(7);
+  gamma.assign(padded, 0.0f);
+  beta.assign(padded, 0.0f);
+  gammaRef.resize(d_model);
+  betaRef.resize(d_model);
+  for (int j = 0; j < d_model; ++j)
+  {
+    gamma[j] = static_cast<float>(1.0 + 0.3 * noise.next());
+    beta[j] = static_cast<float>(0.2 * noise.next());
+    gammaRef[j] = gamma[j];
+    betaRef[j] = beta[j];
+  }
+}
+
+std::vector<float> stageInput()
+{
+  StageNoise noise(3);
+  std::vector<float> input(kStageSamples);
+  for (int s = 0; s < kStageSamples; ++s)
+    input[s] = static_cast<float>(0.5 * std::sin(0.05 * s) + 0.3 * noise.next());
+  return input;
+}
+
+void printStages(const std::string& label, const std::vector<StageError>& stages, bool& allPassed)
+{
+  for (const auto& s : stages)
+  {
+    const bool pass = s.error() <= kStageTolerance;
+    std::printf("  %-34s %-12s max error %10.3e  [%s]\n", label.c_str(), s.name, s.error(), pass ? "PASS" : "FAIL");
+    allPassed &= pass;
+  }
+}
+
+// layerInput, layerOutput and processLayer of Model against the reference, sample by sample on
+// the activations of the model itself
+template <typename Dims, typename Layout>
+void checkModelStages(const nlohmann::json& model_data, const std::string& label, bool& allPassed)
+{
+  using v_type = xsimd::simd_type<float>;
+  constexpr int v_size = static_cast<int>(v_type::size);
+
+  Model<float, xsimd::default_arch::alignment(), Dims, WeightFormats<Fp32Weights>, Layout> model;
+  if (!model.initFromJson(model_data))
+  {
+    std::printf("  %s: load failed: %s\n", label.c_str(), model.getLastError().c_str());
+    allPassed = false;
+    return;
+  }
+  ReferenceLayers reference(model_data);
+  const ModelConfig& c = reference.getConfig();
+  const int d_model = c.d_model;
+  const int d_inner = c.d_inner();
+  const int ssm_size = c.ssm_size();
+  const int v_d_model = ceil_div(d_model, v_size);
+  const int v_d_inner = ceil_div(d_inner, v_size);
+
+  model.discretize_bilinear(static_cast<float>(kStageSampleRate));
+  model.reset();
+  reference.discretize(kStageSampleRate);
+
+  aligned_vector<float, 64> gamma, beta;
+  std::vector<double> gammaRef, betaRef;
+  stageConditioning(d_model, v_d_model * v_size, gamma, beta, gammaRef, betaRef);
+
+  aligned_vector<v_type, 64> x(v_d_model), xOut(v_d_model), proj(2 * v_d_inner), y(v_d_inner);
+  std::vector<float> state(model.stateSize());
+  std::vector<double> xRef(d_model), projRef(2 * v_d_inner * v_size), hRef(2 * ssm_size);
+  std::vector<StageError> stages = {{"layerInput"}, {"layerOutput"}, {"processLayer"}, {"S5 state"}};
+
+  for (float input : stageInput())
+  {
+    model.inputProjection(input, x.data());
+    for (int i = 0; i < c.num_layers; ++i)
+    {
+      const float* xf = reinterpret_cast<const float*>(x.data());
+      for (int j = 0; j < d_model; ++j)
+        xRef[j] = xf[j];
+
+      // FiLM, RMS norm, in proj, silu: u and res2 against the [u | res] halves
+      reference.layerInput(i, xRef, gammaRef.data(), betaRef.data());
+      model.layerInput(i, x.data(), gamma.data(), beta.data(), proj.data());
+      std::fill(projRef.begin(), projRef.end(), 0.0);
+      std::copy(reference.u.begin(), reference.u.end(), projRef.begin());
+      std::copy(reference.res2.begin(), reference.res2.end(), projRef.begin() + v_d_inner * v_size);
+      stages[0].add(reinterpret_cast<const float*>(proj.data()), projRef.data(), 2 * v_d_inner * v_size);
+
+      // out proj and residual of the same gated y
+      model.getState(state.data());
+      reference.setHidden(i, state.data() + 2 * i * ssm_size);
+      reference.s5(i);
+      float* yf = reinterpret_cast<float*>(y.data());
+      std::fill(yf, yf + v_d_inner * v_size, 0.0f);
+      std::vector<double> gated(d_inner);
+      for (int k = 0; k < d_inner; ++k)
+      {
+        yf[k] = static_cast<float>(reference.y[k]);
+        gated[k] = yf[k];
+      }
+      xOut = x;
+      model.layerOutput(i, xOut.data(), y.data());
+      stages[1].add(reinterpret_cast<const float*>(xOut.data()), reference.layerOutput(i, gated).data(), d_model);
+
+      // the whole layer, and the state it leaves
+      model.processLayer(i, x.data(), gamma.data(), beta.data());
+      stages[2].add(reinterpret_cast<const float*>(x.data()), reference.layerOutput(i, reference.y).data(), d_model);
+      model.getState(state.data());
+      for (int p = 0; p < ssm_size; ++p)
+      {
+        hRef[p] = reference.hidden(i)[p].real();
+        hRef[ssm_size + p] = reference.hidden(i)[p].imag();
+      }
+      stages[3].add(state.data() + 2 * i * ssm_size, hRef.data(), 2 * ssm_size);
+    }
+  }
+  printStages(label, stages, allPassed);
+}
+
+#ifdef HARNESS_COMPILED_MODEL
+// processLayer of CompiledModel against the reference, it has no separate front and back stages
+void checkCompiledStages(const nlohmann::json& model_data, bool& allPassed)
+{
+  using v_type = xsimd::simd_type<float>;
+  constexpr int v_size = static_cast<int>(v_type::size);
+  using W = CompiledWeights;
+
+  ReferenceLayers reference(model_data);
+  const ModelConfig& c = reference.getConfig();
+  if (c.d_model != W::d_model || c.d_inner() != W::d_inner || c.ssm_size() != W::ssm_size || c.num_layers != W::num_layers)
+  {
+    std::printf("  compiled: model_compiled.h was generated from a different model\n");
+    allPassed = false;
+    return;
+  }
+  constexpr int v_d_model = ceil_div(W::d_model, v_size);
+  std::unique_ptr<CompiledModel<W>> model(new CompiledModel<W>());
+  model->discretize_bilinear(static_cast<float>(kStageSampleRate));
+  model->reset();
+  reference.discretize(kStageSampleRate);
+
+  aligned_vector<float, 64> gamma, beta;
+  std::vector<double> gammaRef, betaRef;
+  stageConditioning(W::d_model, compiled_stride(W::d_model), gamma, beta, gammaRef, betaRef);
+
+  alignas(64) v_type x[v_d_model];
+  std::vector<float> state(model->stateSize());
+  std::vector<double> xRef(W::d_model), hRef(2 * W::ssm_size);
+  std::vector<StageError> stages = {{"processLayer"}, {"S5 state"}};
+
+  for (float input : stageInput())
+  {
+    model->inputProjection(input, x);
+    for (int i = 0; i < W::num_layers; ++i)
+    {
+      const float* xf = reinterpret_cast<const float*>(x);
+      for (int j = 0; j < W::d_model; ++j)
+        xRef[j] = xf[j];
+      reference.layerInput(i, xRef, gammaRef.data(), betaRef.data());
+      model->getState(state.data());
+      reference.setHidden(i, state.data() + 2 * i * W::ssm_size);
+      reference.s5(i);
+
+      model->processLayer(i, x, gamma.data(), beta.data());
+      stages[0].add(reinterpret_cast<const float*>(x), reference.layerOutput(i, reference.y).data(), W::d_model);
+      model->getState(state.data());
+      for (int p = 0; p < W::ssm_size; ++p)
+      {
+        hRef[p] = reference.hidden(i)[p].real();
+        hRef[W::ssm_size + p] = reference.hidden(i)[p].imag();
+      }
+      stages[1].add(state.data() + 2 * i * W::ssm_size, hRef.data(), 2 * W::ssm_size);
+    }
+  }
+  printStages("compiled", stages, allPassed);
+}
+#endif
+
+// Untrained model for the edge cases of the fused stages, in the layout of model2json.py. A has
+// negative real parts, so the recurrence is stable at any sample rate.
+nlohmann::json stageModel(int d_model, int d_state, int n_layers, bool bias, unsigned seed)
+{
+  StageNoise noise(seed);
+  const int d_inner = 2 * d_model;
+  const int ssm_size = d_state / 2;
+  const int d_hidden = 4;
+  auto matrix = [&](int rows, int cols, double scale) {
+    nlohmann::json m = nlohmann::json::array();
+    for (int r = 0; r < rows; ++r)
+    {
+      nlohmann::json row = nlohmann::json::array();
+      for (int k = 0; k < cols; ++k)
+        row.push_back(scale * noise.next());
+      m.push_back(row);
+    }
+    return m;
+  };
+  auto values = [&](int n, double offset, double scale) {
+    nlohmann::json v = nlohmann::json::array();
+    for (int k = 0; k < n; ++k)
+      v.push_back(offset + scale * noise.next());
+    return v;
+  };
+  auto dense = [&](int rows, int cols, double scale) {
+    return nlohmann::json{{"type", "dense"}, {"activation", ""}, {"shape", {rows, cols}}, {"weights", {matrix(rows, cols, scale), bias ? values(rows, 0.0, 0.1) : nlohmann::json()}}};
+  };
+
+  nlohmann::json layers = nlohmann::json::array();
+  layers.push_back(dense(d_hidden, 2, 1.0));
+  layers.push_back(dense(2 * d_model, d_hidden, 1.0));
+  layers.push_back(dense(d_model, 1, 1.0));
+  for (int i = 0; i < n_layers; ++i)
+  {
+    nlohmann::json mamba;
+    mamba["in_proj"] = {{"weights", matrix(2 * d_inner, d_model, 1.0 / std::sqrt(d_model))}, {"bias", bias ? values(2 * d_inner, 0.0, 0.1) : nlohmann::json()}};
+    mamba["out_proj"] = {{"weights", matrix(d_model, d_inner, 1.0 / std::sqrt(d_inner))}, {"bias", bias ? values(d_model, 0.0, 0.1) : nlohmann::json()}};
+    mamba["A_real"] = values(ssm_size, -0.5, 0.45);
+    mamba["A_imag"] = values(ssm_size, 0.0, 3.0);
+    mamba["B_real"] = matrix(ssm_size, d_inner, 0.5);
+    mamba["B_imag"] = matrix(ssm_size, d_inner, 0.5);
+    mamba["C_real"] = matrix(d_inner, ssm_size, 0.5);
+    mamba["C_imag"] = matrix(d_inner, ssm_size, 0.5);
+    mamba["D"] = values(d_inner, 0.0, 1.0);
+    mamba["inv_dt"] = values(ssm_size, -6.0, 1.0);
+    nlohmann::json parameters = {{"mamba", mamba}, {"norm", {{"weight", values(d_model, 1.0, 0.2)}, {"eps", 1e-5}}}};
+    layers.push_back({{"type", "residual"}, {"parameters", parameters}});
+  }
+  layers.push_back(dense(1, d_model, 1.0));
+
+  const nlohmann::json config = {{"d_model", d_model}, {"d_state", d_state}, {"expand_factor", 2}, {"n_layers", n_layers}, {"c_dim", 2}, {"film_hidden", d_hidden}, {"bias", bias}, {"conj_sym", true}};
+  return {{"config", config}, {"in_shape", 2}, {"layers", layers}};
+}
+
+// The stage check of one weight file: the generic engine in every complex layout, and the
+// precompiled fast path of its size if there is one
+bool checkStages(const nlohmann::json& model_data, const std::string& name)
+{
+  bool passed = true;
+  checkModelStages<RuntimeDims, SplitComplex>(model_data, name + " split", passed);
+  checkModelStages<RuntimeDims, InterleavedComplex>(model_data, name + " interleaved", passed);
+  checkModelStages<RuntimeDims, PackedComplex>(model_data, name + " packed", passed);
+  const ModelConfig config = ModelConfig::fromJson(model_data);
+  if (EngineDefaultDims::matches(config))
+    checkModelStages<EngineDefaultDims, DefaultComplexLayout<float>>(model_data, name + " precompiled", passed);
+  else if (EngineSmallDims::matches(config))
+    checkModelStages<EngineSmallDims, DefaultComplexLayout<float>>(model_data, name + " precompiled", passed);
+  else if (EngineLargeDims::matches(config))
+    checkModelStages<EngineLargeDims, DefaultComplexLayout<float>>(model_data, name + " precompiled", passed);
+  else if (EngineReducedDims::matches(config))
+    checkModelStages<EngineReducedDims, DefaultComplexLayout<float>>(model_data, name + " precompiled", passed);
+  return passed;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "usage: %s <model_weights.json> [--reference <reference.json>] [--variant <name>]... [--candidate <weights.json>]... [--seconds <s>] [--esr <max>] [--peak-db <max>] [--mrstft <max>] [--list]\n", argv[0]);
+    return 2;
+  }
+
+  auto variants = registeredVariants();
+  std::string referencePath;
+  std::vector<std::string> selected;
+  Limits candidateLimits = kEco;
+  double seconds = 1.0;
+  for (int i = 2; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--reference" && hasValue)
+      referencePath = argv[++i];
+    else if (arg == "--variant" && hasValue)
+      selected.push_back(argv[++i]);
+    else if (arg == "--candidate" && hasValue)
+    {
+      const char* path = argv[++i];
+      std::string weights;
+      if (!readFile(path, weights))
+      {
+        std::fprintf(stderr, "cannot read %s\n", path);
+        return 2;
+      }
+      variants.push_back({path, "candidate weight file", candidateLimits, [] { return std::unique_ptr<Renderer>(new ModelRenderer<float>()); }, weights});
+    }
+    else if (arg == "--seconds" && hasValue)
+      seconds = std::atof(argv[++i]);
+    else if (arg == "--esr" && hasValue)
+    {
+      const double value = std::atof(argv[++i]);
+      for (auto& v : variants)
+        v.limits.maxEsr = value;
+      candidateLimits.maxEsr = value;
+    }
+    else if (arg == "--peak-db" && hasValue)
+    {
+      const double value = std::atof(argv[++i]);
+      for (auto& v : variants)
+        v.limits.maxPeakDb = value;
+      candidateLimits.maxPeakDb = value;
+    }
+    else if (arg == "--mrstft" && hasValue)
+    {
+      const double value = std::atof(argv[++i]);
+      for (auto& v : variants)
+        v.limits.maxMrStft = value;
+      candidateLimits.maxMrStft = value;
+    }
+    else if (arg == "--list")
+    {
+      for (const auto& v : variants)
+        std::printf("%-24s %s\n", v.name, v.description);
+      return 0;
+    }
+    else
+    {
+      std::fprintf(stderr, "unknown or incomplete option: %s\n", arg.c_str());
+      return 2;
+    }
+  }
+
+  std::string json;
+  if (!readFile(argv[1], json))
+  {
+    std::fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+
+  std::vector<Case> cases;
+  if (!referencePath.empty())
+  {
+    try
+    {
+      if (!loadReferenceCases(referencePath, cases))
+      {
+        std::fprintf(stderr, "cannot read reference cases from %s\n", referencePath.c_str());
+        return 2;
+      }
+    }
+    catch (const std::exception& e)
+    {
+      std::fprintf(stderr, "invalid reference manifest %s: %s\n", referencePath.c_str(), e.what());
+      return 2;
+    }
+  }
+  else
+  {
+    cases = generatedCases(seconds);
+  }
+
+  ModelRenderer<float> reference;
+  if (!reference.load(json))
+  {
+    std::fprintf(stderr, "reference engine: %s\n", reference.getLastError().c_str());
+    return 2;
+  }
+  double referenceNs = 0.0;
+  const auto referenceOutputs = renderAll(reference, cases, referenceNs);
+  std::printf("%zu cases, %s material, reference engine %.0f ns/sample\n", cases.size(), referencePath.empty() ? "generated" : "PyTorch reference", referenceNs);
+  const MemoryFootprint memory = reference.footprint();
+  std::printf("reference engine memory: %zu bytes hot weights, %zu bytes state (%zu read per sample), %zu bytes cold\n", memory.hot_bytes, memory.state_bytes, memory.touched_bytes, memory.cold_bytes);
+
+  // the fused layer stages against the pre-fusion layer, on this weight file and the edge cases
+  // d_model = 1 and an odd number of complex state batches (interleaved and packed layouts)
+  constexpr int v_size = static_cast<int>(xsimd::simd_type<float>::size);
+  std::printf("layer stages vs the pre-fusion reference\n");
+  bool allPassed = checkStages(nlohmann::json::parse(json), "weights");
+  allPassed &= checkStages(stageModel(1, 8, 2, true, 11), "d_model 1");
+  allPassed &= checkStages(stageModel(3, 3 * v_size, 2, false, 13), "odd v_state");
+#ifdef HARNESS_COMPILED_MODEL
+  checkCompiledStages(nlohmann::json::parse(json), allPassed);
+#endif
+
+  if (!referencePath.empty())
+  {
+    Score worst;
+    for (std::size_t i = 0; i < cases.size(); ++i)
+      worst.accumulateWorst(score(referenceOutputs[i], cases[i].expected));
+    std::printf("reference engine vs PyTorch\n");
+    printScore("worst case", worst, kPyTorchLimits);
+    allPassed &= worst.passes(kPyTorchLimits);
+  }
+
+  for (const auto& variant : variants)
+  {
+    if (!selected.empty() && variant.weights.empty() && std::find(selected.begin(), selected.end(), variant.name) == selected.end())
+      continue;
+
+    auto renderer = variant.make();
+    if (!renderer->load(variant.weights.empty() ? json : variant.weights))
+    {
+      std::printf("%s: load failed: %s\n", variant.name, renderer->getLastError().c_str());
+      allPassed = false;
+      continue;
+    }
+    double ns = 0.0;
+    const auto outputs = renderAll(*renderer, cases, ns);
+
+    Score worst, worstVsTorch;
+    std::string worstCase;
+    for (std::size_t i = 0; i < cases.size(); ++i)
+    {
+      const Score s = score(outputs[i], referenceOutputs[i]);
+      if (s.esr >= worst.esr)
+        worstCase = cases[i].name;
+      worst.accumulateWorst(s);
+      if (!cases[i].expected.empty())
+        worstVsTorch.accumulateWorst(score(outputs[i], cases[i].expected));
+    }
+
+    std::printf("%s: %s, %.0f ns/sample (%.2fx reference)\n", variant.name, variant.description, ns, ns > 0.0 ? referenceNs / ns : 0.0);
+    printScore(("vs reference (" + worstCase + ")").c_str(), worst, variant.limits);
+    allPassed &= worst.passes(variant.limits);
+    if (!referencePath.empty())
+      printScore("vs PyTorch (informational)", worstVsTorch, variant.limits);
+  }
+
+  std::printf("%s\n", allPassed ? "ALL PASSED" : "FAILED");
+  return allPassed ? 0 : 1;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+// Objective metrics used to compare an engine configuration against a reference rendering.
+// The spectral distance follows auraloss.freq.MultiResolutionSTFTLoss as configured in
+// neural_network/utils.py, so the numbers are comparable to the training/eval losses.
+namespace metrics
+{
+// Error-to-signal ratio, same as ESR_loss in neural_network/utils.py
+inline double esr(const float* output, const float* target, std::size_t n, double eps = 1e-8)
+{
+  double errorPower = 0.0;
+  double signalPower = 0.0;
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    const double e = static_cast<double>(output[i]) - static_cast<double>(target[i]);
+    errorPower += e * e;
+    signalPower += static_cast<double>(target[i]) * static_cast<double>(target[i]);
+  }
+  return errorPower / (signalPower + eps);
+}
+
+// Largest absolute sample difference
+inline double peakError(const float* output, const float* target, std::size_t n)
+{
+  double peak = 0.0;
+  for (std::size_t i = 0; i < n; ++i)
+    peak = std::max(peak, std::abs(static_cast<double>(output[i]) - static_cast<double>(target[i])));
+  return peak;
+}
+
+inline double powerToDb(double x) { return 10.0 * std::log10(std::max(x, 1e-30)); }
+inline double amplitudeToDb(double x) { return 20.0 * std::log10(std::max(x, 1e-15)); }
+
+// In-place iterative radix-2 FFT, size must be a power of two
+inline void fft(std::vector<std::complex<double>>& x)
+{
+  const std::size_t n = x.size();
+  for (std::size_t i = 1, j = 0; i < n; ++i)
+  {
+    std::size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      std::swap(x[i], x[j]);
+  }
+
+  const double pi = std::acos(-1.0);
+  for (std::size_t len = 2; len <= n; len <<= 1)
+  {
+    const std::complex<double> wlen = std::polar(1.0, -2.0 * pi / static_cast<double>(len));
+    for (std::size_t i = 0; i < n; i += len)
+    {
+      std::complex<double> w(1.0, 0.0);
+      for (std::size_t j = 0; j < len / 2; ++j)
+      {
+        const std::complex<double> a = x[i + j];
+        const std::complex<double> b = x[i + j + len / 2] * w;
+        x[i + j] = a + b;
+        x[i + j + len / 2] = a - b;
+        w *= wlen;
+      }
+    }
+  }
+}
+
+// Single resolution STFT loss: spectral convergence + L1 log magnitude distance.
+// Mirrors torch.stft defaults (center=True, reflect padding, periodic Hann window zero-padded to fft_size).
+class STFTLoss
+{
+public:
+  STFTLoss(int fftSize, int hopSize, int winLength)
+  : fftSize(fftSize)
+  , hopSize(hopSize)
+  , window(fftSize, 0.0)
+  {
+    const double pi = std::acos(-1.0);
+    const int offset = (fftSize - winLength) / 2;
+    for (int i = 0; i < winLength; ++i)
+      window[offset + i] = 0.5 - 0.5 * std::cos(2.0 * pi * i / winLength);
+  }
+
+  double compute(const float* output, const float* target, std::size_t n) const
+  {
+    std::vector<double> x, y;
+    magnitudes(output, n, x);
+    magnitudes(target, n, y);
+
+    double diffNorm = 0.0;
+    double targetNorm = 0.0;
+    double logDistance = 0.0;
+    for (std::size_t i = 0; i < x.size(); ++i)
+    {
+      diffNorm += (y[i] - x[i]) * (y[i] - x[i]);
+      targetNorm += y[i] * y[i];
+      logDistance += std::abs(std::log(x[i]) - std::log(y[i]));
+    }
+
+    const double spectralConvergence = std::sqrt(diffNorm) / std::sqrt(targetNorm);
+    return spectralConvergence + logDistance / static_cast<double>(x.size());
+  }
+
+private:
+  void magnitudes(const float* signal, std::size_t n, std::vector<double>& mags) const
+  {
+    const std::ptrdiff_t pad = fftSize / 2;
+    const std::ptrdiff_t len = static_cast<std::ptrdiff_t>(n);
+    const std::size_t numFrames = 1 + n / static_cast<std::size_t>(hopSize);
+    const int numBins = fftSize / 2 + 1;
+
+    // reflect padding, folded repeatedly for signals shorter than the pad
+    auto sampleAt = [&](std::ptrdiff_t i) {
+      if (len == 1)
+        return static_cast<double>(signal[0]);
+      const std::ptrdiff_t period = 2 * (len - 1);
+      i %= period;
+      if (i < 0)
+        i += period;
+      return static_cast<double>(signal[i < len ? i : period - i]);
+    };
+
+    mags.resize(numFrames * numBins);
+    std::vector<std::complex<double>> frame(fftSize);
+    for (std::size_t f = 0; f < numFrames; ++f)
+    {
+      const std::ptrdiff_t start = static_cast<std::ptrdiff_t>(f) * hopSize - pad;
+      for (int i = 0; i < fftSize; ++i)
+        frame[i] = std::complex<double>(sampleAt(start + i) * window[i], 0.0);
+      fft(frame);
+      for (int k = 0; k < numBins; ++k)
+        mags[f * numBins + k] = std::sqrt(std::max(std::norm(frame[k]), 1e-8));
+    }
+  }
+
+  int fftSize;
+  int hopSize;
+  std::vector<double> window;
+};
+
+// auraloss.freq.MultiResolutionSTFTLoss(fft_sizes=[1024, 512, 256], hop_sizes=[120, 50, 25], win_lengths=[440, 240, 100])
+class MultiResolutionSTFTLoss
+{
+public:
+  MultiResolutionSTFTLoss()
+  : losses{STFTLoss(1024, 120, 440), STFTLoss(512, 50, 240), STFTLoss(256, 25, 100)}
+  {
+  }
+
+  double compute(const float* output, const float* target, std::size_t n) const
+  {
+    double total = 0.0;
+    for (const auto& loss : losses)
+      total += loss.compute(output, target, n);
+    return total / static_cast<double>(losses.size());
+  }
+
+private:
+  std::vector<STFTLoss> losses;
+};
+} // namespace metrics
@@ -0,0 +1,122 @@
+// Engine autotuner.
+// Benchmarks the engine variants (Autotune.h) on this machine for a weight file, prints the time
+// and error of each, and stores the fastest variant within the accuracy gate in the cache file the
+// plugin reads (NEURAL_AUDIO_AUTOTUNE), so instances start with it without tuning.
+//
+// usage: autotune <model_weights.json> [options]
+//   --cache <path>      cache file (default: the per-user file the plugin uses)
+//   --max-esr <x>       accuracy gate against a double precision render (default 1e-5)
+//   --samples <n>       samples rendered per repeat (default 16384)
+//   --repeats <n>       repeats per variant (default 5)
+//   --show              print the cached entry of this machine and weight file, do not tune
+//   --dry-run           tune but do not write the cache
+
+#include "../Autotune.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace
+{
+bool readFile(const std::string& path, std::string& contents)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  std::ostringstream ss;
+  ss << file.rdbuf();
+  contents = ss.str();
+  return true;
+}
+
+void printResult(const char* label, const TuneResult& result)
+{
+  std::printf("%s: %s, %.1f ns/sample, offline block %s%d\n", label, variantName(result.variant), result.nsPerSample, result.offlineBlock ? "" : "host block ", result.offlineBlock);
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "usage: %s <model_weights.json> [--cache <path>] [--max-esr <x>] [--samples <n>] [--repeats <n>] [--show] [--dry-run]\n", argv[0]);
+    return 2;
+  }
+
+  AutotuneSettings settings;
+  std::string cache = Autotuner::defaultCachePath();
+  bool show = false, dryRun = false;
+  for (int i = 2; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--cache" && hasValue)
+      cache = argv[++i];
+    else if (arg == "--max-esr" && hasValue)
+      settings.maxEsr = std::atof(argv[++i]);
+    else if (arg == "--samples" && hasValue)
+      settings.samples = std::max(256, std::atoi(argv[++i]));
+    else if (arg == "--repeats" && hasValue)
+      settings.repeats = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--show")
+      show = true;
+    else if (arg == "--dry-run")
+      dryRun = true;
+    else
+    {
+      std::fprintf(stderr, "unknown or incomplete option: %s\n", arg.c_str());
+      return 2;
+    }
+  }
+
+  std::string json;
+  if (!readFile(argv[1], json))
+  {
+    std::fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+  const std::string key = Autotuner::cacheKey(json.data(), json.size());
+  std::printf("key %s\ncache %s\n", key.c_str(), cache.empty() ? "(none)" : cache.c_str());
+
+  if (show)
+  {
+    TuneResult cached;
+    if (!Autotuner::lookup(cache, key, cached))
+    {
+      std::printf("not tuned yet\n");
+      return 1;
+    }
+    printResult("cached", cached);
+    return 0;
+  }
+
+  Autotuner tuner(settings);
+  TuneResult result;
+  const bool tuned = tuner.tune(json.data(), json.size(), result);
+  for (const auto& c : tuner.getCandidates())
+  {
+    if (!c.loaded)
+      std::printf("%-20s load failed\n", variantName(c.variant));
+    else
+      std::printf("%-20s %9.1f ns/sample  ESR %10.3e  [%s]\n", variantName(c.variant), c.nsPerSample, c.esr, c.passed ? "PASS" : "FAIL");
+  }
+  if (!tuned)
+  {
+    std::fprintf(stderr, "%s\n", tuner.getLastError().c_str());
+    return 1;
+  }
+  printResult("fastest", result);
+
+  if (!dryRun)
+  {
+    if (cache.empty() || !Autotuner::store(cache, key, result))
+    {
+      std::fprintf(stderr, "cannot write the cache file %s\n", cache.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,185 @@
+// Cost table of model sizes.
+// Renders the same generated material through the engine for every weight file given, e.g. the
+// untrained sizes written by neural_network/synthetic_model.py, and prints one row per file: the
+// dimensions, the time per sample on the engine the plugin would pick (a precompiled size or the
+// runtime dimensions fallback) and on the runtime dimensions fallback, the share of the real-time
+// budget of one channel at 48 kHz, the memory footprint and whether the per-sample data fits in L1.
+//
+// usage: cost_table <model_weights.json>... [options]
+//   --samples <n>       samples rendered per repeat (default 48000)
+//   --repeats <n>       repeats per engine (default 7)
+//   --l1 <KiB>          L1 data cache size (default: read from the system, 32 if unknown)
+//   --csv               comma separated rows with the architecture, to merge runs of several builds
+//
+// Times are only comparable between runs of the same binary: build once per target architecture
+// (-mavx2 -mfma, -mavx512f ..., -msse4.1, NEON) for the table of each.
+
+#include "../Autotune.h"
+#include "../Engine.h"
+#include "../FiLM.h"
+#include "test_signals.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+namespace
+{
+bool readFile(const std::string& path, std::string& contents)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  std::ostringstream ss;
+  ss << file.rdbuf();
+  contents = ss.str();
+  return true;
+}
+
+// File name without folder and extension
+std::string baseName(const std::string& path)
+{
+  const std::size_t slash = path.find_last_of("/\\");
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+  const std::size_t dot = name.rfind('.');
+  return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+// L1 data cache of this CPU in bytes, 0 if the system does not say
+std::size_t l1DataCacheBytes()
+{
+#if defined(__APPLE__)
+  std::uint64_t bytes = 0;
+  std::size_t size = sizeof(bytes);
+  if (sysctlbyname("hw.l1dcachesize", &bytes, &size, nullptr, 0) == 0)
+    return static_cast<std::size_t>(bytes);
+  return 0;
+#elif defined(_SC_LEVEL1_DCACHE_SIZE)
+  const long bytes = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+  return bytes > 0 ? static_cast<std::size_t>(bytes) : 0;
+#else
+  return 0;
+#endif
+}
+
+// Fastest ns/sample of repeats renders, or a negative value with the reason in error if the
+// weights do not load
+double measure(const std::string& json, const EngineOptions& options, const std::vector<float>& input, int repeats, ModelEngine<float>& model, std::string& error)
+{
+  FiLM<float> film;
+  if (!film.initFromJson(json.data(), json.size()) || !model.initFromJson(json.data(), json.size(), options))
+  {
+    error = film.getLastError().empty() ? model.getLastError() : film.getLastError();
+    return -1.0;
+  }
+  std::vector<float> knobs(film.getNumInputs(), 0.5f);
+  film.processSample(knobs.data());
+  model.discretize_bilinear(48000.0f);
+
+  std::vector<float> output(input.size());
+  const int n = static_cast<int>(input.size());
+  model.processBlock(input.data(), output.data(), n, film.getGamma(), film.getBeta()); // warm up caches and branch predictors
+  double fastest = 0.0;
+  for (int r = 0; r < repeats; ++r)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    model.processBlock(input.data(), output.data(), n, film.getGamma(), film.getBeta());
+    const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
+    fastest = r == 0 ? ns : std::min(fastest, ns);
+  }
+  return fastest;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  std::vector<std::string> files;
+  int samples = 48000;
+  int repeats = 7;
+  std::size_t l1 = l1DataCacheBytes();
+  bool csv = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--samples" && hasValue)
+      samples = std::max(256, std::atoi(argv[++i]));
+    else if (arg == "--repeats" && hasValue)
+      repeats = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--l1" && hasValue)
+      l1 = static_cast<std::size_t>(std::max(1, std::atoi(argv[++i]))) * 1024;
+    else if (arg == "--csv")
+      csv = true;
+    else if (arg.compare(0, 2, "--") == 0)
+    {
+      std::fprintf(stderr, "unknown or incomplete option: %s\n", arg.c_str());
+      return 2;
+    }
+    else
+      files.push_back(arg);
+  }
+  if (files.empty())
+  {
+    std::fprintf(stderr, "usage: %s <model_weights.json>... [--samples <n>] [--repeats <n>] [--l1 <KiB>] [--csv]\n", argv[0]);
+    return 2;
+  }
+  if (l1 == 0)
+    l1 = 32 * 1024;
+
+  // white noise at a moderate level, so that no stage runs on denormals or saturates
+  test_signals::Lcg lcg(1);
+  std::vector<float> input(samples);
+  for (auto& x : input)
+    x = 0.25f * lcg.next();
+
+  const char* arch = xsimd::default_arch::name();
+  if (csv)
+    std::printf("arch,file,d_model,d_state,n_layers,exp_f,engine,ns_per_sample,runtime_dims_ns_per_sample,realtime_load_48k,hot_bytes,cold_bytes,l1_fit\n");
+  else
+  {
+    std::printf("%s, %s, L1d %zu KiB, %d samples x %d repeats\n", arch, Autotuner::cpuName().c_str(), l1 / 1024, samples, repeats);
+    std::printf("%-44s %7s %7s %6s %5s  %-11s %9s %12s %7s %8s %8s  %s\n", "file", "d_model", "d_state", "layers", "exp_f", "engine", "ns/sample", "runtime dims", "load", "hot KiB",
+                "cold KiB", "L1");
+  }
+
+  int failed = 0;
+  for (const std::string& path : files)
+  {
+    std::string json, error = "cannot read the file";
+    ModelEngine<float> model, runtime;
+    const double ns = readFile(path, json) ? measure(json, EngineOptions(), input, repeats, model, error) : -1.0;
+    if (ns < 0.0)
+    {
+      std::fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+      ++failed;
+      continue;
+    }
+    // the fallback only differs from the engine above when the size is precompiled
+    const double runtimeNs = model.isPrecompiled() ? measure(json, EngineOptions{false}, input, repeats, runtime, error) : ns;
+
+    const ModelConfig& c = model.getConfig();
+    const MemoryFootprint f = model.footprint();
+    const double load = ns * 48000.0 * 1e-9; // share of one second of audio per channel
+    const bool fits = f.touched_bytes <= l1;
+    const char* engine = model.isPrecompiled() ? "precompiled" : "runtime";
+    const std::string name = baseName(path);
+    if (csv)
+      std::printf("%s,%s,%d,%d,%d,%d,%s,%.2f,%.2f,%.5f,%zu,%zu,%d\n", arch, name.c_str(), c.d_model, c.d_state, c.num_layers, c.exp_f, engine, ns, runtimeNs, load, f.hot_bytes,
+                  f.cold_bytes, fits ? 1 : 0);
+    else
+      std::printf("%-44s %7d %7d %6d %5d  %-11s %9.1f %12.1f %6.2f%% %8.1f %8.1f  %s\n", name.c_str(), c.d_model, c.d_state, c.num_layers, c.exp_f, engine, ns, runtimeNs,
+                  100.0 * load, f.hot_bytes / 1024.0, f.cold_bytes / 1024.0, fits ? "yes" : "no");
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,464 @@
+// Training dataset preprocessor.
+// Does what neural_network/preprocess.py does, but writes a few large shard files instead of two
+// pickles per segment: it pairs the takes of <data>/x and <data>/y, resamples each to every
+// requested rate (the same windowed sinc as torchaudio.transforms.Resample), slices it into
+// warm_up + seq_len segments, shuffles them and splits 3% test, 3% validation and the rest
+// training. Takes are processed on several threads and written in file order.
+//
+// Each split and rate goes to <out>/<split>/shard_<rate>_<n>.s5d: a 4096 byte header, then one
+// fixed size record per segment (input, target and the conditioning, once per segment), every
+// record 64 byte aligned so the files can be memory-mapped as an array of records.
+// <out>/index.json lists the shards and the layout, neural_network/utils.py (ShardDataset) reads
+// the records without copying.
+//
+// usage: dataset_shards <data folder> [options]
+//   --out <folder>      output folder (default "dataset")
+//   --seq-len <n>       samples per segment after the warm-up (default 61440, HyperParams.seq_len)
+//   --warm-up <n>       warm-up samples per segment (default 4096, HyperParams.warm_up)
+//   --rate <hz>         output sample rate, repeatable (default 48000 and 44100)
+//   --shard-mb <n>      largest shard size in MiB (default 512)
+//   --threads <n>       worker threads (default: one per core)
+//   --seed <n>          seed of the segment shuffle (default 0)
+//
+// The target files are named as in the Boss OD-3 dataset, <letter>_D<d>_T<t>..., with knob
+// positions 0 to 4 mapped to conditioning values -1 to 1 as in preprocess.py.
+
+#include "wav_file.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+constexpr std::uint32_t kShardVersion = 1;
+constexpr std::uint32_t kHeaderBytes = 4096; // one page, the records start page aligned
+constexpr std::uint32_t kRecordAlignment = 64;
+constexpr int kConditioningSize = 2;
+const char* const kSplits[3] = {"test", "val", "train"};
+
+// Resampling by a rational factor with a Hann windowed sinc kernel, the algorithm and defaults of
+// torchaudio.transforms.Resample (lowpass_filter_width 6, rolloff 0.99), so the shards match the
+// pickles of preprocess.py to float rounding. One kernel per output phase, only the taps inside
+// the window are kept.
+class PolyphaseResampler
+{
+public:
+  PolyphaseResampler(int fromRate, int toRate, int lowpassFilterWidth = 6, double rolloff = 0.99)
+  {
+    const int g = std::gcd(fromRate, toRate);
+    from = fromRate / g;
+    to = toRate / g;
+    const double baseFreq = std::min(from, to) * rolloff;
+    width = static_cast<int>(std::ceil(lowpassFilterWidth * from / baseFreq));
+    const double pi = 3.14159265358979323846;
+    phases.resize(to);
+    for (int i = 0; i < to; ++i)
+    {
+      Phase& phase = phases[i];
+      phase.first = -1;
+      for (int k = 0; k < 2 * width + from; ++k)
+      {
+        double t = (-static_cast<double>(i) / to + static_cast<double>(k - width) / from) * baseFreq;
+        t = std::max(-static_cast<double>(lowpassFilterWidth), std::min(static_cast<double>(lowpassFilterWidth), t));
+        const double window = std::pow(std::cos(t * pi / lowpassFilterWidth / 2.0), 2.0);
+        t *= pi;
+        const double tap = (t == 0.0 ? 1.0 : std::sin(t) / t) * window * baseFreq / from;
+        if (tap == 0.0 && phase.first < 0)
+          continue;
+        if (phase.first < 0)
+          phase.first = k;
+        phase.taps.push_back(tap);
+      }
+      while (!phase.taps.empty() && phase.taps.back() == 0.0)
+        phase.taps.pop_back();
+      phase.first = std::max(phase.first, 0);
+    }
+  }
+
+  // ceil(to * size / from) samples, as torchaudio
+  std::vector<float> process(const std::vector<float>& input) const
+  {
+    const std::int64_t size = static_cast<std::int64_t>(input.size());
+    if (from == to)
+      return input;
+    const std::int64_t outSize = (static_cast<std::int64_t>(to) * size + from - 1) / from;
+    std::vector<float> output(outSize);
+    for (std::int64_t n = 0; n < outSize; ++n)
+    {
+      // output n is phase n % to of the frame starting at input (n / to) * from - width
+      const Phase& phase = phases[n % to];
+      const std::int64_t start = (n / to) * from - width + phase.first;
+      double acc = 0.0;
+      for (std::size_t k = 0; k < phase.taps.size(); ++k)
+      {
+        const std::int64_t pos = start + static_cast<std::int64_t>(k);
+        if (pos >= 0 && pos < size)
+          acc += phase.taps[k] * input[pos];
+      }
+      output[n] = static_cast<float>(acc);
+    }
+    return output;
+  }
+
+private:
+  struct Phase
+  {
+    int first = 0; // offset of the first kept tap in the frame
+    std::vector<double> taps;
+  };
+  int from = 1;
+  int to = 1;
+  int width = 0;
+  std::vector<Phase> phases;
+};
+
+struct Take
+{
+  std::string x;
+  std::string y;
+  float conditioning[kConditioningSize];
+};
+
+// Knob positions from a target name such as y_D3_T1_... (second character of the second and third
+// fields), scaled as preprocess.parse_conditioning
+bool parseConditioning(const std::string& name, float* conditioning)
+{
+  std::vector<std::string> parts;
+  for (std::size_t pos = 0;;)
+  {
+    const std::size_t next = name.find('_', pos);
+    parts.push_back(name.substr(pos, next - pos));
+    if (next == std::string::npos)
+      break;
+    pos = next + 1;
+  }
+  if (parts.size() < 3 || parts[1].size() < 2 || parts[2].size() < 2 || !std::isdigit(static_cast<unsigned char>(parts[1][1])) ||
+      !std::isdigit(static_cast<unsigned char>(parts[2][1])))
+    return false;
+  conditioning[0] = 2.0f * ((parts[1][1] - '0') / 4.0f) - 1.0f;
+  conditioning[1] = 2.0f * ((parts[2][1] - '0') / 4.0f) - 1.0f;
+  return true;
+}
+
+// The x and y files whose names match after the first character, as preprocess.get_xy_pairs
+std::vector<Take> findTakes(const std::filesystem::path& folder, std::string& error)
+{
+  std::vector<Take> takes;
+  std::error_code ec;
+  std::map<std::string, std::string> targets;
+  for (const auto& entry : std::filesystem::directory_iterator(folder / "y", ec))
+  {
+    const std::string name = entry.path().filename().string();
+    if (!name.empty())
+      targets[name.substr(1)] = name;
+  }
+  std::vector<std::string> inputs;
+  for (const auto& entry : std::filesystem::directory_iterator(folder / "x", ec))
+    inputs.push_back(entry.path().filename().string());
+  if (ec)
+  {
+    error = "cannot list " + folder.string() + "/x and /y: " + ec.message();
+    return takes;
+  }
+  std::sort(inputs.begin(), inputs.end()); // a stable order for the seed
+  for (const std::string& name : inputs)
+  {
+    const auto it = name.empty() ? targets.end() : targets.find(name.substr(1));
+    if (it == targets.end())
+      continue;
+    Take take;
+    if (!parseConditioning(it->second, take.conditioning))
+    {
+      std::fprintf(stderr, "skipping %s: no knob positions in the name\n", it->second.c_str());
+      continue;
+    }
+    take.x = (folder / "x" / name).string();
+    take.y = (folder / "y" / it->second).string();
+    takes.push_back(take);
+  }
+  if (takes.empty())
+    error = "no matching takes in " + folder.string() + "/x and /y";
+  return takes;
+}
+
+void put32(char* p, std::uint32_t v)
+{
+  for (int i = 0; i < 4; ++i)
+    p[i] = static_cast<char>(v >> (8 * i));
+}
+
+// Appends records to the shards of one split and rate, starting a new file at the size limit
+class ShardWriter
+{
+public:
+  ShardWriter(std::string folder, std::string prefix, int sampleRate, int segmentLength, int warmUp, std::uint32_t recordBytes, std::uint32_t shardRecords)
+  : folder(std::move(folder))
+  , prefix(std::move(prefix))
+  , sampleRate(sampleRate)
+  , segmentLength(segmentLength)
+  , warmUp(warmUp)
+  , recordBytes(recordBytes)
+  , shardRecords(shardRecords)
+  , record(recordBytes, 0)
+  {
+  }
+
+  bool write(const float* input, const float* target, const float* conditioning)
+  {
+    if (!file.is_open() && !open())
+      return false;
+    std::memcpy(record.data(), input, segmentLength * sizeof(float));
+    std::memcpy(record.data() + segmentLength * sizeof(float), target, segmentLength * sizeof(float));
+    std::memcpy(record.data() + 2 * segmentLength * sizeof(float), conditioning, kConditioningSize * sizeof(float));
+    file.write(record.data(), recordBytes);
+    if (++count == shardRecords)
+      return close();
+    return static_cast<bool>(file);
+  }
+
+  // Writes the header of the open shard
+  bool close()
+  {
+    if (!file.is_open())
+      return true;
+    char header[kHeaderBytes] = {};
+    std::memcpy(header, "S5SHARD", 8);
+    const std::uint32_t fields[] = {kShardVersion, kHeaderBytes, recordBytes, count, static_cast<std::uint32_t>(segmentLength), static_cast<std::uint32_t>(warmUp),
+                                    kConditioningSize, static_cast<std::uint32_t>(sampleRate)};
+    for (std::size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+      put32(header + 8 + 4 * i, fields[i]);
+    file.seekp(0);
+    file.write(header, kHeaderBytes);
+    file.close();
+    shards.push_back({names.back(), count});
+    count = 0;
+    return !file.fail();
+  }
+
+  struct Shard
+  {
+    std::string file; // relative to the output folder
+    std::uint32_t numSegments;
+  };
+  std::vector<Shard> shards;
+  std::vector<std::string> names;
+
+private:
+  bool open()
+  {
+    char name[64];
+    std::snprintf(name, sizeof(name), "shard_%d_%03d.s5d", sampleRate, static_cast<int>(names.size()));
+    names.push_back(prefix + "/" + name);
+    file.open(folder + "/" + names.back(), std::ios::binary | std::ios::trunc);
+    const std::vector<char> placeholder(kHeaderBytes, 0);
+    file.write(placeholder.data(), kHeaderBytes);
+    return static_cast<bool>(file);
+  }
+
+  std::string folder;
+  std::string prefix;
+  int sampleRate;
+  int segmentLength;
+  int warmUp;
+  std::uint32_t recordBytes;
+  std::uint32_t shardRecords;
+  std::vector<char> record;
+  std::ofstream file;
+  std::uint32_t count = 0;
+};
+
+// One take cut into segments at every rate, with the split of each segment
+struct Segments
+{
+  std::vector<std::vector<float>> x; // per rate, the whole resampled take
+  std::vector<std::vector<float>> y;
+  std::vector<std::pair<int, int>> order; // (split, segment index) in shuffled order
+  std::string error;
+};
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "usage: %s <data folder> [--out <folder>] [--seq-len <n>] [--warm-up <n>] [--rate <hz>]... [--shard-mb <n>] [--threads <n>] [--seed <n>]\n", argv[0]);
+    return 2;
+  }
+
+  std::string out = "dataset";
+  int seqLen = 4096 * 15;
+  int warmUp = 4096;
+  std::vector<int> rates;
+  int shardMb = 512;
+  int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  unsigned seed = 0;
+  for (int i = 2; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--out" && hasValue)
+      out = argv[++i];
+    else if (arg == "--seq-len" && hasValue)
+      seqLen = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--warm-up" && hasValue)
+      warmUp = std::max(0, std::atoi(argv[++i]));
+    else if (arg == "--rate" && hasValue)
+      rates.push_back(std::max(1, std::atoi(argv[++i])));
+    else if (arg == "--shard-mb" && hasValue)
+      shardMb = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--threads" && hasValue)
+      threads = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--seed" && hasValue)
+      seed = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    else
+    {
+      std::fprintf(stderr, "unknown or incomplete option: %s\n", arg.c_str());
+      return 2;
+    }
+  }
+  if (rates.empty())
+    rates = {48000, 44100};
+
+  std::string error;
+  const std::vector<Take> takes = findTakes(argv[1], error);
+  if (takes.empty())
+  {
+    std::fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  const int segmentLength = warmUp + seqLen;
+  const std::uint32_t payload = (2 * segmentLength + kConditioningSize) * sizeof(float);
+  const std::uint32_t recordBytes = (payload + kRecordAlignment - 1) / kRecordAlignment * kRecordAlignment;
+  const std::uint32_t shardRecords = static_cast<std::uint32_t>(std::max<std::uint64_t>(1, (static_cast<std::uint64_t>(shardMb) << 20) / recordBytes));
+
+  std::error_code ec;
+  for (const char* split : kSplits)
+    std::filesystem::create_directories(std::filesystem::path(out) / split, ec);
+  if (ec)
+  {
+    std::fprintf(stderr, "cannot create %s: %s\n", out.c_str(), ec.message().c_str());
+    return 1;
+  }
+  std::vector<ShardWriter> writers; // [split * rates + rate]
+  for (const char* split : kSplits)
+    for (int rate : rates)
+      writers.emplace_back(out, split, rate, segmentLength, warmUp, recordBytes, shardRecords);
+
+  // Workers load and slice takes in any order, the writes happen in take order so the shards do
+  // not depend on the thread count
+  std::atomic<int> next{0};
+  std::mutex mutex;
+  std::condition_variable turn;
+  int nextToWrite = 0;
+  bool failed = false;
+  std::vector<std::size_t> segmentCounts(3, 0);
+
+  auto work = [&] {
+    for (int t = next++; t < static_cast<int>(takes.size()); t = next++)
+    {
+      const Take& take = takes[t];
+      Segments seg;
+      std::vector<float> x, y;
+      double rateX = 0.0, rateY = 0.0;
+      const bool read = wav::read(take.x, x, rateX, seg.error) && wav::read(take.y, y, rateY, seg.error);
+      if (read && rateX != rateY)
+        seg.error = "sample rates don't match for " + take.x + " and " + take.y;
+      else if (read)
+      {
+        const std::size_t length = std::min(x.size(), y.size());
+        x.resize(length);
+        y.resize(length);
+        std::int64_t numSegments = -1;
+        for (int rate : rates)
+        {
+          const PolyphaseResampler resampler(static_cast<int>(rateX), rate);
+          seg.x.push_back(resampler.process(x));
+          seg.y.push_back(resampler.process(y));
+          const std::int64_t n = std::max<std::int64_t>(0, (static_cast<std::int64_t>(seg.x.back().size()) - warmUp) / seqLen);
+          numSegments = numSegments < 0 ? n : std::min(numSegments, n);
+        }
+        // the split of preprocess.py: shuffle, then 3% test, 3% validation, the rest training
+        std::vector<int> indices(static_cast<std::size_t>(numSegments));
+        std::iota(indices.begin(), indices.end(), 0);
+        std::mt19937 rng(seed + static_cast<unsigned>(t));
+        std::shuffle(indices.begin(), indices.end(), rng);
+        const int testCount = static_cast<int>(0.03 * numSegments);
+        for (int i = 0; i < static_cast<int>(indices.size()); ++i)
+          seg.order.push_back({i < testCount ? 0 : i < 2 * testCount ? 1 : 2, indices[i]});
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      turn.wait(lock, [&] { return nextToWrite == t; });
+      if (!seg.error.empty())
+      {
+        std::fprintf(stderr, "%s\n", seg.error.c_str());
+        failed = true;
+      }
+      for (const auto& s : seg.order)
+      {
+        for (std::size_t r = 0; r < rates.size(); ++r)
+        {
+          // segments start every seq_len samples, the warm-up overlaps the previous segment
+          const std::size_t start = static_cast<std::size_t>(s.second) * seqLen;
+          if (!writers[s.first * rates.size() + r].write(seg.x[r].data() + start, seg.y[r].data() + start, take.conditioning))
+            failed = true;
+        }
+        ++segmentCounts[s.first];
+      }
+      ++nextToWrite;
+      lock.unlock();
+      turn.notify_all();
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int i = 0; i < threads; ++i)
+    pool.emplace_back(work);
+  for (auto& thread : pool)
+    thread.join();
+
+  nlohmann::json index;
+  index["version"] = kShardVersion;
+  index["header_bytes"] = kHeaderBytes;
+  index["record_bytes"] = recordBytes;
+  index["seq_len"] = seqLen;
+  index["warm_up"] = warmUp;
+  index["segment_len"] = segmentLength;
+  index["c_dim"] = kConditioningSize;
+  index["shards"] = nlohmann::json::array();
+  for (std::size_t w = 0; w < writers.size(); ++w)
+  {
+    if (!writers[w].close())
+      failed = true;
+    for (const auto& shard : writers[w].shards)
+      index["shards"].push_back({{"file", shard.file}, {"split", kSplits[w / rates.size()]}, {"sample_rate", rates[w % rates.size()]}, {"num_segments", shard.numSegments}});
+  }
+  std::ofstream indexFile(out + "/index.json");
+  indexFile << index.dump(2) << "\n";
+  if (!indexFile || failed)
+  {
+    std::fprintf(stderr, "writing %s failed\n", out.c_str());
+    return 1;
+  }
+
+  std::printf("%zu takes: %zu test, %zu val, %zu train segments of %d samples at %zu rates, %zu shards\n", takes.size(), segmentCounts[0], segmentCounts[1], segmentCounts[2], segmentLength,
+              rates.size(), index["shards"].size());
+  return 0;
+}
@@ -0,0 +1,289 @@
+// Microbenchmark suite for the engine's implementation choices.
+// Every benchmark renders the same generated material through one engine configuration and
+// reports the fastest and the median of several repeats (the fastest is the most stable figure on
+// a busy machine). Benchmarks are grouped by the choice they inform; the fastest entry of each
+// group is printed at the end, e.g. to pick DefaultComplexLayout for an architecture.
+//
+// usage: microbench <model_weights.json> [options]
+//   --filter <text>     only run benchmarks whose group or name contains text (repeatable)
+//   --samples <n>       samples rendered per repeat (default 48000)
+//   --repeats <n>       repeats per benchmark (default 7)
+//   --list              list the registered benchmarks
+//
+// Results are only comparable between runs of the same binary: build once per target
+// architecture (-mavx2 -mfma, -mavx512f ..., -msse4.1, NEON) to compare the choices per arch.
+
+#include "../Engine.h"
+#include "../FiLM.h"
+#include "test_signals.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+// One engine configuration rendering a block of samples
+class Runner
+{
+public:
+  virtual ~Runner() = default;
+  virtual bool load(const std::string& json) = 0;
+  // Called with the material before the timed renders, for runners that keep it in another form
+  virtual void setInput(const std::vector<float>&) {}
+  virtual void render(const float* input, float* output, int numSamples) = 0;
+  const std::string& getLastError() const { return lastError; }
+
+protected:
+  std::string lastError;
+};
+
+template <typename Formats = WeightFormats<Fp32Weights>, typename Layout = DefaultComplexLayout<float>>
+class EngineRunner : public Runner
+{
+public:
+  explicit EngineRunner(const EngineOptions& options = EngineOptions())
+  : options(options)
+  {
+  }
+
+  bool load(const std::string& json) override
+  {
+    if (!film.initFromJson(json.data(), json.size()) || !model.initFromJson(json.data(), json.size(), options))
+    {
+      lastError = film.getLastError().empty() ? model.getLastError() : film.getLastError();
+      return false;
+    }
+    std::vector<float> knobs(film.getNumInputs(), 0.5f);
+    film.processSample(knobs.data());
+    model.discretize_bilinear(48000.0f);
+    return true;
+  }
+
+  void render(const float* input, float* output, int numSamples) override
+  {
+    model.processBlock(input, output, numSamples, film.getGamma(), film.getBeta());
+  }
+
+private:
+  EngineOptions options;
+  FiLM<float> film;
+  ModelEngine<float, xsimd::default_arch::alignment(), Formats, Layout> model;
+};
+
+// How the plugin gets the host's double samples to and from the engine
+enum class HostIO
+{
+  PerSample, // the conversion inside the per-sample loop, as ProcessBlock did
+  Block,     // processBlock on the double buffers, converted in vectorized passes
+  InPlace,   // the same with input and output in one buffer
+  Double     // Model<double>, no conversion
+};
+
+// Renders a double copy of the material, as a host passes it, instead of render's float buffers
+template <HostIO Mode>
+class HostRunner : public Runner
+{
+public:
+  bool load(const std::string& json) override
+  {
+    if (!film.initFromJson(json.data(), json.size()) || !model.initFromJson(json.data(), json.size()) || !filmDouble.initFromJson(json.data(), json.size()) ||
+        !modelDouble.initFromJson(json.data(), json.size()))
+    {
+      lastError = film.getLastError().empty() ? model.getLastError() : film.getLastError();
+      return false;
+    }
+    std::vector<float> knobs(film.getNumInputs(), 0.5f);
+    film.processSample(knobs.data());
+    filmDouble.processSample(knobs.data());
+    model.discretize_bilinear(48000.0f);
+    modelDouble.discretize_bilinear(48000.0);
+    return true;
+  }
+
+  void setInput(const std::vector<float>& input) override
+  {
+    hostInput.assign(input.begin(), input.end());
+    hostOutput.resize(input.size());
+  }
+
+  void render(const float*, float*, int numSamples) override
+  {
+    const double* in = hostInput.data();
+    double* out = hostOutput.data();
+    if (Mode == HostIO::PerSample)
+    {
+      for (int s = 0; s < numSamples; ++s)
+        out[s] = model.processSample(static_cast<float>(in[s]), film.getGamma(), film.getBeta());
+    }
+    else if (Mode == HostIO::Block)
+      model.processBlock(in, out, numSamples, film.getGamma(), film.getBeta());
+    else if (Mode == HostIO::InPlace)
+    {
+      std::copy(in, in + numSamples, out); // the host's buffer, refilled each repeat
+      model.processBlock(out, out, numSamples, film.getGamma(), film.getBeta());
+    }
+    else
+      modelDouble.processBlock(in, out, numSamples, filmDouble.getGamma(), filmDouble.getBeta());
+  }
+
+private:
+  FiLM<float> film;
+  ModelEngine<float> model;
+  FiLM<double> filmDouble;
+  ModelEngine<double> modelDouble;
+  std::vector<double> hostInput;
+  std::vector<double> hostOutput;
+};
+
+struct Benchmark
+{
+  const char* group;
+  const char* name;
+  const char* description;
+  std::function<std::unique_ptr<Runner>()> make;
+};
+
+// Every implementation choice that is made per architecture registers its candidates here
+std::vector<Benchmark> registeredBenchmarks()
+{
+  return {
+    {"complex_layout", "split", "S5 state as [real | imaginary] batches", [] { return std::unique_ptr<Runner>(new EngineRunner<WeightFormats<Fp32Weights>, SplitComplex>()); }},
+    {"complex_layout", "interleaved", "S5 state as (real, imaginary) lane pairs", [] { return std::unique_ptr<Runner>(new EngineRunner<WeightFormats<Fp32Weights>, InterleavedComplex>()); }},
+    {"complex_layout", "packed", "S5 state with real and imaginary halves per batch", [] { return std::unique_ptr<Runner>(new EngineRunner<WeightFormats<Fp32Weights>, PackedComplex>()); }},
+    {"weight_format", "fp32", "all weights in float", [] { return std::unique_ptr<Runner>(new EngineRunner<>()); }},
+    {"weight_format", "fp16_ssm", "C and dB as half precision", [] { return std::unique_ptr<Runner>(new EngineRunner<WeightFormats<Fp32Weights, Fp16Weights>>()); }},
+    {"weight_format", "bf16_ssm", "C and dB as bfloat16", [] { return std::unique_ptr<Runner>(new EngineRunner<WeightFormats<Fp32Weights, Bf16Weights>>()); }},
+    {"host_io", "per_sample", "double host samples converted in the per-sample loop", [] { return std::unique_ptr<Runner>(new HostRunner<HostIO::PerSample>()); }},
+    {"host_io", "block", "double host samples converted per block", [] { return std::unique_ptr<Runner>(new HostRunner<HostIO::Block>()); }},
+    {"host_io", "in_place", "double host samples converted per block, in place", [] { return std::unique_ptr<Runner>(new HostRunner<HostIO::InPlace>()); }},
+    {"host_io", "double", "Model<double> on the double host samples", [] { return std::unique_ptr<Runner>(new HostRunner<HostIO::Double>()); }},
+  };
+}
+
+bool readFile(const std::string& path, std::string& contents)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  std::ostringstream ss;
+  ss << file.rdbuf();
+  contents = ss.str();
+  return true;
+}
+
+bool matches(const Benchmark& b, const std::vector<std::string>& filters)
+{
+  if (filters.empty())
+    return true;
+  for (const auto& f : filters)
+    if (std::string(b.group).find(f) != std::string::npos || std::string(b.name).find(f) != std::string::npos)
+      return true;
+  return false;
+}
+
+struct Timing
+{
+  double fastest;
+  double median;
+};
+
+Timing measure(Runner& runner, const std::vector<float>& input, int repeats)
+{
+  std::vector<float> output(input.size());
+  runner.setInput(input);
+  runner.render(input.data(), output.data(), static_cast<int>(input.size())); // warm up caches and branch predictors
+  std::vector<double> ns;
+  for (int r = 0; r < repeats; ++r)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    runner.render(input.data(), output.data(), static_cast<int>(input.size()));
+    ns.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / static_cast<double>(input.size()));
+  }
+  std::sort(ns.begin(), ns.end());
+  return {ns.front(), ns[ns.size() / 2]};
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "usage: %s <model_weights.json> [--filter <text>]... [--samples <n>] [--repeats <n>] [--list]\n", argv[0]);
+    return 2;
+  }
+
+  const auto benchmarks = registeredBenchmarks();
+  std::vector<std::string> filters;
+  int samples = 48000;
+  int repeats = 7;
+  for (int i = 2; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--filter" && hasValue)
+      filters.push_back(argv[++i]);
+    else if (arg == "--samples" && hasValue)
+      samples = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--repeats" && hasValue)
+      repeats = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--list")
+    {
+      for (const auto& b : benchmarks)
+        std::printf("%-16s %-14s %s\n", b.group, b.name, b.description);
+      return 0;
+    }
+    else
+    {
+      std::fprintf(stderr, "unknown or incomplete option: %s\n", arg.c_str());
+      return 2;
+    }
+  }
+
+  std::string json;
+  if (!readFile(argv[1], json))
+  {
+    std::fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+
+  // white noise at a moderate level, so that no stage runs on denormals or saturates
+  test_signals::Lcg lcg(1);
+  std::vector<float> input(samples);
+  for (auto& x : input)
+    x = 0.25f * lcg.next();
+
+  std::printf("%s, %d samples x %d repeats\n", xsimd::default_arch::name(), samples, repeats);
+  std::vector<std::pair<std::string, std::pair<std::string, double>>> fastest; // group -> (name, ns)
+  for (const auto& b : benchmarks)
+  {
+    if (!matches(b, filters))
+      continue;
+
+    auto runner = b.make();
+    if (!runner->load(json))
+    {
+      std::printf("%-16s %-14s load failed: %s\n", b.group, b.name, runner->getLastError().c_str());
+      continue;
+    }
+    const Timing t = measure(*runner, input, repeats);
+    std::printf("%-16s %-14s %9.1f ns/sample (median %9.1f)  %s\n", b.group, b.name, t.fastest, t.median, b.description);
+
+    auto it = std::find_if(fastest.begin(), fastest.end(), [&](const auto& f) { return f.first == b.group; });
+    if (it == fastest.end())
+      fastest.push_back({b.group, {b.name, t.fastest}});
+    else if (t.fastest < it->second.second)
+      it->second = {b.name, t.fastest};
+  }
+
+  for (const auto& f : fastest)
+    std::printf("fastest %s: %s\n", f.first.c_str(), f.second.first.c_str());
+  return 0;
+}
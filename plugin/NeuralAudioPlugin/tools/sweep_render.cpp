@@ -0,0 +1,165 @@
+// Conditioning sweep renderer.
+// Renders one input file at a grid of drive/tone settings in a single pass (Sweep.h) and writes
+// one 32 bit float WAV file per setting, named <prefix>_drive<d>_tone<t>.wav with the knob
+// positions in percent as on the plugin.
+//
+// usage: sweep_render <model_weights.json> <input.wav> [options]
+//   --grid <n>        n x n knob positions from 0% to 100% (default 5)
+//   --out <prefix>    output path prefix (default "sweep")
+//   --serial          also render every setting one after the other through ModelEngine, and
+//                     report the time of both and the largest difference
+
+#include "../Engine.h"
+#include "../FiLM.h"
+#include "../Sweep.h"
+#include "wav_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+bool readFile(const std::string& path, std::string& contents)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  std::ostringstream ss;
+  ss << file.rdbuf();
+  contents = ss.str();
+  return true;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc < 3)
+  {
+    std::fprintf(stderr, "usage: %s <model_weights.json> <input.wav> [--grid <n>] [--out <prefix>] [--serial]\n", argv[0]);
+    return 2;
+  }
+
+  int grid = 5;
+  std::string prefix = "sweep";
+  bool serial = false;
+  for (int i = 3; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--grid" && hasValue)
+      grid = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--out" && hasValue)
+      prefix = argv[++i];
+    else if (arg == "--serial")
+      serial = true;
+    else
+    {
+      std::fprintf(stderr, "unknown or incomplete option: %s\n", arg.c_str());
+      return 2;
+    }
+  }
+
+  std::string json;
+  if (!readFile(argv[1], json))
+  {
+    std::fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+  std::vector<float> input;
+  double sampleRate = 0.0;
+  std::string error;
+  if (!wav::read(argv[2], input, sampleRate, error))
+  {
+    std::fprintf(stderr, "%s\n", error.c_str());
+    return 2;
+  }
+
+  ConditioningSweep<float> sweep;
+  if (!sweep.initFromJson(json.data(), json.size()))
+  {
+    std::fprintf(stderr, "%s\n", sweep.getLastError().c_str());
+    return 1;
+  }
+  if (sweep.getNumInputs() != 2)
+  {
+    std::fprintf(stderr, "the sweep renders two knob models only\n");
+    return 1;
+  }
+  sweep.discretize_bilinear(static_cast<float>(sampleRate));
+
+  // knob percent p maps to the conditioning value p / 100 * 2 - 1, as in the plugin
+  const int count = grid * grid;
+  std::vector<float> conditions(2 * count);
+  std::vector<int> percent(count * 2);
+  for (int d = 0; d < grid; ++d)
+  {
+    for (int t = 0; t < grid; ++t)
+    {
+      const int k = d * grid + t;
+      percent[2 * k] = grid > 1 ? 100 * d / (grid - 1) : 50;
+      percent[2 * k + 1] = grid > 1 ? 100 * t / (grid - 1) : 50;
+      conditions[2 * k] = percent[2 * k] / 100.0f * 2.0f - 1.0f;
+      conditions[2 * k + 1] = percent[2 * k + 1] / 100.0f * 2.0f - 1.0f;
+    }
+  }
+
+  const int numSamples = static_cast<int>(input.size());
+  std::vector<std::vector<float>> outputs(count, std::vector<float>(numSamples));
+  std::vector<float*> outputPtrs(count);
+  for (int k = 0; k < count; ++k)
+    outputPtrs[k] = outputs[k].data();
+
+  auto start = std::chrono::steady_clock::now();
+  sweep.render(input.data(), numSamples, conditions.data(), count, outputPtrs.data());
+  const double sweepSeconds = secondsSince(start);
+  std::printf("%s, %d settings x %d samples at %.0f Hz: sweep %.3f s\n", xsimd::default_arch::name(), count, numSamples, sampleRate, sweepSeconds);
+
+  if (serial)
+  {
+    FiLM<float> film;
+    ModelEngine<float> model;
+    if (!film.initFromJson(json.data(), json.size()) || !model.initFromJson(json.data(), json.size()))
+    {
+      std::fprintf(stderr, "serial engine load failed: %s\n", model.getLastError().c_str());
+      return 1;
+    }
+    model.discretize_bilinear(static_cast<float>(sampleRate));
+    std::vector<float> output(numSamples);
+    double maxDiff = 0.0;
+    start = std::chrono::steady_clock::now();
+    for (int k = 0; k < count; ++k)
+    {
+      film.processSample(conditions.data() + 2 * k);
+      model.reset();
+      model.processBlock(input.data(), output.data(), numSamples, film.getGamma(), film.getBeta());
+      for (int s = 0; s < numSamples; ++s)
+        maxDiff = std::max(maxDiff, static_cast<double>(std::abs(output[s] - outputs[k][s])));
+    }
+    const double serialSeconds = secondsSince(start);
+    std::printf("serial %.3f s (%.2fx the sweep), largest difference %.3g\n", serialSeconds, serialSeconds / sweepSeconds, maxDiff);
+  }
+
+  for (int k = 0; k < count; ++k)
+  {
+    char name[64];
+    std::snprintf(name, sizeof(name), "_drive%03d_tone%03d.wav", percent[2 * k], percent[2 * k + 1]);
+    if (!wav::write(prefix + name, outputs[k].data(), outputs[k].size(), sampleRate))
+    {
+      std::fprintf(stderr, "cannot write %s%s\n", prefix.c_str(), name);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Deterministic test material for offline evaluation of the engine.
+// Every signal is generated from closed-form expressions and a fixed-seed LCG so that
+// renders are bit-reproducible across runs and machines.
+namespace test_signals
+{
+struct Signal
+{
+  std::string name;
+  std::vector<float> samples;
+};
+
+class Lcg
+{
+public:
+  explicit Lcg(std::uint32_t seed)
+  : state(seed)
+  {
+  }
+
+  // uniform in [-1, 1)
+  float next()
+  {
+    state = state * 1664525u + 1013904223u;
+    return static_cast<float>(state >> 8) / 8388608.0f - 1.0f;
+  }
+
+private:
+  std::uint32_t state;
+};
+
+// Exponential sine sweep from 20 Hz to 20 kHz (or Nyquist)
+inline Signal sweep(double sr, double seconds, float amplitude = 0.5f)
+{
+  const double pi = std::acos(-1.0);
+  const int n = static_cast<int>(sr * seconds);
+  const double f0 = 20.0;
+  const double f1 = std::min(20000.0, 0.45 * sr);
+  const double k = std::log(f1 / f0);
+  Signal s{"sweep", std::vector<float>(n)};
+  for (int i = 0; i < n; ++i)
+  {
+    const double t = i / sr;
+    s.samples[i] = amplitude * static_cast<float>(std::sin(2.0 * pi * f0 * seconds / k * (std::exp(t / seconds * k) - 1.0)));
+  }
+  return s;
+}
+
+// Decaying harmonic notes, roughly a picked guitar DI
+inline Signal plucks(double sr, double seconds, float amplitude = 0.8f)
+{
+  const double pi = std::acos(-1.0);
+  const double notes[] = {82.41, 110.0, 146.83, 196.0, 246.94, 329.63};
+  const int n = static_cast<int>(sr * seconds);
+  const int noteLen = std::max(1, n / 6);
+  Signal s{"plucks", std::vector<float>(n)};
+  for (int i = 0; i < n; ++i)
+  {
+    const int note = std::min(i / noteLen, 5);
+    const double t = (i - note * noteLen) / sr;
+    double v = 0.0;
+    for (int h = 1; h <= 8; ++h)
+      v += std::sin(2.0 * pi * notes[note] * h * t) * std::exp(-t * (3.0 + 2.0 * h)) / h;
+    s.samples[i] = amplitude * static_cast<float>(0.5 * v);
+  }
+  return s;
+}
+
+// White noise bursts at -6, -18 and -30 dBFS separated by silence
+inline Signal noiseBursts(double sr, double seconds)
+{
+  const float levels[] = {0.5f, 0.125f, 0.0316f};
+  const int n = static_cast<int>(sr * seconds);
+  const int segment = std::max(1, n / 6);
+  Lcg rng(12345u);
+  Signal s{"noise_bursts", std::vector<float>(n, 0.0f)};
+  for (int i = 0; i < n; ++i)
+  {
+    const int seg = i / segment;
+    const float v = rng.next();
+    if (seg % 2 == 0 && seg / 2 < 3)
+      s.samples[i] = levels[seg / 2] * v;
+  }
+  return s;
+}
+
+// Low level 440 Hz tone with a fade in and out, exercises the near-linear region
+inline Signal quietTone(double sr, double seconds, float amplitude = 0.01f)
+{
+  const double pi = std::acos(-1.0);
+  const int n = static_cast<int>(sr * seconds);
+  Signal s{"quiet_tone", std::vector<float>(n)};
+  for (int i = 0; i < n; ++i)
+  {
+    const double fade = std::sin(pi * i / std::max(1, n - 1));
+    s.samples[i] = amplitude * static_cast<float>(fade * std::sin(2.0 * pi * 440.0 * i / sr));
+  }
+  return s;
+}
+
+// Full-scale impulse followed by silence, exercises the decay of the state
+inline Signal impulseTail(double sr, double seconds)
+{
+  const int n = static_cast<int>(sr * seconds);
+  Signal s{"impulse_tail", std::vector<float>(n, 0.0f)};
+  if (n > 0)
+    s.samples[n / 10] = 1.0f;
+  return s;
+}
+
+inline std::vector<Signal> standardSet(double sr, double seconds)
+{
+  return {sweep(sr, seconds), plucks(sr, seconds), noiseBursts(sr, seconds), quietTone(sr, seconds), impulseTail(sr, seconds)};
+}
+} // namespace test_signals
@@ -0,0 +1,118 @@
+// Minimal WAV reading and writing for the command line tools: 16/24/32 bit PCM and 32 bit float
+// in, 32 bit float out. Multichannel files are read as their first channel.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace wav
+{
+namespace detail
+{
+inline std::uint32_t u32(const unsigned char* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<std::uint32_t>(p[3]) << 24); }
+inline std::uint16_t u16(const unsigned char* p) { return static_cast<std::uint16_t>(p[0] | (p[1] << 8)); }
+
+inline void put32(std::ofstream& f, std::uint32_t v)
+{
+  const unsigned char b[4] = {static_cast<unsigned char>(v), static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v >> 16), static_cast<unsigned char>(v >> 24)};
+  f.write(reinterpret_cast<const char*>(b), 4);
+}
+
+inline void put16(std::ofstream& f, std::uint16_t v)
+{
+  const unsigned char b[2] = {static_cast<unsigned char>(v), static_cast<unsigned char>(v >> 8)};
+  f.write(reinterpret_cast<const char*>(b), 2);
+}
+} // namespace detail
+
+// Read the first channel of a WAV file. Returns false with the reason in error.
+inline bool read(const std::string& path, std::vector<float>& samples, double& sampleRate, std::string& error)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+  {
+    error = "cannot read " + path;
+    return false;
+  }
+  const std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (data.size() < 12 || std::memcmp(data.data(), "RIFF", 4) != 0 || std::memcmp(data.data() + 8, "WAVE", 4) != 0)
+  {
+    error = path + " is not a WAV file";
+    return false;
+  }
+
+  int format = 0, channels = 0, bits = 0;
+  for (std::size_t pos = 12; pos + 8 <= data.size();)
+  {
+    const unsigned char* chunk = data.data() + pos;
+    const std::size_t size = std::min<std::size_t>(detail::u32(chunk + 4), data.size() - pos - 8);
+    if (std::memcmp(chunk, "fmt ", 4) == 0 && size >= 16)
+    {
+      format = detail::u16(chunk + 8);
+      channels = detail::u16(chunk + 10);
+      sampleRate = detail::u32(chunk + 12);
+      bits = detail::u16(chunk + 22);
+      if (format == 0xFFFE && size >= 26)
+        format = detail::u16(chunk + 32); // WAVE_FORMAT_EXTENSIBLE, sub format
+    }
+    else if (std::memcmp(chunk, "data", 4) == 0)
+    {
+      const bool pcm = format == 1 && (bits == 16 || bits == 24 || bits == 32);
+      const bool ieee = format == 3 && bits == 32;
+      if (channels <= 0 || (!pcm && !ieee))
+      {
+        error = path + ": only 16/24/32 bit PCM and 32 bit float are supported";
+        return false;
+      }
+      const int bytes = bits / 8;
+      const std::size_t frames = size / (bytes * channels);
+      samples.resize(frames);
+      for (std::size_t i = 0; i < frames; ++i)
+      {
+        const unsigned char* p = chunk + 8 + i * bytes * channels;
+        if (ieee)
+          std::memcpy(&samples[i], p, 4);
+        else if (bits == 16)
+          samples[i] = static_cast<std::int16_t>(detail::u16(p)) / 32768.0f;
+        else if (bits == 24)
+          samples[i] = static_cast<std::int32_t>((p[0] << 8) | (p[1] << 16) | (static_cast<std::uint32_t>(p[2]) << 24)) / 2147483648.0f;
+        else
+          samples[i] = static_cast<std::int32_t>(detail::u32(p)) / 2147483648.0f;
+      }
+      return true;
+    }
+    pos += 8 + size + (size & 1);
+  }
+  error = path + " has no audio data";
+  return false;
+}
+
+// Write a mono 32 bit float WAV file
+inline bool write(const std::string& path, const float* samples, std::size_t numSamples, double sampleRate)
+{
+  std::ofstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  const std::uint32_t bytes = static_cast<std::uint32_t>(numSamples * 4);
+  const std::uint32_t rate = static_cast<std::uint32_t>(sampleRate);
+  file.write("RIFF", 4);
+  detail::put32(file, 36 + bytes);
+  file.write("WAVEfmt ", 8);
+  detail::put32(file, 16);
+  detail::put16(file, 3); // IEEE float
+  detail::put16(file, 1);
+  detail::put32(file, rate);
+  detail::put32(file, rate * 4);
+  detail::put16(file, 4);
+  detail::put16(file, 32);
+  file.write("data", 4);
+  detail::put32(file, bytes);
+  file.write(reinterpret_cast<const char*>(samples), bytes);
+  return static_cast<bool>(file);
+}
+} // namespace wav